@@ -0,0 +1,153 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <type_traits>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace rte
+{
+    // Monotonic memory arena. Memory is handed out by bumping a pointer inside large blocks and it is
+    // never given back individually: all of it is freed at once by release() or by the destructor.
+    // Meant for data with a well defined lifetime, like temporary trees or the tables of a level.
+    // Not thread safe.
+    class monotonic_arena
+    {
+    public:
+        explicit monotonic_arena(std::size_t initial_block_size = 64U * 1024U) :
+            m_blocks(nullptr),
+            m_current(nullptr),
+            m_end(nullptr),
+            m_next_block_size(initial_block_size > 0U? initial_block_size : 1U),
+            m_bytes_allocated(0U) {}
+
+        monotonic_arena(const monotonic_arena&) = delete;
+        monotonic_arena& operator=(const monotonic_arena&) = delete;
+
+        ~monotonic_arena() { release(); }
+
+        // alignment must be a power of two. Throws std::bad_alloc if a new block can't be obtained
+        void* allocate(std::size_t bytes, std::size_t alignment)
+        {
+            char* ret = align(m_current, alignment);
+            if (m_current == nullptr || ret > m_end || bytes > std::size_t(m_end - ret)) {
+                add_block(bytes + alignment);
+                ret = align(m_current, alignment);
+            }
+
+            m_current = ret + bytes;
+            m_bytes_allocated += bytes;
+            return ret;
+        }
+
+        // Frees all the memory obtained from this arena. The arena can be reused afterwards
+        void release()
+        {
+            while (m_blocks != nullptr) {
+                block_header* next = m_blocks->m_next;
+                ::operator delete(m_blocks);
+                m_blocks = next;
+            }
+
+            m_current = nullptr;
+            m_end = nullptr;
+            m_bytes_allocated = 0U;
+        }
+
+        // Returns the number of bytes handed out since construction or the last release()
+        std::size_t bytes_allocated() const { return m_bytes_allocated; }
+
+    private:
+        struct block_header
+        {
+            block_header* m_next;
+        };
+
+        static char* align(char* p, std::size_t alignment)
+        {
+            std::uintptr_t address = reinterpret_cast<std::uintptr_t>(p);
+            return p + ((alignment - address % alignment) % alignment);
+        }
+
+        void add_block(std::size_t min_size)
+        {
+            // Block sizes grow geometrically, so that the number of blocks is logarithmic
+            std::size_t block_size = (m_next_block_size > min_size? m_next_block_size : min_size);
+            char* block = static_cast<char*>(::operator new(sizeof(block_header) + block_size));
+            block_header* header = reinterpret_cast<block_header*>(block);
+            header->m_next = m_blocks;
+            m_blocks = header;
+            m_current = block + sizeof(block_header);
+            m_end = m_current + block_size;
+            m_next_block_size = block_size * 2U;
+        }
+
+        block_header*  m_blocks;             //!< list of blocks, the most recent one first
+        char*          m_current;            //!< first free byte of the current block
+        char*          m_end;                //!< end of the current block
+        std::size_t    m_next_block_size;    //!< size of the next block to obtain
+        std::size_t    m_bytes_allocated;    //!< bytes handed out, for statistics
+    };
+
+    // Standard allocator that takes its memory from a monotonic_arena. deallocate() does nothing, the
+    // memory comes back when the arena is released. An allocator without arena (the default) uses the
+    // global operator new and delete, so containers that use it behave exactly as with std::allocator.
+    //
+    // Like std::pmr::polymorphic_allocator the arena is not propagated on copy assignment, move
+    // assignment or swap, and copy constructed containers use the global heap. This way a copy of a
+    // temporary container never points into an arena that is about to be released.
+    template <typename T>
+    class arena_allocator
+    {
+    public:
+        typedef T value_type;
+        typedef std::false_type propagate_on_container_copy_assignment;
+        typedef std::false_type propagate_on_container_move_assignment;
+        typedef std::false_type propagate_on_container_swap;
+
+        arena_allocator() noexcept :
+            m_arena(nullptr) {}
+
+        explicit arena_allocator(monotonic_arena* arena) noexcept :
+            m_arena(arena) {}
+
+        template <typename U>
+        arena_allocator(const arena_allocator<U>& a) noexcept :
+            m_arena(a.get_arena()) {}
+
+        T* allocate(std::size_t n)
+        {
+            if (n > std::size_t(-1) / sizeof(T)) {
+                throw std::bad_alloc();
+            }
+            if (m_arena != nullptr) {
+                return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T)));
+            }
+
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+
+        void deallocate(T* p, std::size_t) noexcept
+        {
+            if (m_arena == nullptr) {
+                ::operator delete(p);
+            }
+        }
+
+        arena_allocator select_on_container_copy_construction() const { return arena_allocator(); }
+
+        monotonic_arena* get_arena() const { return m_arena; }
+
+    private:
+        monotonic_arena* m_arena;
+    };
+
+    template <typename T, typename U>
+    bool operator==(const arena_allocator<T>& a, const arena_allocator<U>& b) { return a.get_arena() == b.get_arena(); }
+
+    template <typename T, typename U>
+    bool operator!=(const arena_allocator<T>& a, const arena_allocator<U>& b) { return !(a == b); }
+} // namespace rte
+
+#endif // ARENA_HPP
@@ -0,0 +1,109 @@
+#include "glm/gtx/transform.hpp"
+#include "frustum_culling.hpp"
+#include "bvh.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <vector>
+
+using namespace rte;
+
+namespace
+{
+    typedef std::chrono::steady_clock bench_clock;
+
+    template<typename F>
+    double measure_ms(unsigned int repetitions, F fn)
+    {
+        auto start = bench_clock::now();
+        for (unsigned int r = 0; r < repetitions; r++) {
+            fn();
+        }
+        auto end = bench_clock::now();
+
+        return std::chrono::duration<double, std::milli>(end - start).count() / repetitions;
+    }
+
+    // Objects of a few units spread over a 2000 units wide square area, 100 units high
+    std::vector<aabb> make_scene(index_type size, std::mt19937& rng)
+    {
+        std::uniform_real_distribution<float> position(-1000.0f, 1000.0f);
+        std::uniform_real_distribution<float> height(0.0f, 100.0f);
+        std::uniform_real_distribution<float> extent(0.5f, 4.0f);
+        std::vector<aabb> boxes;
+        boxes.reserve(size);
+        for (index_type i = 0; i < size; i++) {
+            glm::vec3 center(position(rng), height(rng), position(rng));
+            boxes.push_back(aabb(center - extent(rng), center + extent(rng)));
+        }
+
+        return boxes;
+    }
+} // anonymous namespace
+
+// Times the SAH build, a full refit, the refit of the nodes above the 1% of the items that moved,
+// and a frustum query compared with testing every box with the best kernel of frustum_cull().
+// The camera sees a few percent of the scene, as in a typical walkthrough
+int main()
+{
+    const unsigned int repetitions = 10U;
+    frustum f = frustum_from_matrix(glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 500.0f) *
+                                    glm::lookAt(glm::vec3(0.0f, 50.0f, 0.0f), glm::vec3(1.0f, 50.0f, 1.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+
+    std::cout << std::setw(10) << "nodes"
+              << std::setw(10) << "visible"
+              << std::setw(12) << "build ms"
+              << std::setw(12) << "refit ms"
+              << std::setw(14) << "refit 1% ms"
+              << std::setw(12) << "query ms"
+              << std::setw(12) << "linear ms" << std::endl;
+    for (index_type size : {10000U, 100000U, 1000000U}) {
+        std::mt19937 rng(1U);
+        auto boxes = make_scene(size, rng);
+        auto get_bounds = [&boxes](index_type i) -> const aabb& { return boxes[i]; };
+        std::vector<index_type> items(size);
+        for (index_type i = 0; i < size; i++) {
+            items[i] = i;
+        }
+
+        bvh tree;
+        double build_ms = measure_ms(repetitions, [&]() { bvh_build(tree, items, get_bounds); });
+        double refit_ms = measure_ms(repetitions, [&]() { bvh_refit_all(tree, get_bounds); });
+
+        std::uniform_int_distribution<index_type> pick(0U, size - 1U);
+        std::vector<index_type> moved(size / 100U);
+        for (auto& i : moved) {
+            i = pick(rng);
+        }
+        double partial_refit_ms = measure_ms(repetitions, [&]() {
+            for (auto i : moved) {
+                boxes[i] = aabb(boxes[i].m_min + glm::vec3(0.1f), boxes[i].m_max + glm::vec3(0.1f));
+                bvh_mark_item(tree, i);
+            }
+            bvh_refit(tree, get_bounds);
+        });
+
+        std::vector<index_type> visible;
+        index_type visible_count = 0U;
+        double query_ms = measure_ms(repetitions, [&]() { visible_count = bvh_query(tree, transform_best_kernel(), f, get_bounds, visible); });
+
+        cull_batch batch;
+        for (auto i : items) {
+            cull_batch_add(batch, i, boxes[i]);
+        }
+        double linear_ms = measure_ms(repetitions, [&]() { frustum_cull(transform_best_kernel(), f, batch, visible); });
+
+        std::cout << std::fixed << std::setprecision(3)
+                  << std::setw(10) << size
+                  << std::setw(10) << visible_count
+                  << std::setw(12) << build_ms
+                  << std::setw(12) << refit_ms
+                  << std::setw(14) << partial_refit_ms
+                  << std::setw(12) << query_ms
+                  << std::setw(12) << linear_ms << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include "cow_storage.hpp"
+#include "sparse_tree.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+
+using namespace rte;
+
+namespace
+{
+    // Roughly the size of a scene node with its transforms
+    struct bench_node : public sparse_node
+    {
+        bench_node() : m_val(0), m_payload() {}
+        bench_node(int val) : m_val(val), m_payload() {}
+
+        int m_val;
+        float m_payload[32];
+    };
+
+    typedef sparse_vector<bench_node> contiguous_vector;
+    typedef cow_sparse_vector<bench_node> cow_vector;
+    typedef std::chrono::steady_clock bench_clock;
+
+    template<typename V>
+    void build_tree(V& tree, index_type size)
+    {
+        tree_init(tree);
+        tree.reserve(size);
+        tree_insert(tree, bench_node(0));
+        for (index_type i = 1; i < size; i++) {
+            tree_insert(tree, bench_node(1), (i - 1) / 8);
+        }
+    }
+
+    template<typename V>
+    long long traverse(const V& tree)
+    {
+        long long sum = 0;
+        for (auto it = tree_preorder_begin(tree, 0); it != tree_preorder_end(tree, 0); ++it) {
+            sum += it->m_val;
+        }
+
+        return sum;
+    }
+
+    double elapsed_us(bench_clock::time_point start, bench_clock::time_point end)
+    {
+        return std::chrono::duration<double, std::micro>(end - start).count();
+    }
+
+    // Returns the time taken by a copy of the whole vector, which is the snapshot
+    template<typename V>
+    double measure_snapshot_us(const V& tree)
+    {
+        auto start = bench_clock::now();
+        V snapshot = tree;
+        auto end = bench_clock::now();
+        if (snapshot.size() != tree.size()) {
+            std::cerr << "cow_snapshot_bench: wrong snapshot size" << std::endl;
+        }
+
+        return elapsed_us(start, end);
+    }
+
+    // Returns the time taken by the first write to an entry after a snapshot, which clones its chunk
+    double measure_first_write_us(cow_vector& tree)
+    {
+        cow_vector snapshot = tree;
+        auto start = bench_clock::now();
+        tree.at(tree.size() / 2).m_val++;
+        auto end = bench_clock::now();
+        tree.at(tree.size() / 2).m_val--;
+
+        return elapsed_us(start, end);
+    }
+
+    template<typename V>
+    double measure_traversal_ns_per_node(const V& tree)
+    {
+        unsigned int repetitions = (unsigned int) (10000000U / tree.size());
+        auto start = bench_clock::now();
+        for (unsigned int i = 0; i < repetitions; i++) {
+            if (traverse(tree) != (long long) tree.size() - 1) {
+                std::cerr << "cow_snapshot_bench: wrong traversal result" << std::endl;
+            }
+        }
+        auto end = bench_clock::now();
+
+        return elapsed_us(start, end) * 1000.0 / (double(repetitions) * tree.size());
+    }
+} // anonymous namespace
+
+int main()
+{
+    std::vector<index_type> sizes = {10000U, 100000U, 1000000U};
+
+    std::cout << std::setw(10) << "nodes"
+              << std::setw(18) << "deep copy us"
+              << std::setw(18) << "cow snapshot us"
+              << std::setw(18) << "first write us"
+              << std::setw(22) << "contiguous ns/node"
+              << std::setw(16) << "cow ns/node" << std::endl;
+    for (auto size : sizes) {
+        contiguous_vector contiguous;
+        cow_vector cow;
+        build_tree(contiguous, size);
+        build_tree(cow, size);
+
+        double deep_copy_us = measure_snapshot_us(contiguous);
+        double snapshot_us = measure_snapshot_us(cow);
+        double first_write_us = measure_first_write_us(cow);
+        double contiguous_ns = measure_traversal_ns_per_node(contiguous);
+        double cow_ns = measure_traversal_ns_per_node(cow);
+        std::cout << std::fixed << std::setprecision(2)
+                  << std::setw(10) << size
+                  << std::setw(18) << deep_copy_us
+                  << std::setw(18) << snapshot_us
+                  << std::setw(18) << first_write_us
+                  << std::setw(22) << contiguous_ns
+                  << std::setw(16) << cow_ns << std::endl;
+    }
+
+    return 0;
+}
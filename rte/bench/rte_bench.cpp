@@ -0,0 +1,377 @@
+#include "sparse_tree.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <array>
+#include <new>
+
+using namespace rte;
+
+// Benchmark suite of the sparse containers. Every operation is run over every combination of tree
+// shape, size and payload, and reported as ns/op, allocations/op and allocated bytes/op, where an
+// op is one node inserted, visited, copied or erased. Run with --help for the options. The JSON
+// output is meant to be kept and diffed between runs.
+
+namespace
+{
+    // Every allocation of the process goes through the operator new below, so a benchmark can count
+    // the allocations made by the operation it measures
+    std::atomic<std::size_t> allocation_count(0U);
+    std::atomic<std::size_t> allocated_bytes(0U);
+} // anonymous namespace
+
+void* operator new(std::size_t bytes)
+{
+    allocation_count.fetch_add(1U, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    void* p = std::malloc(bytes > 0U? bytes : 1U);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return p;
+}
+
+void* operator new[](std::size_t bytes) { return operator new(bytes); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+namespace
+{
+    typedef std::chrono::steady_clock bench_clock;
+
+    // Node with Bytes of payload on top of the links and an int that the traversals read
+    template <std::size_t Bytes>
+    struct bench_node : public sparse_node
+    {
+        bench_node() : m_val(0), m_payload() {}
+        explicit bench_node(int val) : m_val(val), m_payload() {}
+
+        int m_val;
+        std::array<char, Bytes> m_payload;
+    };
+
+    struct bench_config
+    {
+        std::vector<std::string>   m_shapes;
+        std::vector<std::string>   m_payloads;
+        std::vector<std::string>   m_ops;
+        std::vector<index_type>    m_sizes;
+        std::size_t                m_max_mb;       //!< cases that would need more memory are skipped
+        index_type                 m_min_ops;      //!< each case is repeated until it has done this many ops
+        std::string                m_json_path;    //!< empty for no JSON output, - for stdout
+    };
+
+    struct bench_result
+    {
+        std::string    m_op;
+        std::string    m_shape;
+        std::string    m_payload;
+        index_type     m_size;
+        index_type     m_repetitions;
+        double         m_ns_per_op;
+        double         m_allocations_per_op;
+        double         m_bytes_per_op;
+    };
+
+    // Accumulates the time and the allocations of the measured parts of a case
+    class bench_meter
+    {
+    public:
+        bench_meter() :
+            m_ns(0.0),
+            m_allocations(0U),
+            m_bytes(0U),
+            m_start(),
+            m_start_allocations(0U),
+            m_start_bytes(0U) {}
+
+        void start()
+        {
+            m_start_allocations = allocation_count.load(std::memory_order_relaxed);
+            m_start_bytes = allocated_bytes.load(std::memory_order_relaxed);
+            m_start = bench_clock::now();
+        }
+
+        void stop()
+        {
+            auto end = bench_clock::now();
+            m_ns += std::chrono::duration<double, std::nano>(end - m_start).count();
+            m_allocations += allocation_count.load(std::memory_order_relaxed) - m_start_allocations;
+            m_bytes += allocated_bytes.load(std::memory_order_relaxed) - m_start_bytes;
+        }
+
+        double get_ns() const { return m_ns; }
+        std::size_t get_allocations() const { return m_allocations; }
+        std::size_t get_bytes() const { return m_bytes; }
+
+    private:
+        double                    m_ns;
+        std::size_t               m_allocations;
+        std::size_t               m_bytes;
+        bench_clock::time_point   m_start;
+        std::size_t               m_start_allocations;
+        std::size_t               m_start_bytes;
+    };
+
+    // Parent of node i (i > 0) for each shape. The random shape uses a fixed seed, so that every run
+    // builds the same trees
+    index_type parent_of(const std::string& shape, index_type i, std::mt19937_64& rng)
+    {
+        if (shape == "chain") {
+            return i - 1U;
+        } else if (shape == "fan") {
+            return 0U;
+        } else if (shape == "balanced") {
+            return (i - 1U) / 8U;
+        }
+
+        return std::uniform_int_distribution<index_type>(0U, i - 1U)(rng);
+    }
+
+    template<typename V>
+    void build_tree(V& tree, const std::string& shape, index_type size)
+    {
+        std::mt19937_64 rng(42U);
+        tree_init(tree);
+        tree_insert(tree, typename V::value_type(0));
+        for (index_type i = 1; i < size; i++) {
+            tree_insert(tree, typename V::value_type(int(i)), parent_of(shape, i, rng));
+        }
+    }
+
+    template<typename V>
+    long long sum_preorder(const V& tree)
+    {
+        long long sum = 0;
+        for (auto it = tree_preorder_begin(tree, 0); it != tree_preorder_end(tree, 0); ++it) {
+            sum += it->m_val;
+        }
+
+        return sum;
+    }
+
+    template<typename V>
+    long long sum_children(const V& tree)
+    {
+        long long sum = 0;
+        for (index_type i = 0; i < tree.size(); i++) {
+            for (auto it = tree_cbegin(tree, i); it != tree_cend(tree, i); ++it) {
+                sum += it->m_val;
+            }
+        }
+
+        return sum;
+    }
+
+    // Runs op repetitions times over trees of the given shape and size. Returns false if op is unknown
+    template<typename V>
+    bool run_op(const std::string& op, const std::string& shape, index_type size, index_type repetitions, bench_meter& meter)
+    {
+        long long expected_sum = (long long) size * (long long) (size - 1U) / 2;
+        V tree;
+        if (op == "insert") {
+            // Into a new vector every time, so that the allocations of the growth are counted
+            for (index_type r = 0; r < repetitions; r++) {
+                V new_tree;
+                meter.start();
+                build_tree(new_tree, shape, size);
+                meter.stop();
+            }
+        } else if (op == "iterate_preorder" || op == "iterate_children") {
+            build_tree(tree, shape, size);
+            for (index_type r = 0; r < repetitions; r++) {
+                meter.start();
+                long long sum = (op == "iterate_preorder"? sum_preorder(tree) : sum_children(tree));
+                meter.stop();
+                if (sum != expected_sum) {
+                    std::cerr << "rte_bench: wrong " << op << " result" << std::endl;
+                }
+            }
+        } else if (op == "subtree_copy") {
+            build_tree(tree, shape, size);
+            for (index_type r = 0; r < repetitions; r++) {
+                V copy;
+                tree_insert(copy, typename V::value_type(0));
+                meter.start();
+                tree_insert(tree, 0, copy, 0);
+                meter.stop();
+            }
+        } else if (op == "erase") {
+            for (index_type r = 0; r < repetitions; r++) {
+                build_tree(tree, shape, size);
+                meter.start();
+                tree_erase(tree, 0);
+                meter.stop();
+                if (tree.count_used() != 0U) {
+                    std::cerr << "rte_bench: tree not fully erased" << std::endl;
+                }
+            }
+        } else {
+            return false;
+        }
+
+        return true;
+    }
+
+    // The table of results is printed to stdout, unless the JSON goes there: then it goes to stderr,
+    // so that stdout is only JSON
+    std::ostream& table_stream(const bench_config& config)
+    {
+        return (config.m_json_path == "-"? std::cerr : std::cout);
+    }
+
+    template<typename V>
+    void run_payload(const bench_config& config, const std::string& payload, std::vector<bench_result>& results)
+    {
+        for (auto& op : config.m_ops) {
+            for (auto& shape : config.m_shapes) {
+                for (auto size : config.m_sizes) {
+                    // The copy needs a second tree. Slots are counted with their share of the bitset
+                    double trees = (op == "subtree_copy"? 2.0 : 1.0);
+                    double mb = trees * size * (sizeof(typename V::value_type) + 0.125) / (1024.0 * 1024.0);
+                    if (mb > config.m_max_mb || size < 2U) {
+                        std::cerr << "rte_bench: skipping " << op << "/" << shape << "/" << payload << "/" << size << std::endl;
+                        continue;
+                    }
+
+                    index_type repetitions = std::max(index_type(1U), config.m_min_ops / size);
+                    bench_meter meter;
+                    if (!run_op<V>(op, shape, size, repetitions, meter)) {
+                        std::cerr << "rte_bench: unknown op " << op << std::endl;
+                        break;
+                    }
+
+                    double ops = double(size) * repetitions;
+                    bench_result result = {op, shape, payload, size, repetitions, meter.get_ns() / ops, meter.get_allocations() / ops, meter.get_bytes() / ops};
+                    results.push_back(result);
+                    table_stream(config) << std::left << std::setw(44) << (op + "/" + shape + "/" + payload + "/" + std::to_string(size)) << std::right
+                              << std::fixed << std::setprecision(2)
+                              << std::setw(12) << result.m_ns_per_op
+                              << std::setw(14) << std::setprecision(4) << result.m_allocations_per_op
+                              << std::setw(14) << std::setprecision(2) << result.m_bytes_per_op << std::endl;
+                }
+            }
+        }
+    }
+
+    void write_json(std::ostream& os, const bench_config& config, const std::vector<bench_result>& results)
+    {
+        os << "{\n  \"benchmark\": \"rte_bench\",\n  \"min_ops\": " << config.m_min_ops << ",\n  \"results\": [";
+        for (std::size_t i = 0; i < results.size(); i++) {
+            auto& r = results[i];
+            os << (i > 0U? "," : "") << "\n    {"
+               << "\"name\": \"" << r.m_op << "/" << r.m_shape << "/" << r.m_payload << "/" << r.m_size << "\", "
+               << "\"op\": \"" << r.m_op << "\", "
+               << "\"shape\": \"" << r.m_shape << "\", "
+               << "\"payload\": \"" << r.m_payload << "\", "
+               << "\"size\": " << r.m_size << ", "
+               << "\"repetitions\": " << r.m_repetitions << ", "
+               << std::setprecision(4) << std::fixed
+               << "\"ns_per_op\": " << r.m_ns_per_op << ", "
+               << "\"allocations_per_op\": " << r.m_allocations_per_op << ", "
+               << "\"bytes_per_op\": " << r.m_bytes_per_op << "}";
+        }
+        os << "\n  ]\n}\n";
+    }
+
+    std::vector<std::string> split_list(const std::string& list)
+    {
+        std::vector<std::string> items;
+        std::stringstream ss(list);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            if (!item.empty()) {
+                items.push_back(item);
+            }
+        }
+
+        return items;
+    }
+
+    void print_usage()
+    {
+        std::cout << "usage: rte_bench [options]\n"
+                  << "  --ops LIST        insert,iterate_preorder,iterate_children,subtree_copy,erase\n"
+                  << "  --shapes LIST     chain,fan,balanced,random\n"
+                  << "  --payloads LIST   small,medium,large (4, 128 and 1024 bytes besides the links)\n"
+                  << "  --sizes LIST      node counts, default 1000,10000,100000,1000000,10000000\n"
+                  << "  --max-mb N        skip cases that need more than N MB of nodes, default 1024\n"
+                  << "  --min-ops N       repeat small cases until they do N ops, default 1000000\n"
+                  << "  --json FILE       write the results as JSON to FILE, - for stdout (the table goes to stderr)\n";
+    }
+} // anonymous namespace
+
+int main(int argc, char** argv)
+{
+    bench_config config = {{"chain", "fan", "balanced", "random"},
+                           {"small", "medium", "large"},
+                           {"insert", "iterate_preorder", "iterate_children", "subtree_copy", "erase"},
+                           {1000U, 10000U, 100000U, 1000000U, 10000000U},
+                           1024U,
+                           1000000U,
+                           std::string()};
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        std::string value = (i + 1 < argc? argv[i + 1] : "");
+        if (arg == "--ops") {
+            config.m_ops = split_list(value);
+        } else if (arg == "--shapes") {
+            config.m_shapes = split_list(value);
+        } else if (arg == "--payloads") {
+            config.m_payloads = split_list(value);
+        } else if (arg == "--sizes") {
+            config.m_sizes.clear();
+            for (auto& s : split_list(value)) {
+                config.m_sizes.push_back(std::stoull(s));
+            }
+        } else if (arg == "--max-mb") {
+            config.m_max_mb = std::stoull(value);
+        } else if (arg == "--min-ops") {
+            config.m_min_ops = std::stoull(value);
+        } else if (arg == "--json") {
+            config.m_json_path = value;
+        } else {
+            print_usage();
+            return (arg == "--help"? 0 : 1);
+        }
+        i++;
+    }
+
+    table_stream(config) << std::left << std::setw(44) << "op/shape/payload/nodes" << std::right
+              << std::setw(12) << "ns/op"
+              << std::setw(14) << "allocs/op"
+              << std::setw(14) << "bytes/op" << std::endl;
+    std::vector<bench_result> results;
+    for (auto& payload : config.m_payloads) {
+        if (payload == "small") {
+            run_payload<sparse_vector<bench_node<0U>>>(config, payload, results);
+        } else if (payload == "medium") {
+            run_payload<sparse_vector<bench_node<128U>>>(config, payload, results);
+        } else if (payload == "large") {
+            run_payload<sparse_vector<bench_node<1024U>>>(config, payload, results);
+        } else {
+            std::cerr << "rte_bench: unknown payload " << payload << std::endl;
+        }
+    }
+
+    if (config.m_json_path == "-") {
+        write_json(std::cout, config, results);
+    } else if (!config.m_json_path.empty()) {
+        std::ofstream ofs(config.m_json_path);
+        write_json(ofs, config, results);
+    }
+
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include "transform_batch.hpp"
+#include "parallel_tree.hpp"
+#include "glm/glm.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace rte;
+
+namespace
+{
+    struct bench_node : public sparse_node
+    {
+        bench_node() : m_local_transform(1.0f), m_accum_transform(1.0f), m_transform_dirty(false) {}
+
+        glm::mat4 m_local_transform;
+        glm::mat4 m_accum_transform;
+        bool m_transform_dirty;
+    };
+
+    typedef sparse_vector<bench_node> bench_vector;
+    typedef std::chrono::steady_clock bench_clock;
+
+    // Same scene-like tree as tree_parallel_bench: a root with a few hundred objects, each with a
+    // few levels of parts
+    void build_tree(bench_vector& tree, index_type size)
+    {
+        tree_init(tree);
+        tree.reserve(size);
+        tree_insert(tree, bench_node());
+        for (index_type i = 1; i < size; i++) {
+            index_type parent = (i < 256U? 0U : (i - 256U) / 4U + 1U);
+            tree_insert(tree, bench_node(), parent);
+        }
+    }
+
+    template<typename F>
+    double measure_ms(unsigned int repetitions, F fn)
+    {
+        auto start = bench_clock::now();
+        for (unsigned int r = 0; r < repetitions; r++) {
+            fn();
+        }
+        auto end = bench_clock::now();
+
+        return std::chrono::duration<double, std::milli>(end - start).count() / repetitions;
+    }
+} // anonymous namespace
+
+// Compares the per-node pass with glm (the loop used before the kernels), the same pass with each
+// kernel (tree_accum_transforms()) and the batched kernels, single threaded and with all the
+// hardware threads. The batch time includes the gather and the scatter; the kernel column is the
+// time of the matrix products alone
+int main()
+{
+    const index_type grain = 4096U;
+    const unsigned int repetitions = 10U;
+    unsigned int hardware_threads = std::max(std::thread::hardware_concurrency(), 1U);
+
+    std::cout << "hardware threads: " << hardware_threads << ", best kernel: " << transform_kernel_name(transform_best_kernel()) << std::endl;
+    std::cout << std::setw(10) << "nodes"
+              << std::setw(10) << "threads"
+              << std::setw(14) << "pass"
+              << std::setw(12) << "ms/pass"
+              << std::setw(14) << "kernel ms"
+              << std::setw(12) << "speedup" << std::endl;
+    for (index_type size : {100000U, 1000000U}) {
+        bench_vector tree;
+        build_tree(tree, size);
+        for (unsigned int threads : {1U, hardware_threads}) {
+            tree_worker_pool pool(threads - 1U);
+            tree_parallel_context context;
+            double per_node_ms = measure_ms(repetitions, [&]() {
+                tree_parallel_for_each(tree, 0, [&tree](index_type i) {
+                    auto& current_node = tree.at(i);
+                    glm::mat4 previous_transform(1.0f);
+                    if (current_node.m_parent != npos) {
+                        previous_transform = tree.at(current_node.m_parent).m_accum_transform;
+                    }
+                    current_node.m_accum_transform = current_node.m_local_transform * previous_transform;
+                }, grain, pool, context);
+            });
+            std::cout << std::fixed << std::setprecision(2)
+                      << std::setw(10) << size
+                      << std::setw(10) << threads
+                      << std::setw(14) << "per-node"
+                      << std::setw(12) << per_node_ms
+                      << std::setw(14) << "-"
+                      << std::setw(12) << 1.0 << std::endl;
+
+            for (auto kernel : {transform_kernel::scalar, transform_kernel::sse, transform_kernel::avx2}) {
+                if (!transform_kernel_supported(kernel)) {
+                    continue;
+                }
+                double in_place_ms = measure_ms(repetitions, [&]() { tree_accum_transforms(tree, 0, kernel, grain, pool, context); });
+                std::cout << std::setw(10) << size
+                          << std::setw(10) << threads
+                          << std::setw(14) << (std::string("node/") + transform_kernel_name(kernel))
+                          << std::setw(12) << in_place_ms
+                          << std::setw(14) << "-"
+                          << std::setw(12) << per_node_ms / in_place_ms << std::endl;
+            }
+            for (auto kernel : {transform_kernel::scalar, transform_kernel::sse, transform_kernel::avx2}) {
+                if (!transform_kernel_supported(kernel)) {
+                    continue;
+                }
+                transform_batch batch;
+                double batch_ms = measure_ms(repetitions, [&]() { tree_batch_accum_transforms(tree, 0, batch, kernel, grain, pool); });
+                double kernel_ms = measure_ms(repetitions, [&]() { transform_batch_compute(batch, kernel, grain, pool); });
+                std::cout << std::setw(10) << size
+                          << std::setw(10) << threads
+                          << std::setw(14) << (std::string("batch/") + transform_kernel_name(kernel))
+                          << std::setw(12) << batch_ms
+                          << std::setw(14) << kernel_ms
+                          << std::setw(12) << per_node_ms / batch_ms << std::endl;
+            }
+            if (threads == hardware_threads) {
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
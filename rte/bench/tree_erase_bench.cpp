@@ -0,0 +1,97 @@
+#include "sparse_tree.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <set>
+
+using namespace rte;
+
+namespace
+{
+    struct bench_node : public sparse_node
+    {
+        bench_node() : m_val(0) {}
+        bench_node(int val) : m_val(val) {}
+
+        int m_val;
+    };
+
+    typedef sparse_vector<bench_node> bench_vector;
+    typedef std::chrono::steady_clock bench_clock;
+
+    // Builds a root with a single child, which is the root of a subtree of subtree_size nodes. Nodes
+    // get up to 8 children each, which is close to the shape of an imported model
+    void build_tree(bench_vector& tree, index_type subtree_size)
+    {
+        tree_init(tree);
+        tree.reserve(subtree_size + 1U);
+        tree_insert(tree, bench_node(0));
+        tree_insert(tree, bench_node(1), 0);
+        for (index_type i = 1; i < subtree_size; i++) {
+            tree_insert(tree, bench_node(i + 1), (i - 1) / 8 + 1);
+        }
+    }
+
+    // The algorithm tree_erase() used before: collect the subtree in a std::set, then erase it
+    void set_based_erase(bench_vector& tree, index_type erase_index)
+    {
+        std::set<index_type> to_delete;
+        std::vector<index_type> pending_nodes;
+        pending_nodes.push_back(erase_index);
+        while (!pending_nodes.empty()) {
+            index_type pending_index = pending_nodes.back();
+            pending_nodes.pop_back();
+
+            to_delete.insert(pending_index);
+
+            for (auto it = tree_rbegin(tree, pending_index); it != tree_rend(tree, pending_index); ++it) {
+                pending_nodes.push_back(index(it));
+            }
+        }
+
+        tree_remove_child(tree, tree.at(erase_index).m_parent, erase_index);
+        for (auto it = to_delete.begin(); it != to_delete.end(); ++it) {
+            tree.clear_used(*it);
+        }
+    }
+
+    template<typename F>
+    double measure_ns_per_node(index_type subtree_size, F erase_function)
+    {
+        bench_vector tree;
+        build_tree(tree, subtree_size);
+
+        auto start = bench_clock::now();
+        erase_function(tree, 1U);
+        auto end = bench_clock::now();
+
+        if (tree.count_used() != 1U) {
+            std::cerr << "tree_erase_bench: subtree was not fully erased" << std::endl;
+        }
+
+        return std::chrono::duration<double, std::nano>(end - start).count() / subtree_size;
+    }
+} // anonymous namespace
+
+int main()
+{
+    std::vector<index_type> sizes = {10000U, 100000U, 1000000U};
+
+    std::cout << std::setw(10) << "nodes"
+              << std::setw(20) << "tree_erase ns/node"
+              << std::setw(20) << "std::set ns/node"
+              << std::setw(20) << "tree_erase Mnode/s" << std::endl;
+    for (auto size : sizes) {
+        double erase_ns = measure_ns_per_node(size, [](bench_vector& tree, index_type i) { tree_erase(tree, i); });
+        double set_ns = measure_ns_per_node(size, set_based_erase);
+        std::cout << std::fixed << std::setprecision(2)
+                  << std::setw(10) << size
+                  << std::setw(20) << erase_ns
+                  << std::setw(20) << set_ns
+                  << std::setw(20) << 1000.0 / erase_ns << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "parallel_tree.hpp"
+#include "glm/glm.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+
+using namespace rte;
+
+namespace
+{
+    struct bench_node : public sparse_node
+    {
+        bench_node() : m_local_transform(1.0f), m_accum_transform(1.0f) {}
+
+        glm::mat4 m_local_transform;
+        glm::mat4 m_accum_transform;
+    };
+
+    typedef sparse_vector<bench_node> bench_vector;
+    typedef std::chrono::steady_clock bench_clock;
+
+    // Builds a scene-like tree: a root with a few hundred objects, each with a few levels of parts
+    void build_tree(bench_vector& tree, index_type size)
+    {
+        tree_init(tree);
+        tree.reserve(size);
+        tree_insert(tree, bench_node());
+        for (index_type i = 1; i < size; i++) {
+            index_type parent = (i < 256U? 0U : (i - 256U) / 4U + 1U);
+            tree_insert(tree, bench_node(), parent);
+        }
+    }
+} // anonymous namespace
+
+int main()
+{
+    const index_type size = 1000000U;
+    const index_type grain = 4096U;
+    const unsigned int repetitions = 10U;
+    bench_vector tree;
+    build_tree(tree, size);
+
+    std::cout << "hardware threads: " << std::thread::hardware_concurrency() << std::endl;
+    std::cout << std::setw(10) << "threads" << std::setw(12) << "ms/pass" << std::setw(12) << "speedup" << std::endl;
+    double single_thread_ms = 0.0;
+    for (unsigned int threads : {1U, 2U, 4U, 8U, 16U, 32U}) {
+        tree_worker_pool pool(threads - 1U);
+        tree_parallel_context context;
+        auto start = bench_clock::now();
+        for (unsigned int r = 0; r < repetitions; r++) {
+            tree_parallel_for_each(tree, 0, [&tree](index_type i) {
+                auto& current_node = tree.at(i);
+                glm::mat4 previous_transform(1.0f);
+                if (current_node.m_parent != npos) {
+                    previous_transform = tree.at(current_node.m_parent).m_accum_transform;
+                }
+                current_node.m_accum_transform = current_node.m_local_transform * previous_transform;
+            }, grain, pool, context);
+        }
+        auto end = bench_clock::now();
+
+        double ms = std::chrono::duration<double, std::milli>(end - start).count() / repetitions;
+        single_thread_ms = (threads == 1U? ms : single_thread_ms);
+        std::cout << std::fixed << std::setprecision(2)
+                  << std::setw(10) << threads
+                  << std::setw(12) << ms
+                  << std::setw(12) << single_thread_ms / ms << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include "sparse_tree.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace rte;
+
+namespace
+{
+    struct bench_node : public sparse_node
+    {
+        bench_node() : m_val(0) {}
+        bench_node(int val) : m_val(val) {}
+
+        int m_val;
+    };
+
+    typedef sparse_vector<bench_node> bench_vector;
+    typedef std::chrono::steady_clock bench_clock;
+
+    // Builds a tree of size nodes where each node has up to fan_out children
+    void build_tree(bench_vector& tree, index_type size, index_type fan_out)
+    {
+        tree_init(tree);
+        tree.reserve(size);
+        tree_insert(tree, bench_node(0));
+        for (index_type i = 1; i < size; i++) {
+            tree_insert(tree, bench_node(i), (i - 1) / fan_out);
+        }
+    }
+
+    // The traversal used before the flat iterators: an explicit stack, children pushed in reverse
+    long long traverse_with_stack(const bench_vector& tree)
+    {
+        long long sum = 0;
+        std::vector<index_type> pending_nodes;
+        pending_nodes.push_back(0U);
+        while (!pending_nodes.empty()) {
+            index_type current = pending_nodes.back();
+            pending_nodes.pop_back();
+
+            sum += tree.at(current).m_val;
+            for (auto it = tree_rbegin(tree, current); it != tree_rend(tree, current); ++it) {
+                pending_nodes.push_back(index(it));
+            }
+        }
+
+        return sum;
+    }
+
+    long long traverse_preorder(const bench_vector& tree)
+    {
+        long long sum = 0;
+        for (auto it = tree_preorder_begin(tree, 0); it != tree_preorder_end(tree, 0); ++it) {
+            sum += it->m_val;
+        }
+
+        return sum;
+    }
+
+    long long traverse_level_order(const bench_vector& tree, std::vector<index_type>& queue)
+    {
+        long long sum = 0;
+        for (auto it = tree_level_order_begin(tree, 0, queue); it != tree_level_order_end(tree, 0, queue); ++it) {
+            sum += it->m_val;
+        }
+
+        return sum;
+    }
+
+    template<typename F>
+    double measure_ns_per_node(const bench_vector& tree, unsigned int repetitions, long long expected_sum, F traverse)
+    {
+        auto start = bench_clock::now();
+        for (unsigned int i = 0; i < repetitions; i++) {
+            if (traverse(tree) != expected_sum) {
+                std::cerr << "tree_traversal_bench: wrong traversal result" << std::endl;
+            }
+        }
+        auto end = bench_clock::now();
+
+        return std::chrono::duration<double, std::nano>(end - start).count() / (double(repetitions) * tree.size());
+    }
+} // anonymous namespace
+
+int main()
+{
+    struct shape { std::string name; index_type fan_out; };
+    std::vector<shape> shapes = {{"binary", 2U}, {"wide", 16U}};
+    std::vector<index_type> sizes = {10000U, 100000U, 1000000U};
+
+    std::cout << std::setw(8) << "shape"
+              << std::setw(10) << "nodes"
+              << std::setw(16) << "stack ns/node"
+              << std::setw(18) << "preorder ns/node"
+              << std::setw(20) << "level order ns/node" << std::endl;
+    for (auto& s : shapes) {
+        for (auto size : sizes) {
+            bench_vector tree;
+            build_tree(tree, size, s.fan_out);
+            long long expected_sum = (long long) size * (size - 1) / 2;
+            unsigned int repetitions = (unsigned int) (10000000U / size);
+            std::vector<index_type> queue;
+
+            double stack_ns = measure_ns_per_node(tree, repetitions, expected_sum, traverse_with_stack);
+            double preorder_ns = measure_ns_per_node(tree, repetitions, expected_sum, traverse_preorder);
+            double level_order_ns = measure_ns_per_node(tree, repetitions, expected_sum, [&queue](const bench_vector& t) { return traverse_level_order(t, queue); });
+            std::cout << std::fixed << std::setprecision(2)
+                      << std::setw(8) << s.name
+                      << std::setw(10) << size
+                      << std::setw(16) << stack_ns
+                      << std::setw(18) << preorder_ns
+                      << std::setw(20) << level_order_ns << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+#ifndef BOUNDS_HPP
+#define BOUNDS_HPP
+
+#include "glm/glm.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include <cmath>
+
+namespace rte
+{
+    // Axis aligned bounding box. The default one is empty: it contains no point, and adding a point
+    // to it gives a box around that point
+    struct aabb
+    {
+        aabb() :
+            m_min(std::numeric_limits<float>::max()),
+            m_max(-std::numeric_limits<float>::max()) {}
+
+        aabb(const glm::vec3& min, const glm::vec3& max) :
+            m_min(min),
+            m_max(max) {}
+
+        bool empty() const { return m_min.x > m_max.x || m_min.y > m_max.y || m_min.z > m_max.z; }
+        glm::vec3 center() const { return (m_min + m_max) * 0.5f; }
+        glm::vec3 extent() const { return (m_max - m_min) * 0.5f; }
+
+        void add(const glm::vec3& p)
+        {
+            m_min = glm::min(m_min, p);
+            m_max = glm::max(m_max, p);
+        }
+
+        void add(const aabb& box)
+        {
+            m_min = glm::min(m_min, box.m_min);
+            m_max = glm::max(m_max, box.m_max);
+        }
+
+        float surface_area() const
+        {
+            if (empty()) {
+                return 0.0f;
+            }
+            glm::vec3 size = m_max - m_min;
+            return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+        }
+
+        glm::vec3      m_min;
+        glm::vec3      m_max;
+    };
+
+    // Bounding sphere. A negative radius means that it is empty
+    struct bounding_sphere
+    {
+        bounding_sphere() :
+            m_center(0.0f),
+            m_radius(-1.0f) {}
+
+        bounding_sphere(const glm::vec3& center, float radius) :
+            m_center(center),
+            m_radius(radius) {}
+
+        bool empty() const { return m_radius < 0.0f; }
+
+        glm::vec3      m_center;
+        float          m_radius;
+    };
+
+    inline aabb aabb_from_points(const std::vector<glm::vec3>& points)
+    {
+        aabb box;
+        for (auto& p : points) {
+            box.add(p);
+        }
+
+        return box;
+    }
+
+    // Sphere centered in the box of the points, with the radius of the farthest one. Not the smallest
+    // sphere, but close for the usual meshes, and never bigger than the sphere around the box
+    inline bounding_sphere sphere_from_points(const std::vector<glm::vec3>& points)
+    {
+        aabb box = aabb_from_points(points);
+        if (box.empty()) {
+            return bounding_sphere();
+        }
+
+        glm::vec3 center = box.center();
+        float radius2 = 0.0f;
+        for (auto& p : points) {
+            glm::vec3 d = p - center;
+            radius2 = std::max(radius2, glm::dot(d, d));
+        }
+
+        return bounding_sphere(center, std::sqrt(radius2));
+    }
+
+    // Box around the transformed box (Arvo's method): each column of the transform moves the
+    // corners along one axis, so the new extent is the sum of the absolute values of the columns
+    // weighted by the old one
+    inline aabb transform_aabb(const aabb& box, const glm::mat4& m)
+    {
+        if (box.empty()) {
+            return box;
+        }
+
+        glm::vec3 center = glm::vec3(m * glm::vec4(box.center(), 1.0f));
+        glm::vec3 e = box.extent();
+        glm::vec3 extent = glm::abs(glm::vec3(m[0])) * e.x + glm::abs(glm::vec3(m[1])) * e.y + glm::abs(glm::vec3(m[2])) * e.z;
+        return aabb(center - extent, center + extent);
+    }
+
+    // Sphere around the transformed sphere. The radius is scaled by the biggest scale of the
+    // transform, so it stays conservative with non-uniform scales
+    inline bounding_sphere transform_sphere(const bounding_sphere& sphere, const glm::mat4& m)
+    {
+        if (sphere.empty()) {
+            return sphere;
+        }
+
+        float scale2 = std::max(glm::dot(glm::vec3(m[0]), glm::vec3(m[0])),
+                                std::max(glm::dot(glm::vec3(m[1]), glm::vec3(m[1])), glm::dot(glm::vec3(m[2]), glm::vec3(m[2]))));
+        return bounding_sphere(glm::vec3(m * glm::vec4(sphere.m_center, 1.0f)), sphere.m_radius * std::sqrt(scale2));
+    }
+} // namespace rte
+
+#endif // BOUNDS_HPP
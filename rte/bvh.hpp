@@ -0,0 +1,425 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include "frustum_culling.hpp"
+#include "sparse_vector.hpp"
+#include "glm/glm.hpp"
+#include "bounds.hpp"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace rte
+{
+    constexpr index_type bvh_leaf_size = 4U;                 //!< ranges of up to this many items are never split
+    constexpr index_type bvh_max_leaf_size = 16U;            //!< ranges of more items are always split, even if the SAH says otherwise
+    constexpr index_type bvh_bin_count = 16U;                //!< bins per axis tried by the SAH build
+    constexpr index_type bvh_rebuild_threshold = 64U;        //!< changes always tolerated before bvh_needs_rebuild() asks for a build
+    constexpr index_type bvh_pending = npos - 1U;            //!< value of bvh::m_item_leaves for the items in bvh::m_pending
+
+    struct bvh_node
+    {
+        bvh_node() :
+            m_bounds(),
+            m_parent(npos),
+            m_first(0U),
+            m_count(0U) {}
+
+        aabb           m_bounds;
+        index_type     m_parent;
+        index_type     m_first;      //!< first child for internal nodes, the second one follows it. First box of bvh::m_items for leaves
+        index_type     m_count;      //!< number of boxes of bvh::m_items for leaves, 0 for internal nodes
+    };
+
+    // Bounding volume hierarchy over items identified by small indexes (the nodes of a view_database),
+    // whose bounds are read through a function given to each call. The leaves keep a copy of the
+    // bounds of their items in a cull_batch, so that the queries read them in order instead of
+    // jumping around the tables of the items, and test the items of a leaf with the SIMD kernels.
+    //
+    // bvh_build() makes a hierarchy of good quality with the surface area heuristic, which is worth
+    // it for static content. When items move, bvh_mark_item() and bvh_refit() update the bounds of
+    // the nodes above them only, keeping the shape of the hierarchy. Inserted items are kept in a
+    // list tested one by one, and removed items leave a hole in their leaf, until
+    // bvh_needs_rebuild() says that it is time to build again
+    struct bvh
+    {
+        bvh() :
+            m_nodes(),
+            m_items(),
+            m_item_leaves(),
+            m_pending(),
+            m_pending_slots(),
+            m_marked(),
+            m_node_marked(),
+            m_item_count(0U),
+            m_removed_count(0U),
+            m_build_stack(),
+            m_query_stack() {}
+
+        std::vector<bvh_node>         m_nodes;               //!< the root first, children always after their parent
+        cull_batch                    m_items;               //!< items of the leaves with their bounds as of the last build or refit, npos for the removed ones
+        std::vector<index_type>       m_item_leaves;         //!< leaf of each item, bvh_pending or npos if the item is not in the bvh
+        std::vector<index_type>       m_pending;             //!< items inserted since the last build
+        std::vector<index_type>       m_pending_slots;       //!< position in m_pending of each item, only meaningful for the pending ones
+        std::vector<index_type>       m_marked;              //!< nodes whose bounds must be recomputed by bvh_refit()
+        std::vector<unsigned char>    m_node_marked;         //!< 1 for the nodes in m_marked
+        index_type                    m_item_count;          //!< items in the leaves
+        index_type                    m_removed_count;       //!< holes left in the leaves by bvh_remove()
+        std::vector<index_type>       m_build_stack;         //!< scratch memory of bvh_build()
+        // Scratch memory of bvh_query(), which is why two queries of the same bvh can't run at once
+        mutable std::vector<std::pair<index_type, int>> m_query_stack;
+    };
+
+    inline void bvh_clear(bvh& tree)
+    {
+        tree.m_nodes.clear();
+        cull_batch_clear(tree.m_items);
+        tree.m_item_leaves.clear();
+        tree.m_pending.clear();
+        tree.m_pending_slots.clear();
+        tree.m_marked.clear();
+        tree.m_node_marked.clear();
+        tree.m_item_count = 0U;
+        tree.m_removed_count = 0U;
+    }
+
+    inline bool bvh_contains(const bvh& tree, index_type item)
+    {
+        return item < tree.m_item_leaves.size() && tree.m_item_leaves[item] != npos;
+    }
+
+    // Recomputes the bounds of a node from those of its children, or for a leaf from the current
+    // bounds of its items, which are copied into m_items
+    template<typename F>
+    void bvh_refit_node(bvh& tree, index_type node_index, F get_bounds)
+    {
+        auto& n = tree.m_nodes[node_index];
+        aabb bounds;
+        if (n.m_count == 0U) {
+            bounds.add(tree.m_nodes[n.m_first].m_bounds);
+            bounds.add(tree.m_nodes[n.m_first + 1U].m_bounds);
+        } else {
+            for (index_type k = n.m_first; k < n.m_first + n.m_count; k++) {
+                index_type item = tree.m_items.m_nodes[k];
+                aabb item_bounds = (item != npos? aabb(get_bounds(item)) : aabb());
+                cull_batch_set(tree.m_items, k, item, item_bounds);
+                bounds.add(item_bounds);
+            }
+        }
+        n.m_bounds = bounds;
+        tree.m_node_marked[node_index] = 0U;
+    }
+
+    // Builds the hierarchy of the given items from scratch, with the bounds returned by
+    // get_bounds(item). Each range of items is split where the binned surface area heuristic
+    // gives the lowest cost, or made a leaf if no split is cheaper than testing all its items
+    template<typename F>
+    void bvh_build(bvh& tree, const std::vector<index_type>& items, F get_bounds)
+    {
+        struct build_entry
+        {
+            index_type m_item;
+            aabb m_bounds;
+            glm::vec3 m_centroid;
+        };
+
+        bvh_clear(tree);
+        std::vector<build_entry> entries;
+        entries.reserve(items.size());
+        index_type max_item = 0U;
+        for (auto item : items) {
+            aabb bounds = get_bounds(item);
+            entries.push_back(build_entry{item, bounds, bounds.empty()? glm::vec3(0.0f) : bounds.center()});
+            max_item = std::max(max_item, item);
+        }
+        if (entries.empty()) {
+            return;
+        }
+
+        tree.m_item_leaves.assign(max_item + 1U, npos);
+        tree.m_nodes.reserve(2U * entries.size() / bvh_leaf_size + 1U);
+        bvh_node root;
+        root.m_count = entries.size();
+        tree.m_nodes.push_back(root);
+        auto& stack = tree.m_build_stack;
+        stack.assign(1U, 0U);
+        while (!stack.empty()) {
+            index_type node_index = stack.back();
+            stack.pop_back();
+            index_type first = tree.m_nodes[node_index].m_first;
+            index_type count = tree.m_nodes[node_index].m_count;
+
+            aabb bounds;
+            aabb centroid_bounds;
+            for (index_type k = first; k < first + count; k++) {
+                bounds.add(entries[k].m_bounds);
+                centroid_bounds.add(entries[k].m_centroid);
+            }
+            tree.m_nodes[node_index].m_bounds = bounds;
+            if (count <= bvh_leaf_size) {
+                continue;
+            }
+
+            // Cost of a split: the probability of visiting each child, proportional to its area,
+            // times the number of items it holds. A leaf costs the area of the node times its items
+            float best_cost = bounds.surface_area() * count;
+            int best_axis = -1;
+            index_type best_bin = 0U;
+            glm::vec3 centroid_size = centroid_bounds.m_max - centroid_bounds.m_min;
+            for (int axis = 0; axis < 3; axis++) {
+                if (centroid_size[axis] <= 0.0f) {
+                    continue;
+                }
+
+                aabb bin_bounds[bvh_bin_count];
+                index_type bin_counts[bvh_bin_count] = {};
+                float scale = bvh_bin_count / centroid_size[axis];
+                for (index_type k = first; k < first + count; k++) {
+                    index_type bin = std::min(bvh_bin_count - 1U, index_type((entries[k].m_centroid[axis] - centroid_bounds.m_min[axis]) * scale));
+                    bin_bounds[bin].add(entries[k].m_bounds);
+                    bin_counts[bin]++;
+                }
+
+                // right_costs[b] is the cost of the bins after b
+                float right_costs[bvh_bin_count];
+                aabb right_bounds;
+                index_type right_count = 0U;
+                for (index_type b = bvh_bin_count - 1U; b > 0U; b--) {
+                    right_bounds.add(bin_bounds[b]);
+                    right_count += bin_counts[b];
+                    right_costs[b - 1U] = right_bounds.surface_area() * right_count;
+                }
+                aabb left_bounds;
+                index_type left_count = 0U;
+                for (index_type b = 0U; b + 1U < bvh_bin_count; b++) {
+                    left_bounds.add(bin_bounds[b]);
+                    left_count += bin_counts[b];
+                    float cost = left_bounds.surface_area() * left_count + right_costs[b];
+                    if (left_count > 0U && left_count < count && cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_bin = b;
+                    }
+                }
+            }
+
+            index_type middle;
+            if (best_axis >= 0) {
+                float scale = bvh_bin_count / centroid_size[best_axis];
+                float min = centroid_bounds.m_min[best_axis];
+                auto it = std::partition(entries.begin() + first, entries.begin() + first + count, [=](const build_entry& e) {
+                    return std::min(bvh_bin_count - 1U, index_type((e.m_centroid[best_axis] - min) * scale)) <= best_bin;
+                });
+                middle = it - entries.begin();
+            } else if (count > bvh_max_leaf_size) {
+                // All the centroids are at the same place, or the heuristic prefers a leaf that would be too big
+                middle = first + count / 2U;
+            } else {
+                continue;
+            }
+
+            index_type left = tree.m_nodes.size();
+            bvh_node child;
+            child.m_parent = node_index;
+            child.m_first = first;
+            child.m_count = middle - first;
+            tree.m_nodes.push_back(child);
+            child.m_first = middle;
+            child.m_count = first + count - middle;
+            tree.m_nodes.push_back(child);
+            tree.m_nodes[node_index].m_first = left;
+            tree.m_nodes[node_index].m_count = 0U;
+            stack.push_back(left + 1U);
+            stack.push_back(left);
+        }
+
+        cull_batch_resize(tree.m_items, entries.size());
+        for (index_type k = 0; k < entries.size(); k++) {
+            cull_batch_set(tree.m_items, k, entries[k].m_item, entries[k].m_bounds);
+        }
+        for (index_type node_index = 0; node_index < tree.m_nodes.size(); node_index++) {
+            auto& n = tree.m_nodes[node_index];
+            for (index_type k = n.m_first; k < n.m_first + n.m_count; k++) {
+                tree.m_item_leaves[tree.m_items.m_nodes[k]] = node_index;
+            }
+        }
+        tree.m_node_marked.assign(tree.m_nodes.size(), 0U);
+        tree.m_item_count = entries.size();
+    }
+
+    // Queues the nodes above a leaf for bvh_refit(). Stops at the first node already queued, whose
+    // ancestors are queued too
+    inline void bvh_mark_node(bvh& tree, index_type node_index)
+    {
+        for (index_type i = node_index; i != npos && !tree.m_node_marked[i]; i = tree.m_nodes[i].m_parent) {
+            tree.m_node_marked[i] = 1U;
+            tree.m_marked.push_back(i);
+        }
+    }
+
+    // Must be called when the bounds of an item change. Items in m_pending are always tested with
+    // their current bounds, so nothing is done for them
+    inline void bvh_mark_item(bvh& tree, index_type item)
+    {
+        if (item < tree.m_item_leaves.size() && tree.m_item_leaves[item] < tree.m_nodes.size()) {
+            bvh_mark_node(tree, tree.m_item_leaves[item]);
+        }
+    }
+
+    inline void bvh_insert(bvh& tree, index_type item)
+    {
+        if (bvh_contains(tree, item)) {
+            return;
+        }
+
+        if (item >= tree.m_item_leaves.size()) {
+            tree.m_item_leaves.resize(item + 1U, npos);
+        }
+        if (item >= tree.m_pending_slots.size()) {
+            tree.m_pending_slots.resize(item + 1U, npos);
+        }
+        tree.m_item_leaves[item] = bvh_pending;
+        tree.m_pending_slots[item] = tree.m_pending.size();
+        tree.m_pending.push_back(item);
+    }
+
+    inline void bvh_remove(bvh& tree, index_type item)
+    {
+        if (!bvh_contains(tree, item)) {
+            return;
+        }
+
+        index_type leaf = tree.m_item_leaves[item];
+        if (leaf == bvh_pending) {
+            // The last pending item takes the place of the removed one
+            index_type slot = tree.m_pending_slots[item];
+            index_type last = tree.m_pending.back();
+            tree.m_pending[slot] = last;
+            tree.m_pending_slots[last] = slot;
+            tree.m_pending.pop_back();
+        } else {
+            auto& n = tree.m_nodes[leaf];
+            auto it = std::find(tree.m_items.m_nodes.begin() + n.m_first, tree.m_items.m_nodes.begin() + n.m_first + n.m_count, item);
+            cull_batch_set(tree.m_items, it - tree.m_items.m_nodes.begin(), npos, aabb());
+            bvh_mark_node(tree, leaf);
+            tree.m_item_count--;
+            tree.m_removed_count++;
+        }
+        tree.m_item_leaves[item] = npos;
+    }
+
+    // True when the items inserted or removed since the last build are enough to slow down the
+    // queries noticeably
+    inline bool bvh_needs_rebuild(const bvh& tree)
+    {
+        return tree.m_pending.size() + tree.m_removed_count > std::max(bvh_rebuild_threshold, tree.m_item_count / 8U);
+    }
+
+    // Recomputes the bounds of the nodes queued by bvh_mark_item() and bvh_remove(). Children have
+    // higher indexes than their parents, so going through the nodes from the highest index
+    // updates the children first. Returns the number of nodes recomputed
+    template<typename F>
+    index_type bvh_refit(bvh& tree, F get_bounds)
+    {
+        std::sort(tree.m_marked.begin(), tree.m_marked.end(), [](index_type a, index_type b) { return a > b; });
+        for (auto node_index : tree.m_marked) {
+            bvh_refit_node(tree, node_index, get_bounds);
+        }
+        index_type refit_count = tree.m_marked.size();
+        tree.m_marked.clear();
+
+        return refit_count;
+    }
+
+    // Recomputes the bounds of every node, for when most items have moved
+    template<typename F>
+    void bvh_refit_all(bvh& tree, F get_bounds)
+    {
+        for (index_type node_index = tree.m_nodes.size(); node_index-- > 0U; ) {
+            bvh_refit_node(tree, node_index, get_bounds);
+        }
+        tree.m_marked.clear();
+    }
+
+    // Replaces the contents of visible_out with the items whose bounds intersect the frustum, like
+    // frustum_cull() with the same boxes but in no particular order. get_bounds() is only called for
+    // the pending items, the others are tested with the bounds of the last refit. Returns the number
+    // of visible items.
+    // The nodes carry the mask of the planes that may still cut them: a plane that leaves a node
+    // fully inside is not tested again below it, and the items of a node fully inside the frustum
+    // are taken without any test. The items of the other leaves are tested with the given kernel
+    // (which must be supported, see transform_kernel_supported()). The walk uses the scratch memory
+    // of tree, so that it doesn't allocate once it has warmed up: a bvh can't be queried by two
+    // threads at once
+    template<typename F>
+    index_type bvh_query(const bvh& tree, transform_kernel kernel, const frustum& f, F get_bounds, std::vector<index_type>& visible_out)
+    {
+        // -1 if the box is outside one of the planes of the mask, otherwise the mask of the
+        // planes that cut it
+        auto classify = [&f](const aabb& box, int mask) {
+            if (box.empty()) {
+                return -1;
+            }
+            glm::vec3 center = box.center();
+            glm::vec3 extent = box.extent();
+            for (int p = 0; p < 6; p++) {
+                if (mask & (1 << p)) {
+                    const glm::vec4& plane = f.m_planes[p];
+                    float distance = glm::dot(glm::vec3(plane), center) + plane.w;
+                    float radius = glm::dot(glm::abs(glm::vec3(plane)), extent);
+                    if (distance + radius < 0.0f) {
+                        return -1;
+                    } else if (distance - radius >= 0.0f) {
+                        mask &= ~(1 << p);
+                    }
+                }
+            }
+            return mask;
+        };
+
+        visible_out.clear();
+        for (auto item : tree.m_pending) {
+            if (classify(get_bounds(item), 0x3f) >= 0) {
+                visible_out.push_back(item);
+            }
+        }
+        if (tree.m_nodes.empty()) {
+            return visible_out.size();
+        }
+
+        auto& stack = tree.m_query_stack;
+        stack.assign(1U, std::make_pair(index_type(0U), 0x3f));
+        while (!stack.empty()) {
+            index_type node_index = stack.back().first;
+            int mask = stack.back().second;
+            stack.pop_back();
+            auto& n = tree.m_nodes[node_index];
+            if (mask != 0) {
+                mask = classify(n.m_bounds, mask);
+                if (mask < 0) {
+                    continue;
+                }
+            }
+
+            if (n.m_count == 0U) {
+                stack.push_back(std::make_pair(n.m_first + 1U, mask));
+                stack.push_back(std::make_pair(n.m_first, mask));
+                continue;
+            }
+            if (mask != 0) {
+                frustum_cull_range(kernel, f, tree.m_items, n.m_first, n.m_first + n.m_count, visible_out);
+                continue;
+            }
+            for (index_type k = n.m_first; k < n.m_first + n.m_count; k++) {
+                if (!cull_batch_empty_box(tree.m_items, k)) {
+                    visible_out.push_back(tree.m_items.m_nodes[k]);
+                }
+            }
+        }
+
+        return visible_out.size();
+    }
+} // namespace rte
+
+#endif // BVH_HPP
@@ -0,0 +1,221 @@
+#ifndef CONCURRENT_APPEND_HPP
+#define CONCURRENT_APPEND_HPP
+
+#include "sparse_tree.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cassert>
+#include <utility>
+#include <atomic>
+#include <vector>
+
+namespace rte
+{
+    // Maximum number of reserved slots that a thread claims at once from a sparse_concurrent_append
+    constexpr index_type concurrent_append_max_block_size = 64U;
+
+    // Batch of insertions into a sparse_vector (or a tree, or a list) made by several threads at once.
+    //
+    // The constructor reserves slots up front, taking them from the free list first and then growing
+    // the vector, so that nothing is reallocated while threads write into it. Each thread uses its
+    // own local, which claims reserved slots in blocks with a single atomic increment and keeps a
+    // free list of its own. Blocks get smaller for small batches, and the reservation includes the
+    // slots that can be left over in the blocks of other threads, so max_count entries always fit
+    // however they are spread among threads. Entries stored by the locals stay invisible until finish()
+    // marks them as used and links them to their parents, which is done by a single thread once the
+    // inserting threads are done. Which slot an entry gets depends on the timing of the threads, so
+    // entries can be given their position in the input, and finish() links them in that order
+    // whatever their indexes. If the batch is destroyed before finish() every entry is discarded, so
+    // a batch is all or nothing.
+    //
+    // While the batch is open the vector must only be written through the locals. Entries that
+    // existed before can be read, but a vector with cow_chunked_storage must not be copied.
+    template<typename V>
+    class sparse_concurrent_append
+    {
+    public:
+        typedef typename V::value_type value_type;
+
+        struct published_entry
+        {
+            index_type m_index;
+            index_type m_parent;
+            index_type m_order;
+        };
+
+        // Insertion state of one thread. A local must not be used by two threads at once
+        class local
+        {
+        public:
+            local() :
+                m_batch(nullptr),
+                m_next_slot(0U),
+                m_end_slot(0U),
+                m_free(),
+                m_published() {}
+
+            // Stores a new entry, which will be a child of parent_index when the batch is finished,
+            // and returns its index. parent_index can be npos, an entry of the vector or an entry
+            // of the batch inserted by any thread. order is the position of the entry in the input
+            // (see finish()). Throws std::length_error if the reserved slots have run out
+            index_type insert(const value_type& t, index_type parent_index = npos, index_type order = npos)
+            {
+                index_type new_index = allocate();
+                try {
+                    m_batch->m_vector.physical_at(new_index) = t;
+                    m_published.push_back({new_index, parent_index, order});
+                } catch (...) {
+                    m_free.push_back(new_index);
+                    throw;
+                }
+
+                return new_index;
+            }
+
+            // Same as insert(const value_type&), but moves the value into its slot
+            index_type insert(value_type&& t, index_type parent_index = npos, index_type order = npos)
+            {
+                index_type new_index = allocate();
+                try {
+                    m_batch->m_vector.physical_at(new_index) = std::move(t);
+                    m_published.push_back({new_index, parent_index, order});
+                } catch (...) {
+                    m_free.push_back(new_index);
+                    throw;
+                }
+
+                return new_index;
+            }
+
+            template<typename... Args>
+            index_type emplace(index_type parent_index, Args&&... args)
+            {
+                return insert(value_type(std::forward<Args>(args)...), parent_index);
+            }
+
+        private:
+            friend class sparse_concurrent_append;
+
+            index_type allocate()
+            {
+                if (!m_free.empty()) {
+                    index_type new_index = m_free.back();
+                    m_free.pop_back();
+                    return new_index;
+                }
+
+                if (m_next_slot == m_end_slot) {
+                    index_type first_slot = m_batch->m_next_slot.fetch_add(m_batch->m_block_size);
+                    if (!(first_slot < m_batch->m_slots.size())) {
+                        throw std::length_error("sparse_concurrent_append: more entries than reserved");
+                    }
+                    m_next_slot = first_slot;
+                    m_end_slot = std::min(first_slot + m_batch->m_block_size, m_batch->m_slots.size());
+                }
+
+                return m_batch->m_slots[m_next_slot++];
+            }
+
+            sparse_concurrent_append*        m_batch;
+            index_type                       m_next_slot;    //!< next slot of the claimed block, as a position in m_slots
+            index_type                       m_end_slot;     //!< end of the claimed block
+            std::vector<index_type>          m_free;         //!< slots given back by failed insertions
+            std::vector<published_entry>     m_published;    //!< entries to link when the batch is finished
+        };
+
+        // Reserves room for max_count entries of v, inserted by up to thread_count locals. Strong
+        // exception guarantee
+        sparse_concurrent_append(V& v, index_type max_count, unsigned int thread_count) :
+            m_vector(v),
+            m_slots(),
+            m_next_slot(0U),
+            m_block_size(std::max(index_type(1U), std::min(concurrent_append_max_block_size, max_count / (8U * std::max(thread_count, 1U))))),
+            m_locals(thread_count),
+            m_finished(false)
+        {
+            // Every local but the one that runs out can hold up to m_block_size - 1 unused slots
+            m_vector.allocate(max_count + thread_count * (m_block_size - 1U), m_slots);
+            for (auto& l : m_locals) {
+                l.m_batch = this;
+            }
+        }
+
+        sparse_concurrent_append(const sparse_concurrent_append&) = delete;
+        sparse_concurrent_append& operator=(const sparse_concurrent_append&) = delete;
+
+        ~sparse_concurrent_append()
+        {
+            if (!m_finished) {
+                give_back_unused_slots();
+            }
+        }
+
+        local& get_local(unsigned int thread_index) { return m_locals.at(thread_index); }
+
+        // Link-up step: marks every stored entry as used and makes it the last child of its parent,
+        // in increasing order of the positions given to insert(), then gives the unused slots back
+        // to the vector. Entries without a position come after the others, in increasing index
+        // order. Must be called by a single thread, after all the locals are done. Throws
+        // std::domain_error without changing anything if the parent of an entry is not valid.
+        void finish()
+        {
+            assert(!m_finished);
+            std::vector<published_entry> entries;
+            for (auto& l : m_locals) {
+                entries.insert(entries.end(), l.m_published.begin(), l.m_published.end());
+            }
+            auto by_index = [](const published_entry& a, const published_entry& b) { return a.m_index < b.m_index; };
+            std::sort(entries.begin(), entries.end(), by_index);
+            for (auto& e : entries) {
+                bool valid_parent = (e.m_parent == npos || m_vector.used(e.m_parent) ||
+                                     std::binary_search(entries.begin(), entries.end(), published_entry{e.m_parent, npos, npos}, by_index));
+                if (!valid_parent) {
+                    throw std::domain_error("sparse_concurrent_append: invalid parent index");
+                }
+            }
+            std::stable_sort(entries.begin(), entries.end(), [](const published_entry& a, const published_entry& b) {
+                return a.m_order < b.m_order;
+            });
+
+            for (auto& e : entries) {
+                if (m_vector.used(e.m_parent)) {
+                    tree_prepare_link(m_vector, e.m_parent);
+                }
+            }
+
+            // Exception safety: now that we have passed all the throw points, impact the changes in the structure.
+            // All the entries are marked first, as parents may be entries of the batch
+            for (auto& e : entries) {
+                tree_link_new_node(m_vector, e.m_index, npos);
+            }
+            for (auto& e : entries) {
+                if (e.m_parent != npos) {
+                    tree_add_child(m_vector, e.m_parent, e.m_index);
+                }
+            }
+            give_back_unused_slots();
+            m_finished = true;
+        }
+
+    private:
+        void give_back_unused_slots()
+        {
+            // In reverse, so that the free list hands them out again in the original order
+            for (auto it = m_slots.rbegin(); it != m_slots.rend(); ++it) {
+                if (!m_vector.used(*it)) {
+                    m_vector.release(*it);
+                }
+            }
+        }
+
+        V&                           m_vector;
+        std::vector<index_type>      m_slots;        //!< slots reserved by the constructor
+        std::atomic<index_type>      m_next_slot;    //!< first position of m_slots not claimed by any local
+        index_type                   m_block_size;   //!< slots claimed at once by a local
+        std::vector<local>           m_locals;
+        bool                         m_finished;
+    };
+} // namespace rte
+
+#endif // CONCURRENT_APPEND_HPP
@@ -0,0 +1,268 @@
+#ifndef COW_STORAGE_HPP
+#define COW_STORAGE_HPP
+
+#include "sparse_vector.hpp"
+
+#include <utility>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <array>
+
+namespace rte
+{
+    // Number of slots of a chunk of cow_chunked_storage. Must be a multiple of occupancy_word_bits
+    constexpr index_type cow_chunk_size = 256U;
+    constexpr index_type cow_chunk_words = cow_chunk_size / occupancy_word_bits;
+
+    // Storage of sparse_vector made of fixed size chunks of slots (with their occupancy bits) that are
+    // shared between copies and cloned on the first write. Copying a vector that uses this storage
+    // copies one pointer per chunk, which makes the copy a cheap snapshot: writes to the original
+    // clone only the chunks they touch, and the snapshot keeps seeing the old ones.
+    //
+    // A snapshot must be taken by the thread that writes the vector. Once taken, it can be read by
+    // another thread without locks while the original keeps being written, because a chunk shared
+    // by two vectors is never written in place. Snapshots can be destroyed by any thread. Writes to
+    // a single vector must still come from one thread at a time, even for different entries, since
+    // two threads could clone the same chunk.
+    //
+    // Any non-const access counts as a write, which includes traversing a tree with non-const
+    // iterators: read through a const reference whenever possible. Functions with a part that must
+    // not throw, like tree_insert() and tree_erase(), clone beforehand the chunks they will write
+    // (see sparse_vector::make_writable()).
+    template <typename T, typename Allocator>
+    class cow_chunked_storage
+    {
+        struct chunk
+        {
+            chunk() :
+                m_elems(),
+                m_used_bits() {}
+
+            std::array<T, cow_chunk_size>                    m_elems;
+            std::array<occupancy_word, cow_chunk_words>      m_used_bits;
+        };
+
+    public:
+        typedef T value_type;
+        typedef Allocator allocator_type;
+        typedef typename std::allocator_traits<allocator_type>::template rebind_alloc<chunk> chunk_allocator_type;
+        typedef std::shared_ptr<chunk> chunk_pointer;
+        typedef typename std::allocator_traits<allocator_type>::template rebind_alloc<chunk_pointer> chunk_pointer_allocator_type;
+        typedef std::vector<chunk_pointer, chunk_pointer_allocator_type> chunk_container;
+
+        static constexpr bool copy_on_write = true;      //!< writing a slot may clone its chunk
+
+        // Used by non-const iterators. Every access goes through the storage, so it clones shared chunks
+        class elements_type
+        {
+        public:
+            elements_type() :
+                m_storage(nullptr) {}
+
+            explicit elements_type(cow_chunked_storage* storage) :
+                m_storage(storage) {}
+
+            T& operator[](index_type index) const { return (*m_storage)[index]; }
+            bool operator==(const elements_type& e) const { return m_storage == e.m_storage; }
+
+            cow_chunked_storage* get_storage() const { return m_storage; }
+
+        private:
+            cow_chunked_storage* m_storage;
+        };
+
+        // Used by const iterators, reads the chunks directly
+        class const_elements_type
+        {
+        public:
+            const_elements_type() :
+                m_chunks(nullptr) {}
+
+            explicit const_elements_type(const chunk_pointer* chunks) :
+                m_chunks(chunks) {}
+
+            const_elements_type(const elements_type& e) :
+                m_chunks(e.get_storage() != nullptr? e.get_storage()->m_chunks.data() : nullptr) {}
+
+            const T& operator[](index_type index) const { return m_chunks[index / cow_chunk_size]->m_elems[index % cow_chunk_size]; }
+            bool operator==(const const_elements_type& e) const { return m_chunks == e.m_chunks; }
+
+        private:
+            const chunk_pointer* m_chunks;
+        };
+
+        cow_chunked_storage() :
+            m_chunks(),
+            m_size(0U) {}
+
+        explicit cow_chunked_storage(const allocator_type& allocator) :
+            m_chunks(chunk_pointer_allocator_type(allocator)),
+            m_size(0U) {}
+
+        // O(chunks). The chunks are shared unless the copy gets a different allocator (as copies of
+        // arena_allocator containers do), in which case they are cloned into the new allocator
+        cow_chunked_storage(const cow_chunked_storage& s) :
+            m_chunks(std::allocator_traits<chunk_pointer_allocator_type>::select_on_container_copy_construction(s.m_chunks.get_allocator())),
+            m_size(0U)
+        {
+            assign_chunks(s);
+        }
+
+        cow_chunked_storage(cow_chunked_storage&& s) :
+            m_chunks(std::move(s.m_chunks)),
+            m_size(s.m_size)
+        {
+            s.m_chunks.clear();
+            s.m_size = 0U;
+        }
+
+        cow_chunked_storage& operator=(const cow_chunked_storage& s)
+        {
+            if (&s != this) {
+                assign_chunks(s);
+            }
+
+            return *this;
+        }
+
+        cow_chunked_storage& operator=(cow_chunked_storage&& s)
+        {
+            if (&s != this) {
+                // Chunks can't be taken from another allocator, they would point into its memory
+                if (m_chunks.get_allocator() == s.m_chunks.get_allocator()) {
+                    m_chunks.swap(s.m_chunks);
+                    m_size = s.m_size;
+                } else {
+                    assign_chunks(s);
+                }
+                s.clear();
+            }
+
+            return *this;
+        }
+
+        // No bounds checking, sparse_vector does it. The non-const version clones the chunk of the
+        // slot if it is shared
+        T& operator[](index_type index) { return writable_chunk(index / cow_chunk_size).m_elems[index % cow_chunk_size]; }
+        const T& operator[](index_type index) const { return m_chunks[index / cow_chunk_size]->m_elems[index % cow_chunk_size]; }
+
+        elements_type elements() { return elements_type(this); }
+        const_elements_type elements() const { return const_elements_type(m_chunks.data()); }
+
+        // Words of the occupancy bitset, cow_chunk_words per chunk. The bits past size() are clear
+        index_type word_count() const { return m_chunks.size() * cow_chunk_words; }
+        occupancy_word word(index_type w) const { return m_chunks[w / cow_chunk_words]->m_used_bits[w % cow_chunk_words]; }
+
+        void set_bit(index_type index)
+        {
+            auto& c = writable_chunk(index / cow_chunk_size);
+            c.m_used_bits[(index % cow_chunk_size) / occupancy_word_bits] |= occupancy_word(1U) << (index % occupancy_word_bits);
+        }
+
+        void clear_bit(index_type index)
+        {
+            auto& c = writable_chunk(index / cow_chunk_size);
+            c.m_used_bits[(index % cow_chunk_size) / occupancy_word_bits] &= ~(occupancy_word(1U) << (index % occupancy_word_bits));
+        }
+
+        // Adds slots until there are new_size. Slots past size() are still default constructed in
+        // their chunk, so only whole chunks are added. Nothing visible changes if it throws
+        void grow(index_type new_size)
+        {
+            index_type first_new_chunk = m_chunks.size();
+            while (capacity() < new_size) {
+                m_chunks.push_back(new_chunk());
+            }
+
+            // The first new slot may be in a chunk shared with a snapshot. Clone it now, so that new
+            // slots can be written without throwing (see sparse_vector::release())
+            if (m_size < new_size && m_size / cow_chunk_size < first_new_chunk) {
+                writable_chunk(m_size / cow_chunk_size);
+            }
+            m_size = new_size;
+        }
+
+        void push_back(const T& t)
+        {
+            if (m_size == capacity()) {
+                m_chunks.push_back(new_chunk());
+            }
+            (*this)[m_size] = t;
+            m_size++;
+        }
+
+        // Clones the chunk of the slot if it is shared, so that writing the slot can't throw
+        void make_writable(index_type index) { writable_chunk(index / cow_chunk_size); }
+
+        // Same as make_writable(), but returns false instead of throwing if the clone fails
+        bool try_make_writable(index_type index)
+        {
+            try {
+                writable_chunk(index / cow_chunk_size);
+                return true;
+            } catch (...) {
+                return false;
+            }
+        }
+
+        allocator_type get_allocator() const { return allocator_type(m_chunks.get_allocator()); }
+        index_type size() const { return m_size; }
+        // Slots of the chunks allocated so far. Slots never move, growing only adds chunks
+        index_type capacity() const { return m_chunks.size() * cow_chunk_size; }
+        // Only reserves room for the chunk pointers, chunks are allocated as the storage grows
+        void reserve(index_type new_capacity) { m_chunks.reserve((new_capacity + cow_chunk_size - 1U) / cow_chunk_size); }
+        void clear() { m_chunks.clear(); m_size = 0U; }
+        void swap(cow_chunked_storage& s) { m_chunks.swap(s.m_chunks); std::swap(m_size, s.m_size); }
+
+        index_type chunk_count() const { return m_chunks.size(); }
+        // Returns true if chunk c is the same memory in both storages, for tests and statistics
+        bool shares_chunk(const cow_chunked_storage& s, index_type c) const
+        {
+            return c < m_chunks.size() && c < s.m_chunks.size() && m_chunks[c] == s.m_chunks[c];
+        }
+
+    private:
+        chunk_pointer new_chunk() const
+        {
+            return std::allocate_shared<chunk>(chunk_allocator_type(m_chunks.get_allocator()));
+        }
+
+        chunk& writable_chunk(index_type c)
+        {
+            chunk_pointer& p = m_chunks[c];
+            if (p.use_count() != 1) {
+                p = std::allocate_shared<chunk>(chunk_allocator_type(m_chunks.get_allocator()), *p);
+            } else {
+                // The last snapshot that shared the chunk may have just been destroyed by a reader
+                // thread. Synchronize with the release of its reference before writing
+                std::atomic_thread_fence(std::memory_order_acquire);
+            }
+
+            return *p;
+        }
+
+        // Copy and swap, so nothing changes if it throws
+        void assign_chunks(const cow_chunked_storage& s)
+        {
+            bool share = (m_chunks.get_allocator() == s.m_chunks.get_allocator());
+            chunk_container chunks(m_chunks.get_allocator());
+            chunks.reserve(s.m_chunks.size());
+            for (auto& c : s.m_chunks) {
+                chunks.push_back(share? c : std::allocate_shared<chunk>(chunk_allocator_type(m_chunks.get_allocator()), *c));
+            }
+
+            m_chunks.swap(chunks);
+            m_size = s.m_size;
+        }
+
+        chunk_container    m_chunks;
+        index_type         m_size;       //!< number of slots, the last chunk may have spare ones
+    };
+
+    // sparse_vector whose copies are copy-on-write snapshots
+    template <typename T, typename Allocator = std::allocator<T>>
+    using cow_sparse_vector = sparse_vector<T, Allocator, cow_chunked_storage>;
+} // namespace rte
+
+#endif // COW_STORAGE_HPP
@@ -1,6 +1,8 @@
+#include "concurrent_append.hpp"
 #include "glm/gtx/transform.hpp"
 #include "database_loader.hpp"
 #include "resource_loader.hpp"
+#include "parallel_tree.hpp"
 #include "nlohmann/json.hpp"
 #include "cmd_line_args.hpp"
 #include "sparse_list.hpp"
@@ -9,7 +11,9 @@
 
 #include <fstream>
 #include <cassert>
+#include <utility>
 #include <string>
+#include <atomic>
 #include <vector>
 #include <map>
 
@@ -64,6 +68,7 @@ namespace rte
 
         void fill_index_vector(const json& mesh_document, std::vector<vindex>& out, const std::string& field_name)
         {
+            out.reserve(out.size() + mesh_document.at(field_name).size());
             for (auto& index : mesh_document.at(field_name)) {
                 out.push_back(index);
             }
@@ -74,6 +79,7 @@ namespace rte
             unsigned int n_elements = 0;
             auto& texture_coords_document = mesh_document.at(field_name);
             assert(texture_coords_document.size() % 2 == 0);
+            out.reserve(out.size() + texture_coords_document.size() / 2);
             auto doc_it = texture_coords_document.begin();
             float u, v;
             u = v = 0.0f;
@@ -93,6 +99,7 @@ namespace rte
             unsigned int n_elements = 0;
             auto& vertices_document = mesh_document.at(field_name);
             assert(vertices_document.size() % 3 == 0);
+            out.reserve(out.size() + vertices_document.size() / 3);
             auto doc_it = vertices_document.begin();
 
             float x, y, z;
@@ -112,24 +119,51 @@ namespace rte
 
         void load_meshes(view_database& db)
         {
-            for (auto& m : document.at("meshes")) {
-                index_type new_mesh_index = list_insert(db.m_meshes, 0, mesh());
-                auto& new_mesh = db.m_meshes.at(new_mesh_index);
-                user_id mesh_user_id = m.value("user_id", nuser_id);
-                new_mesh.m_user_id = mesh_user_id;
+            // Meshes are independent, so they are converted by all the threads of the pool at once.
+            // Each thread takes meshes from the document with an atomic counter and stores them
+            // through its own local of the batches, which are linked into the lists at the end in
+            // document order
+            const json& meshes_document = document.at("meshes");
+            index_type mesh_count = meshes_document.size();
+            tree_worker_pool& pool = tree_default_worker_pool();
+            sparse_concurrent_append<mesh_database> mesh_batch(db.m_meshes, mesh_count, pool.get_concurrency());
+            sparse_concurrent_append<mesh_buffer_database> mesh_buffer_batch(db.m_mesh_buffers, mesh_count, pool.get_concurrency());
+            std::vector<index_type> mesh_indexes(mesh_count, npos);
+            std::atomic<unsigned int> next_local(0U);
+            std::atomic<index_type> next_mesh(0U);
+            pool.run([&]() {
+                unsigned int local_index = next_local++;
+                auto& meshes = mesh_batch.get_local(local_index);
+                auto& mesh_buffers = mesh_buffer_batch.get_local(local_index);
+                for (index_type i = next_mesh++; i < mesh_count; i = next_mesh++) {
+                    auto& m = meshes_document[i];
+                    mesh new_mesh;
+                    new_mesh.m_user_id = m.value("user_id", nuser_id);
+
+                    // Fill the buffers before inserting them, so that the vertex data is moved into the
+                    // database instead of copied
+                    mesh_buffer new_mesh_buffer;
+                    fill_3d_vector(m, new_mesh_buffer.m_vertices, "vertices");
+                    fill_2d_vector(m, new_mesh_buffer.m_texture_coords, "texture_coords");
+                    fill_3d_vector(m, new_mesh_buffer.m_normals, "normals");
+                    fill_index_vector(m, new_mesh_buffer.m_indices, "indices");
+
+                    new_mesh.m_num_vertices = new_mesh_buffer.m_indices.size();
+                    new_mesh.m_bounds = aabb_from_points(new_mesh_buffer.m_vertices);
+                    new_mesh.m_bounding_sphere = sphere_from_points(new_mesh_buffer.m_vertices);
+                    mesh_indexes[i] = meshes.insert(std::move(new_mesh), 0, i);
+                    new_mesh_buffer.m_mesh = mesh_indexes[i];
+                    mesh_buffers.insert(std::move(new_mesh_buffer), 0, i);
+                }
+            });
+            mesh_batch.finish();
+            mesh_buffer_batch.finish();
+
+            for (auto new_mesh_index : mesh_indexes) {
+                user_id mesh_user_id = db.m_meshes.at(new_mesh_index).m_user_id;
                 if (mesh_user_id != nuser_id) {
                     mesh_ids[mesh_user_id] = new_mesh_index;
                 }
-
-                auto new_mesh_buffer_index = list_insert(db.m_mesh_buffers, 0, mesh_buffer());
-                auto& new_mesh_buffer = db.m_mesh_buffers.at(new_mesh_buffer_index);
-                new_mesh_buffer.m_mesh = new_mesh_index;
-                fill_3d_vector(m, new_mesh_buffer.m_vertices, "vertices");
-                fill_2d_vector(m, new_mesh_buffer.m_texture_coords, "texture_coords");
-                fill_3d_vector(m, new_mesh_buffer.m_normals, "normals");
-                fill_index_vector(m, new_mesh_buffer.m_indices, "indices");
-
-                new_mesh.m_num_vertices = new_mesh_buffer.m_indices.size();
             }
         }
 
@@ -296,20 +330,20 @@ namespace rte
             // resource_index can be npos, in that case make_node() creates an empty node
             index_type new_node_index = npos;
             insert_node_tree(resource_index, parent_index, new_node_index, db);
-            auto& new_node = db.m_nodes.at(new_node_index);
-            new_node.m_name = node_document.value("name", std::string());
-            new_node.m_user_id = node_document.value("user_id", nuser_id);
+            auto& new_node_metadata = db.m_nodes.cold_at(new_node_index);
+            new_node_metadata.m_name = node_document.value("name", std::string());
+            new_node_metadata.m_user_id = node_document.value("user_id", nuser_id);
 
             // The transform inherited from the resource_index is only overwritten if the document includes all required properties
             if (node_document.count("scale")
                     && node_document.count("rotation_angle")
                     && node_document.count("rotation_axis")
                     && node_document.count("translation")) {
-                // The rotation angle is in degrees!
-                glm::mat4 scale = glm::scale(array_to_vec3(node_document.at("scale")));
-                glm::mat4 rotation = glm::rotate(node_document.at("rotation_angle").get<float>(), array_to_vec3(node_document.at("rotation_axis")));;
-                glm::mat4 translation = glm::translate(array_to_vec3(node_document.at("translation")));
-                new_node.m_local_transform = translation * rotation * scale;
+                // The rotation angle is in radians, as glm::rotate() used to take it
+                glm::vec3 scale = array_to_vec3(node_document.at("scale"));
+                glm::quat rotation = glm::angleAxis(node_document.at("rotation_angle").get<float>(), glm::normalize(array_to_vec3(node_document.at("rotation_axis"))));
+                glm::vec3 translation = array_to_vec3(node_document.at("translation"));
+                set_local_transform(new_node_index, trs_transform(translation, rotation, scale), db);
             }
             // materials are set later in a second traversal
 
@@ -370,7 +404,7 @@ namespace rte
                 }
 
                 if (current.doc.count("name")) {
-                    current_node.m_name = current.doc.at("name").get<std::string>();
+                    db.cold_at(current.node_index).m_name = current.doc.at("name").get<std::string>();
                 }
 
                 // Note that in this case it's not relevant in what order the children are processed,
@@ -440,7 +474,11 @@ namespace rte
         if (!initialized) return;
         std::string filename = cmd_line_args_get_option_value("-config", "");
 
-        view_database tmp_db;
+        // Load into a database that lives in an arena, so that the memory left behind by growing the
+        // tables is freed at once when loading finishes. Moving it into db moves the elements out
+        // of the arena, because the arena is not propagated on move assignment
+        monotonic_arena arena(1024U * 1024U);
+        view_database tmp_db(&arena);
 
         log(LOG_LEVEL_DEBUG, std::string("database_loader: loading database from file ") + filename);
         std::ifstream ifs(filename);
@@ -467,6 +505,7 @@ namespace rte
 
         auto root_node_index = tree_insert(tmp_db.m_nodes, node());
         tmp_db.m_root_node = root_node_index;
+        mark_transform_dirty(root_node_index, tmp_db);
 
         user_id skybox_user_id = document.value("skybox", nuser_id);
         cubemap_map::iterator mit;
@@ -485,6 +524,9 @@ namespace rte
         list_empty_list(tmp_db.m_point_lights);
         load_point_lights(document, tmp_db);
 
+        // Materials are assigned to the nodes after they are inserted
+        rebuild_render_list(tmp_db);
+
         db = std::move(tmp_db);
 
         document = json();
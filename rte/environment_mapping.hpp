@@ -5,26 +5,31 @@ const char* environment_mapping_vertex_shader = R"glsl(
     layout(location = 0) in vec3 vertex_position_modelspace;
     layout(location = 1) in vec2 vertex_tex_coords;
     layout(location = 2) in vec3 vertex_direction_n_modelspace;
+    // Model matrix, per instance in instanced draws and constant otherwise. Takes locations 3 to 6
+    layout(location = 3) in mat4 model;
 
     // Output data ; will be interpolated for each fragment.
     out vec2 tex_coords;
     out vec3 position_worldspace;
     out vec3 direction_n_worldspace;
 
-    // Values that stay constant for the whole mesh.
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
-    uniform mat4 mvp;
+    // Values that stay constant for the whole frame, shared by all the programs. The layout must
+    // match camera_block in opengl_driver.cpp
+    layout(std140) uniform camera_data
+    {
+        mat4 view;
+        mat4 projection;
+        vec3 camera_position_worldspace;
+    };
 
     void main(){
-        // Output position of the vertex, in clip space : mvp * position
-        gl_Position =  mvp * vec4(vertex_position_modelspace, 1);
-
         // Position of the vertex, in worldspace : model * position
         vec4 position_worldspace4 = model * vec4(vertex_position_modelspace, 1);
         position_worldspace = position_worldspace4.xyz / position_worldspace4.w;
 
+        // Output position of the vertex, in clip space : projection * view * model * position
+        gl_Position =  projection * view * position_worldspace4;
+
         direction_n_worldspace = mat3(transpose(inverse(model))) * vertex_direction_n_modelspace;
 
         // Texture coordinates of the vertex. No special space for this one.
@@ -52,10 +57,13 @@ const char* environment_mapping_fragment_shader = R"glsl(
         float     refractive_index;
     };
 
+    // Same as in the phong shader, since the lights are in a block shared by both programs. The
+    // specular colors are not used here
     struct dirlight_data
     {
         vec3 ambient_color;
         vec3 diffuse_color;
+        vec3 specular_color;
         vec3 direction_cameraspace;
     };
 
@@ -64,6 +72,7 @@ const char* environment_mapping_fragment_shader = R"glsl(
         vec3  position_cameraspace;
         vec3  ambient_color;
         vec3  diffuse_color;
+        vec3  specular_color;
         float constant_attenuation;
         float linear_attenuation;
         float quadratic_attenuation;
@@ -78,12 +87,25 @@ const char* environment_mapping_fragment_shader = R"glsl(
     // Ouput data
     out vec3 color;
 
+    // Same block as in the vertex shader, for the camera position
+    layout(std140) uniform camera_data
+    {
+        mat4 view;
+        mat4 projection;
+        vec3 camera_position_worldspace;
+    };
+
+    // Lights of the frame, shared by all the programs. The layout must match light_block in
+    // opengl_driver.cpp
+    layout(std140) uniform light_data
+    {
+        dirlight_data     dirlight;
+        point_light_data  point_lights[MAX_POINT_LIGHTS];
+        uint              npoint_lights;
+    };
+
     // Values that stay constant for the whole mesh.
     uniform material_data     material;
-    uniform dirlight_data     dirlight;
-    uniform point_light_data  point_lights[MAX_POINT_LIGHTS];
-    uniform uint              npoint_lights;
-    uniform vec3              camera_position_worldspace;
     uniform samplerCube       cubemap;
 
     // Calculates the contribution of the directional light
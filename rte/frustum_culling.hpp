@@ -0,0 +1,251 @@
+#ifndef FRUSTUM_CULLING_HPP
+#define FRUSTUM_CULLING_HPP
+
+#include "transform_batch.hpp"
+#include "glm/glm.hpp"
+#include "bounds.hpp"
+
+#include <limits>
+#include <vector>
+#include <cmath>
+
+namespace rte
+{
+    // The six planes of a view frustum, as (normal, distance) with the normal pointing inside and of
+    // unit length: a point p is inside the plane if dot(normal, p) + distance >= 0
+    struct frustum
+    {
+        glm::vec4 m_planes[6];      //!< left, right, bottom, top, near, far
+    };
+
+    // Extracts the planes from a projection * view matrix (Gribb and Hartmann): each plane is the
+    // last row of the matrix plus or minus one of the other rows
+    inline frustum frustum_from_matrix(const glm::mat4& m)
+    {
+        glm::vec4 rows[4];
+        for (int r = 0; r < 4; r++) {
+            rows[r] = glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+        }
+
+        frustum f;
+        for (int p = 0; p < 6; p++) {
+            glm::vec4 plane = (p % 2 == 0? rows[3] + rows[p / 2] : rows[3] - rows[p / 2]);
+            f.m_planes[p] = plane / glm::length(glm::vec3(plane));
+        }
+
+        return f;
+    }
+
+    // A box is outside the frustum if it is fully behind one of the planes, that is, if the corner
+    // farthest along the plane normal is behind it. Boxes that cross the corners of the frustum
+    // without touching it are kept: the test is conservative
+    inline bool frustum_test_aabb(const frustum& f, const aabb& box)
+    {
+        if (box.empty()) {
+            return false;
+        }
+
+        glm::vec3 center = box.center();
+        glm::vec3 extent = box.extent();
+        for (auto& plane : f.m_planes) {
+            glm::vec3 normal(plane);
+            if (glm::dot(normal, center) + plane.w + glm::dot(glm::abs(normal), extent) < 0.0f) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Boxes to test against a frustum, stored as structure of arrays so the SIMD kernels load the
+    // same coordinate of 4 or 8 boxes at once
+    struct cull_batch
+    {
+        std::vector<index_type> m_nodes;        //!< node of each box
+        std::vector<float> m_center_x;
+        std::vector<float> m_center_y;
+        std::vector<float> m_center_z;
+        std::vector<float> m_extent_x;
+        std::vector<float> m_extent_y;
+        std::vector<float> m_extent_z;
+    };
+
+    // Removes the boxes without releasing the memory, so a batch filled every frame doesn't allocate
+    inline void cull_batch_clear(cull_batch& batch)
+    {
+        batch.m_nodes.clear();
+        batch.m_center_x.clear();
+        batch.m_center_y.clear();
+        batch.m_center_z.clear();
+        batch.m_extent_x.clear();
+        batch.m_extent_y.clear();
+        batch.m_extent_z.clear();
+    }
+
+    // Adds the box of a node. Empty boxes are left out, their node has nothing to draw
+    inline void cull_batch_add(cull_batch& batch, index_type node, const aabb& box)
+    {
+        if (box.empty()) {
+            return;
+        }
+
+        glm::vec3 center = box.center();
+        glm::vec3 extent = box.extent();
+        batch.m_nodes.push_back(node);
+        batch.m_center_x.push_back(center.x);
+        batch.m_center_y.push_back(center.y);
+        batch.m_center_z.push_back(center.z);
+        batch.m_extent_x.push_back(extent.x);
+        batch.m_extent_y.push_back(extent.y);
+        batch.m_extent_z.push_back(extent.z);
+    }
+
+    // Gives the batch count boxes, to be written with cull_batch_set()
+    inline void cull_batch_resize(cull_batch& batch, index_type count)
+    {
+        batch.m_nodes.resize(count);
+        batch.m_center_x.resize(count);
+        batch.m_center_y.resize(count);
+        batch.m_center_z.resize(count);
+        batch.m_extent_x.resize(count);
+        batch.m_extent_y.resize(count);
+        batch.m_extent_z.resize(count);
+    }
+
+    // Writes the box of a node at position k. An empty box is stored with the lowest extent, which
+    // puts it behind every plane, so the kernels never report it
+    inline void cull_batch_set(cull_batch& batch, index_type k, index_type node, const aabb& box)
+    {
+        glm::vec3 center = box.empty()? glm::vec3(0.0f) : box.center();
+        glm::vec3 extent = box.empty()? glm::vec3(std::numeric_limits<float>::lowest()) : box.extent();
+        batch.m_nodes[k] = node;
+        batch.m_center_x[k] = center.x;
+        batch.m_center_y[k] = center.y;
+        batch.m_center_z[k] = center.z;
+        batch.m_extent_x[k] = extent.x;
+        batch.m_extent_y[k] = extent.y;
+        batch.m_extent_z[k] = extent.z;
+    }
+
+    inline bool cull_batch_empty_box(const cull_batch& batch, index_type k)
+    {
+        return batch.m_extent_x[k] < 0.0f;
+    }
+
+    // The kernels append to visible_out the nodes of the boxes in [first, last) that are in the
+    // frustum, in the order of the batch
+    inline void frustum_cull_scalar(const frustum& f, const cull_batch& batch, index_type first, index_type last, std::vector<index_type>& visible_out)
+    {
+        for (index_type k = first; k < last; k++) {
+            bool visible = true;
+            for (auto& plane : f.m_planes) {
+                float distance = plane.x * batch.m_center_x[k] + plane.y * batch.m_center_y[k] + plane.z * batch.m_center_z[k] + plane.w
+                               + std::abs(plane.x) * batch.m_extent_x[k] + std::abs(plane.y) * batch.m_extent_y[k] + std::abs(plane.z) * batch.m_extent_z[k];
+                if (distance < 0.0f) {
+                    visible = false;
+                    break;
+                }
+            }
+            if (visible) {
+                visible_out.push_back(batch.m_nodes[k]);
+            }
+        }
+    }
+
+#ifdef RTE_X86_TRANSFORM_KERNELS
+    // 4 boxes against one plane per iteration: the distances of the farthest corners are compared
+    // with zero and the masks of the six planes are combined
+    __attribute__((target("sse")))
+    inline void frustum_cull_sse(const frustum& f, const cull_batch& batch, index_type first, index_type last, std::vector<index_type>& visible_out)
+    {
+        const __m128 sign_mask = _mm_set1_ps(-0.0f);
+        index_type k = first;
+        for (; k + 4U <= last; k += 4U) {
+            __m128 cx = _mm_loadu_ps(&batch.m_center_x[k]);
+            __m128 cy = _mm_loadu_ps(&batch.m_center_y[k]);
+            __m128 cz = _mm_loadu_ps(&batch.m_center_z[k]);
+            __m128 ex = _mm_loadu_ps(&batch.m_extent_x[k]);
+            __m128 ey = _mm_loadu_ps(&batch.m_extent_y[k]);
+            __m128 ez = _mm_loadu_ps(&batch.m_extent_z[k]);
+            __m128 outside = _mm_setzero_ps();
+            for (auto& plane : f.m_planes) {
+                __m128 nx = _mm_set1_ps(plane.x);
+                __m128 ny = _mm_set1_ps(plane.y);
+                __m128 nz = _mm_set1_ps(plane.z);
+                __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)), _mm_add_ps(_mm_mul_ps(nz, cz), _mm_set1_ps(plane.w)));
+                __m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign_mask, nx), ex), _mm_mul_ps(_mm_andnot_ps(sign_mask, ny), ey)),
+                                           _mm_mul_ps(_mm_andnot_ps(sign_mask, nz), ez));
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, radius), _mm_setzero_ps()));
+            }
+            int visible = ~_mm_movemask_ps(outside) & 0xf;
+            for (; visible != 0; visible &= visible - 1) {
+                visible_out.push_back(batch.m_nodes[k + __builtin_ctz(visible)]);
+            }
+        }
+        frustum_cull_scalar(f, batch, k, last, visible_out);
+    }
+
+    // Same as frustum_cull_sse() with 8 boxes per iteration
+    __attribute__((target("avx2,fma")))
+    inline void frustum_cull_avx2(const frustum& f, const cull_batch& batch, index_type first, index_type last, std::vector<index_type>& visible_out)
+    {
+        const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+        index_type k = first;
+        for (; k + 8U <= last; k += 8U) {
+            __m256 cx = _mm256_loadu_ps(&batch.m_center_x[k]);
+            __m256 cy = _mm256_loadu_ps(&batch.m_center_y[k]);
+            __m256 cz = _mm256_loadu_ps(&batch.m_center_z[k]);
+            __m256 ex = _mm256_loadu_ps(&batch.m_extent_x[k]);
+            __m256 ey = _mm256_loadu_ps(&batch.m_extent_y[k]);
+            __m256 ez = _mm256_loadu_ps(&batch.m_extent_z[k]);
+            __m256 outside = _mm256_setzero_ps();
+            for (auto& plane : f.m_planes) {
+                __m256 nx = _mm256_set1_ps(plane.x);
+                __m256 ny = _mm256_set1_ps(plane.y);
+                __m256 nz = _mm256_set1_ps(plane.z);
+                __m256 distance = _mm256_fmadd_ps(nx, cx, _mm256_fmadd_ps(ny, cy, _mm256_fmadd_ps(nz, cz, _mm256_set1_ps(plane.w))));
+                distance = _mm256_fmadd_ps(_mm256_andnot_ps(sign_mask, nx), ex, distance);
+                distance = _mm256_fmadd_ps(_mm256_andnot_ps(sign_mask, ny), ey, distance);
+                distance = _mm256_fmadd_ps(_mm256_andnot_ps(sign_mask, nz), ez, distance);
+                outside = _mm256_or_ps(outside, _mm256_cmp_ps(distance, _mm256_setzero_ps(), _CMP_LT_OQ));
+            }
+            int visible = ~_mm256_movemask_ps(outside) & 0xff;
+            for (; visible != 0; visible &= visible - 1) {
+                visible_out.push_back(batch.m_nodes[k + __builtin_ctz(visible)]);
+            }
+        }
+        frustum_cull_scalar(f, batch, k, last, visible_out);
+    }
+#endif
+
+    // Appends to visible_out the nodes of the boxes in [first, last) that are in the frustum, using
+    // the given kernel (which must be supported, see transform_kernel_supported())
+    inline void frustum_cull_range(transform_kernel kernel, const frustum& f, const cull_batch& batch, index_type first, index_type last, std::vector<index_type>& visible_out)
+    {
+#ifdef RTE_X86_TRANSFORM_KERNELS
+        if (kernel == transform_kernel::avx2) {
+            frustum_cull_avx2(f, batch, first, last, visible_out);
+            return;
+        } else if (kernel == transform_kernel::sse) {
+            frustum_cull_sse(f, batch, first, last, visible_out);
+            return;
+        }
+#else
+        (void)kernel;
+#endif
+        frustum_cull_scalar(f, batch, first, last, visible_out);
+    }
+
+    // Replaces the contents of visible_out with the nodes of the boxes of the batch that are in the
+    // frustum, using the given kernel. Returns the number of visible nodes
+    inline index_type frustum_cull(transform_kernel kernel, const frustum& f, const cull_batch& batch, std::vector<index_type>& visible_out)
+    {
+        index_type count = static_cast<index_type>(batch.m_nodes.size());
+        visible_out.clear();
+        visible_out.reserve(count);
+        frustum_cull_range(kernel, f, batch, 0U, count, visible_out);
+        return static_cast<index_type>(visible_out.size());
+    }
+} // namespace rte
+
+#endif // FRUSTUM_CULLING_HPP
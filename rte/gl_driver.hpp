@@ -190,11 +190,36 @@ namespace rte
     //-----------------------------------------------------------------------------------------------
     typedef void (*initialize_frame_func)();
 
+    //-----------------------------------------------------------------------------------------------
+    //! @brief Function type used to send the data that stays constant during a frame: the view and
+    //!  projection transforms and the lights of the context.
+    //! @remark The draw calls use the data of the last call, they ignore these fields of their
+    //!  context.
+    //-----------------------------------------------------------------------------------------------
+    typedef void (*set_frame_data_func)(const gl_driver_context& context);
+
     //-----------------------------------------------------------------------------------------------
     //! @brief Function type used to do a draw call.
     //-----------------------------------------------------------------------------------------------
     typedef void (*draw_func)(const gl_driver_context& context);
 
+    //-----------------------------------------------------------------------------------------------
+    //! @brief Function type used to draw the node of the context once per model matrix in a single
+    //!  draw call.
+    //! @remark The model matrix of the node is ignored, the instances only share its buffers,
+    //!  texture and material.
+    //-----------------------------------------------------------------------------------------------
+    typedef void (*draw_instanced_func)(const gl_driver_context& context,
+                                        const std::vector<glm::mat4>& models);
+
+    //-----------------------------------------------------------------------------------------------
+    //! @brief Function type used to get the number of state changes (program, textures, buffers,
+    //!  material, depth func) done by the draw calls since the start of the frame.
+    //! @remark The draw calls skip the state that is already set, so drawing the nodes sorted by
+    //!  state keeps this number low.
+    //-----------------------------------------------------------------------------------------------
+    typedef unsigned int (*get_frame_state_changes_func)();
+
     struct gl_driver
     {
         gl_driver() :
@@ -212,23 +237,29 @@ namespace rte
             new_program(nullptr),
             delete_program(nullptr),
             initialize_frame(nullptr),
-            draw(nullptr) {}
-
-        gl_driver_init_func         gl_driver_init;
-        new_default_texture_func    new_default_texture;
-        delete_default_texture_func delete_default_texture;
-        new_texture_func            new_texture;
-        delete_texture_func         delete_texture;
-        new_3d_buffer_func          new_3d_buffer;
-        new_2d_buffer_func          new_2d_buffer;
-        new_index_buffer_func       new_index_buffer;
-        delete_buffer_func          delete_buffer;
-        new_gl_cubemap_func         new_gl_cubemap;
-        delete_gl_cubemap_func      delete_gl_cubemap;
-        new_program_func            new_program;
-        delete_program_func         delete_program;
-        initialize_frame_func       initialize_frame;
-        draw_func                   draw;
+            set_frame_data(nullptr),
+            draw(nullptr),
+            draw_instanced(nullptr),
+            get_frame_state_changes(nullptr) {}
+
+        gl_driver_init_func          gl_driver_init;
+        new_default_texture_func     new_default_texture;
+        delete_default_texture_func  delete_default_texture;
+        new_texture_func             new_texture;
+        delete_texture_func          delete_texture;
+        new_3d_buffer_func           new_3d_buffer;
+        new_2d_buffer_func           new_2d_buffer;
+        new_index_buffer_func        new_index_buffer;
+        delete_buffer_func           delete_buffer;
+        new_gl_cubemap_func          new_gl_cubemap;
+        delete_gl_cubemap_func       delete_gl_cubemap;
+        new_program_func             new_program;
+        delete_program_func          delete_program;
+        initialize_frame_func        initialize_frame;
+        set_frame_data_func          set_frame_data;
+        draw_func                    draw;
+        draw_instanced_func          draw_instanced;
+        get_frame_state_changes_func get_frame_state_changes;
     };
 } // namespace rte
 
@@ -0,0 +1,455 @@
+#ifndef OCCLUSION_CULLING_HPP
+#define OCCLUSION_CULLING_HPP
+
+#include "transform_batch.hpp"
+#include "parallel_tree.hpp"
+#include "rte_common.hpp"
+#include "glm/glm.hpp"
+#include "bounds.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <vector>
+#include <cmath>
+
+namespace rte
+{
+    constexpr index_type occlusion_band_height = 8U;        //!< rows of the depth buffer rasterized by a thread at a time
+
+    // Mesh rasterized into an occlusion_buffer. The arrays must outlive the call to
+    // occlusion_rasterize()
+    struct occluder
+    {
+        const glm::vec3*   m_vertices;
+        const vindex*      m_indices;          //!< three per triangle
+        index_type         m_index_count;
+        glm::mat4          m_model;            //!< model transform of the mesh
+    };
+
+    // Copy of the data of a mesh that occluders point to. The mesh buffers of the view database
+    // are released once they are in the graphics API, so the renderer keeps its own copy of the
+    // meshes that can be occluders
+    struct occluder_mesh
+    {
+        std::vector<glm::vec3> m_vertices;
+        std::vector<vindex>    m_indices;
+    };
+
+    // A node that can be an occluder, with its size on screen
+    struct occluder_candidate
+    {
+        float                 m_size;
+        const occluder_mesh*  m_mesh;
+        const glm::mat4*      m_model;
+    };
+
+    // Copies the mesh if it has at most max_triangles triangles, meshes with more cost more to
+    // rasterize than they save. Otherwise the copy is left empty
+    inline void occluder_mesh_init(occluder_mesh& mesh, const std::vector<glm::vec3>& vertices, const std::vector<vindex>& indices, index_type max_triangles)
+    {
+        mesh.m_vertices.clear();
+        mesh.m_indices.clear();
+        if (!indices.empty() && indices.size() <= 3U * max_triangles) {
+            mesh.m_vertices = vertices;
+            mesh.m_indices = indices;
+        }
+    }
+
+    // Radius of the sphere over its distance to the camera, which grows like its size on screen.
+    // Spheres around the camera are the biggest
+    inline float occluder_screen_size(const bounding_sphere& sphere, const glm::vec3& camera_position)
+    {
+        float distance = glm::length(sphere.m_center - camera_position);
+        return (distance > sphere.m_radius? sphere.m_radius / distance : std::numeric_limits<float>::max());
+    }
+
+    // Replaces the contents of occluders_out with the max_count biggest candidates. The candidates
+    // are reordered
+    inline void occlusion_select_occluders(std::vector<occluder_candidate>& candidates, index_type max_count, std::vector<occluder>& occluders_out)
+    {
+        auto last = candidates.begin() + std::min(candidates.size(), max_count);
+        std::partial_sort(candidates.begin(), last, candidates.end(), [](const occluder_candidate& a, const occluder_candidate& b) {
+            return a.m_size > b.m_size;
+        });
+
+        occluders_out.clear();
+        for (auto it = candidates.begin(); it != last; ++it) {
+            occluders_out.push_back(occluder{it->m_mesh->m_vertices.data(), it->m_mesh->m_indices.data(), it->m_mesh->m_indices.size(), *it->m_model});
+        }
+    }
+
+    // Triangle ready to be rasterized: the edge functions and the depth are linear functions
+    // a * x + b * y + c of the screen position
+    struct occlusion_triangle
+    {
+        float          m_edge_a[3];
+        float          m_edge_b[3];
+        float          m_edge_c[3];
+        float          m_depth_a;
+        float          m_depth_b;
+        float          m_depth_c;
+        int            m_min_x;
+        int            m_max_x;
+        int            m_min_y;
+        int            m_max_y;
+    };
+
+    // Low resolution depth buffer where the occluders are rasterized, and its hierarchical-Z pyramid.
+    // Depths go from 0 at the near plane to 1 at the far plane, as in OpenGL's default depth range
+    struct occlusion_buffer
+    {
+        occlusion_buffer() :
+            m_width(0U),
+            m_height(0U),
+            m_view_projection(1.0f),
+            m_levels(),
+            m_level_widths(),
+            m_level_heights(),
+            m_clip_vertices(),
+            m_triangles() {}
+
+        index_type                          m_width;
+        index_type                          m_height;
+        glm::mat4                           m_view_projection;     //!< transform used to rasterize the occluders and to test the bounds
+        std::vector<std::vector<float>>     m_levels;              //!< level 0 is the depth buffer, each texel of the next levels keeps the farthest depth of the 2x2 texels below it
+        std::vector<index_type>             m_level_widths;
+        std::vector<index_type>             m_level_heights;
+        std::vector<glm::vec4>              m_clip_vertices;       //!< scratch memory of occlusion_rasterize()
+        std::vector<occlusion_triangle>     m_triangles;           //!< scratch memory of occlusion_rasterize()
+    };
+
+    // The width must be a multiple of 8, so that the rows can be rasterized 8 pixels at a time
+    inline void occlusion_buffer_init(occlusion_buffer& buffer, index_type width, index_type height)
+    {
+        if (width == 0U || height == 0U || width % 8U != 0U) {
+            throw std::invalid_argument("occlusion_buffer_init: error, the width must be a positive multiple of 8");
+        }
+
+        buffer.m_width = width;
+        buffer.m_height = height;
+        buffer.m_levels.clear();
+        buffer.m_level_widths.clear();
+        buffer.m_level_heights.clear();
+        while (true) {
+            buffer.m_levels.push_back(std::vector<float>(width * height, 1.0f));
+            buffer.m_level_widths.push_back(width);
+            buffer.m_level_heights.push_back(height);
+            if (width == 1U && height == 1U) {
+                break;
+            }
+            width = (width + 1U) / 2U;
+            height = (height + 1U) / 2U;
+        }
+    }
+
+    // Empties the buffer (every depth goes to the far plane) before rasterizing the occluders of a
+    // new view
+    inline void occlusion_buffer_clear(occlusion_buffer& buffer, const glm::mat4& view_projection)
+    {
+        buffer.m_view_projection = view_projection;
+        for (auto& level : buffer.m_levels) {
+            std::fill(level.begin(), level.end(), 1.0f);
+        }
+    }
+
+    // Turns a triangle in clip space, in front of the near plane, into an occlusion_triangle. Returns
+    // false if it covers no pixel center
+    inline bool occlusion_setup_triangle(const occlusion_buffer& buffer, const glm::vec4& c0, const glm::vec4& c1, const glm::vec4& c2, occlusion_triangle& t)
+    {
+        glm::vec3 p[3];
+        const glm::vec4* clip[3] = {&c0, &c1, &c2};
+        for (int v = 0; v < 3; v++) {
+            const glm::vec4& c = *clip[v];
+            p[v] = glm::vec3((c.x / c.w * 0.5f + 0.5f) * buffer.m_width, (c.y / c.w * 0.5f + 0.5f) * buffer.m_height, c.z / c.w * 0.5f + 0.5f);
+        }
+
+        // Occluders are rasterized from both sides, so clockwise triangles are turned around
+        float area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[1].y - p[0].y) * (p[2].x - p[0].x);
+        if (area < 0.0f) {
+            std::swap(p[1], p[2]);
+            area = -area;
+        }
+        if (!(area > 0.0f)) {
+            return false;
+        }
+
+        // Clamped as floats first, vertices close to the near plane can be very far out
+        float width = float(buffer.m_width);
+        float height = float(buffer.m_height);
+        t.m_min_x = int(std::floor(glm::clamp(std::min(p[0].x, std::min(p[1].x, p[2].x)), 0.0f, width)));
+        t.m_max_x = std::min(int(buffer.m_width) - 1, int(std::ceil(glm::clamp(std::max(p[0].x, std::max(p[1].x, p[2].x)), -1.0f, width))));
+        t.m_min_y = int(std::floor(glm::clamp(std::min(p[0].y, std::min(p[1].y, p[2].y)), 0.0f, height)));
+        t.m_max_y = std::min(int(buffer.m_height) - 1, int(std::ceil(glm::clamp(std::max(p[0].y, std::max(p[1].y, p[2].y)), -1.0f, height))));
+        if (t.m_min_x > t.m_max_x || t.m_min_y > t.m_max_y) {
+            return false;
+        }
+
+        // Edge e goes from vertex e + 1 to vertex e + 2 and is positive inside. Divided by the area,
+        // it is the barycentric coordinate of vertex e, which interpolates the depth
+        t.m_depth_a = t.m_depth_b = t.m_depth_c = 0.0f;
+        for (int e = 0; e < 3; e++) {
+            const glm::vec3& a = p[(e + 1) % 3];
+            const glm::vec3& b = p[(e + 2) % 3];
+            t.m_edge_a[e] = a.y - b.y;
+            t.m_edge_b[e] = b.x - a.x;
+            t.m_edge_c[e] = -t.m_edge_a[e] * a.x - t.m_edge_b[e] * a.y;
+            t.m_depth_a += t.m_edge_a[e] * p[e].z / area;
+            t.m_depth_b += t.m_edge_b[e] * p[e].z / area;
+            t.m_depth_c += t.m_edge_c[e] * p[e].z / area;
+        }
+
+        return true;
+    }
+
+    // Clips a triangle in clip space against the near plane (z >= -w), which leaves a polygon of 3
+    // or 4 vertices, and sets up its triangles. The other planes don't need clipping: the bounding
+    // rectangle of the triangle is clamped to the buffer
+    inline void occlusion_clip_triangle(occlusion_buffer& buffer, const glm::vec4& c0, const glm::vec4& c1, const glm::vec4& c2)
+    {
+        const glm::vec4* in[3] = {&c0, &c1, &c2};
+        glm::vec4 out[4];
+        int out_count = 0;
+        for (int v = 0; v < 3; v++) {
+            const glm::vec4& a = *in[v];
+            const glm::vec4& b = *in[(v + 1) % 3];
+            float da = a.z + a.w;
+            float db = b.z + b.w;
+            if (da >= 0.0f) {
+                out[out_count++] = a;
+            }
+            if ((da >= 0.0f) != (db >= 0.0f)) {
+                out[out_count++] = a + (b - a) * (da / (da - db));
+            }
+        }
+
+        occlusion_triangle t;
+        for (int v = 2; v < out_count; v++) {
+            if (occlusion_setup_triangle(buffer, out[0], out[v - 1], out[v], t)) {
+                buffer.m_triangles.push_back(t);
+            }
+        }
+    }
+
+    // The row kernels rasterize a triangle in the pixels [x0, x1) of a row, keeping the nearest
+    // depth of each pixel center. For the SIMD kernels x0 and x1 are multiples of 4 or 8
+    inline void occlusion_raster_row_scalar(const occlusion_triangle& t, float* row, int x0, int x1, float py)
+    {
+        for (int x = x0; x < x1; x++) {
+            float px = x + 0.5f;
+            if (t.m_edge_a[0] * px + t.m_edge_b[0] * py + t.m_edge_c[0] >= 0.0f
+                    && t.m_edge_a[1] * px + t.m_edge_b[1] * py + t.m_edge_c[1] >= 0.0f
+                    && t.m_edge_a[2] * px + t.m_edge_b[2] * py + t.m_edge_c[2] >= 0.0f) {
+                row[x] = std::min(row[x], t.m_depth_a * px + t.m_depth_b * py + t.m_depth_c);
+            }
+        }
+    }
+
+#ifdef RTE_X86_TRANSFORM_KERNELS
+    __attribute__((target("sse")))
+    inline void occlusion_raster_row_sse(const occlusion_triangle& t, float* row, int x0, int x1, float py)
+    {
+        const __m128 zero = _mm_setzero_ps();
+        __m128 px = _mm_add_ps(_mm_set1_ps(x0 + 0.5f), _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+        __m128 edge[3];
+        __m128 edge_step[3];
+        for (int e = 0; e < 3; e++) {
+            edge[e] = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.m_edge_a[e]), px), _mm_set1_ps(t.m_edge_b[e] * py + t.m_edge_c[e]));
+            edge_step[e] = _mm_set1_ps(t.m_edge_a[e] * 4.0f);
+        }
+        __m128 depth = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.m_depth_a), px), _mm_set1_ps(t.m_depth_b * py + t.m_depth_c));
+        __m128 depth_step = _mm_set1_ps(t.m_depth_a * 4.0f);
+        for (int x = x0; x < x1; x += 4) {
+            __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(edge[0], zero), _mm_cmpge_ps(edge[1], zero)), _mm_cmpge_ps(edge[2], zero));
+            __m128 old_depth = _mm_loadu_ps(row + x);
+            __m128 new_depth = _mm_min_ps(old_depth, depth);
+            _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, new_depth), _mm_andnot_ps(inside, old_depth)));
+            for (int e = 0; e < 3; e++) {
+                edge[e] = _mm_add_ps(edge[e], edge_step[e]);
+            }
+            depth = _mm_add_ps(depth, depth_step);
+        }
+    }
+
+    __attribute__((target("avx2,fma")))
+    inline void occlusion_raster_row_avx2(const occlusion_triangle& t, float* row, int x0, int x1, float py)
+    {
+        const __m256 zero = _mm256_setzero_ps();
+        __m256 px = _mm256_add_ps(_mm256_set1_ps(x0 + 0.5f), _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f));
+        __m256 edge[3];
+        __m256 edge_step[3];
+        for (int e = 0; e < 3; e++) {
+            edge[e] = _mm256_fmadd_ps(_mm256_set1_ps(t.m_edge_a[e]), px, _mm256_set1_ps(t.m_edge_b[e] * py + t.m_edge_c[e]));
+            edge_step[e] = _mm256_set1_ps(t.m_edge_a[e] * 8.0f);
+        }
+        __m256 depth = _mm256_fmadd_ps(_mm256_set1_ps(t.m_depth_a), px, _mm256_set1_ps(t.m_depth_b * py + t.m_depth_c));
+        __m256 depth_step = _mm256_set1_ps(t.m_depth_a * 8.0f);
+        for (int x = x0; x < x1; x += 8) {
+            __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(edge[0], zero, _CMP_GE_OQ), _mm256_cmp_ps(edge[1], zero, _CMP_GE_OQ)),
+                                          _mm256_cmp_ps(edge[2], zero, _CMP_GE_OQ));
+            __m256 old_depth = _mm256_loadu_ps(row + x);
+            _mm256_storeu_ps(row + x, _mm256_blendv_ps(old_depth, _mm256_min_ps(old_depth, depth), inside));
+            for (int e = 0; e < 3; e++) {
+                edge[e] = _mm256_add_ps(edge[e], edge_step[e]);
+            }
+            depth = _mm256_add_ps(depth, depth_step);
+        }
+    }
+#endif
+
+    // Rasterizes the triangles set up in the buffer into the rows [y0, y1)
+    inline void occlusion_raster_band(occlusion_buffer& buffer, transform_kernel kernel, int y0, int y1)
+    {
+        float* depths = buffer.m_levels[0].data();
+        int width = int(buffer.m_width);
+        for (auto& t : buffer.m_triangles) {
+            int first_row = std::max(t.m_min_y, y0);
+            int last_row = std::min(t.m_max_y + 1, y1);
+            // The SIMD kernels start at a multiple of 8 and may go past the triangle, the edge
+            // functions mask the pixels outside
+            int x0 = t.m_min_x & ~7;
+            int x1 = std::min((t.m_max_x + 8) & ~7, width);
+            for (int y = first_row; y < last_row; y++) {
+                float* row = depths + y * width;
+#ifdef RTE_X86_TRANSFORM_KERNELS
+                if (kernel == transform_kernel::avx2) {
+                    occlusion_raster_row_avx2(t, row, x0, x1, y + 0.5f);
+                    continue;
+                } else if (kernel == transform_kernel::sse) {
+                    occlusion_raster_row_sse(t, row, x0, x1, y + 0.5f);
+                    continue;
+                }
+#endif
+                occlusion_raster_row_scalar(t, row, x0, x1, y + 0.5f);
+            }
+        }
+    }
+
+    // Builds the levels of the pyramid above the depth buffer
+    inline void occlusion_build_hiz(occlusion_buffer& buffer)
+    {
+        for (index_type l = 1; l < buffer.m_levels.size(); l++) {
+            const std::vector<float>& below = buffer.m_levels[l - 1U];
+            std::vector<float>& level = buffer.m_levels[l];
+            index_type below_width = buffer.m_level_widths[l - 1U];
+            index_type below_height = buffer.m_level_heights[l - 1U];
+            for (index_type y = 0; y < buffer.m_level_heights[l]; y++) {
+                index_type y0 = 2U * y;
+                index_type y1 = std::min(y0 + 1U, below_height - 1U);
+                for (index_type x = 0; x < buffer.m_level_widths[l]; x++) {
+                    index_type x0 = 2U * x;
+                    index_type x1 = std::min(x0 + 1U, below_width - 1U);
+                    level[y * buffer.m_level_widths[l] + x] = std::max(std::max(below[y0 * below_width + x0], below[y0 * below_width + x1]),
+                                                                       std::max(below[y1 * below_width + x0], below[y1 * below_width + x1]));
+                }
+            }
+        }
+    }
+
+    // Rasterizes the occluders into the depth buffer, seen through the transform given to
+    // occlusion_buffer_clear(), with the row kernel of the given kernel (which must be supported),
+    // and builds the pyramid. The triangles are transformed and clipped by the calling thread, then
+    // the threads of pool rasterize bands of rows, so no two threads write the same pixel
+    inline void occlusion_rasterize(occlusion_buffer& buffer, const std::vector<occluder>& occluders, transform_kernel kernel, tree_worker_pool& pool)
+    {
+        buffer.m_triangles.clear();
+        for (auto& o : occluders) {
+            glm::mat4 transform = buffer.m_view_projection * o.m_model;
+            index_type vertex_count = 0U;
+            for (index_type k = 0; k < o.m_index_count; k++) {
+                vertex_count = std::max(vertex_count, index_type(o.m_indices[k]) + 1U);
+            }
+            buffer.m_clip_vertices.resize(vertex_count);
+            for (index_type v = 0; v < vertex_count; v++) {
+                buffer.m_clip_vertices[v] = transform * glm::vec4(o.m_vertices[v], 1.0f);
+            }
+            for (index_type k = 0; k + 2U < o.m_index_count; k += 3U) {
+                occlusion_clip_triangle(buffer, buffer.m_clip_vertices[o.m_indices[k]], buffer.m_clip_vertices[o.m_indices[k + 1U]], buffer.m_clip_vertices[o.m_indices[k + 2U]]);
+            }
+        }
+
+        int height = int(buffer.m_height);
+        if (pool.get_concurrency() == 1U || buffer.m_triangles.size() < 64U) {
+            occlusion_raster_band(buffer, kernel, 0, height);
+        } else {
+            std::atomic<int> next(0);
+            pool.run([&]() {
+                for (int y0 = next.fetch_add(int(occlusion_band_height)); y0 < height; y0 = next.fetch_add(int(occlusion_band_height))) {
+                    occlusion_raster_band(buffer, kernel, y0, std::min(y0 + int(occlusion_band_height), height));
+                }
+            });
+        }
+        occlusion_build_hiz(buffer);
+    }
+
+    // Returns false if the box is hidden by the occluders: its nearest point is farther than the
+    // farthest depth of the texels it covers, taken from the level of the pyramid where it covers at
+    // most 4x4 texels (with 2x2, the texels can reach far beyond the box). Boxes that cross the
+    // near plane are always visible. Only pixel centers are rasterized, so an object seen through a
+    // gap narrower than a pixel of the buffer may be culled
+    inline bool occlusion_test_aabb(const occlusion_buffer& buffer, const aabb& box)
+    {
+        if (box.empty()) {
+            return false;
+        }
+
+        float min_x = std::numeric_limits<float>::max();
+        float max_x = -std::numeric_limits<float>::max();
+        float min_y = std::numeric_limits<float>::max();
+        float max_y = -std::numeric_limits<float>::max();
+        float min_depth = std::numeric_limits<float>::max();
+        for (int corner = 0; corner < 8; corner++) {
+            glm::vec3 p((corner & 1)? box.m_max.x : box.m_min.x, (corner & 2)? box.m_max.y : box.m_min.y, (corner & 4)? box.m_max.z : box.m_min.z);
+            glm::vec4 c = buffer.m_view_projection * glm::vec4(p, 1.0f);
+            if (c.w <= 0.0f || c.z < -c.w) {
+                return true;
+            }
+            float x = (c.x / c.w * 0.5f + 0.5f) * buffer.m_width;
+            float y = (c.y / c.w * 0.5f + 0.5f) * buffer.m_height;
+            min_x = std::min(min_x, x);
+            max_x = std::max(max_x, x);
+            min_y = std::min(min_y, y);
+            max_y = std::max(max_y, y);
+            min_depth = std::min(min_depth, c.z / c.w * 0.5f + 0.5f);
+        }
+
+        float width = float(buffer.m_width);
+        float height = float(buffer.m_height);
+        int x0 = int(std::floor(glm::clamp(min_x, 0.0f, width)));
+        int x1 = std::min(int(buffer.m_width) - 1, int(std::floor(glm::clamp(max_x, -1.0f, width))));
+        int y0 = int(std::floor(glm::clamp(min_y, 0.0f, height)));
+        int y1 = std::min(int(buffer.m_height) - 1, int(std::floor(glm::clamp(max_y, -1.0f, height))));
+        if (x0 > x1 || y0 > y1) {
+            return true;
+        }
+
+        index_type l = 0U;
+        while (l + 1U < buffer.m_levels.size() && ((x1 >> l) - (x0 >> l) > 3 || (y1 >> l) - (y0 >> l) > 3)) {
+            l++;
+        }
+        const std::vector<float>& level = buffer.m_levels[l];
+        index_type level_width = buffer.m_level_widths[l];
+        float max_depth = 0.0f;
+        for (int y = (y0 >> l); y <= (y1 >> l); y++) {
+            for (int x = (x0 >> l); x <= (x1 >> l); x++) {
+                max_depth = std::max(max_depth, level[y * level_width + x]);
+            }
+        }
+
+        return min_depth <= max_depth;
+    }
+
+    // Removes from nodes the ones whose bounds, returned by get_bounds(node), are hidden (see
+    // occlusion_test_aabb()), keeping the order of the others. Returns the number of nodes removed
+    template<typename F>
+    index_type occlusion_cull(const occlusion_buffer& buffer, std::vector<index_type>& nodes, F get_bounds)
+    {
+        index_type count = nodes.size();
+        nodes.erase(std::remove_if(nodes.begin(), nodes.end(), [&](index_type i) { return !occlusion_test_aabb(buffer, get_bounds(i)); }), nodes.end());
+
+        return count - nodes.size();
+    }
+} // namespace rte
+
+#endif // OCCLUSION_CULLING_HPP
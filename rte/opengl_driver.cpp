@@ -7,7 +7,7 @@
 #include "log.hpp"
 
 #include <stdexcept>
-#include <sstream>
+#include <algorithm>
 #include <string>
 #include <map>
 
@@ -18,19 +18,101 @@ namespace rte
         //---------------------------------------------------------------------------------------------
         // Internal declarations
         //---------------------------------------------------------------------------------------------
-        typedef std::map<image_format, GLenum> opengl_image_format_map;
-        typedef std::map<depth_func, GLenum>   opengl_depth_func_map;
+        // Locations of the uniforms of a program that change between draws, resolved when the
+        // program is created. A location is -1 if the program doesn't use the uniform
+        struct program_locations
+        {
+            GLint m_diffuse_color;
+            GLint m_specular_color;
+            GLint m_smoothness;
+            GLint m_reflectivity;
+            GLint m_translucency;
+            GLint m_refractive_index;
+            material_data m_material;       //!< last material sent to the program, uniforms are state of the program
+            bool  m_material_set;
+        };
 
         // WARNING: this constant is also defined inside the fragment shaders
         constexpr std::size_t   MAX_POINT_LIGHTS = 10;
+        // WARNING: this constant is also defined inside the phong and environment mapping vertex shaders
+        constexpr GLuint        MODEL_ATTRIBUTE = 3U;
+        // Binding points of the uniform blocks
+        constexpr GLuint        CAMERA_BLOCK_BINDING = 0U;
+        constexpr GLuint        LIGHT_BLOCK_BINDING = 1U;
+
+        // The uniform blocks of the shaders, with the std140 layout: vec3 are aligned to 16 bytes,
+        // and a float after a vec3 takes its last 4 bytes
+        struct std140_dirlight
+        {
+            glm::vec3 m_ambient_color;
+            float     m_padding0;
+            glm::vec3 m_diffuse_color;
+            float     m_padding1;
+            glm::vec3 m_specular_color;
+            float     m_padding2;
+            glm::vec3 m_direction_cameraspace;
+            float     m_padding3;
+        };
+
+        struct std140_point_light
+        {
+            glm::vec3 m_position_cameraspace;
+            float     m_padding0;
+            glm::vec3 m_ambient_color;
+            float     m_padding1;
+            glm::vec3 m_diffuse_color;
+            float     m_padding2;
+            glm::vec3 m_specular_color;
+            float     m_constant_attenuation;
+            float     m_linear_attenuation;
+            float     m_quadratic_attenuation;
+            float     m_padding3[2];
+        };
+
+        struct camera_block
+        {
+            glm::mat4 m_view;
+            glm::mat4 m_projection;
+            glm::vec3 m_camera_position_worldspace;
+            float     m_padding0;
+        };
+
+        struct light_block
+        {
+            std140_dirlight    m_dirlight;
+            std140_point_light m_point_lights[MAX_POINT_LIGHTS];
+            GLuint             m_npoint_lights;
+            GLuint             m_padding0[3];
+        };
+
+        static_assert(sizeof (std140_dirlight) == 64U, "std140_dirlight doesn't match the std140 layout");
+        static_assert(sizeof (std140_point_light) == 80U, "std140_point_light doesn't match the std140 layout");
+        static_assert(sizeof (camera_block) == 144U, "camera_block doesn't match the std140 layout");
+        static_assert(sizeof (light_block) == 880U, "light_block doesn't match the std140 layout");
+
+        typedef std::map<image_format, GLenum>      opengl_image_format_map;
+        typedef std::map<depth_func, GLenum>        opengl_depth_func_map;
+        typedef std::map<GLuint, program_locations> program_locations_map;
+
         opengl_image_format_map opengl_image_formats;
         opengl_depth_func_map   opengl_depth_funcs;
+        program_locations_map   locations;
+        program_locations*      bound_locations = nullptr;
+        GLuint                  camera_buffer_id = 0U;
+        GLuint                  light_buffer_id = 0U;
         GLuint                  vao_id = 0U;
         GLuint                  bound_program = 0U;
         GLuint                  bound_texture_2d = 0U;
         GLuint                  bound_texture_cubemap = 0U;
+        GLuint                  bound_array_buffer = 0U;
         GLuint                  bound_element_array_buffer = 0U;
+        GLuint                  attribute_buffers[3] = {0U, 0U, 0U};    // buffer of the position, UV and normal attributes, 0 if their array is disabled
+        bool                    model_attributes_enabled = false;
         GLenum                  current_depth_func = 0U;
+        unsigned int            state_changes = 0U;                    // since the start of the frame
+        GLuint                  instance_buffer_id = 0U;
+        GLsizeiptr              instance_buffer_capacity = 0;
+        GLsizeiptr              instance_buffer_offset = 0;
 
         void initialize_opengl_image_formats()
         {
@@ -79,6 +161,27 @@ namespace rte
             // compulsory, but you may use only one and modify it permanently.
             glGenVertexArrays(1, &vao_id);
             glBindVertexArray(vao_id);
+            // A new VAO has all its arrays disabled
+            std::fill(attribute_buffers, attribute_buffers + 3, 0U);
+            model_attributes_enabled = false;
+            // Per-instance model matrices of the instanced draws. The divisors are part of the VAO
+            // state, and the attributes only read the buffer while their arrays are enabled
+            glGenBuffers(1, &instance_buffer_id);
+            instance_buffer_capacity = 0;
+            instance_buffer_offset = 0;
+            for (GLuint i = 0U; i < 4U; i++) {
+                glVertexAttribDivisor(MODEL_ATTRIBUTE + i, 1);
+            }
+            // Per-frame uniform blocks, bound once to their binding points. Each program maps its
+            // blocks to those points when it is created
+            glGenBuffers(1, &camera_buffer_id);
+            glBindBuffer(GL_UNIFORM_BUFFER, camera_buffer_id);
+            glBufferData(GL_UNIFORM_BUFFER, sizeof (camera_block), nullptr, GL_STREAM_DRAW);
+            glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BLOCK_BINDING, camera_buffer_id);
+            glGenBuffers(1, &light_buffer_id);
+            glBindBuffer(GL_UNIFORM_BUFFER, light_buffer_id);
+            glBufferData(GL_UNIFORM_BUFFER, sizeof (light_block), nullptr, GL_STREAM_DRAW);
+            glBindBufferBase(GL_UNIFORM_BUFFER, LIGHT_BLOCK_BINDING, light_buffer_id);
             // Since we only use texture unit 0, we bind this unit at initialization and then never bound it again
             glActiveTexture(GL_TEXTURE0);
         }
@@ -90,6 +193,7 @@ namespace rte
             glGenTextures(1, &texture_id);
             // "Bind" the newly created texture : all future texture functions will modify this texture
             glBindTexture(GL_TEXTURE_2D, texture_id);
+            bound_texture_2d = texture_id;
             std::vector<unsigned char> default_texture_data = {255U, 255U, 255U};
             glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_BGR, GL_UNSIGNED_BYTE, &default_texture_data[0]);
             glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -99,6 +203,9 @@ namespace rte
         void delete_default_texture(gl_texture_id id)
         {
             glDeleteTextures(1, &id);  
+            if (bound_texture_2d == id) {
+                bound_texture_2d = 0U;
+            }
         }
 
         void new_texture(unsigned int width,
@@ -132,7 +239,11 @@ namespace rte
 
         void delete_texture(gl_texture_id id)
         {
+            // Deleting a texture unbinds it, and its name may be given to a new one
             glDeleteTextures(1, &id);
+            if (bound_texture_2d == id) {
+                bound_texture_2d = 0U;
+            }
         }
 
         void new_3d_buffer(const std::vector<glm::vec3>& data, gl_buffer_id* buffer_id)
@@ -140,6 +251,7 @@ namespace rte
             GLuint vbo_id = 0U;
             glGenBuffers(1, &vbo_id);
             glBindBuffer(GL_ARRAY_BUFFER, vbo_id);
+            bound_array_buffer = vbo_id;
             glBufferData(GL_ARRAY_BUFFER, 3 * data.size() * sizeof (float), &data[0][0], GL_STATIC_DRAW);
             *buffer_id = vbo_id;
         }
@@ -149,6 +261,7 @@ namespace rte
             GLuint vbo_id = 0U;
             glGenBuffers(1, &vbo_id);
             glBindBuffer(GL_ARRAY_BUFFER, vbo_id);
+            bound_array_buffer = vbo_id;
             glBufferData(GL_ARRAY_BUFFER, 2 * data.size() * sizeof (float), &data[0][0], GL_STATIC_DRAW);
             *buffer_id = vbo_id;
         }
@@ -166,7 +279,20 @@ namespace rte
 
         void delete_buffer(gl_buffer_id buffer_id)
         {
+            // Deleting a buffer detaches it from the bound VAO, and its name may be given to a new one
             glDeleteBuffers(1, &buffer_id);
+            if (bound_array_buffer == buffer_id) {
+                bound_array_buffer = 0U;
+            }
+            if (bound_element_array_buffer == buffer_id) {
+                bound_element_array_buffer = 0U;
+            }
+            for (GLuint i = 0U; i < 3U; i++) {
+                if (attribute_buffers[i] == buffer_id) {
+                    glDisableVertexAttribArray(i);
+                    attribute_buffers[i] = 0U;
+                }
+            }
         }
 
         void flip_image_vertically(unsigned int width,
@@ -227,6 +353,9 @@ namespace rte
         void delete_gl_cubemap(gl_cubemap_id id)
         {
             glDeleteTextures(1, &id);
+            if (bound_texture_cubemap == id) {
+                bound_texture_cubemap = 0U;
+            }
         }
 
         void load_shaders(const char* vertex_shader_source,
@@ -306,129 +435,253 @@ namespace rte
         void initialize_frame()
         {
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            instance_buffer_offset = 0;
+            state_changes = 0U;
         }
 
-        void draw(const gl_driver_context& context)
+        unsigned int get_frame_state_changes()
         {
+            return state_changes;
+        }
+
+        void bind_depth_func(depth_func func)
+        {
+            // The depth func stays set for the next draws, which usually use the same one
             initialize_opengl_depth_func_map();
-            GLenum previous_depth_func = 0U;
-            bool depth_func_updated = false;
-            if (opengl_depth_funcs[context.m_depth_func] != current_depth_func) {
-                depth_func_updated = true;
-                glDepthFunc(opengl_depth_funcs[context.m_depth_func]);
-                previous_depth_func = current_depth_func;
-                current_depth_func = opengl_depth_funcs[context.m_depth_func];
+            if (opengl_depth_funcs[func] != current_depth_func) {
+                glDepthFunc(opengl_depth_funcs[func]);
+                current_depth_func = opengl_depth_funcs[func];
+                state_changes++;
+            }
+        }
+
+        void bind_array_buffer(GLuint buffer)
+        {
+            if (bound_array_buffer != buffer) {
+                glBindBuffer(GL_ARRAY_BUFFER, buffer);
+                bound_array_buffer = buffer;
+            }
+        }
+
+        bool same_material(const material_data& a, const material_data& b)
+        {
+            return a.m_diffuse_color == b.m_diffuse_color
+                && a.m_specular_color == b.m_specular_color
+                && a.m_smoothness == b.m_smoothness
+                && a.m_reflectivity == b.m_reflectivity
+                && a.m_translucency == b.m_translucency
+                && a.m_refractive_index == b.m_refractive_index;
+        }
+
+        void set_frame_data(const gl_driver_context& context)
+        {
+            camera_block camera;
+            camera.m_view = context.m_view;
+            camera.m_projection = context.m_projection;
+            camera.m_camera_position_worldspace = camera_position_worldspace_from_view_matrix(context.m_view);
+
+            light_block lights;
+            lights.m_dirlight.m_ambient_color = context.m_dirlight.m_ambient_color;
+            lights.m_dirlight.m_diffuse_color = context.m_dirlight.m_diffuse_color;
+            lights.m_dirlight.m_specular_color = context.m_dirlight.m_specular_color;
+            lights.m_dirlight.m_direction_cameraspace = context.m_dirlight.m_direction_cameraspace;
+            lights.m_npoint_lights = 0U;
+            for (auto& pl : context.m_point_lights) {
+                if (lights.m_npoint_lights >= MAX_POINT_LIGHTS) { break; }
+
+                auto& pl_block = lights.m_point_lights[lights.m_npoint_lights++];
+                pl_block.m_position_cameraspace = pl.m_position_cameraspace;
+                pl_block.m_ambient_color = pl.m_ambient_color;
+                pl_block.m_diffuse_color = pl.m_diffuse_color;
+                pl_block.m_specular_color = pl.m_specular_color;
+                pl_block.m_constant_attenuation = pl.m_constant_attenuation;
+                pl_block.m_linear_attenuation = pl.m_linear_attenuation;
+                pl_block.m_quadratic_attenuation = pl.m_quadratic_attenuation;
             }
+
+            // Orphan the previous contents, the draws of the last frame may still read them
+            glBindBuffer(GL_UNIFORM_BUFFER, camera_buffer_id);
+            glBufferData(GL_UNIFORM_BUFFER, sizeof (camera_block), &camera, GL_STREAM_DRAW);
+            glBindBuffer(GL_UNIFORM_BUFFER, light_buffer_id);
+            glBufferData(GL_UNIFORM_BUFFER, sizeof (light_block), &lights, GL_STREAM_DRAW);
+        }
+
+        void set_uniforms(const gl_driver_context& context)
+        {
             // Bind the program
             if (context.m_program != bound_program) {
                 glUseProgram(context.m_program);
                 bound_program = context.m_program;
+                bound_locations = &locations.at(context.m_program);
+                state_changes++;
             }
-            // Send our transformation to the currently bound shader
-            glm::mat4 mvp = context.m_projection * context.m_view * context.m_node.m_model;
-            glUniformMatrix4fv(glGetUniformLocation(context.m_program, "model"), 1, GL_FALSE, &context.m_node.m_model[0][0]);
-            glUniformMatrix4fv(glGetUniformLocation(context.m_program, "view"), 1, GL_FALSE, &context.m_view[0][0]);
-            glUniformMatrix4fv(glGetUniformLocation(context.m_program, "projection"), 1, GL_FALSE, &context.m_projection[0][0]);
-            glUniformMatrix4fv(glGetUniformLocation(context.m_program, "mvp"), 1, GL_FALSE, &mvp[0][0]);
             // Bind our cubemap texture in the GL_TEXTURE_CUBE_MAP target of texture unit 0
             // The texture unit is 0 because we called glActiveTexture(GL_TEXTURE0) at initialization
             if (bound_texture_cubemap != context.m_gl_cubemap) {
                 glBindTexture(GL_TEXTURE_CUBE_MAP, context.m_gl_cubemap);
                 bound_texture_cubemap = context.m_gl_cubemap;
+                state_changes++;
             }
-            // Set the cubemap uniform. The value to set is the texture unit, which is 0 because we
-            // called glActiveTexture(GL_TEXTURE0) at initialization. The cubemap sampler knows that
-            // is needs to use the GL_TEXTURE_CUBE_MAP target of that unit.
-            glUniform1i(glGetUniformLocation(context.m_program, "cubemap"), 0);
-
             // Bind our texture in the GL_TEXTURE_2D target of texture unit 0
             // The texture unit is 0 because we called glActiveTexture(GL_TEXTURE0) at initialization
             if (bound_texture_2d != context.m_node.m_texture) {
                 glBindTexture(GL_TEXTURE_2D, context.m_node.m_texture);
                 bound_texture_2d = context.m_node.m_texture;
+                state_changes++;
             }
-            // Set the diffuse_sampler uniform (used to sample the texture). The value to set is the
-            // texture unit, which is 0 because we called glActiveTexture(GL_TEXTURE0) at
-            // initialization. The 2D sampler knows that is needs to use the GL_TEXTURE_2D target of
-            // that unit.
-            glUniform1i(glGetUniformLocation(context.m_program, "material.diffuse_sampler"), 0);
-
-            // Set material uniform properties from material information
-            glUniform3fv(glGetUniformLocation(context.m_program, "material.diffuse_color"), 1, &context.m_node.m_material.m_diffuse_color[0]);
-            glUniform3fv(glGetUniformLocation(context.m_program, "material.specular_color"), 1, &context.m_node.m_material.m_specular_color[0]);
-            glUniform1f(glGetUniformLocation(context.m_program,  "material.smoothness"), context.m_node.m_material.m_smoothness);
-            glUniform1f(glGetUniformLocation(context.m_program,  "material.reflectivity"), context.m_node.m_material.m_reflectivity);
-            glUniform1f(glGetUniformLocation(context.m_program,  "material.translucency"), context.m_node.m_material.m_translucency);
-            glUniform1f(glGetUniformLocation(context.m_program,  "material.refractive_index"), context.m_node.m_material.m_refractive_index);
-
-            // Set dirlight uniform properties
-            glUniform3fv(glGetUniformLocation(context.m_program, "dirlight.ambient_color"),  1, &context.m_dirlight.m_ambient_color[0]);
-            glUniform3fv(glGetUniformLocation(context.m_program, "dirlight.diffuse_color"),  1, &context.m_dirlight.m_diffuse_color[0]);
-            glUniform3fv(glGetUniformLocation(context.m_program, "dirlight.specular_color"), 1, &context.m_dirlight.m_specular_color[0]);
-            glUniform3fv(glGetUniformLocation(context.m_program, "dirlight.direction_cameraspace"), 1, &context.m_dirlight.m_direction_cameraspace[0]);
-
-            // Set camera position uniform
-            glm::vec3 camera_position_worldspace = camera_position_worldspace_from_view_matrix(context.m_view);
-            glUniform3fv(glGetUniformLocation(context.m_program, "camera_position_worldspace"), 1, &camera_position_worldspace[0]);
-
-            // Set point light uniform
-            std::size_t sent_point_lights = 0U;
-            for (std::vector<point_light_data>::const_iterator it = context.m_point_lights.begin(); it != context.m_point_lights.end(); it++) {
-                if (sent_point_lights >= MAX_POINT_LIGHTS) { break; }
-
-                std::ostringstream oss;
-                oss << "point_lights[" << sent_point_lights << "]";
-                std::string uniform_prefix = oss.str();
-
-                glUniform3fv(glGetUniformLocation(context.m_program, (uniform_prefix + ".position_cameraspace").c_str()), 1, &it->m_position_cameraspace[0]);
-                glUniform3fv(glGetUniformLocation(context.m_program, (uniform_prefix + ".ambient_color").c_str()), 1, &it->m_ambient_color[0]);
-                glUniform3fv(glGetUniformLocation(context.m_program, (uniform_prefix + ".diffuse_color").c_str()), 1, &it->m_diffuse_color[0]);
-                glUniform3fv(glGetUniformLocation(context.m_program, (uniform_prefix + ".specular_color").c_str()), 1, &it->m_specular_color[0]);
-                glUniform1f(glGetUniformLocation(context.m_program,  (uniform_prefix + ".constant_attenuation").c_str()), it->m_constant_attenuation);
-                glUniform1f(glGetUniformLocation(context.m_program,  (uniform_prefix + ".linear_attenuation").c_str()), it->m_linear_attenuation);
-                glUniform1f(glGetUniformLocation(context.m_program,  (uniform_prefix + ".quadratic_attenuation").c_str()), it->m_quadratic_attenuation);
-
-                sent_point_lights++;
-            }
-            glUniform1ui(glGetUniformLocation(context.m_program, "npoint_lights"), sent_point_lights);
 
-            // 1rst attribute buffer : vertices
-            glEnableVertexAttribArray(0);
-            glBindBuffer(GL_ARRAY_BUFFER, context.m_node.m_position_buffer);
-            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*) 0);
+            // Set material uniform properties from material information, unless the program already
+            // has them. The transforms, lights and camera position are in the uniform blocks, see
+            // set_frame_data()
+            program_locations& l = *bound_locations;
+            if (!l.m_material_set || !same_material(l.m_material, context.m_node.m_material)) {
+                glUniform3fv(l.m_diffuse_color, 1, &context.m_node.m_material.m_diffuse_color[0]);
+                glUniform3fv(l.m_specular_color, 1, &context.m_node.m_material.m_specular_color[0]);
+                glUniform1f(l.m_smoothness, context.m_node.m_material.m_smoothness);
+                glUniform1f(l.m_reflectivity, context.m_node.m_material.m_reflectivity);
+                glUniform1f(l.m_translucency, context.m_node.m_material.m_translucency);
+                glUniform1f(l.m_refractive_index, context.m_node.m_material.m_refractive_index);
+                l.m_material = context.m_node.m_material;
+                l.m_material_set = true;
+                state_changes++;
+            }
+        }
 
-            // 2nd attribute buffer : UVs
-            if (context.m_node.m_texture_coords_buffer) {
-                glEnableVertexAttribArray(1);
-                glBindBuffer(GL_ARRAY_BUFFER, context.m_node.m_texture_coords_buffer);
-                glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void*) 0);
+        void bind_attribute_buffer(GLuint attribute, GLuint buffer, GLint size)
+        {
+            // The arrays stay enabled between draws, so consecutive draws of the same mesh don't
+            // specify them again. A buffer 0 disables the array: the shader reads the current value
+            // of the attribute instead
+            if (attribute_buffers[attribute] == buffer) {
+                return;
             }
 
-            // 3rd attribute buffer : normals
-            if (context.m_node.m_normal_buffer) {
-                glEnableVertexAttribArray(2);
-                glBindBuffer(GL_ARRAY_BUFFER, context.m_node.m_normal_buffer);
-                glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (void*) 0);
+            if (buffer == 0U) {
+                glDisableVertexAttribArray(attribute);
+            } else {
+                if (attribute_buffers[attribute] == 0U) {
+                    glEnableVertexAttribArray(attribute);
+                }
+                bind_array_buffer(buffer);
+                glVertexAttribPointer(attribute, size, GL_FLOAT, GL_FALSE, 0, (void*) 0);
             }
+            attribute_buffers[attribute] = buffer;
+            state_changes++;
+        }
+
+        void bind_vertex_buffers(const gl_node_context& node)
+        {
+            // 1rst attribute buffer : vertices
+            bind_attribute_buffer(0U, node.m_position_buffer, 3);
+            // 2nd attribute buffer : UVs
+            bind_attribute_buffer(1U, node.m_texture_coords_buffer, 2);
+            // 3rd attribute buffer : normals
+            bind_attribute_buffer(2U, node.m_normal_buffer, 3);
 
             // Index buffer
-            if (bound_element_array_buffer != context.m_node.m_index_buffer) {
-                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, context.m_node.m_index_buffer);
-                bound_element_array_buffer = context.m_node.m_index_buffer;
+            if (bound_element_array_buffer != node.m_index_buffer) {
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, node.m_index_buffer);
+                bound_element_array_buffer = node.m_index_buffer;
+                state_changes++;
             }
+        }
+
+        void set_model_attributes(const glm::mat4& model)
+        {
+            // The model matrix takes the 4 locations from MODEL_ATTRIBUTE, one per column. When
+            // their arrays are disabled the shaders read the current value of the attributes, so
+            // a single draw sets them with glVertexAttrib4fv() instead of a buffer
+            if (model_attributes_enabled) {
+                for (GLuint i = 0U; i < 4U; i++) {
+                    glDisableVertexAttribArray(MODEL_ATTRIBUTE + i);
+                }
+                model_attributes_enabled = false;
+                state_changes++;
+            }
+            for (GLuint i = 0U; i < 4U; i++) {
+                glVertexAttrib4fv(MODEL_ATTRIBUTE + i, &model[i][0]);
+            }
+        }
+
+        void draw(const gl_driver_context& context)
+        {
+            bind_depth_func(context.m_depth_func);
+            set_uniforms(context);
+            bind_vertex_buffers(context.m_node);
+            set_model_attributes(context.m_node.m_model);
 
             // Draw the triangles !
             glDrawElements(GL_TRIANGLES, context.m_node.m_num_indices, GL_UNSIGNED_SHORT, (void*) 0);
+        }
+
+        void draw_instanced(const gl_driver_context& context, const std::vector<glm::mat4>& models)
+        {
+            if (models.empty()) {
+                return;
+            }
 
-            glDisableVertexAttribArray(0);
-            glDisableVertexAttribArray(1);
-            glDisableVertexAttribArray(2);
+            // The model matrices of all the instanced draws of a frame are appended to the instance
+            // buffer. When it is full it is reallocated, which gives a new storage without waiting
+            // for the draws that still read the previous one
+            GLsizeiptr size = models.size() * sizeof (glm::mat4);
+            bind_array_buffer(instance_buffer_id);
+            if (instance_buffer_offset + size > instance_buffer_capacity) {
+                instance_buffer_capacity = std::max(2 * instance_buffer_capacity, size);
+                glBufferData(GL_ARRAY_BUFFER, instance_buffer_capacity, nullptr, GL_STREAM_DRAW);
+                instance_buffer_offset = 0;
+            }
+            glBufferSubData(GL_ARRAY_BUFFER, instance_buffer_offset, size, &models[0][0][0]);
+
+            bind_depth_func(context.m_depth_func);
+            set_uniforms(context);
+            bind_vertex_buffers(context.m_node);
+
+            // One column of the model matrix per location, advancing once per instance (the divisors
+            // are set at initialization). The offset changes with every draw, so the pointers do too
+            bind_array_buffer(instance_buffer_id);
+            for (GLuint i = 0U; i < 4U; i++) {
+                if (!model_attributes_enabled) {
+                    glEnableVertexAttribArray(MODEL_ATTRIBUTE + i);
+                }
+                glVertexAttribPointer(MODEL_ATTRIBUTE + i, 4, GL_FLOAT, GL_FALSE, sizeof (glm::mat4),
+                                      (void*) (instance_buffer_offset + i * sizeof (glm::vec4)));
+            }
+            model_attributes_enabled = true;
+            instance_buffer_offset += size;
+            state_changes++;
+
+            glDrawElementsInstanced(GL_TRIANGLES, context.m_node.m_num_indices, GL_UNSIGNED_SHORT, (void*) 0, models.size());
+        }
 
-            // Restore the previous depth func
-            if (depth_func_updated) {
-                glDepthFunc(previous_depth_func);
-                current_depth_func = previous_depth_func;
+        void initialize_program(gl_program_id id)
+        {
+            // Map the uniform blocks used by the program to their binding points
+            GLuint camera_block_index = glGetUniformBlockIndex(id, "camera_data");
+            if (camera_block_index != GL_INVALID_INDEX) {
+                glUniformBlockBinding(id, camera_block_index, CAMERA_BLOCK_BINDING);
+            }
+            GLuint light_block_index = glGetUniformBlockIndex(id, "light_data");
+            if (light_block_index != GL_INVALID_INDEX) {
+                glUniformBlockBinding(id, light_block_index, LIGHT_BLOCK_BINDING);
             }
+
+            // The samplers never change: the value to set is the texture unit, which is 0 because
+            // we called glActiveTexture(GL_TEXTURE0) at initialization. The cubemap sampler uses the
+            // GL_TEXTURE_CUBE_MAP target of that unit, and the diffuse sampler the GL_TEXTURE_2D one
+            glUseProgram(id);
+            bound_program = id;
+            glUniform1i(glGetUniformLocation(id, "cubemap"), 0);
+            glUniform1i(glGetUniformLocation(id, "material.diffuse_sampler"), 0);
+
+            program_locations& l = locations[id];
+            l.m_diffuse_color = glGetUniformLocation(id, "material.diffuse_color");
+            l.m_specular_color = glGetUniformLocation(id, "material.specular_color");
+            l.m_smoothness = glGetUniformLocation(id, "material.smoothness");
+            l.m_reflectivity = glGetUniformLocation(id, "material.reflectivity");
+            l.m_translucency = glGetUniformLocation(id, "material.translucency");
+            l.m_refractive_index = glGetUniformLocation(id, "material.refractive_index");
+            l.m_material_set = false;
+            bound_locations = &l;
         }
 
         void new_program(program_type type, gl_program_id* gl_program_id)
@@ -443,11 +696,17 @@ namespace rte
             } else if (type == program_type::skybox) {
                 load_shaders(skybox_vertex_shader, skybox_fragment_shader, gl_program_id);
             }
+            initialize_program(*gl_program_id);
         }
 
         void delete_program(gl_program_id id)
         {
             glDeleteProgram(id);
+            locations.erase(id);
+            if (bound_program == id) {
+                bound_program = 0U;
+                bound_locations = nullptr;
+            }
         }
     } // anonymous namespace
 
@@ -471,7 +730,10 @@ namespace rte
         driver.new_program = new_program;
         driver.delete_program = delete_program;
         driver.initialize_frame = initialize_frame;
+        driver.set_frame_data = set_frame_data;
         driver.draw = draw;
+        driver.draw_instanced = draw_instanced;
+        driver.get_frame_state_changes = get_frame_state_changes;
 
         return driver;
     }
@@ -0,0 +1,236 @@
+#ifndef PARALLEL_TREE_HPP
+#define PARALLEL_TREE_HPP
+
+#include "sparse_tree.hpp"
+
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <mutex>
+
+namespace rte
+{
+    // Fixed set of worker threads that run the same job together. The threads are started once and
+    // sleep between jobs, so a job can be run every frame without paying for thread creation.
+    class tree_worker_pool
+    {
+    public:
+        // thread_count is the number of threads besides the calling thread, which also runs jobs
+        explicit tree_worker_pool(unsigned int thread_count) :
+            m_threads(),
+            m_run_mutex(),
+            m_mutex(),
+            m_start_condition(),
+            m_done_condition(),
+            m_job(),
+            m_job_exception(),
+            m_job_generation(0U),
+            m_running_workers(0U),
+            m_stop(false)
+        {
+            for (unsigned int i = 0; i < thread_count; i++) {
+                m_threads.emplace_back([this]() { worker_loop(); });
+            }
+        }
+
+        tree_worker_pool(const tree_worker_pool&) = delete;
+        tree_worker_pool& operator=(const tree_worker_pool&) = delete;
+
+        ~tree_worker_pool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_start_condition.notify_all();
+            for (auto& t : m_threads) {
+                t.join();
+            }
+        }
+
+        // Runs job on every worker thread and on the calling thread, and returns once all of them
+        // have finished. If job throws in any thread, one of the exceptions is rethrown here.
+        // Concurrent calls are serialized. job must not call run() on the same pool.
+        void run(const std::function<void()>& job)
+        {
+            std::lock_guard<std::mutex> run_lock(m_run_mutex);
+            std::exception_ptr caller_exception;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_job = job;
+                m_job_exception = nullptr;
+                m_running_workers = m_threads.size();
+                m_job_generation++;
+            }
+            m_start_condition.notify_all();
+
+            try {
+                job();
+            } catch (...) {
+                caller_exception = std::current_exception();
+            }
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done_condition.wait(lock, [this]() { return m_running_workers == 0U; });
+            m_job = nullptr;
+            if (caller_exception) {
+                std::rethrow_exception(caller_exception);
+            }
+            if (m_job_exception) {
+                std::rethrow_exception(m_job_exception);
+            }
+        }
+
+        // Returns the number of threads that run a job, including the calling thread
+        unsigned int get_concurrency() const { return m_threads.size() + 1U; }
+
+    private:
+        void worker_loop()
+        {
+            unsigned int last_generation = 0U;
+            while (true) {
+                std::function<void()> job;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_start_condition.wait(lock, [&]() { return m_stop || m_job_generation != last_generation; });
+                    if (m_stop) {
+                        return;
+                    }
+                    last_generation = m_job_generation;
+                    job = m_job;
+                }
+
+                std::exception_ptr exception;
+                try {
+                    job();
+                } catch (...) {
+                    exception = std::current_exception();
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    if (exception && !m_job_exception) {
+                        m_job_exception = exception;
+                    }
+                    m_running_workers--;
+                }
+                m_done_condition.notify_one();
+            }
+        }
+
+        std::vector<std::thread>     m_threads;
+        std::mutex                   m_run_mutex;         //!< held for the whole duration of run()
+        std::mutex                   m_mutex;             //!< protects the members below
+        std::condition_variable      m_start_condition;   //!< signaled when a job is posted or the pool stops
+        std::condition_variable      m_done_condition;    //!< signaled when a worker finishes a job
+        std::function<void()>        m_job;               //!< job being run
+        std::exception_ptr           m_job_exception;     //!< first exception thrown by a worker during the job
+        unsigned int                 m_job_generation;    //!< incremented every time a job is posted
+        unsigned int                 m_running_workers;   //!< workers that have not finished the current job
+        bool                         m_stop;
+    };
+
+    // Returns a pool shared by all callers of tree_parallel_for_each() that don't provide their own,
+    // with one thread per hardware thread (counting the calling thread)
+    inline tree_worker_pool& tree_default_worker_pool()
+    {
+        static tree_worker_pool pool(std::max(std::thread::hardware_concurrency(), 1U) - 1U);
+        return pool;
+    }
+
+    constexpr unsigned int tree_parallel_tasks_per_thread = 8U;   //!< tasks made per thread, so that threads that finish early can take more
+
+    // Scratch memory for tree_parallel_for_each(). Reusing it between calls avoids allocating
+    struct tree_parallel_context
+    {
+        std::vector<index_type>    m_queue;           //!< nodes of the level-order walk of the calling thread, the roots of the tasks at the end
+    };
+
+    // Calls fn(i) for every node i of the subtree rooted at root, using the threads of pool. A node is
+    // always processed after its parent has been processed, so fn can read data computed for the
+    // parent (like an accumulated transform). Siblings, and subtrees in general, are processed in no
+    // particular order and possibly concurrently, so fn must only write data of the node it is
+    // given, and it must not change the structure of the tree. With cow_chunked_storage, the slots fn
+    // writes must have been made writable beforehand (see sparse_vector::make_writable()).
+    //
+    // The calling thread processes the top of the subtree in level order. It stops once it has
+    // processed at least grain nodes and the nodes waiting in the walk are enough to give every
+    // thread several tasks. Their subtrees are then split into consecutive ranges, which the
+    // threads take as tasks. A subtree that the walk covers before that, like a small dirty subtree
+    // of a big scene, is processed without waking the pool. Only the top of the subtree is walked
+    // before the tasks start, so the serial part doesn't grow with the size of the tree. grain
+    // should be big enough to amortize scheduling, in the order of thousands.
+    // fn must not call tree_parallel_for_each() with the same pool. Returns the number of nodes processed.
+    template<typename V, typename F>
+    index_type tree_parallel_for_each(V& tree, index_type root, F fn, index_type grain, tree_worker_pool& pool, tree_parallel_context& context)
+    {
+        assert(root < tree.size());
+        if (!(root < tree.size())) {
+            throw std::out_of_range("tree_parallel_for_each: invalid root index");
+        }
+        grain = std::max(grain, index_type(1U));
+        // The tree is only walked through a const reference: with cow_chunked_storage, non-const
+        // access can clone a chunk, which several threads must not do at once. Writes are left to fn
+        const V& const_tree = tree;
+        if (pool.get_concurrency() == 1U || tree.size() < grain) {
+            index_type count = 0U;
+            for (auto it = tree_preorder_begin(const_tree, root); it != tree_preorder_end(const_tree, root); ++it) {
+                fn(index(it));
+                count++;
+            }
+            return count;
+        }
+
+        // Process the top of the subtree in the calling thread. The nodes of the queue past
+        // first_waiting have not been processed yet, and their parents have
+        index_type task_count = index_type(pool.get_concurrency()) * tree_parallel_tasks_per_thread;
+        auto& queue = context.m_queue;
+        queue.assign(1U, root);
+        index_type first_waiting = 0U;
+        while (first_waiting < queue.size() && (first_waiting < grain || queue.size() - first_waiting < task_count)) {
+            index_type i = queue[first_waiting++];
+            fn(i);
+            for (auto it = tree_begin(const_tree, i); it != tree_end(const_tree, i); ++it) {
+                queue.push_back(index(it));
+            }
+        }
+        index_type count = first_waiting;
+        if (first_waiting == queue.size()) {
+            return count;
+        }
+
+        // Every thread takes ranges of roots until there are none left
+        index_type root_count = queue.size() - first_waiting;
+        index_type roots_per_task = (root_count + task_count - 1U) / task_count;
+        std::atomic<index_type> next_root(0U);
+        std::atomic<index_type> task_counts(0U);
+        pool.run([&]() {
+            for (index_type first = next_root.fetch_add(roots_per_task); first < root_count; first = next_root.fetch_add(roots_per_task)) {
+                index_type processed = 0U;
+                for (index_type r = first_waiting + first; r < first_waiting + std::min(first + roots_per_task, root_count); r++) {
+                    for (auto it = tree_preorder_begin(const_tree, queue[r]); it != tree_preorder_end(const_tree, queue[r]); ++it) {
+                        fn(index(it));
+                        processed++;
+                    }
+                }
+                task_counts += processed;
+            }
+        });
+
+        return count + task_counts;
+    }
+
+    // Same as above, using the default pool and scratch memory local to the calling thread
+    template<typename V, typename F>
+    index_type tree_parallel_for_each(V& tree, index_type root, F fn, index_type grain)
+    {
+        static thread_local tree_parallel_context context;
+        return tree_parallel_for_each(tree, root, fn, grain, tree_default_worker_pool(), context);
+    }
+} // namespace rte
+
+#endif // PARALLEL_TREE_HPP
@@ -5,6 +5,8 @@ const char* phong_vertex_shader = R"glsl(
     layout(location = 0) in vec3 vertex_position_modelspace;
     layout(location = 1) in vec2 vertex_tex_coords;
     layout(location = 2) in vec3 vertex_direction_n_modelspace;
+    // Model matrix, per instance in instanced draws and constant otherwise. Takes locations 3 to 6
+    layout(location = 3) in mat4 model;
 
     // Output data ; will be interpolated for each fragment.
     out vec2 tex_coords;
@@ -13,24 +15,27 @@ const char* phong_vertex_shader = R"glsl(
     out vec3 direction_n_cameraspace;
     out vec3 direction_v_cameraspace;
 
-    // Values that stay constant for the whole mesh.
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
-    uniform mat4 mvp;
+    // Values that stay constant for the whole frame, shared by all the programs. The layout must
+    // match camera_block in opengl_driver.cpp
+    layout(std140) uniform camera_data
+    {
+        mat4 view;
+        mat4 projection;
+        vec3 camera_position_worldspace;
+    };
 
     void main(){
-        // Output position of the vertex, in clip space : mvp * position
-        gl_Position =  mvp * vec4(vertex_position_modelspace,1);
-
         // Position of the vertex, in worldspace : model * position
         vec4 position_worldspace4 = model * vec4(vertex_position_modelspace, 1);
         position_worldspace = position_worldspace4.xyz / position_worldspace4.w;
 
         // Vector that goes from the vertex to the camera, in camera space.
         // In camera space, the camera is at the origin (0,0,0).
-        vec4 position_cameraspace4 = view * model * vec4(vertex_position_modelspace, 1);
+        vec4 position_cameraspace4 = view * position_worldspace4;
         position_cameraspace = position_cameraspace4.xyz / position_cameraspace4.w;
+
+        // Output position of the vertex, in clip space : projection * view * model * position
+        gl_Position =  projection * position_cameraspace4;
         direction_v_cameraspace = vec3(0,0,0) - position_cameraspace;
 
         // Normal of the the vertex, in camera space. Note this is only correct if the model
@@ -96,11 +101,17 @@ const char* phong_fragment_shader = R"glsl(
     // Ouput data
     out vec3 color;
 
+    // Lights of the frame, shared by all the programs. The layout must match light_block in
+    // opengl_driver.cpp
+    layout(std140) uniform light_data
+    {
+        dirlight_data     dirlight;
+        point_light_data  point_lights[MAX_POINT_LIGHTS];
+        uint              npoint_lights;
+    };
+
     // Values that stay constant for the whole mesh.
     uniform material_data     material;
-    uniform dirlight_data     dirlight;
-    uniform point_light_data  point_lights[MAX_POINT_LIGHTS];
-    uniform uint              npoint_lights;
 
     // Calculates the contribution of the directional light
     vec3 calc_dirlight(dirlight_data dirlight,
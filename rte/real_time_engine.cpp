@@ -63,6 +63,8 @@ namespace rte
 
             database_loader_initialize();
             load_database(m_view_db);
+            // Lay out the scene in traversal order, so that the per-frame passes walk memory sequentially
+            compact_database(m_view_db);
             log_database(m_view_db);
 
             unique_window window = make_window(896, 504, false);
@@ -103,6 +105,14 @@ namespace rte
             try {
                 log(LOG_LEVEL_DEBUG, "real_time_engine: finalizing application");
                 m_framerate_controller.log_stats();
+                std::ostringstream oss;
+                oss << "real_time_engine: last frame, visible nodes: " << get_render_stats().m_visible_nodes
+                    << ", culled nodes: " << get_render_stats().m_culled_nodes
+                    << ", occluded nodes: " << get_render_stats().m_occluded_nodes
+                    << ", draw calls: " << get_render_stats().m_draw_calls
+                    << ", instanced nodes: " << get_render_stats().m_instanced_nodes
+                    << ", state changes: " << get_render_stats().m_state_changes;
+                log(LOG_LEVEL_DEBUG, oss.str());
                 finalize_renderer();
                 m_window.reset();
                 system_finalize();
@@ -121,29 +131,6 @@ namespace rte
             }
         }
 
-        void compute_accum_transforms(view_database& db)
-        {
-            struct context { index_type node_index; };
-            std::vector<context> pending_nodes;
-            pending_nodes.push_back({db.m_root_node});
-            while (!pending_nodes.empty()) {
-                auto current = pending_nodes.back();
-                pending_nodes.pop_back();
-
-                auto& current_node = db.m_nodes.at(current.node_index);
-                glm::mat4 previous_transform(1.0f);
-                if (current_node.m_parent != npos) {
-                    previous_transform = db.m_nodes.at(current_node.m_parent).m_accum_transform;
-                }
-                current_node.m_accum_transform = current_node.m_local_transform * previous_transform;
-
-                // process current
-                for (auto it = tree_rbegin(db.m_nodes, current.node_index); it != tree_rend(db.m_nodes, current.node_index); ++it) {
-                    pending_nodes.push_back({index(it)});
-                }
-            }
-        }
-
         bool frame()
         {
             // Delta time for simulation
@@ -164,7 +151,8 @@ namespace rte
             // Control projection (update fov)
             m_perspective_controller.process(dt, m_events);
 
-            compute_accum_transforms(m_view_db);
+            // Only the subtrees whose local transforms changed since the last frame are recomputed
+            update_accum_transforms(m_view_db);
 
             // Render the frame
             render(m_view_db);
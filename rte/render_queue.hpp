@@ -0,0 +1,139 @@
+#ifndef RENDER_QUEUE_HPP
+#define RENDER_QUEUE_HPP
+
+#include "sparse_vector.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace rte
+{
+    // Bits of each field of a draw key, from the most significant one. The sort groups the draws by
+    // pass first, then by the state that is most expensive to change. Identifiers with more bits
+    // than their field are truncated: draws that differ only by the truncated bits are still drawn
+    // correctly, just not next to each other
+    constexpr unsigned int draw_key_pass_bits = 4U;
+    constexpr unsigned int draw_key_program_bits = 8U;
+    constexpr unsigned int draw_key_texture_bits = 12U;
+    constexpr unsigned int draw_key_mesh_bits = 16U;
+    constexpr unsigned int draw_key_material_bits = 12U;
+    constexpr unsigned int draw_key_depth_bits = 12U;
+    static_assert(draw_key_pass_bits + draw_key_program_bits + draw_key_texture_bits + draw_key_mesh_bits
+                  + draw_key_material_bits + draw_key_depth_bits == 64U, "the fields of a draw key must fill 64 bits");
+
+    constexpr std::size_t render_queue_radix_min_items = 2048U;   //!< smaller queues are sorted with std::stable_sort(), faster for them
+
+    typedef std::uint64_t draw_key;
+
+    // Depth field of a key: the upper bits of a positive float keep its order, so the distance
+    // needs no range. Without the sign bit, 12 bits keep the exponent and the first 4 bits of the
+    // mantissa, that is, a resolution of 1/16 of each power of two
+    inline draw_key draw_key_depth(float distance)
+    {
+        if (!(distance > 0.0f)) {
+            return 0U;
+        }
+
+        std::uint32_t bits = 0U;
+        std::memcpy(&bits, &distance, sizeof bits);
+        return static_cast<std::uint32_t>(bits << 1U) >> (32U - draw_key_depth_bits);
+    }
+
+    // Builds the key of a draw. Sorting by key gives the draws in pass order, with the draws that
+    // share program, texture, mesh and material next to each other, and front to back among them
+    inline draw_key make_draw_key(index_type pass, index_type program, index_type texture, index_type mesh, index_type material, float distance)
+    {
+        auto field = [](index_type value, unsigned int bits) {
+            return static_cast<draw_key>(value) & ((draw_key(1U) << bits) - 1U);
+        };
+
+        draw_key key = field(pass, draw_key_pass_bits);
+        key = (key << draw_key_program_bits) | field(program, draw_key_program_bits);
+        key = (key << draw_key_texture_bits) | field(texture, draw_key_texture_bits);
+        key = (key << draw_key_mesh_bits) | field(mesh, draw_key_mesh_bits);
+        key = (key << draw_key_material_bits) | field(material, draw_key_material_bits);
+        key = (key << draw_key_depth_bits) | draw_key_depth(distance);
+        return key;
+    }
+
+    // The key without its depth field: draws with the same state have the same one
+    inline draw_key draw_key_state(draw_key key)
+    {
+        return key >> draw_key_depth_bits;
+    }
+
+    inline index_type draw_key_pass(draw_key key)
+    {
+        return static_cast<index_type>(key >> (64U - draw_key_pass_bits));
+    }
+
+    struct render_item
+    {
+        draw_key       m_key;
+        index_type     m_node;
+    };
+
+    // Draws of a frame. It is filled and sorted every frame, so clearing it keeps the memory
+    struct render_queue
+    {
+        std::vector<render_item> m_items;
+        std::vector<render_item> m_scratch;      //!< second buffer of the radix sort
+    };
+
+    inline void render_queue_clear(render_queue& queue)
+    {
+        queue.m_items.clear();
+    }
+
+    inline void render_queue_add(render_queue& queue, draw_key key, index_type node)
+    {
+        queue.m_items.push_back(render_item{key, node});
+    }
+
+    // Sorts the items by key with a least significant digit radix sort, one byte per pass. The
+    // sort is stable, so items with the same key stay in the order they were added. The passes where
+    // all the keys have the same byte are skipped, which is common for the upper fields
+    inline void render_queue_sort(render_queue& queue)
+    {
+        constexpr unsigned int radix_bits = 8U;
+        constexpr std::size_t radix_size = std::size_t(1U) << radix_bits;
+        std::size_t count = queue.m_items.size();
+        if (count < render_queue_radix_min_items) {
+            std::stable_sort(queue.m_items.begin(), queue.m_items.end(), [](const render_item& a, const render_item& b) {
+                return a.m_key < b.m_key;
+            });
+            return;
+        }
+
+        // The counts of all the passes in a single read of the keys
+        std::uint32_t counts[64U / radix_bits][radix_size] = {};
+        for (auto& item : queue.m_items) {
+            for (unsigned int pass = 0U; pass < 64U / radix_bits; pass++) {
+                counts[pass][(item.m_key >> (pass * radix_bits)) & (radix_size - 1U)]++;
+            }
+        }
+
+        queue.m_scratch.resize(count);
+        for (unsigned int pass = 0U; pass < 64U / radix_bits; pass++) {
+            std::uint32_t* pass_counts = counts[pass];
+            if (std::find(pass_counts, pass_counts + radix_size, count) != pass_counts + radix_size) {
+                continue;
+            }
+
+            std::size_t offsets[radix_size];
+            std::size_t offset = 0U;
+            for (std::size_t digit = 0U; digit < radix_size; digit++) {
+                offsets[digit] = offset;
+                offset += pass_counts[digit];
+            }
+            for (auto& item : queue.m_items) {
+                queue.m_scratch[offsets[(item.m_key >> (pass * radix_bits)) & (radix_size - 1U)]++] = item;
+            }
+            queue.m_items.swap(queue.m_scratch);
+        }
+    }
+} // namespace rte
+
+#endif // RENDER_QUEUE_HPP
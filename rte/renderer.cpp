@@ -1,3 +1,6 @@
+#include "occlusion_culling.hpp"
+#include "frustum_culling.hpp"
+#include "render_queue.hpp"
 #include "sparse_list.hpp"
 #include "math_utils.hpp"
 #include "renderer.hpp"
@@ -6,19 +9,31 @@
 
 #include <algorithm>
 #include <sstream>
+#include <utility>
+#include <limits>
 #include <memory>
 #include <vector>
 
 namespace rte
 {
+    // Size of the depth buffer where the occluders are rasterized
+    constexpr index_type occlusion_width = 256U;
+    constexpr index_type occlusion_height = 128U;
+    // Occluders rasterized per frame, at most
+    constexpr index_type occluder_max_count = 8U;
+    // Meshes with more triangles cost more to rasterize than they save
+    constexpr index_type occluder_max_triangles = 4096U;
+    // Smallest radius of the bounding sphere of an occluder, relative to its distance to the camera
+    constexpr float occluder_min_size = 0.1f;
+    // Passes of the draw keys, in drawing order
+    constexpr index_type phong_pass = 0U;
+    constexpr index_type environment_mapping_pass = 1U;
+
     namespace
     {
         //---------------------------------------------------------------------------------------------
         // Internal declarations
         //---------------------------------------------------------------------------------------------
-        typedef std::vector<index_type> node_vector;
-
-        node_vector                 nodes_to_render;
         glm::vec3                   camera_position_worldspace;
         gl_driver                   driver;
         gl_driver_context           driver_context;
@@ -33,6 +48,14 @@ namespace rte
         program_vector              environment_mapping_programs;        // placeholder, only contains one element
         program_vector              skybox_programs;                     // placeholder, only contains one element
         bool                        gl_driver_set = false;
+        std::vector<index_type>     visible_nodes;                       // nodes of the render list inside the view frustum and not occluded
+        std::vector<occluder_mesh>  occluder_meshes;                     // copy of the meshes that can be occluders, by mesh index
+        occlusion_buffer            occlusion;
+        std::vector<occluder>       occluders;
+        std::vector<occluder_candidate> occluder_candidates;
+        render_queue                queue;                               // visible nodes sorted by pass and state
+        std::vector<glm::mat4>      instance_models;                     // model matrices of the current instanced draw
+        render_stats                stats;
 
         //---------------------------------------------------------------------------------------------
         // Helper functions
@@ -97,6 +120,10 @@ namespace rte
                     return mf.m_mesh == index(it);
                 });
                 auto& mf = *mesh_buffer_it;
+                if (occluder_meshes.size() <= index(it)) {
+                    occluder_meshes.resize(index(it) + 1U);
+                }
+                occluder_mesh_init(occluder_meshes[index(it)], mf.m_vertices, mf.m_indices, occluder_max_triangles);
 
                 auto position_buffer = make_3d_buffer(driver, mf.m_vertices);
                 auto uv_buffer = make_2d_buffer(driver, mf.m_texture_coords);
@@ -215,6 +242,7 @@ namespace rte
         initialize_textures(db);
         initialize_meshes(db);
         initialize_gl_cubemaps(db);
+        occlusion_buffer_init(occlusion, occlusion_width, occlusion_height);
     }
 
     void finalize_renderer()
@@ -228,6 +256,10 @@ namespace rte
         phong_programs.clear();
         environment_mapping_programs.clear();
         skybox_programs.clear();
+        occluder_meshes.clear();
+        occluders.clear();
+        render_queue_clear(queue);
+        instance_models.clear();
     }
 
     void get_view_properties(const view_database& db)
@@ -291,36 +323,96 @@ namespace rte
         driver_context.m_node.m_model = current_node.m_accum_transform;
     }
 
-    void render_phong_nodes(const view_database& db)
+    void cull_nodes(const view_database& db)
+    {
+        // Keep the nodes of the render list whose world box intersects the view frustum. The spatial
+        // index skips whole groups of nodes outside of it
+        frustum view_frustum = frustum_from_matrix(db.m_projection_transform * db.m_view_transform);
+        stats.m_visible_nodes = query_visible_nodes(view_frustum, visible_nodes, db);
+        stats.m_culled_nodes = db.m_render_list.size() - stats.m_visible_nodes;
+    }
+
+    void occlude_nodes(const view_database& db)
     {
-        // Render nodes that are neither reflective nor tranlucent with the phong model
-        driver_context.m_program = phong_programs[0].get();
-        for (auto node_index : nodes_to_render) {
+        // The opaque visible nodes that look biggest from the camera are the occluders. Their meshes
+        // are rasterized on the CPU, and the visible nodes hidden behind them are dropped
+        glm::vec3 camera_position = camera_position_worldspace_from_view_matrix(db.m_view_transform);
+        occluder_candidates.clear();
+        for (auto node_index : visible_nodes) {
             auto& current_node = db.m_nodes.at(node_index);
-            auto& current_material = db.m_materials.at(current_node.m_material);
-            if (current_node.m_material != npos
-                    && current_material.m_reflectivity == 0.0f
-                    && current_material.m_translucency == 0.0f) {
-                driver_context.m_node = gl_node_context();
-                get_node_properties(node_index, db);
-                driver.draw(driver_context);
+            auto& sphere = current_node.m_world_sphere;
+            if (current_node.m_mesh >= occluder_meshes.size()
+                    || occluder_meshes[current_node.m_mesh].m_indices.empty()
+                    || sphere.empty()
+                    || db.m_materials.at(current_node.m_material).m_translucency > 0.0f) {
+                continue;
             }
+            float size = occluder_screen_size(sphere, camera_position);
+            if (size >= occluder_min_size) {
+                occluder_candidates.push_back(occluder_candidate{size, &occluder_meshes[current_node.m_mesh], &current_node.m_accum_transform});
+            }
+        }
+        occlusion_select_occluders(occluder_candidates, occluder_max_count, occluders);
+        stats.m_occluders = occluders.size();
+        stats.m_occluded_nodes = 0U;
+        if (occluders.empty()) {
+            return;
         }
+
+        occlusion_buffer_clear(occlusion, db.m_projection_transform * db.m_view_transform);
+        occlusion_rasterize(occlusion, occluders, transform_best_kernel(), tree_default_worker_pool());
+        stats.m_occluded_nodes = occlusion_cull(occlusion, visible_nodes, [&db](index_type i) -> const aabb& { return db.m_nodes.at(i).m_world_bounds; });
+        stats.m_visible_nodes -= stats.m_occluded_nodes;
     }
 
-    void render_environment_mapping_nodes(const view_database& db)
+    void queue_nodes(const view_database& db)
     {
-        // Render reflective or translucent nodes
-        driver_context.m_program = environment_mapping_programs[0].get();
-        for (auto node_index : nodes_to_render) {
+        // Each visible node gets a key with its pass and the state it needs, so sorting the queue
+        // puts the draws that share state next to each other, front to back
+        glm::vec3 camera_position = camera_position_worldspace_from_view_matrix(db.m_view_transform);
+        render_queue_clear(queue);
+        for (auto node_index : visible_nodes) {
             auto& current_node = db.m_nodes.at(node_index);
             auto& current_material = db.m_materials.at(current_node.m_material);
-            if (current_material.m_reflectivity > 0.0f
-                    || current_material.m_translucency > 0.0f) {
-                driver_context.m_node = gl_node_context();
-                get_node_properties(node_index, db);
+            // Nodes that are neither reflective nor translucent are rendered with the phong model
+            bool reflective = current_material.m_reflectivity > 0.0f || current_material.m_translucency > 0.0f;
+            index_type pass = (reflective? environment_mapping_pass : phong_pass);
+            gl_program_id program = (reflective? environment_mapping_programs[0].get() : phong_programs[0].get());
+            float distance = glm::length(current_node.m_world_sphere.m_center - camera_position);
+            render_queue_add(queue, make_draw_key(pass, program, current_material.m_texture_id, current_node.m_mesh, current_node.m_material, distance), node_index);
+        }
+        render_queue_sort(queue);
+    }
+
+    void render_queued_nodes(const view_database& db)
+    {
+        // Nodes sharing a mesh and a material only differ by their model matrix, so each group of
+        // them is drawn with a single instanced draw. The keys may be equal for different meshes or
+        // materials if their indexes don't fit in the key, so the groups check them too
+        for (auto first = queue.m_items.begin(); first != queue.m_items.end();) {
+            auto& first_node = db.m_nodes.at(first->m_node);
+            auto last = std::find_if(first + 1, queue.m_items.end(), [&db, first, &first_node](const render_item& item) {
+                auto& current_node = db.m_nodes.at(item.m_node);
+                return draw_key_state(item.m_key) != draw_key_state(first->m_key)
+                    || current_node.m_mesh != first_node.m_mesh
+                    || current_node.m_material != first_node.m_material;
+            });
+            driver_context.m_program = (draw_key_pass(first->m_key) == environment_mapping_pass?
+                                        environment_mapping_programs[0].get() : phong_programs[0].get());
+            driver_context.m_node = gl_node_context();
+            get_node_properties(first->m_node, db);
+            if (last - first == 1) {
                 driver.draw(driver_context);
+            } else {
+                instance_models.clear();
+                for (auto it = first; it != last; ++it) {
+                    instance_models.push_back(db.m_nodes.at(it->m_node).m_accum_transform);
+                }
+                driver.draw_instanced(driver_context, instance_models);
+                stats.m_instanced_nodes += instance_models.size();
             }
+            stats.m_draw_calls++;
+            first = last;
         }
     }
 
@@ -332,25 +424,33 @@ namespace rte
             driver_context.m_node = gl_node_context();
             // Change depth function so depth test passes when values are equal to depth buffer's content
             driver_context.m_depth_func = depth_func::lequal;
-            // Remove translation from the view matrix
-            driver_context.m_view = glm::mat4(glm::mat3(driver_context.m_view));
             driver_context.m_node.m_position_buffer = gl_cubemap_position_buffers.at(0).get();
             driver_context.m_node.m_index_buffer = gl_cubemap_index_buffers.at(0).get();
             driver_context.m_node.m_num_indices = 36U;
             driver.draw(driver_context);
+            stats.m_draw_calls++;
         }
     }
 
     void render(const view_database& db)
     {
         driver.initialize_frame();
-        // Convert tree into list and filter out non-enabled nodes
-        nodes_to_render.clear();
-        get_descendant_nodes(db.m_root_node, nodes_to_render, db);
+        // db.m_render_list already holds the enabled nodes with a mesh and a material
         driver_context = gl_driver_context();
         get_view_properties(db);
-        render_phong_nodes(db);
-        render_environment_mapping_nodes(db);
+        driver.set_frame_data(driver_context);
+        stats.m_draw_calls = 0U;
+        stats.m_instanced_nodes = 0U;
+        cull_nodes(db);
+        occlude_nodes(db);
+        queue_nodes(db);
+        render_queued_nodes(db);
         render_skybox();
+        stats.m_state_changes = driver.get_frame_state_changes();
+    }
+
+    const render_stats& get_render_stats()
+    {
+        return stats;
     }
 } // namespace rte
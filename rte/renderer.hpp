@@ -6,6 +6,27 @@
 
 namespace rte
 {
+    // Counts of the last frame rendered
+    struct render_stats
+    {
+        render_stats() :
+            m_visible_nodes(0U),
+            m_culled_nodes(0U),
+            m_occluded_nodes(0U),
+            m_occluders(0U),
+            m_draw_calls(0U),
+            m_instanced_nodes(0U),
+            m_state_changes(0U) {}
+
+        index_type m_visible_nodes;     //!< nodes of the render list drawn
+        index_type m_culled_nodes;      //!< nodes of the render list outside the view frustum, skipped
+        index_type m_occluded_nodes;    //!< nodes of the render list inside the view frustum but hidden by the occluders, skipped
+        index_type m_occluders;         //!< nodes whose meshes were rasterized to find the hidden ones
+        index_type m_draw_calls;        //!< draw calls submitted to the driver
+        index_type m_instanced_nodes;   //!< nodes drawn with instanced draws, several per draw call
+        index_type m_state_changes;     //!< state set by the driver for the draw calls, the rest was already set
+    };
+
     //-----------------------------------------------------------------------------------------------
     // Public functions
     //-----------------------------------------------------------------------------------------------
@@ -13,6 +34,7 @@ namespace rte
     void initialize_renderer(view_database& db);
     void finalize_renderer();
     void render(const view_database& db);
+    const render_stats& get_render_stats();
 } // namespace rte
 
 #endif // RENDERER_HPP
@@ -1,6 +1,8 @@
+#include "concurrent_append.hpp"
 #include "glm/gtc/type_ptr.hpp"
 #include "assimp/postprocess.h"
 #include "resource_loader.hpp"
+#include "parallel_tree.hpp"
 #include "assimp/cimport.h"
 #include "sparse_list.hpp"
 #include "assimp/scene.h"
@@ -13,6 +15,8 @@
 #include <iomanip>
 #include <cstring>
 #include <sstream>
+#include <utility>
+#include <atomic>
 #include <vector>
 #include <map>
 
@@ -72,62 +76,90 @@ namespace rte
                 mat.m_specular_color = color_specular;
                 mat.m_smoothness = smoothness;
                 mat.m_texture_path = texture_path;
-                material_indices[i] = list_insert(db.m_materials, 0, mat);
+                material_indices[i] = list_insert(db.m_materials, 0, std::move(mat));
             }
         }
 
         void create_meshes(const struct aiScene* scene, view_database& db)
         {
-            for (std::size_t i_mesh = 0; i_mesh < scene->mNumMeshes; i_mesh++) {
-                aiMesh* ai_mesh = scene->mMeshes[i_mesh];
-
-                if (material_indices.find(ai_mesh->mMaterialIndex) == material_indices.end()) continue;
-                auto new_mesh_index = list_insert(db.m_meshes, 0, mesh());
-                auto& new_mesh = db.m_meshes.at(new_mesh_index);
-
-                mesh_indices[i_mesh] = new_mesh_index;
-
-                auto new_mesh_buffer_index = list_insert(db.m_mesh_buffers, 0, mesh_buffer());
-                auto& new_mesh_buffer = db.m_mesh_buffers.at(new_mesh_buffer_index);
-                new_mesh_buffer.m_mesh = new_mesh_index;
-
-                if (ai_mesh->HasPositions()) {
-                    for (std::size_t i_vertices = 0; i_vertices < ai_mesh->mNumVertices; i_vertices++) {
-                        aiVector3D vertex = ai_mesh->mVertices[i_vertices];
-                        new_mesh_buffer.m_vertices.push_back(glm::vec3(vertex.x, vertex.y, vertex.z));
+            // Meshes are converted by all the threads of the pool at once, see load_meshes() in
+            // database_loader.cpp. material_indices is only read meanwhile
+            tree_worker_pool& pool = tree_default_worker_pool();
+            sparse_concurrent_append<mesh_database> mesh_batch(db.m_meshes, scene->mNumMeshes, pool.get_concurrency());
+            sparse_concurrent_append<mesh_buffer_database> mesh_buffer_batch(db.m_mesh_buffers, scene->mNumMeshes, pool.get_concurrency());
+            std::vector<index_type> new_mesh_indexes(scene->mNumMeshes, npos);
+            std::atomic<unsigned int> next_local(0U);
+            std::atomic<std::size_t> next_mesh(0U);
+            pool.run([&]() {
+                unsigned int local_index = next_local++;
+                auto& meshes = mesh_batch.get_local(local_index);
+                auto& mesh_buffers = mesh_buffer_batch.get_local(local_index);
+                for (std::size_t i_mesh = next_mesh++; i_mesh < scene->mNumMeshes; i_mesh = next_mesh++) {
+                    aiMesh* ai_mesh = scene->mMeshes[i_mesh];
+
+                    if (material_indices.find(ai_mesh->mMaterialIndex) == material_indices.end()) continue;
+
+                    // Fill the buffers before inserting them, so that the vertex data is moved into the
+                    // database instead of copied
+                    mesh_buffer new_mesh_buffer;
+
+                    if (ai_mesh->HasPositions()) {
+                        new_mesh_buffer.m_vertices.reserve(ai_mesh->mNumVertices);
+                        for (std::size_t i_vertices = 0; i_vertices < ai_mesh->mNumVertices; i_vertices++) {
+                            aiVector3D vertex = ai_mesh->mVertices[i_vertices];
+                            new_mesh_buffer.m_vertices.push_back(glm::vec3(vertex.x, vertex.y, vertex.z));
+                        }
                     }
-                }
 
-                if (ai_mesh->HasTextureCoords(0)) {
-                    for (std::size_t i_vertices = 0; i_vertices < ai_mesh->mNumVertices; i_vertices++) {
-                        aiVector3D tex_coords = ai_mesh->mTextureCoords[0][i_vertices];
-                        new_mesh_buffer.m_texture_coords.push_back(glm::vec2(tex_coords.x, tex_coords.y));
+                    if (ai_mesh->HasTextureCoords(0)) {
+                        new_mesh_buffer.m_texture_coords.reserve(ai_mesh->mNumVertices);
+                        for (std::size_t i_vertices = 0; i_vertices < ai_mesh->mNumVertices; i_vertices++) {
+                            aiVector3D tex_coords = ai_mesh->mTextureCoords[0][i_vertices];
+                            new_mesh_buffer.m_texture_coords.push_back(glm::vec2(tex_coords.x, tex_coords.y));
+                        }
                     }
-                }
 
-                if (ai_mesh->HasNormals()) {
-                    for (std::size_t i_normals = 0; i_normals < ai_mesh->mNumVertices; i_normals++) {
-                        aiVector3D normal = ai_mesh->mNormals[i_normals];
-                        new_mesh_buffer.m_normals.push_back(glm::vec3(normal.x, normal.y, normal.z));
+                    if (ai_mesh->HasNormals()) {
+                        new_mesh_buffer.m_normals.reserve(ai_mesh->mNumVertices);
+                        for (std::size_t i_normals = 0; i_normals < ai_mesh->mNumVertices; i_normals++) {
+                            aiVector3D normal = ai_mesh->mNormals[i_normals];
+                            new_mesh_buffer.m_normals.push_back(glm::vec3(normal.x, normal.y, normal.z));
+                        }
                     }
-                }
 
-                if (ai_mesh->HasFaces()) {
-                    for (std::size_t i_faces = 0; i_faces < ai_mesh->mNumFaces; i_faces++) {
-                        aiFace face = ai_mesh->mFaces[i_faces];
-                        for (std::size_t i_indices = 0; i_indices < face.mNumIndices; i_indices++) {
-                            new_mesh_buffer.m_indices.push_back(face.mIndices[i_indices]);
+                    if (ai_mesh->HasFaces()) {
+                        for (std::size_t i_faces = 0; i_faces < ai_mesh->mNumFaces; i_faces++) {
+                            aiFace face = ai_mesh->mFaces[i_faces];
+                            for (std::size_t i_indices = 0; i_indices < face.mNumIndices; i_indices++) {
+                                new_mesh_buffer.m_indices.push_back(face.mIndices[i_indices]);
+                            }
                         }
                     }
+
+                    mesh new_mesh;
+                    new_mesh.m_num_vertices = new_mesh_buffer.m_indices.size();
+                    new_mesh.m_bounds = aabb_from_points(new_mesh_buffer.m_vertices);
+                    new_mesh.m_bounding_sphere = sphere_from_points(new_mesh_buffer.m_vertices);
+                    new_mesh_indexes[i_mesh] = meshes.insert(std::move(new_mesh), 0, i_mesh);
+                    new_mesh_buffer.m_mesh = new_mesh_indexes[i_mesh];
+                    mesh_buffers.insert(std::move(new_mesh_buffer), 0, i_mesh);
                 }
+            });
+            mesh_batch.finish();
+            mesh_buffer_batch.finish();
 
-                new_mesh.m_num_vertices = new_mesh_buffer.m_indices.size();
+            for (std::size_t i_mesh = 0; i_mesh < scene->mNumMeshes; i_mesh++) {
+                if (new_mesh_indexes[i_mesh] != npos) {
+                    mesh_indices[i_mesh] = new_mesh_indexes[i_mesh];
+                }
             }
         }
 
         void create_resources(const struct aiScene* scene, index_type& root_out, view_database& db)
         {
-            resource_database new_resource_db;
+            // The temporary tree lives in an arena, so that it is freed at once on return
+            monotonic_arena arena;
+            resource_database new_resource_db{resource_database::allocator_type(&arena)};
             index_type new_resource_index = tree_insert(new_resource_db, resource());
             struct context{ index_type added_resource_index; aiNode* ai_node; };
             std::vector<context> pending_nodes;
@@ -150,10 +182,16 @@ namespace rte
                 // Fill the resource local transform. The aiMatrix4x4 type uses a contiguous layout
                 // for its elements, so we can just use its representation as if it were a float
                 // array. But we need to transpose it first, because assimp uses a row-major layout
-                // and we need column-major.
+                // and we need column-major. Resources keep it as translation, rotation and scale, so
+                // a matrix with shear changes the geometry: report it instead of dropping it silently
                 aiMatrix4x4 local_transform = current.ai_node->mTransformation;
                 aiTransposeMatrix4(&local_transform);
-                added_resource.m_local_transform = glm::make_mat4((float *) &local_transform);
+                glm::mat4 local_matrix = glm::make_mat4((float *) &local_transform);
+                if (!trs_splits_exactly(local_matrix)) {
+                    log(LOG_LEVEL_ERROR, std::string("resource_loader: the transform of node ") + current.ai_node->mName.C_Str() +
+                                         " has shear or a projective part, which is dropped");
+                }
+                added_resource.m_local_transform = trs_from_matrix(local_matrix);
 
                 // Assimp creates a structure with several meshes by node, and each mesh has a
                 // material. In practice though most models have one mesh by node. Our model has one
@@ -166,19 +204,17 @@ namespace rte
                 index_type last_parent_index = current.added_resource_index;
                 unsigned int ai_mesh = 1;
                 while (ai_mesh < current.ai_node->mNumMeshes) {
-                    resource res;
-                    last_parent_index = tree_insert(new_resource_db, res, last_parent_index);
+                    last_parent_index = tree_emplace(new_resource_db, last_parent_index);
                     auto& last_parent = new_resource_db.at(last_parent_index);
                     last_parent.m_mesh = mesh_indices.at(current.ai_node->mMeshes[ai_mesh]);
                     last_parent.m_material = material_indices.at(scene->mMeshes[current.ai_node->mMeshes[ai_mesh]]->mMaterialIndex);
-                    last_parent.m_local_transform = glm::mat4(1.0f);
+                    last_parent.m_local_transform = trs_transform();
                     ai_mesh++;
                 }
 
                 // Push the children to be processed next
                 for (unsigned int i = 0; i < current.ai_node->mNumChildren; ++i) {
-                    resource res;
-                    index_type child_index = tree_insert(new_resource_db, res, last_parent_index);
+                    index_type child_index = tree_emplace(new_resource_db, last_parent_index);
                     pending_nodes.push_back({child_index, current.ai_node->mChildren[i]});
                 }
             }
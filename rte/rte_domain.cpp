@@ -1,10 +1,13 @@
 #include "serialization_utils.hpp"
 #include "glm/gtc/type_ptr.hpp"
+#include "transform_batch.hpp"
 #include "sparse_list.hpp"
 #include "rte_domain.hpp"
 #include "glm/glm.hpp"
 #include "log.hpp"
 
+#include <stdexcept>
+#include <algorithm>
 #include <iomanip>
 #include <sstream>
 #include <string>
@@ -12,6 +15,9 @@
 
 namespace rte
 {
+    // Minimum number of nodes of a subtree to process it in its own task when propagating transforms
+    constexpr index_type transform_grain = 4096U;
+
     namespace
     {
         std::string format_mesh_id(index_type m)
@@ -52,13 +58,13 @@ namespace rte
                 oss << ", " << a[2];
             }
             oss << ", ...//... , ";
-            if (num_elems - 3 >= 0) {
+            if (num_elems >= 3) {
                 oss << ", " << a[num_elems - 3];
             }
-            if (num_elems - 2 >= 0) {
+            if (num_elems >= 2) {
                 oss << ", " << a[num_elems - 2];
             }
-            if (num_elems - 1 >= 0) {
+            if (num_elems >= 1) {
                 oss << ", " << a[num_elems - 1];
             }
             oss << " ]";
@@ -84,6 +90,11 @@ namespace rte
             oss.str("");
             oss << "        user id: " << format_user_id(m.m_user_id);
             log(LOG_LEVEL_DEBUG, oss.str().c_str());
+
+            oss.str("");
+            oss << "        bounds: " << m.m_bounds.m_min << " - " << m.m_bounds.m_max;
+            oss << ", sphere: " << m.m_bounding_sphere.m_center << " r " << m.m_bounding_sphere.m_radius;
+            log(LOG_LEVEL_DEBUG, oss.str().c_str());
     
             oss.str("");
             oss << "        vertex base: ";
@@ -117,23 +128,17 @@ namespace rte
         void log_resource(index_type root_index, const resource_database& db)
         {
             // Iterate the resource tree with a depth-first search printing resources
-            struct context{ index_type resource_index; unsigned int indentation; };
-            std::vector<context> pending_nodes;
-            pending_nodes.push_back({root_index, 1U});
-            while (!pending_nodes.empty()) {
-                auto current = pending_nodes.back();
-                pending_nodes.pop_back();
-    
-                auto& res = db.at(current.resource_index);
+            for (auto it = tree_preorder_begin(db, root_index); it != tree_preorder_end(db, root_index); ++it) {
+                auto& res = *it;
     
                 std::ostringstream oss;
                 oss << std::setprecision(2) << std::fixed;
-                for (unsigned int i = 0; i < current.indentation; i++) {
+                for (unsigned int i = 0; i < it.get_depth() + 1U; i++) {
                     oss << "    ";
                 }
     
                 oss << "[ ";
-                oss << "index: " << current.resource_index;
+                oss << "index: " << index(it);
                 oss << ", user id: " << format_user_id(res.m_user_id);
                 oss << ", name: " << res.m_name;
                 oss << ", mesh: " << format_mesh_id(res.m_mesh);
@@ -141,23 +146,57 @@ namespace rte
                 oss << ", local transform: " << res.m_local_transform;
                 oss << " ]";
                 log(LOG_LEVEL_DEBUG, oss.str().c_str());
+            }
+        }
 
-                // We are using a stack to process depth-first, so in order for the children to be
-                // processed in the order in which they appear we must push them in reverse order,
-                // otherwise the last child will be processed first    
-                for (auto it = tree_begin(db, current.resource_index); it != tree_end(db, current.resource_index); ++it) {
-                    pending_nodes.push_back({index(it), current.indentation + 1});
-                }
+        void render_list_add(index_type node_index, view_database& db)
+        {
+            const node_database& nodes = db.m_nodes;
+            if (nodes.at(node_index).m_render_slot == npos) {
+                db.m_render_list.push_back(node_index);
+                db.m_nodes.at(node_index).m_render_slot = db.m_render_list.size() - 1U;
+                bvh_insert(db.m_spatial_index, node_index);
             }
         }
 
-        struct node_context{ index_type node_index; };
-        typedef std::vector<node_context> node_context_vector;
+        // The last entry of the list takes the place of the removed one. The node is only written
+        // if it has an entry, so that its chunk is not cloned otherwise
+        void render_list_remove(index_type node_index, view_database& db)
+        {
+            const node_database& nodes = db.m_nodes;
+            if (nodes.at(node_index).m_render_slot != npos) {
+                auto& n = db.m_nodes.at(node_index);
+                index_type last_index = db.m_render_list.back();
+                db.m_render_list[n.m_render_slot] = last_index;
+                db.m_nodes.at(last_index).m_render_slot = n.m_render_slot;
+                db.m_render_list.pop_back();
+                n.m_render_slot = npos;
+                bvh_remove(db.m_spatial_index, node_index);
+            }
+        }
 
-        //---------------------------------------------------------------------------------------------
-        // Internal data structures
-        //---------------------------------------------------------------------------------------------    
-        node_context_vector      pending_nodes;   //!< helper structure used in get_descendant_nodes
+        // Returns true if the node and all its ancestors are enabled
+        bool is_node_enabled(index_type node_index, const view_database& db)
+        {
+            for (index_type i = node_index; i != npos; i = db.m_nodes.at(i).m_parent) {
+                if (!db.m_nodes.at(i).m_enabled) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        void update_render_list_entry(index_type node_index, bool enabled, view_database& db)
+        {
+            const node_database& nodes = db.m_nodes;
+            auto& n = nodes.at(node_index);
+            if (enabled && n.m_mesh != npos && n.m_material != npos) {
+                render_list_add(node_index, db);
+            } else {
+                render_list_remove(node_index, db);
+            }
+        }
     } // Anonymous namespace
 
     //-----------------------------------------------------------------------------------------------
@@ -236,37 +275,25 @@ namespace rte
     void log_node(index_type root, const node_database& db)
     {
         // Iterate the node tree with a depth-first search printing nodes
-        struct context{ index_type node_index; unsigned int indentation; };
-        std::vector<context> pending_nodes;
-        pending_nodes.push_back({root, 3U});
-        while (!pending_nodes.empty()) {
-            auto current = pending_nodes.back();
-            pending_nodes.pop_back();
-
-            auto& n = db.at(current.node_index);
+        for (auto it = tree_preorder_begin(db, root); it != tree_preorder_end(db, root); ++it) {
+            auto& n = *it;
+            auto& n_metadata = db.cold_at(index(it));
 
             std::ostringstream oss;
             oss << std::setprecision(2) << std::fixed;
-            for (unsigned int i = 0; i < current.indentation; i++) {
+            for (unsigned int i = 0; i < it.get_depth() + 3U; i++) {
                 oss << "    ";
             }
 
             oss << "[ ";
-            oss << "index: " << current.node_index;
-            oss << ", user id: " << format_user_id(n.m_user_id);
-            oss << ", name: " << n.m_name;
+            oss << "index: " << index(it);
+            oss << ", user id: " << format_user_id(n_metadata.m_user_id);
+            oss << ", name: " << n_metadata.m_name;
             oss << ", mesh: " << format_mesh_id(n.m_mesh);
             oss << ", material: " << format_material_id(n.m_material);
             oss << ", local transform: " << n.m_local_transform;
             oss << " ]";
             log(LOG_LEVEL_DEBUG, oss.str().c_str());
-
-            // We are using a stack to process depth-first, so in order for the children to be
-            // processed in the order in which they appear we must push them in reverse order,
-            // otherwise the last child will be processed first
-            for (auto it = tree_begin(db, current.node_index); it != tree_end(db, current.node_index); ++it) {
-                pending_nodes.push_back({index(it), current.indentation + 1});
-            }
         }
     }
 
@@ -341,58 +368,276 @@ namespace rte
     {
         if (root_resource_index == npos) {
             node_index_out = tree_insert(db.m_nodes, node(), parent_index);
+            mark_transform_dirty(node_index_out, db);
+            update_render_list(node_index_out, db);
             return;
         }
 
-        node_database tmp_db;
+        // The temporary tree lives in an arena, so that it is freed at once on return
+        monotonic_arena arena;
+        node_database tmp_db{node_database::allocator_type(&arena)};
         tree_init(tmp_db);
-        struct context{ index_type resource_index; index_type parent_node; };
-        std::vector<context> pending_nodes;
-        pending_nodes.push_back({root_resource_index, npos});
-        while (!pending_nodes.empty()) {
-            auto current = pending_nodes.back();
-            pending_nodes.pop_back();
-
-            index_type new_node_index = tree_insert(tmp_db, node(), current.parent_node);
+        std::vector<index_type> new_ancestors; // last node created at each depth
+        const resource_database& resources = db.m_resources;
+        for (auto it = tree_preorder_begin(resources, root_resource_index); it != tree_preorder_end(resources, root_resource_index); ++it) {
+            index_type depth = it.get_depth();
+            index_type new_node_index = tree_insert(tmp_db, node(), depth > 0U? new_ancestors[depth - 1U] : npos);
+            new_ancestors.resize(depth + 1U);
+            new_ancestors[depth] = new_node_index;
+
             auto& new_node = tmp_db.at(new_node_index);
-            auto& res = db.m_resources.at(current.resource_index);
-            new_node.m_local_transform = res.m_local_transform;
-            new_node.m_mesh = res.m_mesh;
-            new_node.m_material = res.m_material;
+            new_node.m_local_transform = it->m_local_transform;
+            new_node.m_mesh = it->m_mesh;
+            new_node.m_material = it->m_material;
+        }
+
+        node_index_out = tree_insert(tmp_db, 0, db.m_nodes, parent_index);
+        mark_transform_dirty(node_index_out, db);
+        update_render_list(node_index_out, db);
+    }
+
+    void mark_transform_dirty(index_type node_index, view_database& db)
+    {
+        auto& n = db.m_nodes.at(node_index);
+        if (!n.m_transform_dirty) {
+            db.m_dirty_transforms.push_back(node_index);
+            n.m_transform_dirty = true;
+        }
+    }
+
+    void set_local_transform(index_type node_index, const trs_transform& local_transform, view_database& db)
+    {
+        db.m_nodes.at(node_index).m_local_transform = local_transform;
+        mark_transform_dirty(node_index, db);
+    }
+
+    void set_local_transform(index_type node_index, const glm::mat4& local_transform, view_database& db)
+    {
+        if (!trs_splits_exactly(local_transform)) {
+            throw std::invalid_argument("set_local_transform: error, the matrix has shear or a projective part");
+        }
+
+        set_local_transform(node_index, trs_from_matrix(local_transform), db);
+    }
+
+    void set_local_translation(index_type node_index, const glm::vec3& translation, view_database& db)
+    {
+        db.m_nodes.at(node_index).m_local_transform.m_translation = translation;
+        mark_transform_dirty(node_index, db);
+    }
+
+    void set_local_rotation(index_type node_index, const glm::quat& rotation, view_database& db)
+    {
+        db.m_nodes.at(node_index).m_local_transform.m_rotation = rotation;
+        mark_transform_dirty(node_index, db);
+    }
+
+    void set_local_scale(index_type node_index, const glm::vec3& scale, view_database& db)
+    {
+        db.m_nodes.at(node_index).m_local_transform.m_scale = scale;
+        mark_transform_dirty(node_index, db);
+    }
+
+    index_type update_accum_transforms(view_database& db)
+    {
+        // Parents are always processed before their children, so the parent's transform is up to
+        // date when a node is visited. Large subtrees are split across threads, and the products use
+        // the fastest kernel the CPU supports.
+        // Every recomputed node leaves the queue, so a subtree queued inside another one that has
+        // already been recomputed is skipped. In the other order it is computed twice, which is
+        // still correct. After compact_database() indexes follow the tree order, so sorting the
+        // queue makes the second case rare
+        static thread_local tree_parallel_context context;
+        auto& nodes = db.m_nodes;
+        const auto& const_nodes = db.m_nodes;
+        const auto& meshes = db.m_meshes;
+        auto update_bounds = [&nodes, &meshes](index_type i) {
+            auto& n = nodes.at(i);
+            if (n.m_mesh != npos) {
+                auto& m = meshes.at(n.m_mesh);
+                n.m_world_bounds = transform_aabb(m.m_bounds, n.m_accum_transform);
+                n.m_world_sphere = transform_sphere(m.m_bounding_sphere, n.m_accum_transform);
+            } else {
+                n.m_world_bounds = aabb();
+                n.m_world_sphere = bounding_sphere();
+            }
+        };
+        auto& dirty = db.m_dirty_transforms;
+        std::sort(dirty.begin(), dirty.end());
+        index_type recomputed = 0U;
+        for (auto root : dirty) {
+            // Erased nodes, and reused slots whose new node has not been queued, are skipped
+            if (!nodes.used(root) || !nodes.at(root).m_transform_dirty) {
+                continue;
+            }
 
-            for (auto it = tree_begin(db.m_resources, current.resource_index); it != tree_end(db.m_resources, current.resource_index); ++it) {
-                pending_nodes.push_back({index(it), new_node_index});
+            // With cow_chunked_storage the threads must not clone chunks, so the chunks of the
+            // subtree that are shared with a copy of the database are cloned here
+            for (auto it = tree_preorder_begin(const_nodes, root); it != tree_preorder_end(const_nodes, root); ++it) {
+                nodes.make_writable(index(it));
+            }
+            recomputed += tree_accum_transforms(nodes, root, transform_best_kernel(), transform_grain, tree_default_worker_pool(), context, update_bounds);
+            // The nodes of the subtree that are in the spatial index have moved. Not needed if the
+            // index is going to be built again
+            if (!bvh_needs_rebuild(db.m_spatial_index)) {
+                for (auto it = tree_preorder_begin(const_nodes, root); it != tree_preorder_end(const_nodes, root); ++it) {
+                    if (it->m_render_slot != npos) {
+                        bvh_mark_item(db.m_spatial_index, index(it));
+                    }
+                }
             }
         }
+        dirty.clear();
+        db.m_recomputed_transforms = recomputed;
+        update_spatial_index(db);
 
-        node_index_out = tree_insert(tmp_db, 0, db.m_nodes, parent_index);
+        return recomputed;
     }
 
-    void get_descendant_nodes(index_type root_index,
-                        std::vector<index_type>& nodes_out,
-                        const view_database& db)
+    void update_spatial_index(view_database& db)
     {
-        pending_nodes.clear();
-        pending_nodes.push_back({root_index});
+        auto world_bounds = [&db](index_type i) -> const aabb& { return db.m_nodes.at(i).m_world_bounds; };
+        if (bvh_needs_rebuild(db.m_spatial_index)) {
+            bvh_build(db.m_spatial_index, db.m_render_list, world_bounds);
+        } else {
+            bvh_refit(db.m_spatial_index, world_bounds);
+        }
+    }
 
-        while (!pending_nodes.empty()) {
-            auto current = pending_nodes.back();
-            pending_nodes.pop_back();
+    index_type query_visible_nodes(const frustum& f, std::vector<index_type>& nodes_out, const view_database& db)
+    {
+        return bvh_query(db.m_spatial_index, transform_best_kernel(), f, [&db](index_type i) -> const aabb& { return db.m_nodes.at(i).m_world_bounds; }, nodes_out);
+    }
 
-            auto& current_node = db.m_nodes.at(current.node_index);
+    void update_render_list(index_type node_index, view_database& db)
+    {
+        // disabled_depth is the depth of the shallowest disabled node on the path to the current one,
+        // or npos if there is none. The walk is in pre-order, so a node at that depth or above is
+        // out of its subtree. Disabled subtrees are still walked, to remove the entries of their nodes
+        // The walk only reads the nodes, so that it doesn't clone the chunks of the subtree whose
+        // entries don't change
+        const node_database& nodes = db.m_nodes;
+        auto& root = nodes.at(node_index);
+        bool parent_enabled = (root.m_parent == npos || is_node_enabled(root.m_parent, db));
+        index_type disabled_depth = npos;
+        for (auto it = tree_preorder_begin(nodes, node_index); it != tree_preorder_end(nodes, node_index); ++it) {
+            index_type depth = it.get_depth();
+            if (depth <= disabled_depth) {
+                disabled_depth = (it->m_enabled? npos : depth);
+            }
+            update_render_list_entry(index(it), parent_enabled && disabled_depth == npos, db);
+        }
+    }
+
+    void rebuild_render_list(view_database& db)
+    {
+        // The nodes are added back to the spatial index as pending, and the next
+        // update_spatial_index() builds it with their world bounds
+        db.m_render_list.clear();
+        bvh_clear(db.m_spatial_index);
+        db.m_nodes.for_each_used([&db](index_type i) { db.m_nodes.at(i).m_render_slot = npos; });
+        if (db.m_root_node != npos) {
+            update_render_list(db.m_root_node, db);
+        }
+    }
 
+    void set_node_enabled(index_type node_index, bool enabled, view_database& db)
+    {
+        auto& n = db.m_nodes.at(node_index);
+        if (n.m_enabled != enabled) {
+            n.m_enabled = enabled;
+            update_render_list(node_index, db);
+        }
+    }
+
+    void set_node_mesh(index_type node_index, index_type mesh_index, view_database& db)
+    {
+        db.m_nodes.at(node_index).m_mesh = mesh_index;
+        update_render_list_entry(node_index, is_node_enabled(node_index, db), db);
+        // The world bounds are updated along with the transform
+        mark_transform_dirty(node_index, db);
+    }
+
+    void set_node_material(index_type node_index, index_type material_index, view_database& db)
+    {
+        db.m_nodes.at(node_index).m_material = material_index;
+        update_render_list_entry(node_index, is_node_enabled(node_index, db), db);
+    }
+
+    void erase_node_tree(index_type node_index, view_database& db)
+    {
+        for (auto it = tree_preorder_begin(db.m_nodes, node_index); it != tree_preorder_end(db.m_nodes, node_index); ++it) {
+            render_list_remove(index(it), db);
+        }
+        tree_erase(db.m_nodes, node_index);
+        if (node_index == db.m_root_node) {
+            db.m_root_node = npos;
+        }
+    }
+
+    void get_descendant_nodes(index_type root_index,
+                        std::vector<index_type>& nodes_out,
+                        const view_database& db)
+    {
+        for (auto it = tree_preorder_begin(db.m_nodes, root_index); it != tree_preorder_end(db.m_nodes, root_index); ++it) {
             // If a node is not enabled, all its subtree is pruned
-            if (current_node.m_enabled) {
-                // If a node doesn't have any meshes or materials it is ignored, but its children are processed
-                if (current_node.m_mesh != npos
-                        && current_node.m_material != npos) {
-                    nodes_out.push_back(current.node_index);
-                }
-    
-                for (auto it = tree_rbegin(db.m_nodes, current.node_index); it != tree_rend(db.m_nodes, current.node_index); ++it) {
-                    pending_nodes.push_back({index(it)});
-                }            
+            if (!it->m_enabled) {
+                it.skip_children();
+                continue;
+            }
+
+            // If a node doesn't have any meshes or materials it is ignored, but its children are processed
+            if (it->m_mesh != npos
+                    && it->m_material != npos) {
+                nodes_out.push_back(index(it));
             }
         }
     }
+
+    void compact_database(view_database& db)
+    {
+        auto material_remap = tree_compact(db.m_materials);
+        auto mesh_remap = tree_compact(db.m_meshes);
+        tree_compact(db.m_mesh_buffers);
+        tree_compact(db.m_resources);
+        auto cubemap_remap = tree_compact(db.m_cubemaps);
+        auto node_remap = tree_compact(db.m_nodes);
+        tree_compact(db.m_point_lights);
+
+        // Translate the indexes that point into other tables
+        // Tables have no holes after compaction, so they can be walked by index
+        for (index_type i = 0; i < db.m_mesh_buffers.size(); i++) {
+            auto& buffer = db.m_mesh_buffers.at(i);
+            buffer.m_mesh = tree_remap_index(mesh_remap, buffer.m_mesh);
+        }
+        for (index_type i = 0; i < db.m_resources.size(); i++) {
+            auto& res = db.m_resources.at(i);
+            res.m_mesh = tree_remap_index(mesh_remap, res.m_mesh);
+            res.m_material = tree_remap_index(material_remap, res.m_material);
+        }
+        for (index_type i = 0; i < db.m_nodes.size(); i++) {
+            auto& n = db.m_nodes.at(i);
+            n.m_mesh = tree_remap_index(mesh_remap, n.m_mesh);
+            n.m_material = tree_remap_index(material_remap, n.m_material);
+        }
+        db.m_root_node = tree_remap_index(node_remap, db.m_root_node);
+        // Queued nodes that were erased are dropped
+        auto& dirty = db.m_dirty_transforms;
+        for (auto& i : dirty) {
+            i = tree_remap_index(node_remap, i);
+        }
+        dirty.erase(std::remove(dirty.begin(), dirty.end(), npos), dirty.end());
+        // Nodes in the render list are all in use, and keep their slots
+        for (auto& i : db.m_render_list) {
+            i = tree_remap_index(node_remap, i);
+        }
+        // The world bounds may not have been computed yet (right after loading, nothing has been
+        // propagated), so the nodes go back to the spatial index as pending, like in
+        // rebuild_render_list(), and update_spatial_index() builds it once they are up to date
+        bvh_clear(db.m_spatial_index);
+        for (auto i : db.m_render_list) {
+            bvh_insert(db.m_spatial_index, i);
+        }
+        db.m_skybox = tree_remap_index(cubemap_remap, db.m_skybox);
+    }
 } // namespace rte
@@ -1,11 +1,18 @@
 #ifndef RTE_DOMAIN_HPP
 #define RTE_DOMAIN_HPP
 
+#include "split_sparse_vector.hpp"
+#include "trs_transform.hpp"
+#include "cow_storage.hpp"
 #include "sparse_tree.hpp"
 #include "rte_common.hpp"
 #include "glm/glm.hpp"
+#include "bounds.hpp"
+#include "arena.hpp"
+#include "bvh.hpp"
 
 #include <memory>
+#include <vector>
 
 namespace rte
 {
@@ -35,7 +42,7 @@ namespace rte
         std::string        m_name;
     };
 
-    typedef sparse_vector<material> material_database;
+    typedef sparse_vector<material, arena_allocator<material>, cow_chunked_storage> material_database;
 
     struct mesh : public sparse_node
     {
@@ -45,17 +52,22 @@ namespace rte
             m_normal_buffer_id(0U),
             m_index_buffer_id(0U),
             m_num_vertices(0U),
+            m_bounds(),
+            m_bounding_sphere(),
             m_user_id(nuser_id),
             m_name() {}
     
         mesh(const mesh& m) = default;
 
         mesh(mesh&& m) :
+            sparse_node(m),
             m_position_buffer_id(std::move(m.m_position_buffer_id)),
             m_uv_buffer_id(std::move(m.m_uv_buffer_id)),
             m_normal_buffer_id(std::move(m.m_normal_buffer_id)),
             m_index_buffer_id(std::move(m.m_index_buffer_id)),
             m_num_vertices(std::move(m.m_num_vertices)),
+            m_bounds(std::move(m.m_bounds)),
+            m_bounding_sphere(std::move(m.m_bounding_sphere)),
             m_user_id(std::move(m.m_user_id)),
             m_name(std::move(m.m_name)) {}
 
@@ -64,11 +76,14 @@ namespace rte
         mesh& operator=(mesh&& m)
         {
             if (&m != this) {
+                sparse_node::operator=(m);
                 m_position_buffer_id = std::move(m.m_position_buffer_id);
                 m_uv_buffer_id = std::move(m.m_uv_buffer_id);
                 m_normal_buffer_id = std::move(m.m_normal_buffer_id);
                 m_index_buffer_id = std::move(m.m_index_buffer_id);
                 m_num_vertices = std::move(m.m_num_vertices);
+                m_bounds = std::move(m.m_bounds);
+                m_bounding_sphere = std::move(m.m_bounding_sphere);
                 m_user_id = std::move(m.m_user_id);
                 m_name = std::move(m.m_name);            
             }
@@ -81,11 +96,13 @@ namespace rte
         gl_buffer_id                m_normal_buffer_id;    //!< id of the normal buffer in the graphics API
         gl_buffer_id                m_index_buffer_id;     //!< id of the index buffer in the graphics API
         unsigned int                m_num_vertices;        //!< number of vertices of this mesh
+        aabb                        m_bounds;              //!< box around the vertices, in model space
+        bounding_sphere             m_bounding_sphere;     //!< sphere around the vertices, in model space
         user_id                     m_user_id;             //!< user id of this mesh
         std::string                 m_name;                //!< name of this mesh
     };
 
-    typedef sparse_vector<mesh> mesh_database;
+    typedef sparse_vector<mesh, arena_allocator<mesh>, cow_chunked_storage> mesh_database;
 
     struct mesh_buffer : public sparse_node
     {
@@ -99,6 +116,7 @@ namespace rte
         mesh_buffer(const mesh_buffer& m) = default;
 
         mesh_buffer(mesh_buffer&& m) :
+            sparse_node(m),
             m_mesh(std::move(m.m_mesh)),
             m_vertices(std::move(m.m_vertices)),
             m_texture_coords(std::move(m.m_texture_coords)),
@@ -110,6 +128,7 @@ namespace rte
         mesh_buffer& operator=(mesh_buffer&& m)
         {
             if (&m != this) {
+                sparse_node::operator=(m);
                 m_mesh = std::move(m.m_mesh);
                 m_vertices = std::move(m.m_vertices);
                 m_texture_coords = std::move(m.m_texture_coords);
@@ -127,25 +146,25 @@ namespace rte
         std::vector<vindex>         m_indices;             //!< faces, as a sequence of indexes over the logical vertex array
     };
 
-    typedef sparse_vector<mesh_buffer> mesh_buffer_database;
+    typedef sparse_vector<mesh_buffer, arena_allocator<mesh_buffer>> mesh_buffer_database;
 
     struct resource : public sparse_node
     {
         resource() :
             m_mesh(npos),
             m_material(npos),
-            m_local_transform(1.0f),
+            m_local_transform(),
             m_user_id(nuser_id),
             m_name() {}
      
         index_type       m_mesh;               //!< mesh contained in this resource
         index_type       m_material;           //!< material of this resource
-        glm::mat4        m_local_transform;    //!< resource transform relative to the parent's reference frame
+        trs_transform    m_local_transform;    //!< resource transform relative to the parent's reference frame
         user_id          m_user_id;            //!< user id of this resource
         std::string      m_name;               //!< name of this resource
     };
 
-    typedef sparse_vector<resource> resource_database;
+    typedef sparse_vector<resource, arena_allocator<resource>, cow_chunked_storage> resource_database;
 
     struct cubemap : public sparse_node
     {
@@ -161,29 +180,45 @@ namespace rte
         std::string                   m_name;           //!< name of this resource
     };
 
-    typedef sparse_vector<cubemap> cubemap_database;
+    typedef sparse_vector<cubemap, arena_allocator<cubemap>, cow_chunked_storage> cubemap_database;
 
+    // Hot part of a node: the data read by the per-frame passes (transform propagation, render list)
     struct node : public sparse_node
     {    
         node() :
             m_mesh(npos),
             m_material(npos),
-            m_local_transform(1.0f),
+            m_local_transform(),
             m_accum_transform(1.0f),
             m_enabled(true),
-            m_user_id(nuser_id),
-            m_name() {}
+            m_transform_dirty(false),
+            m_render_slot(npos),
+            m_world_bounds(),
+            m_world_sphere() {}
     
         index_type       m_mesh;             //!< mesh contained in this node
         index_type       m_material;         //!< material of this node
-        glm::mat4        m_local_transform;  //!< node transform relative to the parent
+        trs_transform    m_local_transform;  //!< node transform relative to the parent (change it with set_local_transform())
         glm::mat4        m_accum_transform;  //!< node transform relative to the root
         bool             m_enabled;          //!< is this node enabled? (if it is not, all descendants are ignored when rendering)
+        bool             m_transform_dirty;  //!< is this node in view_database::m_dirty_transforms?
+        index_type       m_render_slot;      //!< position of this node in view_database::m_render_list, npos if it is not there
+        aabb             m_world_bounds;     //!< box around the mesh in world space, empty if there is no mesh. Updated with m_accum_transform
+        bounding_sphere  m_world_sphere;     //!< sphere around the mesh in world space, empty if there is no mesh. Updated with m_accum_transform
+    };
+
+    // Cold part of a node: data that is not needed to render a frame. Accessed with node_database::cold_at()
+    struct node_metadata
+    {
+        node_metadata() :
+            m_user_id(nuser_id),
+            m_name() {}
+
         user_id          m_user_id;          //!< user id of this node
         std::string      m_name;             //!< name of this node
     };
 
-    typedef sparse_vector<node> node_database;
+    typedef split_sparse_vector<node, node_metadata, arena_allocator<node>, cow_chunked_storage> node_database;
 
     struct point_light : public sparse_node
     {
@@ -208,7 +243,7 @@ namespace rte
         std::string      m_name;
     };
 
-    typedef sparse_vector<point_light> point_light_database;
+    typedef sparse_vector<point_light, arena_allocator<point_light>, cow_chunked_storage> point_light_database;
 
     struct dirlight : public sparse_node
     {
@@ -224,9 +259,48 @@ namespace rte
         glm::vec3      m_direction;      //!< direction of the directional light
     };
 
+    // All the tables of a database take their storage from the same arena, if there is one. The
+    // default constructor uses the global heap. Every table but the mesh buffers uses
+    // cow_chunked_storage, so a copy of a database on the heap shares their chunks until they are
+    // written, and writing a node only clones the chunk that holds it. Copies of a database in an
+    // arena clone them
     struct view_database : public sparse_node
     {
-        view_database() = default;
+        view_database() :
+            m_materials(),
+            m_meshes(),
+            m_mesh_buffers(),
+            m_resources(),
+            m_cubemaps(),
+            m_nodes(),
+            m_point_lights(),
+            m_root_node(npos),
+            m_view_transform(1.0f),
+            m_projection_transform(1.0f),
+            m_skybox(npos),
+            m_dirlight(),
+            m_dirty_transforms(),
+            m_recomputed_transforms(0U),
+            m_render_list(),
+            m_spatial_index() {}
+
+        explicit view_database(monotonic_arena* arena) :
+            m_materials(material_database::allocator_type(arena)),
+            m_meshes(mesh_database::allocator_type(arena)),
+            m_mesh_buffers(mesh_buffer_database::allocator_type(arena)),
+            m_resources(resource_database::allocator_type(arena)),
+            m_cubemaps(cubemap_database::allocator_type(arena)),
+            m_nodes(node_database::allocator_type(arena)),
+            m_point_lights(point_light_database::allocator_type(arena)),
+            m_root_node(npos),
+            m_view_transform(1.0f),
+            m_projection_transform(1.0f),
+            m_skybox(npos),
+            m_dirlight(),
+            m_dirty_transforms(),
+            m_recomputed_transforms(0U),
+            m_render_list(),
+            m_spatial_index() {}
 
         view_database(const view_database& vbd) = default;
 
@@ -242,7 +316,11 @@ namespace rte
             m_view_transform(std::move(vdb.m_view_transform)),
             m_projection_transform(std::move(vdb.m_projection_transform)),
             m_skybox(std::move(vdb.m_skybox)),
-            m_dirlight(std::move(vdb.m_dirlight)) {}
+            m_dirlight(std::move(vdb.m_dirlight)),
+            m_dirty_transforms(std::move(vdb.m_dirty_transforms)),
+            m_recomputed_transforms(std::move(vdb.m_recomputed_transforms)),
+            m_render_list(std::move(vdb.m_render_list)),
+            m_spatial_index(std::move(vdb.m_spatial_index)) {}
 
         view_database& operator=(const view_database&) = default;
 
@@ -261,6 +339,10 @@ namespace rte
                 m_projection_transform = std::move(vdb.m_projection_transform);
                 m_skybox = std::move(vdb.m_skybox);
                 m_dirlight = std::move(vdb.m_dirlight);
+                m_dirty_transforms = std::move(vdb.m_dirty_transforms);
+                m_recomputed_transforms = std::move(vdb.m_recomputed_transforms);
+                m_render_list = std::move(vdb.m_render_list);
+                m_spatial_index = std::move(vdb.m_spatial_index);
             }
 
             return *this;
@@ -278,6 +360,10 @@ namespace rte
         glm::mat4                 m_projection_transform;             //!< the projection transform used to render all objects in the scene
         index_type                m_skybox;                           //!< the id of the cubemap to use as skybox (can be npos)
         dirlight                  m_dirlight;                         //!< directional light
+        std::vector<index_type>   m_dirty_transforms;                 //!< nodes whose accumulated transform must be recomputed, with their subtrees
+        index_type                m_recomputed_transforms;            //!< nodes recomputed by the last update_accum_transforms()
+        std::vector<index_type>   m_render_list;                      //!< nodes to render, in no particular order (see update_render_list())
+        bvh                       m_spatial_index;                    //!< hierarchy over the world bounds of the nodes of m_render_list (see update_spatial_index())
     };
 
     void log_materials(const view_database& db);
@@ -293,9 +379,49 @@ namespace rte
                         index_type parent_index,
                         index_type& node_index_out,
                         view_database& db);
+    // Queues the subtree of a node for update_accum_transforms(). Must be called for every node
+    // inserted in the tree (insert_node_tree() does it) and whenever a local transform changes
+    void mark_transform_dirty(index_type node_index, view_database& db);
+    // Change the local transform of a node, or a part of it, and queue its subtree. A matrix is split
+    // with trs_from_matrix(). Throws std::invalid_argument if it has shear or a projective part, which
+    // the split would lose (see trs_splits_exactly()), and the node is left untouched
+    void set_local_transform(index_type node_index, const trs_transform& local_transform, view_database& db);
+    void set_local_transform(index_type node_index, const glm::mat4& local_transform, view_database& db);
+    void set_local_translation(index_type node_index, const glm::vec3& translation, view_database& db);
+    void set_local_rotation(index_type node_index, const glm::quat& rotation, view_database& db);
+    void set_local_scale(index_type node_index, const glm::vec3& scale, view_database& db);
+    // Recomputes the accumulated transforms of the queued subtrees, and the world bounds of their
+    // nodes, leaving the rest of the tree untouched, and empties the queue. Then brings the spatial
+    // index up to date. Returns the number of nodes recomputed, which is also kept in
+    // m_recomputed_transforms
+    index_type update_accum_transforms(view_database& db);
+    // The spatial index holds the nodes of the render list. Nodes added to the list are tested one
+    // by one by the queries, and the ones removed leave holes, until enough of them call for a new
+    // build. Nodes that move only refit the bounds above them. update_accum_transforms() calls
+    // update_spatial_index(), which does the build or the refit
+    void update_spatial_index(view_database& db);
+    // Replaces the contents of nodes_out with the nodes of the render list whose world bounds
+    // intersect the frustum, in no particular order. Returns their number
+    index_type query_visible_nodes(const frustum& f, std::vector<index_type>& nodes_out, const view_database& db);
+    // The render list holds the nodes with a mesh and a material whose ancestors are all enabled. It
+    // is kept up to date by the functions below and by insert_node_tree(), so that rendering a frame
+    // doesn't walk the tree. Code that changes nodes in any other way must call update_render_list()
+    // for the subtrees it has changed, or rebuild_render_list()
+    void update_render_list(index_type node_index, view_database& db);
+    void rebuild_render_list(view_database& db);
+    void set_node_enabled(index_type node_index, bool enabled, view_database& db);
+    void set_node_mesh(index_type node_index, index_type mesh_index, view_database& db);
+    void set_node_material(index_type node_index, index_type material_index, view_database& db);
+    // Erases a node and its descendants
+    void erase_node_tree(index_type node_index, view_database& db);
     void get_descendant_nodes(index_type node_index,
                         std::vector<index_type>& nodes_out,
                         const view_database& db);
+    // Compacts all the tables with tree_compact() and translates the indexes stored in the database
+    // (m_root_node, m_skybox, m_dirty_transforms, m_render_list and the m_mesh/m_material references between tables). The
+    // spatial index is emptied and its nodes are inserted again, for the next update_spatial_index() to build it from their
+    // world bounds. Any index held outside the database is invalidated
+    void compact_database(view_database& db);
 } // namespace rte
 
 #endif // RTE_DOMAIN_HPP
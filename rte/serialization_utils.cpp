@@ -40,4 +40,14 @@ namespace rte
 
         return os;   
     }
+
+    std::ostream& operator<<(std::ostream& os, const trs_transform& trs)
+    {
+        const glm::quat& q = trs.m_rotation;
+        os << "{ translation: " << trs.m_translation;
+        os << ", rotation: [ " << q.w << ", " << q.x << ", " << q.y << ", " << q.z << " ]";
+        os << ", scale: " << trs.m_scale << " }";
+
+        return os;
+    }
 }
@@ -1,6 +1,7 @@
 #ifndef SERIALIZATION_UTILS_HPP
 #define SERIALIZATION_UTILS_HPP
 
+#include "trs_transform.hpp"
 #include "rte_common.hpp"
 #include "glm/glm.hpp"
 
@@ -12,6 +13,7 @@ namespace rte
     std::string format_user_id(user_id uid);
     std::ostream& operator<<(std::ostream&, const glm::mat4& mat);
     std::ostream& operator<<(std::ostream&, const glm::vec3& vec);
+    std::ostream& operator<<(std::ostream&, const trs_transform& trs);
 }
 
 #endif
@@ -4,13 +4,20 @@ const char* skybox_vertex_shader = R"glsl(
 
     out vec3 tex_coords;
 
-    uniform mat4 view;
-    uniform mat4 projection;
+    // Values that stay constant for the whole frame, shared by all the programs. The layout must
+    // match camera_block in opengl_driver.cpp
+    layout(std140) uniform camera_data
+    {
+        mat4 view;
+        mat4 projection;
+        vec3 camera_position_worldspace;
+    };
 
     void main()
     {
         tex_coords = a_pos;
-        vec4 pos = projection * view * vec4(a_pos, 1.0);
+        // Remove translation from the view matrix, the skybox stays around the camera
+        vec4 pos = projection * mat4(mat3(view)) * vec4(a_pos, 1.0);
         gl_Position = pos.xyww;
     }
 )glsl";
@@ -23,6 +23,18 @@ namespace rte
   {
       return tree_insert(v, t, head_index);
   }
+
+  template<typename V>
+  index_type list_insert(V& v, index_type head_index, typename V::value_type&& t)
+  {
+      return tree_insert(v, std::move(t), head_index);
+  }
+
+  template<typename V, typename... Args>
+  index_type list_emplace(V& v, index_type head_index, Args&&... args)
+  {
+      return tree_emplace(v, head_index, std::forward<Args>(args)...);
+  }
   
   template<typename V>
   void list_erase(V& v, index_type node_index)
@@ -3,30 +3,254 @@
 
 #include "sparse_vector.hpp"
 
+#include <type_traits>
+#include <vector>
+
 namespace rte
 {
-    // Erases all nodes in a sparse_vector
+    // Iterator that visits a subtree in depth-first pre-order, starting with its root. It follows child,
+    // sibling and parent links, so it needs no stack and never allocates. Calling skip_children()
+    // makes the next increment skip the descendants of the current node (pruning).
+    template <typename T, bool isconst = false, typename Elements = T*, typename ConstElements = const T*>
+    class sparse_preorder_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef typename std::conditional<isconst, const T*, T*>::type pointer;
+        typedef typename std::conditional<isconst, const T&, T&>::type reference;
+        typedef typename std::conditional<isconst, ConstElements, Elements>::type elements;
+        typedef std::ptrdiff_t difference_type;
+        typedef T value_type;
+
+        sparse_preorder_iterator() :
+            m_begin(),
+            m_root(npos),
+            m_current(npos),
+            m_depth(0U),
+            m_skip_children(false) {}
+
+        // current is either root or npos (end)
+        sparse_preorder_iterator(elements begin, index_type root, index_type current) :
+            m_begin(begin),
+            m_root(root),
+            m_current(current),
+            m_depth(0U),
+            m_skip_children(false) {}
+
+        sparse_preorder_iterator(const sparse_preorder_iterator<T, false, Elements, ConstElements>& spi) :
+            m_begin(spi.get_begin()),
+            m_root(spi.get_root()),
+            m_current(spi.get_current()),
+            m_depth(spi.get_depth()),
+            m_skip_children(spi.get_skip_children()) {}
+
+        sparse_preorder_iterator& operator=(const sparse_preorder_iterator&) = default;
+
+        bool operator==(const sparse_preorder_iterator& spi) const
+        {
+            return (m_begin == spi.m_begin && m_current == spi.m_current);
+        }
+
+        bool operator!=(const sparse_preorder_iterator& spi) const { return !(*this == spi); }
+
+        sparse_preorder_iterator& operator++()
+        {
+            bool skip_children = m_skip_children;
+            m_skip_children = false;
+
+            index_type first_child = m_begin[m_current].m_first_child;
+            if (!skip_children && first_child != npos) {
+                m_current = first_child;
+                m_depth++;
+                return (*this);
+            }
+
+            // Climb until we find an ancestor (or the node itself) with a next sibling, but never
+            // leave the subtree: the siblings of the root are not part of it
+            index_type current = m_current;
+            while (current != m_root) {
+                auto& current_node = m_begin[current];
+                if (current_node.m_next_sibling != npos) {
+                    m_current = current_node.m_next_sibling;
+                    return (*this);
+                }
+                current = current_node.m_parent;
+                m_depth--;
+            }
+
+            m_current = npos;
+            return (*this);
+        }
+
+        sparse_preorder_iterator operator++(int)
+        {
+            sparse_preorder_iterator tmp(*this);
+            ++*this;
+            return tmp;
+        }
+
+        reference operator*() const
+        {
+            assert(m_current != npos);
+            assert(m_begin[m_current].m_generation & 1U);
+            return m_begin[m_current];
+        }
+
+        pointer operator->() const
+        {
+            assert(m_current != npos);
+            assert(m_begin[m_current].m_generation & 1U);
+            return &m_begin[m_current];
+        }
+
+        // The descendants of the current node won't be visited
+        void skip_children() { m_skip_children = true; }
+
+        elements get_begin() const { return m_begin; }
+        index_type get_root() const { return m_root; }
+        index_type get_current() const { return m_current; }
+        // Returns the depth of the current node relative to the root of the iteration (the root has depth 0)
+        index_type get_depth() const { return m_depth; }
+        bool get_skip_children() const { return m_skip_children; }
+
+    private:
+        elements        m_begin;
+        index_type      m_root;
+        index_type      m_current;
+        index_type      m_depth;
+        bool            m_skip_children;
+    };
+
+    template<typename T, bool isconst, typename Elements, typename ConstElements>
+    index_type index(const sparse_preorder_iterator<T, isconst, Elements, ConstElements>& it)
+    {
+        return it.get_current();
+    }
+
+    // Iterator that visits a subtree in breadth-first order, starting with its root. The queue of
+    // pending nodes is a vector provided by the caller, so that it can be reused between traversals
+    // and allocates nothing once it has grown to the size of the subtree. As with the pre-order
+    // iterator, skip_children() prunes the descendants of the current node.
+    template <typename T, bool isconst = false, typename Elements = T*, typename ConstElements = const T*>
+    class sparse_level_order_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef typename std::conditional<isconst, const T*, T*>::type pointer;
+        typedef typename std::conditional<isconst, const T&, T&>::type reference;
+        typedef typename std::conditional<isconst, ConstElements, Elements>::type elements;
+        typedef std::ptrdiff_t difference_type;
+        typedef T value_type;
+
+        sparse_level_order_iterator() :
+            m_begin(),
+            m_queue(nullptr),
+            m_position(npos),
+            m_skip_children(false) {}
+
+        // The queue must only hold the root of the iteration when position is 0
+        sparse_level_order_iterator(elements begin, std::vector<index_type>* queue, index_type position) :
+            m_begin(begin),
+            m_queue(queue),
+            m_position(position),
+            m_skip_children(false) {}
+
+        sparse_level_order_iterator(const sparse_level_order_iterator<T, false, Elements, ConstElements>& sli) :
+            m_begin(sli.get_begin()),
+            m_queue(sli.get_queue()),
+            m_position(sli.get_position()),
+            m_skip_children(sli.get_skip_children()) {}
+
+        sparse_level_order_iterator& operator=(const sparse_level_order_iterator&) = default;
+
+        bool operator==(const sparse_level_order_iterator& sli) const
+        {
+            return (m_begin == sli.m_begin && m_position == sli.m_position);
+        }
+
+        bool operator!=(const sparse_level_order_iterator& sli) const { return !(*this == sli); }
+
+        sparse_level_order_iterator& operator++()
+        {
+            if (!m_skip_children) {
+                for (index_type child = m_begin[get_current()].m_first_child; child != npos; child = m_begin[child].m_next_sibling) {
+                    m_queue->push_back(child);
+                }
+            }
+            m_skip_children = false;
+
+            m_position++;
+            if (m_position == m_queue->size()) {
+                m_position = npos;
+            }
+
+            return (*this);
+        }
+
+        sparse_level_order_iterator operator++(int)
+        {
+            sparse_level_order_iterator tmp(*this);
+            ++*this;
+            return tmp;
+        }
+
+        reference operator*() const
+        {
+            assert(m_position != npos);
+            assert(m_begin[get_current()].m_generation & 1U);
+            return m_begin[get_current()];
+        }
+
+        pointer operator->() const
+        {
+            assert(m_position != npos);
+            assert(m_begin[get_current()].m_generation & 1U);
+            return &m_begin[get_current()];
+        }
+
+        // The descendants of the current node won't be visited
+        void skip_children() { m_skip_children = true; }
+
+        elements get_begin() const { return m_begin; }
+        std::vector<index_type>* get_queue() const { return m_queue; }
+        index_type get_position() const { return m_position; }
+        index_type get_current() const { return (m_position != npos? (*m_queue)[m_position] : npos); }
+        bool get_skip_children() const { return m_skip_children; }
+
+    private:
+        elements                     m_begin;
+        std::vector<index_type>*     m_queue;
+        index_type                   m_position;
+        bool                         m_skip_children;
+    };
+
+    template<typename T, bool isconst, typename Elements, typename ConstElements>
+    index_type index(const sparse_level_order_iterator<T, isconst, Elements, ConstElements>& it)
+    {
+        return it.get_current();
+    }
+
+    // Erases all nodes in a sparse_vector. Existing handles become stale
     template<typename V>
     void tree_init(V& tree)
     {
         tree.clear();
     }
 
+    // Reserves a slot for a new node. The slot is not marked as used, and it will not be returned
+    // again by this function until it is either marked as used and erased, or released.
     template<typename V>
-    index_type tree_allocate_node(V& tree, const std::set<index_type>& previously_allocated_indexes)
+    index_type tree_allocate_node(V& tree)
     {
-        index_type ret = tree.size();
-        for (index_type i = 0; i < tree.size(); i++) {
-            if (!tree.physical_at(i).m_used && previously_allocated_indexes.count(i) == 0) {
-                ret = i;
-                break;
-            }
-        }
-        if ((!ret < tree.size())) {
-            tree.push_back(typename V::value_type());
-        }
+        return tree.allocate();
+    }
 
-        return ret;
+    // Reserves count slots for new nodes at once, appending their indexes to indexes_out. As with
+    // tree_allocate_node(), the slots are not marked as used
+    template<typename V>
+    void tree_allocate_nodes(V& tree, index_type count, std::vector<index_type>& indexes_out)
+    {
+        tree.allocate(count, indexes_out);
     }
 
     // parent_index must be the index of a valid, used element.
@@ -76,26 +300,83 @@ namespace rte
         }
     }
 
-    // Inserts a single node as the last child of an existing one
+    // Throws if parent_index is neither npos nor the index of a used element
     template<typename V>
-    index_type tree_insert(V& tree, const typename V::value_type t, index_type parent_index = npos)
+    void tree_check_parent(const V& tree, index_type parent_index)
     {
         assert(parent_index == npos || parent_index < tree.size());
         if (!(parent_index == npos || parent_index < tree.size())) {
             throw std::domain_error("tree_insert: invalid parent index");
         }
-        if (!(parent_index == npos || tree.at(parent_index).m_used)) {
+        if (!(parent_index == npos || tree.used(parent_index))) {
             throw std::domain_error("tree_insert: parent has been erased");
         }
+    }
+
+    // Makes writable the nodes that linking a new child to parent_index writes, besides the child:
+    // the parent and its last child. Called before the throw points of the insertions are passed
+    template<typename V>
+    void tree_prepare_link(V& tree, index_type parent_index)
+    {
+        if (parent_index < tree.size() && tree.used(parent_index)) {
+            tree.make_writable(parent_index);
+            index_type last_child = static_cast<const V&>(tree).at(parent_index).m_last_child;
+            if (last_child != npos) {
+                tree.make_writable(last_child);
+            }
+        }
+    }
+
+    // Makes visible a node stored with insert() or emplace(), as the last child of parent_index. The
+    // links of the stored value are discarded, as they may come from another tree. Never throws
+    template<typename V>
+    void tree_link_new_node(V& tree, index_type new_index, index_type parent_index)
+    {
+        auto& new_node = tree.physical_at(new_index);
+        new_node.m_parent = npos;
+        new_node.m_first_child = npos;
+        new_node.m_last_child = npos;
+        new_node.m_next_sibling = npos;
+        new_node.m_previous_sibling = npos;
 
-        index_type new_index = tree.insert(t);
-    
-        // Exception safety: now that we have passed all the throw points, impact the changes in the structure
         tree.set_used(new_index);
-        if (parent_index < tree.size() && tree.at(parent_index).m_used) {
+        if (parent_index < tree.size() && tree.used(parent_index)) {
             tree_add_child(tree, parent_index, new_index);
         }
+    }
+
+    // Inserts a single node as the last child of an existing one
+    template<typename V>
+    index_type tree_insert(V& tree, const typename V::value_type& t, index_type parent_index = npos)
+    {
+        tree_check_parent(tree, parent_index);
+        tree_prepare_link(tree, parent_index);
+        index_type new_index = tree.insert(t);
+    
+        // Exception safety: now that we have passed all the throw points, impact the changes in the structure
+        tree_link_new_node(tree, new_index, parent_index);
+        return new_index;
+    }
 
+    // Same as above, but moves t into the tree instead of copying it
+    template<typename V>
+    index_type tree_insert(V& tree, typename V::value_type&& t, index_type parent_index = npos)
+    {
+        tree_check_parent(tree, parent_index);
+        tree_prepare_link(tree, parent_index);
+        index_type new_index = tree.insert(std::move(t));
+        tree_link_new_node(tree, new_index, parent_index);
+        return new_index;
+    }
+
+    // Inserts a single node built from args as the last child of parent_index (which can be npos)
+    template<typename V, typename... Args>
+    index_type tree_emplace(V& tree, index_type parent_index, Args&&... args)
+    {
+        tree_check_parent(tree, parent_index);
+        tree_prepare_link(tree, parent_index);
+        index_type new_index = tree.emplace(std::forward<Args>(args)...);
+        tree_link_new_node(tree, new_index, parent_index);
         return new_index;
     }
 
@@ -106,83 +387,95 @@ namespace rte
     template<typename V>
     index_type tree_insert(const V& input_tree, index_type input_index, V& output_tree, index_type output_parent_index = npos)
     {
-        assert(output_parent_index == npos || output_parent_index < output_tree.size());
-        if (!(output_parent_index == npos || output_parent_index < output_tree.size())) {
-            throw std::domain_error("tree_insert: invalid parent index");
-        }
-        if (!(output_parent_index == npos || output_tree.at(output_parent_index).m_used)) {
-            throw std::domain_error("tree_insert: parent has been erased");
-        }
+        tree_check_parent(output_tree, output_parent_index);
         assert(input_index < input_tree.size());
         if (!(input_index < input_tree.size())) {
             throw std::out_of_range("tree_insert: invalid input index");
         }
-        assert(input_tree.at(input_index).m_used);
-        if (!(input_tree.at(input_index).m_used)) {
+        assert(input_tree.used(input_index));
+        if (!(input_tree.used(input_index))) {
             throw std::out_of_range("tree_insert: input index has been erased");
         }
 
-        // Insert all nodes
-        std::map<index_type, index_type> new_index_map;
-        // The npos references should stay that way
-        new_index_map[npos] = npos;
-        std::set<index_type> new_indices;
-        std::vector<index_type> pending_nodes;
-        pending_nodes.push_back(input_index);
-        while (!pending_nodes.empty()) {
-            // If this node is the root of the input tree save its index for later
-            index_type input_node_index = pending_nodes.back();
-            pending_nodes.pop_back();
-
-            index_type new_index = tree_allocate_node(output_tree, new_indices);
-            new_indices.insert(new_index);
-            new_index_map[input_node_index] = new_index;
-
-            // Insert the value in its new position. The new entries are not yet marked as used, so we
-            // can't use at() because it would fail the assertion on m_used. We use utility method physical_at
-            // which has the same behavior as at() but doesn't check for m_used
-            const auto& input_node = input_tree.at(input_node_index);
-            output_tree.physical_at(new_index) = input_node;
-
-            for (auto it = tree_rbegin(input_tree, input_node_index); it != tree_rend(input_tree, input_node_index); ++it) {
-                pending_nodes.push_back(index(it));
+        // Collect the subtree in depth-first order. Each entry stores the position of its parent in
+        // the same vector, which is all we need to rebuild the links in the output tree, so no map
+        // from input indexes to output indexes is needed
+        struct copy_context { index_type input_index; index_type parent_position; };
+        std::vector<copy_context> nodes_to_copy;
+        std::vector<index_type> ancestor_positions; // position of the last node seen at each depth
+        for (auto it = tree_preorder_begin(input_tree, input_index); it != tree_preorder_end(input_tree, input_index); ++it) {
+            index_type depth = it.get_depth();
+            ancestor_positions.resize(depth + 1U);
+            ancestor_positions[depth] = nodes_to_copy.size();
+            nodes_to_copy.push_back({index(it), depth > 0U? ancestor_positions[depth - 1U] : npos});
+        }
+
+        tree_prepare_link(output_tree, output_parent_index);
+
+        // Reserve all the slots at once. new_indices is a flat remap from position in nodes_to_copy
+        // to index in the output tree
+        std::vector<index_type> new_indices;
+        tree_allocate_nodes(output_tree, nodes_to_copy.size(), new_indices);
+
+        // Insert the values in their new positions. The new entries are not yet marked as used, so we
+        // can't use at() because it would fail the assertion on occupancy. We use utility method physical_at
+        // which has the same behavior as at() but doesn't check for occupancy
+        try {
+            for (index_type i = 0; i < nodes_to_copy.size(); i++) {
+                output_tree.copy_entry(new_indices[i], input_tree, nodes_to_copy[i].input_index);
             }
+        } catch (...) {
+            // Give back the reserved slots, none of them has been made visible yet
+            for (auto new_index : new_indices) {
+                output_tree.release(new_index);
+            }
+            throw;
         }
 
-        // Update the references in all inserted nodes
-        // Remove the external index that may be present in the parent reference of the output root node
-        // (we will set this later in function tree_add_child())
-        output_tree.physical_at(new_index_map.at(input_index)).m_parent = npos;
-        for (auto& it : new_index_map) {
-            if (it.second != npos) {
-                auto& new_node = output_tree.physical_at(it.second);
-                new_node.m_parent = new_index_map.at(new_node.m_parent);
-                new_node.m_first_child = new_index_map.at(new_node.m_first_child);
-                new_node.m_last_child = new_index_map.at(new_node.m_last_child);
-                new_node.m_next_sibling = new_index_map.at(new_node.m_next_sibling);
-                new_node.m_previous_sibling = new_index_map.at(new_node.m_previous_sibling);
+        // Rebuild the references in all inserted nodes. Nodes are visited in depth-first order, so each
+        // parent is linked before its children and children are appended in their original order
+        for (index_type i = 0; i < nodes_to_copy.size(); i++) {
+            index_type new_index = new_indices[i];
+            auto& new_node = output_tree.physical_at(new_index);
+            new_node.m_parent = npos;
+            new_node.m_first_child = npos;
+            new_node.m_last_child = npos;
+            new_node.m_next_sibling = npos;
+            new_node.m_previous_sibling = npos;
+
+            index_type parent_position = nodes_to_copy[i].parent_position;
+            if (parent_position != npos) {
+                index_type new_parent_index = new_indices[parent_position];
+                auto& new_parent = output_tree.physical_at(new_parent_index);
+                new_node.m_parent = new_parent_index;
+                new_node.m_previous_sibling = new_parent.m_last_child;
+                if (new_parent.m_last_child != npos) {
+                    output_tree.physical_at(new_parent.m_last_child).m_next_sibling = new_index;
+                } else {
+                    new_parent.m_first_child = new_index;
+                }
+                new_parent.m_last_child = new_index;
             }
         }
 
         // Exception safety: now that we have passed all the throw points, impact the changes in the structure
 
         // Insert the root in the list of children of the parent
-        index_type new_root_index = new_index_map.at(input_index);
-        if (output_parent_index < output_tree.size() && output_tree.physical_at(output_parent_index).m_used) {
+        index_type new_root_index = new_indices[0];
+        if (output_parent_index < output_tree.size() && output_tree.used(output_parent_index)) {
             tree_add_child(output_tree, output_parent_index, new_root_index);        
         }
 
         // Mark all the new nodes as used to make them visible
-        for (auto& it : new_index_map) {
-            if (it.second != npos) {
-                output_tree.set_used(it.second);
-            }
+        for (auto new_index : new_indices) {
+            output_tree.set_used(new_index);
         }
 
         return new_root_index;
     }
 
-    // Removes a tree node and all its descendants recursively
+    // Removes a tree node and all its descendants recursively. The subtree is walked in post-order by
+    // following its own links, so no memory is allocated regardless of the size of the subtree
     template<typename V>
     void tree_erase(V& tree, index_type erase_index)
     {
@@ -190,46 +483,149 @@ namespace rte
         if (!(erase_index < tree.size())) {
             throw std::out_of_range("sparse_vector::erase: invalid remove index");
         }
-        assert(tree.at(erase_index).m_used);
-        if (!(tree.at(erase_index).m_used)) {
+        assert(tree.used(erase_index));
+        if (!(tree.used(erase_index))) {
             throw std::domain_error("sparse_vector::erase: remove index has already been erased");
         }
-        // Mark the node and all its descendants as not used, recursively
-        std::set<index_type> to_delete;
-        std::vector<index_type> pending_nodes;
-        pending_nodes.push_back(erase_index);
-        while (!pending_nodes.empty()) {
-            index_type pending_index = pending_nodes.back();
-            pending_nodes.pop_back();
 
-            to_delete.insert(pending_index);
-
-            for (auto it = tree_rbegin(tree, pending_index); it != tree_rend(tree, pending_index); ++it) {
-                pending_nodes.push_back(index(it));
+        // With copy-on-write storage, clone first the chunks of every node written below: the
+        // parent and the siblings of the erased node, and the whole subtree
+        if (V::storage_type::copy_on_write) {
+            const V& const_tree = tree;
+            auto& erased = const_tree.at(erase_index);
+            for (index_type i : {erased.m_parent, erased.m_previous_sibling, erased.m_next_sibling}) {
+                if (i != npos) {
+                    tree.make_writable(i);
+                }
+            }
+            for (auto it = tree_preorder_begin(const_tree, erase_index); it != tree_preorder_end(const_tree, erase_index); ++it) {
+                tree.make_writable(index(it));
             }
         }
 
-        // Exception safety: now that we have passed all the throw points, impact the changes in the structure
+        // Exception safety: there are no throw points past this line
         if (tree.at(erase_index).m_parent < tree.size()) {
             tree_remove_child(tree, tree.at(erase_index).m_parent, erase_index);
         }
-        for (auto it = to_delete.begin(); it != to_delete.end(); ++it) {
-            tree.clear_used(*it);
+
+        // Erase a node once it has no children left. Before erasing it, unlink it from its parent by
+        // advancing the parent's first child, and read its links, because clear_used() reuses
+        // m_next_sibling to thread the slot into the free list
+        index_type current = erase_index;
+        while (true) {
+            auto& current_node = tree.physical_at(current);
+            if (current_node.m_first_child != npos) {
+                current = current_node.m_first_child;
+                continue;
+            }
+
+            index_type parent_index = current_node.m_parent;
+            index_type next_sibling_index = current_node.m_next_sibling;
+            tree.clear_used(current);
+            if (current == erase_index) {
+                break;
+            }
+
+            tree.physical_at(parent_index).m_first_child = next_sibling_index;
+            current = (next_sibling_index != npos? next_sibling_index : parent_index);
         }
     }
 
-    template<typename V> typename V::iterator tree_begin(V& v, index_type i) { auto& elem = v.at(i); return typename V::iterator(&v.at(0), npos, elem.m_first_child, elem.m_first_child != npos? v.at(elem.m_first_child).m_next_sibling : npos, v.size()); }
-    template<typename V> typename V::const_iterator tree_begin(const V& v, index_type i) { auto& elem = v.at(i); return typename V::const_iterator(&v.at(0), npos, elem.m_first_child, elem.m_first_child != npos? v.at(elem.m_first_child).m_next_sibling : npos, v.size()); }
-    template<typename V> typename V::const_iterator tree_cbegin(const V& v, index_type i) { auto& elem = v.at(i); return typename V::const_iterator(&v.at(0), npos, elem.m_first_child, elem.m_first_child != npos? v.at(elem.m_first_child).m_next_sibling : npos, v.size()); }
-    template<typename V> typename V::iterator tree_end(V& v, index_type i) { auto& elem = v.at(i); return typename V::iterator(&v.at(0), elem.m_last_child, npos, npos, v.size()); }
-    template<typename V> typename V::const_iterator tree_end(const V& v, index_type i)  { auto& elem = v.at(i); return typename V::const_iterator(&v.at(0), elem.m_last_child, npos, npos, v.size()); }
-    template<typename V> typename V::const_iterator tree_cend(const V& v, index_type i) { auto& elem = v.at(i); return typename V::const_iterator(&v.at(0), elem.m_last_child, npos, npos, v.size()); }
+    // Translates an index through a remap returned by tree_compact(). npos is mapped to npos, so
+    // optional references (parent links, m_skybox...) can be remapped without checking them first
+    inline index_type tree_remap_index(const std::vector<index_type>& remap, index_type old_index)
+    {
+        return (old_index < remap.size()? remap[old_index] : npos);
+    }
+
+    // Rewrites all the nodes of a sparse_vector so that they are stored in depth-first order with no
+    // holes, and shrinks its capacity to fit. Trees are laid out one after another, in the order of
+    // their roots' indexes, so the head of a list stored at index 0 stays at index 0.
+    // Returns a remap from old index to new index, which holds npos for slots that were not in use.
+    // Indexes stored outside the sparse_vector must be translated with tree_remap_index(), and all the
+    // existing handles, iterators and references are invalidated.
+    template<typename V>
+    std::vector<index_type> tree_compact(V& tree)
+    {
+        // Collect the live nodes in depth-first order. new_order is a remap from new index to old index
+        std::vector<index_type> new_order;
+        new_order.reserve(tree.count_used());
+        tree.for_each_used([&](index_type root_index) {
+            if (tree.at(root_index).m_parent != npos) {
+                return;
+            }
+
+            for (auto it = tree_preorder_begin(tree, root_index); it != tree_preorder_end(tree, root_index); ++it) {
+                new_order.push_back(index(it));
+            }
+        });
+
+        std::vector<index_type> remap(tree.size(), npos);
+        for (index_type i = 0; i < new_order.size(); i++) {
+            remap[new_order[i]] = i;
+        }
+
+        // Build the compacted tree aside, so that tree is left untouched if copying a value throws.
+        // The new vector is empty, so the slots it hands out are 0, 1, 2... It uses the allocator of
+        // tree so that they can be swapped (with an arena, the old storage is freed with the arena)
+        // Every slot it ever creates, now or when it grows again, gets a generation newer than any
+        // slot of tree had, so stale handles stay stale
+        V compacted_tree(tree.get_allocator());
+        compacted_tree.skip_generations(tree.newest_generation());
+        compacted_tree.reserve(new_order.size());
+        std::vector<index_type> new_indices;
+        tree_allocate_nodes(compacted_tree, new_order.size(), new_indices);
+        for (index_type i = 0; i < new_order.size(); i++) {
+            compacted_tree.copy_entry(i, tree, new_order[i]);
+            auto& new_node = compacted_tree.physical_at(i);
+            new_node.m_parent = tree_remap_index(remap, new_node.m_parent);
+            new_node.m_first_child = tree_remap_index(remap, new_node.m_first_child);
+            new_node.m_last_child = tree_remap_index(remap, new_node.m_last_child);
+            new_node.m_next_sibling = tree_remap_index(remap, new_node.m_next_sibling);
+            new_node.m_previous_sibling = tree_remap_index(remap, new_node.m_previous_sibling);
+        }
+
+        // Exception safety: now that we have passed all the throw points, impact the changes in the structure
+        for (index_type i = 0; i < new_order.size(); i++) {
+            compacted_tree.set_used(i);
+        }
+        tree.swap(compacted_tree);
+
+        return remap;
+    }
+
+    template<typename V> typename V::iterator tree_begin(V& v, index_type i) { auto& elem = v.at(i); return typename V::iterator(v.elements(), npos, elem.m_first_child, elem.m_first_child != npos? v.at(elem.m_first_child).m_next_sibling : npos, v.size()); }
+    template<typename V> typename V::const_iterator tree_begin(const V& v, index_type i) { auto& elem = v.at(i); return typename V::const_iterator(v.elements(), npos, elem.m_first_child, elem.m_first_child != npos? v.at(elem.m_first_child).m_next_sibling : npos, v.size()); }
+    template<typename V> typename V::const_iterator tree_cbegin(const V& v, index_type i) { auto& elem = v.at(i); return typename V::const_iterator(v.elements(), npos, elem.m_first_child, elem.m_first_child != npos? v.at(elem.m_first_child).m_next_sibling : npos, v.size()); }
+    template<typename V> typename V::iterator tree_end(V& v, index_type i) { auto& elem = v.at(i); return typename V::iterator(v.elements(), elem.m_last_child, npos, npos, v.size()); }
+    template<typename V> typename V::const_iterator tree_end(const V& v, index_type i)  { auto& elem = v.at(i); return typename V::const_iterator(v.elements(), elem.m_last_child, npos, npos, v.size()); }
+    template<typename V> typename V::const_iterator tree_cend(const V& v, index_type i) { auto& elem = v.at(i); return typename V::const_iterator(v.elements(), elem.m_last_child, npos, npos, v.size()); }
     template<typename V> typename V::reverse_iterator tree_rbegin(V& v, index_type i) { return typename V::reverse_iterator(tree_end(v, i)); }
     template<typename V> typename V::const_reverse_iterator tree_rbegin(const V& v, index_type i) { return typename V::const_reverse_iterator(tree_end(v, i)); }
     template<typename V> typename V::const_reverse_iterator tree_crbegin(const V& v, index_type i) { return typename V::const_reverse_iterator(tree_end(v, i)); }
     template<typename V> typename V::reverse_iterator tree_rend(V& v, index_type i) { return typename V::reverse_iterator(tree_begin(v, i)); }
     template<typename V> typename V::const_reverse_iterator tree_rend(const V& v, index_type i) { return typename V::const_reverse_iterator(tree_begin(v, i)); }
     template<typename V> typename V::const_reverse_iterator tree_crend(const V& v, index_type i) { return typename V::const_reverse_iterator(tree_begin(v, i)); }
+
+    // Iterator types of the traversals below for a vector type V, whatever its storage
+    template<typename V, bool isconst>
+    using tree_preorder_iterator = sparse_preorder_iterator<typename V::value_type, isconst, typename V::elements_type, typename V::const_elements_type>;
+    template<typename V, bool isconst>
+    using tree_level_order_iterator = sparse_level_order_iterator<typename V::value_type, isconst, typename V::elements_type, typename V::const_elements_type>;
+
+    // Pre-order traversal of the subtree rooted at i, including i. Usage:
+    //     for (auto it = tree_preorder_begin(v, i); it != tree_preorder_end(v, i); ++it) { ... }
+    template<typename V> tree_preorder_iterator<V, false> tree_preorder_begin(V& v, index_type i) { v.at(i); return tree_preorder_iterator<V, false>(v.elements(), i, i); }
+    template<typename V> tree_preorder_iterator<V, true> tree_preorder_begin(const V& v, index_type i) { v.at(i); return tree_preorder_iterator<V, true>(v.elements(), i, i); }
+    template<typename V> tree_preorder_iterator<V, false> tree_preorder_end(V& v, index_type i) { v.at(i); return tree_preorder_iterator<V, false>(v.elements(), i, npos); }
+    template<typename V> tree_preorder_iterator<V, true> tree_preorder_end(const V& v, index_type i) { v.at(i); return tree_preorder_iterator<V, true>(v.elements(), i, npos); }
+
+    // Level-order traversal of the subtree rooted at i, including i. queue is cleared and used as
+    // scratch space, it must outlive the iteration and not be shared by two iterations at once
+    template<typename V> tree_level_order_iterator<V, false> tree_level_order_begin(V& v, index_type i, std::vector<index_type>& queue) { v.at(i); queue.clear(); queue.push_back(i); return tree_level_order_iterator<V, false>(v.elements(), &queue, 0U); }
+    template<typename V> tree_level_order_iterator<V, true> tree_level_order_begin(const V& v, index_type i, std::vector<index_type>& queue) { v.at(i); queue.clear(); queue.push_back(i); return tree_level_order_iterator<V, true>(v.elements(), &queue, 0U); }
+    template<typename V> tree_level_order_iterator<V, false> tree_level_order_end(V& v, index_type i, std::vector<index_type>& queue) { v.at(i); return tree_level_order_iterator<V, false>(v.elements(), &queue, npos); }
+    template<typename V> tree_level_order_iterator<V, true> tree_level_order_end(const V& v, index_type i, std::vector<index_type>& queue) { v.at(i); return tree_level_order_iterator<V, true>(v.elements(), &queue, npos); }
 } // namespace rte
 
 #endif // SPARSE_TREE_HPP
@@ -5,8 +5,10 @@
 #include <stdexcept>
 #include <iterator>
 #include <cassert>
+#include <cstdint>
+#include <utility>
+#include <memory>
 #include <vector>
-#include <set>
 #include <map>
 
 namespace rte
@@ -14,11 +16,54 @@ namespace rte
     typedef std::size_t index_type;
     constexpr index_type npos = -1;
 
+    // Counter incremented every time an entry is marked as used or erased. Live entries always have
+    // an odd generation, so a generation taken from a live entry never matches an erased one.
+    typedef std::uint32_t generation_type;
+
+    // Reference to an entry of a sparse_vector that packs its index and its generation. Unlike a plain
+    // index_type, a handle can detect that the entry it refers to has been erased even after the slot
+    // has been reused by another entry (see sparse_vector::try_get()). The index must fit in 32 bits,
+    // and 0xffffffff is reserved for handles that don't refer to any entry.
+    class sparse_handle
+    {
+    public:
+        constexpr sparse_handle() :
+            m_value(~std::uint64_t(0)) {}
+
+        // Throws std::out_of_range if the index doesn't fit in the handle
+        constexpr sparse_handle(index_type index, generation_type generation) :
+            m_value(std::uint64_t(index) < 0xffffffffU? (std::uint64_t(generation) << 32) | std::uint64_t(index)
+                                                       : throw std::out_of_range("sparse_handle: index out of range")) {}
+
+        bool operator==(const sparse_handle& h) const { return m_value == h.m_value; }
+        bool operator!=(const sparse_handle& h) const { return m_value != h.m_value; }
+
+        // Returns npos for a handle that doesn't refer to any entry
+        index_type get_index() const { return (m_value & 0xffffffffU) != 0xffffffffU? index_type(m_value & 0xffffffffU) : npos; }
+        generation_type get_generation() const { return generation_type(m_value >> 32); }
+
+    private:
+        std::uint64_t m_value;
+    };
+
+    // Handle that doesn't refer to any entry: get_index() returns npos, which is never the index of a slot.
+    // It is the only handle with the reserved index 0xffffffff
+    constexpr sparse_handle nhandle;
+
+    // Word type of the occupancy bitset of sparse_vector. Bit i % 64 of word i / 64 is set when slot i is used
+    typedef std::uint64_t occupancy_word;
+    constexpr index_type occupancy_word_bits = 64U;
+
+    inline index_type occupancy_words(index_type slots) { return (slots + occupancy_word_bits - 1U) / occupancy_word_bits; }
+    // w must not be zero
+    inline index_type occupancy_lowest_bit(occupancy_word w) { return __builtin_ctzll(w); }
+    inline index_type occupancy_popcount(occupancy_word w) { return __builtin_popcountll(w); }
+
     class sparse_node
     {
     public:
         sparse_node() :
-            m_used(false),
+            m_generation(0U),
             m_parent(npos),
             m_first_child(npos),
             m_last_child(npos),
@@ -26,12 +71,10 @@ namespace rte
             m_previous_sibling(npos) {}
 
         sparse_node(const sparse_node&) = default;
-
-        ~sparse_node() { m_used = false; }
     
         sparse_node& operator=(const sparse_node& node)
         {
-            // Member m_used is not touched, this is only set explicitly
+            // Member m_generation is not touched, it is only set by the owning sparse_vector
             if (&node != this) {
                 m_parent = node.m_parent;
                 m_first_child = node.m_first_child;
@@ -43,7 +86,7 @@ namespace rte
             return *this;
         }
 
-        bool            m_used;
+        generation_type m_generation;
         index_type      m_parent;
         index_type      m_first_child;
         index_type      m_last_child;
@@ -51,7 +94,10 @@ namespace rte
         index_type      m_previous_sibling;
     };
 
-    template <typename T, bool isconst = false>
+    // Elements is what the iterator uses to reach the entries of the vector: anything that can be
+    // indexed with operator[], like the plain pointer of sparse_contiguous_storage. ConstElements is
+    // its read only counterpart, which must be constructible from Elements.
+    template <typename T, bool isconst = false, typename Elements = T*, typename ConstElements = const T*>
     class sparse_node_iterator
     {
     public:
@@ -71,17 +117,18 @@ namespace rte
         typedef std::bidirectional_iterator_tag iterator_category;
         typedef typename choose<isconst, const T*, T*>::type pointer;
         typedef typename choose<isconst, const T&, T&>::type reference;
+        typedef typename choose<isconst, ConstElements, Elements>::type elements;
         typedef typename std::ptrdiff_t difference_type;
         typedef T value_type;
     
         sparse_node_iterator() :
-            m_begin(nullptr),
+            m_begin(),
             m_previous(0U),
             m_current(0U),
             m_next(0U),
             m_size(0U) {}
 
-        sparse_node_iterator(pointer begin,
+        sparse_node_iterator(elements begin,
                 index_type previous,
                 index_type current,
                 index_type next,
@@ -92,7 +139,7 @@ namespace rte
             m_next(next),
             m_size(size) {}
 
-        sparse_node_iterator(const sparse_node_iterator<T, false>& spi) :
+        sparse_node_iterator(const sparse_node_iterator<T, false, Elements, ConstElements>& spi) :
             m_begin(spi.get_begin()),
             m_previous(spi.get_previous()),
             m_current(spi.get_current()),
@@ -110,11 +157,18 @@ namespace rte
 
         bool operator!=(const sparse_node_iterator& spi) const { return !(*this == spi); }
 
+        // Stepping past either end doesn't read any slot: the iterator keeps the sibling it comes
+        // from, so that it can step back
         sparse_node_iterator& operator++()
         {
+            index_type previous = m_current;
             m_current = m_next;
-            m_previous = m_begin[m_current].m_previous_sibling;
-            m_next = m_begin[m_current].m_next_sibling;
+            if (m_current != npos) {
+                m_previous = m_begin[m_current].m_previous_sibling;
+                m_next = m_begin[m_current].m_next_sibling;
+            } else {
+                m_previous = previous;
+            }
             return (*this);
         }
 
@@ -127,9 +181,14 @@ namespace rte
 
         sparse_node_iterator& operator--()
         {
+            index_type next = m_current;
             m_current = m_previous;
-            m_previous = m_begin[m_current].m_previous_sibling;
-            m_next = m_begin[m_current].m_next_sibling;
+            if (m_current != npos) {
+                m_previous = m_begin[m_current].m_previous_sibling;
+                m_next = m_begin[m_current].m_next_sibling;
+            } else {
+                m_next = next;
+            }
             return (*this);
         }
 
@@ -140,37 +199,24 @@ namespace rte
             return tmp;
         }
 
+        // Iterators only follow sibling links between live entries, so dereferencing them is only
+        // checked in debug builds. Use handles and sparse_vector::try_get() to detect stale references.
+        // Live entries have an odd generation, which lets the check work without the occupancy bitset.
         reference operator*() const
         {
             assert(m_current < m_size);
-            if (!(m_current < m_size)) {
-                throw std::out_of_range("sparse_node_iterator::operator*: invalid index");
-            }
-
-            assert(m_begin[m_current].m_used);
-            if (!m_begin[m_current].m_used) {
-                throw std::domain_error("sparse_node_iterator::operator*: entry has been erased");
-            }
-
+            assert(m_begin[m_current].m_generation & 1U);
             return m_begin[m_current];
         }
 
         pointer operator->() const
         {
             assert(m_current < m_size);
-            if (!(m_current < m_size)) {
-                throw std::out_of_range("sparse_node_iterator::operator->: invalid index");
-            }
-
-            assert(m_begin[m_current].m_used);
-            if (!m_begin[m_current].m_used) {
-                throw std::domain_error("sparse_node_iterator::operator->: entry has been erased");
-            }
-
-            return m_begin + m_current;
+            assert(m_begin[m_current].m_generation & 1U);
+            return &m_begin[m_current];
         }
     
-        pointer get_begin() const { return m_begin; }
+        elements get_begin() const { return m_begin; }
         index_type get_previous() const { return m_previous; }
         index_type get_current() const { return m_current; }
         index_type get_next() const { return m_next; }
@@ -180,15 +226,15 @@ namespace rte
         // Note that in order for reverse iteration with std::reverse_iterator to work, the end()
         // iterator must be able to do it--. This is why we store previous and next in the iterator,
         // otherwise end() wouldn't be able to go back.
-        pointer         m_begin;
+        elements        m_begin;
         index_type      m_previous;
         index_type      m_current;
         index_type      m_next;
         index_type      m_size;
     };
 
-    template<typename T, bool isconst>
-    index_type index(const sparse_node_iterator<T, isconst>& it)
+    template<typename T, bool isconst, typename Elements, typename ConstElements>
+    index_type index(const sparse_node_iterator<T, isconst, Elements, ConstElements>& it)
     {
         return it.get_current();
     }
@@ -202,27 +248,118 @@ namespace rte
         return index(tmp);
     }
 
-    template <typename T>
+    // Storage of sparse_vector that keeps the slots in a single std::vector and the occupancy bitset
+    // in another one, so iterators reach the slots through a plain pointer. This is the default and
+    // the fastest one to traverse.
+    //
+    // A storage only holds slots and their occupancy bits, sparse_vector builds the free list and
+    // the handles on top of it. Slots past size() are never read, and their bits are always clear.
+    template <typename T, typename Allocator>
+    class sparse_contiguous_storage
+    {
+    public:
+        typedef T value_type;
+        typedef Allocator allocator_type;
+        typedef typename std::allocator_traits<allocator_type>::template rebind_alloc<occupancy_word> occupancy_allocator_type;
+        typedef T* elements_type;
+        typedef const T* const_elements_type;
+
+        static constexpr bool copy_on_write = false;     //!< writing a slot never allocates
+
+        sparse_contiguous_storage() :
+            m_elems(),
+            m_used_bits() {}
+
+        explicit sparse_contiguous_storage(const allocator_type& allocator) :
+            m_elems(allocator),
+            m_used_bits(occupancy_allocator_type(allocator)) {}
+
+        // No bounds checking, sparse_vector does it
+        T& operator[](index_type index) { return m_elems[index]; }
+        const T& operator[](index_type index) const { return m_elems[index]; }
+
+        elements_type elements() { return m_elems.data(); }
+        const_elements_type elements() const { return m_elems.data(); }
+
+        // Words of the occupancy bitset. There may be more words than needed to cover size()
+        index_type word_count() const { return m_used_bits.size(); }
+        occupancy_word word(index_type w) const { return m_used_bits[w]; }
+        void set_bit(index_type index) { m_used_bits[index / occupancy_word_bits] |= occupancy_word(1U) << (index % occupancy_word_bits); }
+        void clear_bit(index_type index) { m_used_bits[index / occupancy_word_bits] &= ~(occupancy_word(1U) << (index % occupancy_word_bits)); }
+
+        // Appends default constructed slots until there are new_size. Nothing changes if it throws
+        void grow(index_type new_size)
+        {
+            // The bitset grows first, so that it is never behind the slots
+            grow_used_bits(new_size);
+            m_elems.resize(new_size);
+        }
+
+        void push_back(const T& t) { grow_used_bits(m_elems.size() + 1U); m_elems.push_back(t); }
+
+        // Slots can always be written in place
+        void make_writable(index_type) {}
+        bool try_make_writable(index_type) { return true; }
+
+        allocator_type get_allocator() const { return m_elems.get_allocator(); }
+        index_type size() const { return m_elems.size(); }
+        index_type capacity() const { return m_elems.capacity(); }
+        void reserve(index_type new_capacity) { m_elems.reserve(new_capacity); m_used_bits.reserve(occupancy_words(new_capacity)); }
+        void clear() { m_elems.clear(); m_used_bits.clear(); }
+        void swap(sparse_contiguous_storage& s) { m_elems.swap(s.m_elems); m_used_bits.swap(s.m_used_bits); }
+
+    private:
+        void grow_used_bits(index_type new_size)
+        {
+            if (m_used_bits.size() < occupancy_words(new_size)) {
+                m_used_bits.resize(occupancy_words(new_size), 0U);
+            }
+        }
+
+        std::vector<T, Allocator>                               m_elems;
+        std::vector<occupancy_word, occupancy_allocator_type>   m_used_bits;    //!< one bit per slot, bit i % 64 of word i / 64 is set when slot i is used
+    };
+
+    // Allocator is used for both the elements and the occupancy bitset. Allocators that don't compare
+    // equal can't be swapped, as with std::vector. Storage decides how the slots are laid out: either
+    // sparse_contiguous_storage (the default) or cow_chunked_storage, whose copies are snapshots that
+    // share memory with the original (see cow_storage.hpp).
+    template <typename T, typename Allocator = std::allocator<T>, template <typename, typename> class Storage = sparse_contiguous_storage>
     class sparse_vector
     {
     public:
         typedef T value_type;
         typedef value_type& reference;
         typedef const value_type& const_reference;
-        typedef std::vector<value_type> container;
-        typedef typename container::difference_type difference_type;
-        typedef typename container::allocator_type allocator_type;
-        typedef sparse_node_iterator<value_type, false> iterator;
-        typedef sparse_node_iterator<value_type, true> const_iterator;
+        typedef std::ptrdiff_t difference_type;
+        typedef Allocator allocator_type;
+        typedef Storage<T, Allocator> storage_type;
+        typedef typename storage_type::elements_type elements_type;
+        typedef typename storage_type::const_elements_type const_elements_type;
+        typedef sparse_node_iterator<value_type, false, elements_type, const_elements_type> iterator;
+        typedef sparse_node_iterator<value_type, true, elements_type, const_elements_type> const_iterator;
         typedef std::reverse_iterator<iterator> reverse_iterator;
         typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
     
-        sparse_vector() {}
+        sparse_vector() :
+            m_storage(),
+            m_free_head(npos),
+            m_generation_floor(0U) {}
+
+        explicit sparse_vector(const allocator_type& allocator) :
+            m_storage(allocator),
+            m_free_head(npos),
+            m_generation_floor(0U) {}
 
         sparse_vector(const sparse_vector& st) = default;
 
         sparse_vector(sparse_vector&& st) :
-            m_elems(std::move(st.m_elems)) {}
+            m_storage(std::move(st.m_storage)),
+            m_free_head(st.m_free_head),
+            m_generation_floor(st.m_generation_floor)
+        {
+            st.m_free_head = npos;
+        }
 
         ~sparse_vector() {}
     
@@ -231,100 +368,331 @@ namespace rte
         sparse_vector& operator=(sparse_vector&& st)
         {
             if (&st != this) {
-                m_elems = std::move(st.m_elems);            
+                m_storage = std::move(st.m_storage);
+                m_free_head = st.m_free_head;
+                m_generation_floor = st.m_generation_floor;
+                st.m_free_head = npos;
             }
 
             return *this;
         }
 
+        // Reserves a slot for a new element and returns its index. The slot is taken out of the free
+        // list but it is not marked as used, so it must be either marked with set_used() or given
+        // back with release(). Amortized O(1).
+        index_type allocate()
+        {
+            if (m_free_head != npos) {
+                // Read through a const reference, which never clones a chunk of cow_chunked_storage
+                const storage_type& storage = m_storage;
+                index_type new_index = m_free_head;
+                m_free_head = storage[new_index].m_next_sibling;
+                return new_index;
+            }
+
+            m_storage.grow(m_storage.size() + 1U);
+            // New slots are writable after grow(), so this doesn't throw
+            m_storage[m_storage.size() - 1].m_generation = m_generation_floor;
+            return m_storage.size() - 1;
+        }
+
+        // Reserves count slots at once and appends their indexes to indexes_out. Slots are taken from
+        // the free list first and the rest are appended to the storage with a single resize.
+        // As with allocate(), none of the slots is marked as used. If this method throws nothing has
+        // been reserved and indexes_out is left unchanged.
+        void allocate(index_type count, std::vector<index_type>& indexes_out)
+        {
+            index_type previous_size = indexes_out.size();
+            indexes_out.reserve(previous_size + count);
+            // The free list is only read, through a const reference that never clones a chunk of
+            // cow_chunked_storage. The slots taken from it keep their links, so a rollback only has
+            // to point m_free_head back to the first one, which doesn't write any slot
+            const storage_type& storage = m_storage;
+            index_type first_new_index = m_storage.size();
+            index_type remaining = count;
+            try {
+                while (indexes_out.size() - previous_size < count && m_free_head != npos) {
+                    indexes_out.push_back(m_free_head);
+                    m_free_head = storage[m_free_head].m_next_sibling;
+                }
+
+                remaining = count - (indexes_out.size() - previous_size);
+                m_storage.grow(first_new_index + remaining);
+            } catch (...) {
+                if (indexes_out.size() > previous_size) {
+                    m_free_head = indexes_out[previous_size];
+                    indexes_out.resize(previous_size);
+                }
+                throw;
+            }
+
+            for (index_type i = 0; i < remaining; i++) {
+                m_storage[first_new_index + i].m_generation = m_generation_floor;
+                indexes_out.push_back(first_new_index + i);
+            }
+        }
+
+        // Copies the value of an entry of another vector into a slot of this one. Like assignment of
+        // sparse_node, occupancy and m_generation are not touched
+        void copy_entry(index_type index_to_set, const sparse_vector& source, index_type source_index)
+        {
+            physical_at(index_to_set) = source.at(source_index);
+        }
+
+        // Gives back a slot obtained with allocate() or insert() that has not been marked as used.
+        // Never throws, so it can be used to roll back allocations. With cow_chunked_storage, a slot
+        // whose chunk is shared with a snapshot taken since it was allocated, and can't be cloned,
+        // is left out of the free list: it stays unused until tree_compact()
+        void release(index_type index_to_release)
+        {
+            assert(index_to_release < m_storage.size());
+            assert(!used(index_to_release));
+            if (!m_storage.try_make_writable(index_to_release)) {
+                return;
+            }
+            m_storage[index_to_release].m_next_sibling = m_free_head;
+            m_free_head = index_to_release;
+        }
+
         // Inserts a single element, but doesn't mark it as used yet for exception safety in the calling function.
+        // t may be an element of this vector: it is copied before allocate() can move the elements
         index_type insert(const T& t)
         {
-            auto nit = std::find_if(m_elems.begin(), m_elems.end(), [](const value_type& tn) {
-                return !tn.m_used;
-            }); 
-            index_type new_index = nit - m_elems.begin();
-            if (new_index == m_elems.size()) {
-                m_elems.push_back(value_type());
+            T copy(t);
+            index_type new_index = allocate();
+            try {
+                m_storage[new_index] = std::move(copy);
+            } catch (...) {
+                release(new_index);
+                throw;
             }
-            m_elems.at(new_index) = t;
 
             return new_index;
         }
 
-        reference at(index_type index)
+        // Same as insert(const T&), but moves the value into its slot instead of copying it
+        index_type insert(T&& t)
+        {
+            index_type new_index = allocate();
+            try {
+                m_storage[new_index] = std::move(t);
+            } catch (...) {
+                release(new_index);
+                throw;
+            }
+
+            return new_index;
+        }
+
+        // Same as insert(T&&), but builds the value from args. Slots always hold a constructed value,
+        // so the new value is move assigned into its slot rather than constructed in place
+        template<typename... Args>
+        index_type emplace(Args&&... args)
         {
-            assert(index < m_elems.size());
-            assert(m_elems.at(index).m_used);
+            return insert(value_type(std::forward<Args>(args)...));
+        }
 
-            reference ret = m_elems.at(index);
+        reference at(index_type index)
+        {
+            assert(index < m_storage.size());
+            assert(used(index));
 
-            if (!ret.m_used) {
+            check_range(index);
+            if (!used(index)) {
                 throw std::domain_error("sparse_vector::at invalid index, element has been erased");
             }
 
-            return ret;
+            return m_storage[index];
         }
 
         const_reference at(index_type index) const
         {
-            assert(index < m_elems.size());
-            assert(m_elems.at(index).m_used);
-
-            const_reference ret = m_elems.at(index);
+            assert(index < m_storage.size());
+            assert(used(index));
 
-            if (!ret.m_used) {
+            check_range(index);
+            if (!used(index)) {
                 throw std::domain_error("sparse_vector::at invalid index, element has been erased");
             }
 
-            return ret;
+            return m_storage[index];
         }
 
-        // This method has the same behavior as at() but doesn't check for m_used. This is meant to be used
+        // Returns a handle to a used element, which can be validated later with try_get()
+        sparse_handle get_handle(index_type index) const
+        {
+            return sparse_handle(index, at(index).m_generation);
+        }
+
+        // Returns the element referred by a handle, or nullptr if it has been erased since the handle
+        // was obtained (even if its slot has been reused later). Never throws.
+        value_type* try_get(sparse_handle h)
+        {
+            index_type i = h.get_index();
+            const storage_type& storage = m_storage;
+            return (i < storage.size() && storage[i].m_generation == h.get_generation())? &m_storage[i] : nullptr;
+        }
+
+        const value_type* try_get(sparse_handle h) const
+        {
+            index_type i = h.get_index();
+            return (i < m_storage.size() && m_storage[i].m_generation == h.get_generation())? &m_storage[i] : nullptr;
+        }
+
+        // This method has the same behavior as at() but doesn't check for occupancy. This is meant to be used
         // in contexts where entries that have not yet been marked as used need to be manipulated
         reference physical_at(index_type index)
         {
-            assert(index < m_elems.size());
-            reference ret = m_elems.at(index);
+            assert(index < m_storage.size());
+            check_range(index);
 
-            return ret;
+            return m_storage[index];
         }
 
         const_reference physical_at(index_type index) const
         {
-            assert(index < m_elems.size());
-            const_reference ret = m_elems.at(index);
+            assert(index < m_storage.size());
+            check_range(index);
 
-            return ret;
+            return m_storage[index];
         }
 
-        void erase(const std::set<index_type>& to_delete)
+        // Makes sure that writing the slot won't allocate, which only matters with
+        // cow_chunked_storage, whose shared chunks are cloned on the first write. Functions that must
+        // not throw past some point call it beforehand on every slot they will write
+        void make_writable(index_type index)
         {
-            for (auto it = to_delete.begin(); it != to_delete.end(); ++it) {
-                m_elems.at(*it).m_used = false;
-            }
+            check_range(index);
+            m_storage.make_writable(index);
         }
 
+        // Returns what iterators use to reach the slots. Indexing it is not checked at all
+        elements_type elements() { return m_storage.elements(); }
+        const_elements_type elements() const { return m_storage.elements(); }
+
+        // index_to_set must have been obtained from allocate(), insert() or push_back()
         void set_used(index_type index_to_set)
         {
-            m_elems.at(index_to_set).m_used = true;
+            check_range(index_to_set);
+            if (!used(index_to_set)) {
+                m_storage.set_bit(index_to_set);
+                m_storage[index_to_set].m_generation++;
+            }
+        }
+
+        // Makes every slot appended from now on, by allocate() or push_back(), start from a generation
+        // newer than generation, so that handles taken with that generation or an older one never
+        // match it. Used when the slots are rebuilt in a new vector, like tree_compact() does
+        void skip_generations(generation_type generation)
+        {
+            m_generation_floor = std::max(m_generation_floor, generation_type((generation | 1U) + 1U));
         }
 
+        // Returns a generation at least as new as the one of any slot this vector has ever had
+        generation_type newest_generation() const
+        {
+            generation_type newest = m_generation_floor;
+            for (index_type i = 0; i < m_storage.size(); i++) {
+                newest = std::max(newest, m_storage[i].m_generation);
+            }
+
+            return newest;
+        }
+
+        // Marks an element as not used and threads it into the free list so it can be reused
         void clear_used(index_type index_to_clear)
         {
-            m_elems.at(index_to_clear).m_used = false;
+            check_range(index_to_clear);
+            if (used(index_to_clear)) {
+                m_storage.clear_bit(index_to_clear);
+                m_storage[index_to_clear].m_generation++;
+                release(index_to_clear);
+            }
+        }
+
+        // Returns true if the slot holds a live element. Out of range indexes are not used. Reads only the bitset
+        bool used(index_type index) const
+        {
+            return index < m_storage.size() && ((m_storage.word(index / occupancy_word_bits) >> (index % occupancy_word_bits)) & 1U);
         }
 
+        // Returns the number of live elements. Counts 64 slots per step without touching the elements
+        index_type count_used() const
+        {
+            index_type count = 0U;
+            for (index_type w = 0; w < m_storage.word_count(); w++) {
+                count += occupancy_popcount(m_storage.word(w));
+            }
+
+            return count;
+        }
+
+        // Returns the lowest index of a slot that is not used, or npos if all the slots are used.
+        // Note that allocate() doesn't necessarily return this slot, as it takes slots from the free list
+        index_type first_free() const
+        {
+            for (index_type w = 0; w < m_storage.word_count(); w++) {
+                occupancy_word free_bits = ~m_storage.word(w);
+                if (free_bits != 0U) {
+                    index_type index = w * occupancy_word_bits + occupancy_lowest_bit(free_bits);
+                    return (index < m_storage.size()? index : npos);
+                }
+            }
+
+            return npos;
+        }
+
+        // Calls f(index) for every used slot in increasing index order. Only the bitset is scanned, so
+        // runs of erased slots are skipped a whole word at a time. f must not insert or erase elements
+        template<typename F>
+        void for_each_used(F f) const
+        {
+            for (index_type w = 0; w < m_storage.word_count(); w++) {
+                occupancy_word word = m_storage.word(w);
+                while (word != 0U) {
+                    f(w * occupancy_word_bits + occupancy_lowest_bit(word));
+                    word &= word - 1U;
+                }
+            }
+        }
+
+        const storage_type& get_storage() const { return m_storage; }
+        allocator_type get_allocator() const { return m_storage.get_allocator(); }
         // Returs physical number of elements. Elements that have been erased are counted too.
-        index_type size() const { return m_elems.size(); }
-        // Does a physical push_back on the underlying vector, but doesn't mark the new element as used
+        index_type size() const { return m_storage.size(); }
+        // Returns the number of elements that can be held without reallocating
+        index_type capacity() const { return m_storage.capacity(); }
+        // Makes room for at least new_capacity elements without reallocating. Indexes are not affected.
+        void reserve(index_type new_capacity) { m_storage.reserve(new_capacity); }
+        // Does a physical push_back on the underlying storage, but doesn't mark the new element as used
         // for exception safety of the calling function.
-        void push_back(const value_type& t) { m_elems.push_back(t); }
-        void clear() { m_elems.clear(); }
-        void swap(sparse_vector& sf) { m_elems.swap(sf.m_elems); }
+        void push_back(const value_type& t) { m_storage.push_back(t); m_storage[m_storage.size() - 1].m_generation = m_generation_floor; }
+        // Erases all the elements. Slots created afterwards get a generation newer than any slot had,
+        // so handles taken before don't match the new elements
+        void clear()
+        {
+            skip_generations(newest_generation());
+            m_storage.clear();
+            m_free_head = npos;
+        }
+        void swap(sparse_vector& sf)
+        {
+            m_storage.swap(sf.m_storage);
+            std::swap(m_free_head, sf.m_free_head);
+            std::swap(m_generation_floor, sf.m_generation_floor);
+        }
 
     private:
-        container      m_elems;
+        void check_range(index_type index) const
+        {
+            if (!(index < m_storage.size())) {
+                throw std::out_of_range("sparse_vector: index out of range");
+            }
+        }
+
+        storage_type                 m_storage;
+        index_type                   m_free_head;    //!< first slot of the free list, which is threaded through m_next_sibling of unused slots
+        generation_type              m_generation_floor;    //!< generation of the slots appended from now on, see skip_generations()
     };
 } // namespace rte
 
@@ -0,0 +1,159 @@
+#ifndef SPLIT_SPARSE_VECTOR_HPP
+#define SPLIT_SPARSE_VECTOR_HPP
+
+#include "sparse_vector.hpp"
+
+#include <utility>
+#include <memory>
+#include <vector>
+
+namespace rte
+{
+    // A sparse_vector that splits each entry into a hot part and a cold part stored in separate arrays
+    // (hot/cold splitting). The hot part is the value_type seen by the tree and list functions, so
+    // tree_begin(), tree_insert(), tree_erase() and the rest work unchanged and only touch hot data.
+    // The cold part holds data that is rarely accessed (names, user ids...), which is read with
+    // cold_at(). Passes that only need links and hot data stream through a smaller array.
+    //
+    // T must derive from sparse_node. C can be any default constructible type. The cold part of a new
+    // entry is always default constructed, even when its slot is reused. The cold array uses
+    // Allocator rebound to C, and the same Storage as the hot one.
+    template <typename T, typename C, typename Allocator = std::allocator<T>, template <typename, typename> class Storage = sparse_contiguous_storage>
+    class split_sparse_vector : public sparse_vector<T, Allocator, Storage>
+    {
+    public:
+        typedef sparse_vector<T, Allocator, Storage> base;
+        typedef typename base::allocator_type allocator_type;
+        typedef C cold_type;
+        typedef cold_type& cold_reference;
+        typedef const cold_type& const_cold_reference;
+        typedef typename std::allocator_traits<allocator_type>::template rebind_alloc<cold_type> cold_allocator_type;
+        typedef Storage<cold_type, cold_allocator_type> cold_container;
+
+        split_sparse_vector() :
+            base(),
+            m_cold() {}
+
+        explicit split_sparse_vector(const allocator_type& allocator) :
+            base(allocator),
+            m_cold(cold_allocator_type(allocator)) {}
+
+        split_sparse_vector(const split_sparse_vector&) = default;
+        split_sparse_vector(split_sparse_vector&&) = default;
+        ~split_sparse_vector() {}
+        split_sparse_vector& operator=(const split_sparse_vector&) = default;
+        split_sparse_vector& operator=(split_sparse_vector&&) = default;
+
+        index_type allocate()
+        {
+            // Make room in the cold array first, so that the hot array never gets ahead of it
+            grow_cold(1U);
+            index_type new_index = base::allocate();
+            m_cold[new_index] = cold_type();
+            return new_index;
+        }
+
+        void allocate(index_type count, std::vector<index_type>& indexes_out)
+        {
+            grow_cold(count);
+            index_type previous_size = indexes_out.size();
+            base::allocate(count, indexes_out);
+            for (index_type i = previous_size; i < indexes_out.size(); i++) {
+                m_cold[indexes_out[i]] = cold_type();
+            }
+        }
+
+        // t may be an entry of this vector, so it is copied before allocate() can move the entries
+        index_type insert(const T& t)
+        {
+            T copy(t);
+            index_type new_index = allocate();
+            try {
+                base::physical_at(new_index) = std::move(copy);
+            } catch (...) {
+                base::release(new_index);
+                throw;
+            }
+
+            return new_index;
+        }
+
+        index_type insert(T&& t)
+        {
+            index_type new_index = allocate();
+            try {
+                base::physical_at(new_index) = std::move(t);
+            } catch (...) {
+                base::release(new_index);
+                throw;
+            }
+
+            return new_index;
+        }
+
+        template<typename... Args>
+        index_type emplace(Args&&... args)
+        {
+            return insert(T(std::forward<Args>(args)...));
+        }
+
+        // Copies both the hot and the cold part of an entry
+        void copy_entry(index_type index_to_set, const split_sparse_vector& source, index_type source_index)
+        {
+            base::copy_entry(index_to_set, source, source_index);
+            m_cold[index_to_set] = source.m_cold[source_index];
+        }
+
+        // Same checks as at(), but returns the cold part of the entry
+        cold_reference cold_at(index_type index)
+        {
+            base::at(index);
+            return m_cold[index];
+        }
+
+        const_cold_reference cold_at(index_type index) const
+        {
+            base::at(index);
+            return m_cold[index];
+        }
+
+        const cold_container& get_cold_storage() const { return m_cold; }
+
+        void push_back(const T& t)
+        {
+            grow_cold(1U);
+            base::push_back(t);
+        }
+
+        void reserve(index_type new_capacity)
+        {
+            base::reserve(new_capacity);
+            m_cold.reserve(new_capacity);
+        }
+
+        void clear()
+        {
+            base::clear();
+            m_cold.clear();
+        }
+
+        void swap(split_sparse_vector& ssv)
+        {
+            base::swap(ssv);
+            m_cold.swap(ssv.m_cold);
+        }
+
+    private:
+        // Invariant: m_cold.size() >= size(). Cold entries beyond size() are spare and default constructed.
+        void grow_cold(index_type count)
+        {
+            if (m_cold.size() < base::size() + count) {
+                m_cold.grow(base::size() + count);
+            }
+        }
+
+        cold_container m_cold;
+    };
+} // namespace rte
+
+#endif // SPLIT_SPARSE_VECTOR_HPP
@@ -0,0 +1,100 @@
+#include "glm/gtx/transform.hpp"
+#include "gtest/gtest.h"
+#include "bounds.hpp"
+
+#include <random>
+#include <vector>
+
+using namespace rte;
+
+class bounds_test : public ::testing::Test
+{
+protected:
+    bounds_test() {}
+    virtual ~bounds_test() {}
+};
+
+std::vector<glm::vec3> random_points(unsigned int count, unsigned int seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> dist(-2.0f, 3.0f);
+    std::vector<glm::vec3> points;
+    for (unsigned int i = 0; i < count; i++) {
+        points.push_back(glm::vec3(dist(rng), dist(rng) * 0.5f, dist(rng) * 2.0f));
+    }
+
+    return points;
+}
+
+bool contains(const aabb& box, const glm::vec3& p)
+{
+    const float eps = 1e-4f;
+    return glm::all(glm::greaterThanEqual(p, box.m_min - eps)) && glm::all(glm::lessThanEqual(p, box.m_max + eps));
+}
+
+bool contains(const bounding_sphere& sphere, const glm::vec3& p)
+{
+    return glm::length(p - sphere.m_center) <= sphere.m_radius + 1e-4f;
+}
+
+TEST_F(bounds_test, empty) {
+    ASSERT_TRUE(aabb().empty());
+    ASSERT_TRUE(bounding_sphere().empty());
+    ASSERT_TRUE(aabb_from_points({}).empty());
+    ASSERT_TRUE(sphere_from_points({}).empty());
+    ASSERT_TRUE(transform_aabb(aabb(), glm::translate(glm::vec3(1.0f))).empty());
+    ASSERT_TRUE(transform_sphere(bounding_sphere(), glm::translate(glm::vec3(1.0f))).empty());
+
+    aabb box;
+    box.add(glm::vec3(1.0f, 2.0f, 3.0f));
+    ASSERT_FALSE(box.empty());
+    ASSERT_EQ(box.m_min, box.m_max);
+}
+
+TEST_F(bounds_test, points) {
+    auto points = random_points(1000U, 1U);
+    aabb box = aabb_from_points(points);
+    bounding_sphere sphere = sphere_from_points(points);
+    for (auto& p : points) {
+        ASSERT_TRUE(contains(box, p));
+        ASSERT_TRUE(contains(sphere, p));
+    }
+    // The sphere is never bigger than the one around the box
+    ASSERT_LE(sphere.m_radius, glm::length(box.extent()) + 1e-4f);
+}
+
+TEST_F(bounds_test, transformed_bounds_contain_transformed_points) {
+    auto points = random_points(500U, 2U);
+    aabb box = aabb_from_points(points);
+    bounding_sphere sphere = sphere_from_points(points);
+    glm::mat4 transforms[] = {
+        glm::mat4(1.0f),
+        glm::translate(glm::vec3(5.0f, -1.0f, 2.0f)) * glm::rotate(0.7f, glm::normalize(glm::vec3(1.0f, 2.0f, 3.0f))),
+        glm::rotate(-2.0f, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::scale(glm::vec3(3.0f, 0.5f, 1.0f)),
+        glm::scale(glm::vec3(-1.0f, 1.0f, 1.0f)) * glm::translate(glm::vec3(1.0f, 1.0f, 1.0f))
+    };
+    for (auto& m : transforms) {
+        aabb world_box = transform_aabb(box, m);
+        bounding_sphere world_sphere = transform_sphere(sphere, m);
+        aabb tight_box;
+        for (auto& p : points) {
+            glm::vec3 world_p = glm::vec3(m * glm::vec4(p, 1.0f));
+            ASSERT_TRUE(contains(world_box, world_p));
+            ASSERT_TRUE(contains(world_sphere, world_p));
+            tight_box.add(world_p);
+        }
+        // The identity keeps the box, up to rounding
+        if (m == glm::mat4(1.0f)) {
+            ASSERT_LT(glm::length(world_box.m_min - box.m_min), 1e-4f);
+            ASSERT_LT(glm::length(world_box.m_max - box.m_max), 1e-4f);
+        }
+        ASSERT_TRUE(contains(world_box, tight_box.m_min));
+        ASSERT_TRUE(contains(world_box, tight_box.m_max));
+    }
+}
+
+int main(int argc, char** argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,243 @@
+#include "glm/gtx/transform.hpp"
+#include "gtest/gtest.h"
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+using namespace rte;
+
+class bvh_test : public ::testing::Test
+{
+protected:
+    bvh_test() {}
+    virtual ~bvh_test() {}
+};
+
+// Boxes of random sizes spread over a 200 units wide cube, with a few empty ones
+std::vector<aabb> random_boxes(index_type count, std::mt19937& rng)
+{
+    std::uniform_real_distribution<float> position(-100.0f, 100.0f);
+    std::uniform_real_distribution<float> size(0.1f, 3.0f);
+    std::vector<aabb> boxes;
+    for (index_type i = 0; i < count; i++) {
+        glm::vec3 center(position(rng), position(rng), position(rng));
+        boxes.push_back(i % 97U == 0U? aabb() : aabb(center - size(rng), center + size(rng)));
+    }
+
+    return boxes;
+}
+
+frustum test_frustum(float yaw)
+{
+    return frustum_from_matrix(glm::perspective(glm::radians(60.0f), 4.0f / 3.0f, 0.1f, 80.0f) *
+                               glm::rotate(yaw, glm::vec3(0.0f, 1.0f, 0.0f)) *
+                               glm::lookAt(glm::vec3(0.0f, 0.0f, 50.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+}
+
+std::vector<index_type> expected_visible(const frustum& f, const std::vector<aabb>& boxes, const std::vector<index_type>& items)
+{
+    std::vector<index_type> visible;
+    for (auto item : items) {
+        if (frustum_test_aabb(f, boxes[item])) {
+            visible.push_back(item);
+        }
+    }
+    std::sort(visible.begin(), visible.end());
+
+    return visible;
+}
+
+std::vector<index_type> query(const bvh& tree, const frustum& f, const std::vector<aabb>& boxes, transform_kernel kernel = transform_best_kernel())
+{
+    std::vector<index_type> visible;
+    bvh_query(tree, kernel, f, [&boxes](index_type i) { return boxes[i]; }, visible);
+    std::sort(visible.begin(), visible.end());
+
+    return visible;
+}
+
+// Every item is in exactly one leaf and every node contains its children and items
+void check_structure(const bvh& tree, const std::vector<aabb>& boxes, index_type item_count)
+{
+    std::vector<index_type> seen(boxes.size(), 0U);
+    auto contains = [](const aabb& outer, const aabb& inner) {
+        return inner.empty() || (glm::all(glm::lessThanEqual(outer.m_min, inner.m_min)) && glm::all(glm::greaterThanEqual(outer.m_max, inner.m_max)));
+    };
+    for (index_type i = 0; i < tree.m_nodes.size(); i++) {
+        auto& n = tree.m_nodes[i];
+        if (n.m_count == 0U) {
+            ASSERT_GT(n.m_first, i);
+            ASSERT_EQ(tree.m_nodes[n.m_first].m_parent, i);
+            ASSERT_EQ(tree.m_nodes[n.m_first + 1U].m_parent, i);
+            ASSERT_TRUE(contains(n.m_bounds, tree.m_nodes[n.m_first].m_bounds));
+            ASSERT_TRUE(contains(n.m_bounds, tree.m_nodes[n.m_first + 1U].m_bounds));
+        } else {
+            ASSERT_LE(n.m_count, bvh_max_leaf_size);
+            for (index_type k = n.m_first; k < n.m_first + n.m_count; k++) {
+                index_type item = tree.m_items.m_nodes[k];
+                if (item != npos) {
+                    seen[item]++;
+                    ASSERT_EQ(tree.m_item_leaves[item], i);
+                    ASSERT_TRUE(contains(n.m_bounds, boxes[item]));
+                }
+            }
+        }
+    }
+    index_type total = 0U;
+    for (auto s : seen) {
+        ASSERT_LE(s, 1U);
+        total += s;
+    }
+    ASSERT_EQ(total, item_count);
+    ASSERT_EQ(tree.m_item_count, item_count);
+}
+
+TEST_F(bvh_test, build) {
+    std::mt19937 rng(17U);
+    auto boxes = random_boxes(5000U, rng);
+    std::vector<index_type> items;
+    for (index_type i = 0; i < boxes.size(); i += 2U) {
+        items.push_back(i);
+    }
+
+    bvh tree;
+    bvh_build(tree, items, [&boxes](index_type i) { return boxes[i]; });
+    check_structure(tree, boxes, items.size());
+    ASSERT_FALSE(bvh_contains(tree, 1U));
+    ASSERT_TRUE(bvh_contains(tree, 2U));
+    ASSERT_FALSE(bvh_needs_rebuild(tree));
+
+    bvh_build(tree, {}, [&boxes](index_type i) { return boxes[i]; });
+    ASSERT_TRUE(tree.m_nodes.empty());
+    ASSERT_TRUE(query(tree, test_frustum(0.0f), boxes).empty());
+}
+
+TEST_F(bvh_test, same_centroids) {
+    // All the boxes share their center, so no split separates them: leaves are split by count
+    std::vector<aabb> boxes;
+    std::vector<index_type> items;
+    for (index_type i = 0; i < 100U; i++) {
+        boxes.push_back(aabb(glm::vec3(-1.0f - i), glm::vec3(1.0f + i)));
+        items.push_back(i);
+    }
+    bvh tree;
+    bvh_build(tree, items, [&boxes](index_type i) { return boxes[i]; });
+    check_structure(tree, boxes, items.size());
+    ASSERT_EQ(query(tree, test_frustum(0.0f), boxes), expected_visible(test_frustum(0.0f), boxes, items));
+}
+
+TEST_F(bvh_test, query_matches_linear_test) {
+    std::mt19937 rng(19U);
+    auto boxes = random_boxes(20000U, rng);
+    std::vector<index_type> items(boxes.size());
+    for (index_type i = 0; i < items.size(); i++) {
+        items[i] = i;
+    }
+
+    bvh tree;
+    bvh_build(tree, items, [&boxes](index_type i) { return boxes[i]; });
+    for (float yaw : {0.0f, 1.0f, 2.5f, -2.0f}) {
+        frustum f = test_frustum(yaw);
+        auto expected = expected_visible(f, boxes, items);
+        ASSERT_FALSE(expected.empty());
+        for (auto kernel : {transform_kernel::scalar, transform_kernel::sse, transform_kernel::avx2}) {
+            if (transform_kernel_supported(kernel)) {
+                ASSERT_EQ(query(tree, f, boxes, kernel), expected);
+            }
+        }
+    }
+}
+
+TEST_F(bvh_test, refit) {
+    std::mt19937 rng(23U);
+    auto boxes = random_boxes(10000U, rng);
+    std::vector<index_type> items(boxes.size());
+    for (index_type i = 0; i < items.size(); i++) {
+        items[i] = i;
+    }
+    auto get_bounds = [&boxes](index_type i) { return boxes[i]; };
+    bvh tree;
+    bvh_build(tree, items, get_bounds);
+
+    // Move one item in ten across the scene, only their paths to the root are recomputed
+    std::uniform_real_distribution<float> offset(-50.0f, 50.0f);
+    for (index_type i = 0; i < boxes.size(); i += 10U) {
+        if (!boxes[i].empty()) {
+            glm::vec3 d(offset(rng), offset(rng), offset(rng));
+            boxes[i] = aabb(boxes[i].m_min + d, boxes[i].m_max + d);
+        }
+        bvh_mark_item(tree, i);
+    }
+    index_type refit_count = bvh_refit(tree, get_bounds);
+    ASSERT_GT(refit_count, 0U);
+    ASSERT_LT(refit_count, tree.m_nodes.size());
+    ASSERT_TRUE(tree.m_marked.empty());
+    check_structure(tree, boxes, items.size());
+    frustum f = test_frustum(0.5f);
+    ASSERT_EQ(query(tree, f, boxes), expected_visible(f, boxes, items));
+
+    // A full refit gives the same bounds
+    auto nodes = tree.m_nodes;
+    bvh_refit_all(tree, get_bounds);
+    for (index_type i = 0; i < nodes.size(); i++) {
+        ASSERT_EQ(nodes[i].m_bounds.m_min, tree.m_nodes[i].m_bounds.m_min);
+        ASSERT_EQ(nodes[i].m_bounds.m_max, tree.m_nodes[i].m_bounds.m_max);
+    }
+}
+
+TEST_F(bvh_test, insert_remove) {
+    std::mt19937 rng(29U);
+    auto boxes = random_boxes(3000U, rng);
+    auto get_bounds = [&boxes](index_type i) { return boxes[i]; };
+    std::vector<index_type> items;
+    for (index_type i = 0; i < 2000U; i++) {
+        items.push_back(i);
+    }
+    bvh tree;
+    bvh_build(tree, items, get_bounds);
+
+    // Items inserted after the build are found, removed ones are not, whether they were built
+    // into a leaf or were still pending
+    for (index_type i = 2000U; i < 2200U; i++) {
+        bvh_insert(tree, i);
+        items.push_back(i);
+    }
+    bvh_insert(tree, 2000U);
+    ASSERT_EQ(tree.m_pending.size(), 200U);
+    for (index_type i : {3U, 500U, 1999U, 2050U, 2199U}) {
+        bvh_remove(tree, i);
+        items.erase(std::find(items.begin(), items.end(), i));
+        ASSERT_FALSE(bvh_contains(tree, i));
+    }
+    bvh_remove(tree, 2500U);
+    ASSERT_FALSE(bvh_needs_rebuild(tree));
+    ASSERT_EQ(tree.m_pending.size(), 198U);
+    ASSERT_EQ(tree.m_removed_count, 3U);
+    // Pending items are removed by swapping the last one into their place
+    for (index_type k = 0; k < tree.m_pending.size(); k++) {
+        ASSERT_EQ(tree.m_pending_slots[tree.m_pending[k]], k);
+    }
+    bvh_refit(tree, get_bounds);
+    for (float yaw : {0.0f, 2.0f}) {
+        ASSERT_EQ(query(tree, test_frustum(yaw), boxes), expected_visible(test_frustum(yaw), boxes, items));
+    }
+
+    // 261 changes for 1997 items built, more than one in eight
+    for (index_type i = 2200U; i < 2260U; i++) {
+        bvh_insert(tree, i);
+        items.push_back(i);
+    }
+    ASSERT_TRUE(bvh_needs_rebuild(tree));
+    bvh_build(tree, items, get_bounds);
+    check_structure(tree, boxes, items.size());
+    ASSERT_FALSE(bvh_needs_rebuild(tree));
+    ASSERT_EQ(query(tree, test_frustum(1.0f), boxes), expected_visible(test_frustum(1.0f), boxes, items));
+}
+
+int main(int argc, char** argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,91 @@
+#include "glm/gtx/transform.hpp"
+#include "frustum_culling.hpp"
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+using namespace rte;
+
+class frustum_culling_test : public ::testing::Test
+{
+protected:
+    frustum_culling_test() {}
+    virtual ~frustum_culling_test() {}
+};
+
+// Camera at (0, 0, 10) looking at the origin, 45 degrees of field of view, from 0.1 to 100
+glm::mat4 view_projection()
+{
+    return glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 100.0f) *
+           glm::lookAt(glm::vec3(0.0f, 0.0f, 10.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+}
+
+aabb box_at(const glm::vec3& center, float half_size)
+{
+    return aabb(center - glm::vec3(half_size), center + glm::vec3(half_size));
+}
+
+TEST_F(frustum_culling_test, planes) {
+    frustum f = frustum_from_matrix(view_projection());
+    for (auto& plane : f.m_planes) {
+        ASSERT_NEAR(glm::length(glm::vec3(plane)), 1.0f, 1e-5f);
+        // The point looked at is inside every plane
+        ASSERT_GT(plane.w, 0.0f);
+    }
+    // Near plane faces the view direction, 0.1 in front of the camera
+    ASSERT_NEAR(f.m_planes[4].z, -1.0f, 1e-4f);
+    ASSERT_NEAR(f.m_planes[4].w, 9.9f, 1e-3f);
+}
+
+TEST_F(frustum_culling_test, test_aabb) {
+    frustum f = frustum_from_matrix(view_projection());
+    ASSERT_TRUE(frustum_test_aabb(f, box_at(glm::vec3(0.0f), 1.0f)));
+    ASSERT_FALSE(frustum_test_aabb(f, box_at(glm::vec3(0.0f, 0.0f, 20.0f), 1.0f)));      // behind the camera
+    ASSERT_FALSE(frustum_test_aabb(f, box_at(glm::vec3(0.0f, 0.0f, -200.0f), 1.0f)));    // beyond the far plane
+    ASSERT_FALSE(frustum_test_aabb(f, box_at(glm::vec3(50.0f, 0.0f, 0.0f), 1.0f)));      // right
+    ASSERT_FALSE(frustum_test_aabb(f, box_at(glm::vec3(0.0f, -50.0f, 0.0f), 1.0f)));     // below
+    ASSERT_TRUE(frustum_test_aabb(f, box_at(glm::vec3(0.0f, 0.0f, 20.0f), 10.5f)));      // contains the camera
+    ASSERT_TRUE(frustum_test_aabb(f, box_at(glm::vec3(6.0f, 0.0f, 0.0f), 2.5f)));        // crosses the right plane
+    ASSERT_FALSE(frustum_test_aabb(f, aabb()));
+}
+
+TEST_F(frustum_culling_test, kernels_match_reference) {
+    std::mt19937 rng(13U);
+    std::uniform_real_distribution<float> position(-60.0f, 60.0f);
+    std::uniform_real_distribution<float> size(0.0f, 5.0f);
+    frustum f = frustum_from_matrix(glm::rotate(0.3f, glm::vec3(0.0f, 1.0f, 0.0f)) * view_projection());
+
+    // An odd count leaves a tail for the scalar loop of the SIMD kernels
+    cull_batch batch;
+    std::vector<index_type> expected;
+    for (index_type i = 0; i < 1003U; i++) {
+        aabb box = (i % 50U == 0U? aabb() : box_at(glm::vec3(position(rng), position(rng), position(rng)), size(rng)));
+        cull_batch_add(batch, i * 2U, box);
+        if (frustum_test_aabb(f, box)) {
+            expected.push_back(i * 2U);
+        }
+    }
+    ASSERT_FALSE(expected.empty());
+    ASSERT_LT(expected.size(), batch.m_nodes.size());
+
+    for (auto kernel : {transform_kernel::scalar, transform_kernel::sse, transform_kernel::avx2}) {
+        if (!transform_kernel_supported(kernel)) {
+            continue;
+        }
+        std::vector<index_type> visible = {42U};
+        ASSERT_EQ(frustum_cull(kernel, f, batch, visible), expected.size());
+        ASSERT_EQ(visible, expected);
+    }
+
+    cull_batch_clear(batch);
+    std::vector<index_type> visible;
+    ASSERT_EQ(frustum_cull(transform_best_kernel(), f, batch, visible), 0U);
+}
+
+int main(int argc, char** argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
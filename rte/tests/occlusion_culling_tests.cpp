@@ -0,0 +1,193 @@
+#include "glm/gtx/transform.hpp"
+#include "occlusion_culling.hpp"
+#include "gtest/gtest.h"
+
+#include <random>
+#include <limits>
+#include <vector>
+
+using namespace rte;
+
+class occlusion_culling_test : public ::testing::Test
+{
+protected:
+    occlusion_culling_test() {}
+    virtual ~occlusion_culling_test() {}
+};
+
+// Camera at (0, 0, 10) looking at the origin
+glm::mat4 view_projection()
+{
+    return glm::perspective(glm::radians(60.0f), 2.0f, 0.1f, 100.0f) *
+           glm::lookAt(glm::vec3(0.0f, 0.0f, 10.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+}
+
+// Square of side 2 in the xy plane, centered at the origin
+const std::vector<glm::vec3> quad_vertices = {
+    glm::vec3(-1.0f, -1.0f, 0.0f), glm::vec3(1.0f, -1.0f, 0.0f), glm::vec3(1.0f, 1.0f, 0.0f), glm::vec3(-1.0f, 1.0f, 0.0f)
+};
+const std::vector<vindex> quad_indices = {0, 1, 2, 0, 2, 3};
+
+occluder make_occluder(const glm::mat4& model)
+{
+    return occluder{quad_vertices.data(), quad_indices.data(), quad_indices.size(), model};
+}
+
+aabb box_at(const glm::vec3& center, float half_size)
+{
+    return aabb(center - glm::vec3(half_size), center + glm::vec3(half_size));
+}
+
+TEST_F(occlusion_culling_test, init) {
+    occlusion_buffer buffer;
+    ASSERT_THROW(occlusion_buffer_init(buffer, 100U, 50U), std::invalid_argument);
+    occlusion_buffer_init(buffer, 104U, 50U);
+    ASSERT_EQ(buffer.m_levels.size(), 8U);
+    ASSERT_EQ(buffer.m_level_widths[1], 52U);
+    ASSERT_EQ(buffer.m_level_heights[1], 25U);
+    ASSERT_EQ(buffer.m_level_heights[2], 13U);
+    ASSERT_EQ(buffer.m_levels.back().size(), 1U);
+}
+
+TEST_F(occlusion_culling_test, occluded_boxes) {
+    // A wall of 8x8 units at z = 0 hides what is right behind it
+    occlusion_buffer buffer;
+    occlusion_buffer_init(buffer, 128U, 64U);
+    occlusion_buffer_clear(buffer, view_projection());
+    tree_worker_pool pool(0U);
+    occlusion_rasterize(buffer, {make_occluder(glm::scale(glm::vec3(4.0f)))}, transform_kernel::scalar, pool);
+
+    ASSERT_FALSE(occlusion_test_aabb(buffer, box_at(glm::vec3(0.0f, 0.0f, -5.0f), 1.0f)));
+    ASSERT_FALSE(occlusion_test_aabb(buffer, box_at(glm::vec3(1.0f, -1.0f, -20.0f), 2.0f)));
+    ASSERT_TRUE(occlusion_test_aabb(buffer, box_at(glm::vec3(0.0f, 0.0f, 2.0f), 1.0f)));        // in front
+    ASSERT_TRUE(occlusion_test_aabb(buffer, box_at(glm::vec3(0.0f, 0.0f, 0.0f), 1.0f)));        // through the wall
+    ASSERT_TRUE(occlusion_test_aabb(buffer, box_at(glm::vec3(8.0f, 0.0f, -5.0f), 1.0f)));       // beside
+    ASSERT_TRUE(occlusion_test_aabb(buffer, box_at(glm::vec3(0.0f, 5.0f, -5.0f), 1.5f)));       // sticks out above
+    ASSERT_TRUE(occlusion_test_aabb(buffer, box_at(glm::vec3(0.0f, 0.0f, 10.0f), 1.0f)));       // around the camera
+    ASSERT_FALSE(occlusion_test_aabb(buffer, aabb()));
+
+    // The boxes are removed, the order of the others is kept
+    std::vector<aabb> boxes = {box_at(glm::vec3(0.0f, 0.0f, 2.0f), 1.0f), box_at(glm::vec3(0.0f, 0.0f, -5.0f), 1.0f), box_at(glm::vec3(8.0f, 0.0f, -5.0f), 1.0f)};
+    std::vector<index_type> nodes = {0U, 1U, 2U};
+    auto get_bounds = [&boxes](index_type i) { return boxes[i]; };
+    ASSERT_EQ(occlusion_cull(buffer, nodes, get_bounds), 1U);
+    ASSERT_EQ(nodes, std::vector<index_type>({0U, 2U}));
+
+    // Nothing is hidden by an empty buffer
+    occlusion_buffer_clear(buffer, view_projection());
+    ASSERT_TRUE(occlusion_test_aabb(buffer, box_at(glm::vec3(0.0f, 0.0f, -5.0f), 1.0f)));
+}
+
+TEST_F(occlusion_culling_test, occluders_outlive_mesh_buffers) {
+    // The renderer copies the meshes that can be occluders, then the database releases its buffers
+    std::vector<occluder_mesh> meshes(2U);
+    {
+        std::vector<glm::vec3> vertices = quad_vertices;
+        std::vector<vindex> indices = quad_indices;
+        std::vector<vindex> big_indices(3U * 9U, 0U);
+        occluder_mesh_init(meshes[0], vertices, indices, 8U);
+        occluder_mesh_init(meshes[1], vertices, big_indices, 8U);
+        vertices.clear();
+        vertices.shrink_to_fit();
+        indices.clear();
+        indices.shrink_to_fit();
+    }
+    ASSERT_EQ(meshes[0].m_indices, quad_indices);
+    ASSERT_EQ(meshes[0].m_vertices.size(), quad_vertices.size());
+    ASSERT_TRUE(meshes[1].m_indices.empty());       // over the triangle limit
+
+    ASSERT_FLOAT_EQ(occluder_screen_size(bounding_sphere(glm::vec3(0.0f), 1.0f), glm::vec3(0.0f, 0.0f, 10.0f)), 0.1f);
+    ASSERT_EQ(occluder_screen_size(bounding_sphere(glm::vec3(0.0f), 1.0f), glm::vec3(0.0f, 0.5f, 0.0f)), std::numeric_limits<float>::max());
+
+    // The biggest candidate is kept, and rasterized from the copy
+    glm::mat4 wall = glm::scale(glm::vec3(4.0f));
+    glm::mat4 small = glm::translate(glm::vec3(20.0f, 0.0f, 0.0f)) * glm::scale(glm::vec3(0.1f));
+    std::vector<occluder_candidate> candidates = {{0.05f, &meshes[0], &small}, {0.4f, &meshes[0], &wall}};
+    std::vector<occluder> occluders;
+    occlusion_select_occluders(candidates, 1U, occluders);
+    ASSERT_EQ(occluders.size(), 1U);
+    ASSERT_EQ(occluders[0].m_vertices, meshes[0].m_vertices.data());
+    ASSERT_TRUE(occluders[0].m_model == wall);
+
+    occlusion_buffer buffer;
+    occlusion_buffer_init(buffer, 128U, 64U);
+    occlusion_buffer_clear(buffer, view_projection());
+    tree_worker_pool pool(0U);
+    occlusion_rasterize(buffer, occluders, transform_kernel::scalar, pool);
+    ASSERT_FALSE(occlusion_test_aabb(buffer, box_at(glm::vec3(0.0f, 0.0f, -5.0f), 1.0f)));
+    ASSERT_TRUE(occlusion_test_aabb(buffer, box_at(glm::vec3(0.0f, 0.0f, 2.0f), 1.0f)));
+
+    occlusion_select_occluders(candidates, 4U, occluders);
+    ASSERT_EQ(occluders.size(), 2U);
+}
+
+TEST_F(occlusion_culling_test, near_plane_clipping) {
+    // A floor that goes under the camera and behind it still hides what is below it
+    occlusion_buffer buffer;
+    occlusion_buffer_init(buffer, 64U, 32U);
+    occlusion_buffer_clear(buffer, view_projection());
+    tree_worker_pool pool(0U);
+    glm::mat4 floor = glm::translate(glm::vec3(0.0f, -1.0f, 0.0f)) * glm::rotate(glm::radians(-90.0f), glm::vec3(1.0f, 0.0f, 0.0f)) * glm::scale(glm::vec3(50.0f));
+    occlusion_rasterize(buffer, {make_occluder(floor)}, transform_kernel::scalar, pool);
+
+    index_type written = 0U;
+    for (auto depth : buffer.m_levels[0]) {
+        ASSERT_GE(depth, 0.0f);
+        written += (depth < 1.0f? 1U : 0U);
+    }
+    // The lower half of the view sees the floor
+    ASSERT_GE(written, 64U * 15U);
+    ASSERT_LE(written, 64U * 17U);
+    ASSERT_FALSE(occlusion_test_aabb(buffer, box_at(glm::vec3(0.0f, -4.0f, 0.0f), 1.0f)));
+    ASSERT_TRUE(occlusion_test_aabb(buffer, box_at(glm::vec3(0.0f, 0.0f, 0.0f), 0.5f)));
+}
+
+TEST_F(occlusion_culling_test, kernels_and_threads_match) {
+    std::mt19937 rng(31U);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<occluder> occluders;
+    for (int i = 0; i < 200; i++) {
+        glm::vec3 axis = glm::normalize(glm::vec3(dist(rng), dist(rng), dist(rng) + 2.0f));
+        occluders.push_back(make_occluder(glm::translate(glm::vec3(dist(rng) * 8.0f, dist(rng) * 4.0f, dist(rng) * 20.0f)) *
+                                          glm::rotate(dist(rng) * 3.0f, axis) * glm::scale(glm::vec3(1.0f + dist(rng)))));
+    }
+
+    occlusion_buffer expected;
+    occlusion_buffer_init(expected, 200U, 100U);
+    occlusion_buffer_clear(expected, view_projection());
+    tree_worker_pool single(0U);
+    occlusion_rasterize(expected, occluders, transform_kernel::scalar, single);
+
+    tree_worker_pool pool(3U);
+    for (auto kernel : {transform_kernel::scalar, transform_kernel::sse, transform_kernel::avx2}) {
+        if (!transform_kernel_supported(kernel)) {
+            continue;
+        }
+        occlusion_buffer buffer;
+        occlusion_buffer_init(buffer, 200U, 100U);
+        occlusion_buffer_clear(buffer, view_projection());
+        occlusion_rasterize(buffer, occluders, kernel, pool);
+        for (index_type l = 0; l < buffer.m_levels.size(); l++) {
+            for (index_type k = 0; k < buffer.m_levels[l].size(); k++) {
+                ASSERT_NEAR(buffer.m_levels[l][k], expected.m_levels[l][k], 1e-5f);
+            }
+        }
+    }
+
+    // Each texel of the pyramid is the farthest of the ones below it
+    for (index_type l = 1; l < expected.m_levels.size(); l++) {
+        index_type width = expected.m_level_widths[l];
+        index_type below_width = expected.m_level_widths[l - 1U];
+        for (index_type y = 0; y < expected.m_level_heights[l]; y++) {
+            for (index_type x = 0; x < width; x++) {
+                ASSERT_GE(expected.m_levels[l][y * width + x], expected.m_levels[l - 1U][2U * y * below_width + 2U * x]);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
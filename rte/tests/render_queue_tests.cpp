@@ -0,0 +1,88 @@
+#include "render_queue.hpp"
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+using namespace rte;
+
+class render_queue_test : public ::testing::Test
+{
+protected:
+    render_queue_test() {}
+    virtual ~render_queue_test() {}
+};
+
+TEST_F(render_queue_test, key_fields_order)
+{
+    // Each field decides the order only when the fields above it are equal
+    ASSERT_LT(make_draw_key(0U, 9U, 9U, 9U, 9U, 100.0f), make_draw_key(1U, 0U, 0U, 0U, 0U, 0.0f));
+    ASSERT_LT(make_draw_key(1U, 1U, 9U, 9U, 9U, 100.0f), make_draw_key(1U, 2U, 0U, 0U, 0U, 0.0f));
+    ASSERT_LT(make_draw_key(1U, 2U, 3U, 9U, 9U, 100.0f), make_draw_key(1U, 2U, 4U, 0U, 0U, 0.0f));
+    ASSERT_LT(make_draw_key(1U, 2U, 3U, 4U, 9U, 100.0f), make_draw_key(1U, 2U, 3U, 5U, 0U, 0.0f));
+    ASSERT_LT(make_draw_key(1U, 2U, 3U, 4U, 5U, 100.0f), make_draw_key(1U, 2U, 3U, 4U, 6U, 0.0f));
+    ASSERT_LT(make_draw_key(1U, 2U, 3U, 4U, 5U, 1.0f), make_draw_key(1U, 2U, 3U, 4U, 5U, 2.0f));
+
+    draw_key key = make_draw_key(3U, 2U, 3U, 4U, 5U, 7.0f);
+    ASSERT_EQ(3U, draw_key_pass(key));
+    ASSERT_EQ(draw_key_state(key), draw_key_state(make_draw_key(3U, 2U, 3U, 4U, 5U, 1000.0f)));
+    ASSERT_NE(draw_key_state(key), draw_key_state(make_draw_key(3U, 2U, 3U, 4U, 6U, 7.0f)));
+
+    // Truncated identifiers don't spill over the other fields
+    ASSERT_EQ(draw_key_pass(make_draw_key(1U, npos, npos, npos, npos, 1.0f)), 1U);
+}
+
+TEST_F(render_queue_test, key_depth_is_monotonic)
+{
+    ASSERT_EQ(0U, draw_key_depth(0.0f));
+    ASSERT_EQ(0U, draw_key_depth(-5.0f));
+    draw_key previous = 0U;
+    for (float distance = 0.001f; distance < 1.0e6f; distance *= 1.1f) {
+        draw_key depth = draw_key_depth(distance);
+        ASSERT_GE(depth, previous);
+        ASSERT_LT(depth, draw_key(1U) << draw_key_depth_bits);
+        previous = depth;
+    }
+    // Distances more than 1/16 of their power of two apart are told apart
+    ASSERT_LT(draw_key_depth(8.0f), draw_key_depth(8.6f));
+}
+
+TEST_F(render_queue_test, sort_matches_stable_sort)
+{
+    // Both below and above render_queue_radix_min_items
+    std::mt19937 rng(5U);
+    for (unsigned int count : {0U, 1U, 17U, 1000U, 3000U, 20000U}) {
+        render_queue queue;
+        std::uniform_int_distribution<index_type> small(0U, 3U);
+        std::uniform_real_distribution<float> distance(0.0f, 50.0f);
+        for (index_type i = 0U; i < count; i++) {
+            // Few distinct values per field, so many keys are equal and most bytes are shared
+            render_queue_add(queue, make_draw_key(small(rng), small(rng), small(rng), small(rng), small(rng), distance(rng)), i);
+        }
+
+        std::vector<render_item> expected = queue.m_items;
+        std::stable_sort(expected.begin(), expected.end(), [](const render_item& a, const render_item& b) {
+            return a.m_key < b.m_key;
+        });
+        render_queue_sort(queue);
+
+        ASSERT_EQ(expected.size(), queue.m_items.size());
+        for (std::size_t i = 0U; i < expected.size(); i++) {
+            ASSERT_EQ(expected[i].m_key, queue.m_items[i].m_key);
+            ASSERT_EQ(expected[i].m_node, queue.m_items[i].m_node);
+        }
+
+        // Clearing keeps the memory for the next frame
+        std::size_t capacity = queue.m_items.capacity();
+        render_queue_clear(queue);
+        ASSERT_TRUE(queue.m_items.empty());
+        ASSERT_EQ(capacity, queue.m_items.capacity());
+    }
+}
+
+int main(int argc, char** argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,479 @@
+#include "glm/gtx/transform.hpp"
+#include "sparse_list.hpp"
+#include "rte_domain.hpp"
+#include "gtest/gtest.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+
+using namespace rte;
+
+class rte_domain_test : public ::testing::Test
+{
+protected:
+    rte_domain_test() {}
+    virtual ~rte_domain_test() {}
+};
+
+// Database with the empty lists of materials and meshes, and a root node, as load_database() leaves it
+void init_database(view_database& db)
+{
+    list_init(db.m_materials);
+    list_empty_list(db.m_materials);
+    list_init(db.m_meshes);
+    list_empty_list(db.m_meshes);
+    db.m_root_node = tree_insert(db.m_nodes, node());
+    mark_transform_dirty(db.m_root_node, db);
+}
+
+// Inserts an empty node with a translation, queued for update_accum_transforms()
+index_type insert_node(index_type parent_index, const glm::vec3& translation, view_database& db)
+{
+    index_type node_index = npos;
+    insert_node_tree(npos, parent_index, node_index, db);
+    set_local_translation(node_index, translation, db);
+    return node_index;
+}
+
+// Checks the accumulated transform of every node against the product of the local transforms of
+// its ancestors, composed like the engine does: accumulated = local * accumulated of the parent
+void check_accum_transforms(const view_database& db)
+{
+    db.m_nodes.for_each_used([&db](index_type i) {
+        glm::mat4 expected(1.0f);
+        for (index_type j = i; j != npos; j = db.m_nodes.at(j).m_parent) {
+            expected = expected * trs_to_matrix(db.m_nodes.at(j).m_local_transform);
+        }
+        auto& accum = db.m_nodes.at(i).m_accum_transform;
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++) {
+                ASSERT_NEAR(accum[c][r], expected[c][r], 1e-4f) << "node " << i;
+            }
+        }
+    });
+}
+
+TEST_F(rte_domain_test, default_construction) {
+    view_database db;
+    ASSERT_EQ(db.m_root_node, npos);
+    ASSERT_EQ(db.m_skybox, npos);
+    ASSERT_EQ(db.m_recomputed_transforms, 0U);
+    ASSERT_TRUE(db.m_dirty_transforms.empty());
+    ASSERT_TRUE(db.m_render_list.empty());
+}
+
+TEST_F(rte_domain_test, accum_transforms_nested_queue) {
+    view_database db;
+    init_database(db);
+    auto a = insert_node(db.m_root_node, glm::vec3(1.0f, 0.0f, 0.0f), db);
+    auto b = insert_node(a, glm::vec3(0.0f, 2.0f, 0.0f), db);
+    auto c = insert_node(db.m_root_node, glm::vec3(0.0f, 0.0f, 3.0f), db);
+    ASSERT_EQ(update_accum_transforms(db), 4U);
+    ASSERT_EQ(db.m_recomputed_transforms, 4U);
+    ASSERT_TRUE(db.m_dirty_transforms.empty());
+    check_accum_transforms(db);
+
+    // Nothing queued, nothing recomputed
+    ASSERT_EQ(update_accum_transforms(db), 0U);
+
+    // b is queued inside the subtree of a, which recomputes it, so it is skipped. c is untouched
+    set_local_translation(b, glm::vec3(0.0f, 5.0f, 0.0f), db);
+    set_local_translation(a, glm::vec3(4.0f, 0.0f, 0.0f), db);
+    set_local_translation(b, glm::vec3(0.0f, 6.0f, 0.0f), db);
+    ASSERT_EQ(db.m_dirty_transforms.size(), 2U);
+    ASSERT_EQ(update_accum_transforms(db), 2U);
+    ASSERT_EQ(db.m_recomputed_transforms, 2U);
+    check_accum_transforms(db);
+    ASSERT_EQ(glm::vec3(db.m_nodes.at(b).m_accum_transform[3]), glm::vec3(4.0f, 6.0f, 0.0f));
+    ASSERT_EQ(glm::vec3(db.m_nodes.at(c).m_accum_transform[3]), glm::vec3(0.0f, 0.0f, 3.0f));
+}
+
+TEST_F(rte_domain_test, accum_transforms_composition) {
+    // Rotations and non-uniform scales don't commute, so the order of the products matters
+    view_database db;
+    init_database(db);
+    auto a = insert_node(db.m_root_node, glm::vec3(1.0f, 0.0f, 0.0f), db);
+    set_local_rotation(a, glm::angleAxis(0.5f, glm::vec3(0.0f, 0.0f, 1.0f)), db);
+    set_local_scale(a, glm::vec3(2.0f, 1.0f, 0.5f), db);
+    auto b = insert_node(a, glm::vec3(0.0f, 3.0f, 0.0f), db);
+    set_local_rotation(b, glm::angleAxis(1.2f, glm::vec3(1.0f, 0.0f, 0.0f)), db);
+    set_local_scale(b, glm::vec3(1.0f, 4.0f, 1.0f), db);
+    auto c = insert_node(b, glm::vec3(0.0f, 0.0f, -2.0f), db);
+    set_local_rotation(c, glm::angleAxis(-0.7f, glm::vec3(0.0f, 1.0f, 0.0f)), db);
+    set_local_scale(c, glm::vec3(0.5f, 3.0f, 2.0f), db);
+    ASSERT_EQ(update_accum_transforms(db), 4U);
+    check_accum_transforms(db);
+    auto local = [&db](index_type i) { return trs_to_matrix(db.m_nodes.at(i).m_local_transform); };
+    glm::mat4 expected = local(c) * local(b) * local(a);
+    ASSERT_NE(expected, local(a) * local(b) * local(c));
+    for (int col = 0; col < 4; col++) {
+        for (int r = 0; r < 4; r++) {
+            ASSERT_NEAR(db.m_nodes.at(c).m_accum_transform[col][r], expected[col][r], 1e-4f);
+        }
+    }
+
+    // Changing a node in the middle recomputes its subtree with the new transform
+    set_local_rotation(b, glm::angleAxis(-0.3f, glm::normalize(glm::vec3(0.0f, 1.0f, 1.0f))), db);
+    set_local_scale(c, glm::vec3(2.0f, 0.25f, 1.0f), db);
+    ASSERT_EQ(update_accum_transforms(db), 2U);
+    check_accum_transforms(db);
+}
+
+TEST_F(rte_domain_test, accum_transforms_erased_and_reused_slots) {
+    view_database db;
+    init_database(db);
+    auto a = insert_node(db.m_root_node, glm::vec3(1.0f, 0.0f, 0.0f), db);
+    auto b = insert_node(a, glm::vec3(0.0f, 2.0f, 0.0f), db);
+    update_accum_transforms(db);
+
+    // A queued node that is erased is skipped
+    set_local_translation(b, glm::vec3(0.0f, 3.0f, 0.0f), db);
+    erase_node_tree(b, db);
+    ASSERT_EQ(update_accum_transforms(db), 0U);
+    ASSERT_TRUE(db.m_dirty_transforms.empty());
+
+    // A reused slot is skipped while its new node has not been queued
+    set_local_translation(a, glm::vec3(7.0f, 0.0f, 0.0f), db);
+    auto a_child = insert_node(a, glm::vec3(0.0f, 1.0f, 0.0f), db);
+    update_accum_transforms(db);
+    set_local_translation(a_child, glm::vec3(0.0f, 2.0f, 0.0f), db);
+    erase_node_tree(a_child, db);
+    auto unqueued = tree_insert(db.m_nodes, node(), a);
+    ASSERT_EQ(unqueued, a_child);
+    ASSERT_EQ(update_accum_transforms(db), 0U);
+    ASSERT_EQ(db.m_nodes.at(unqueued).m_accum_transform, glm::mat4(1.0f));
+    erase_node_tree(unqueued, db);
+
+    // Once queued, the new node is recomputed once, even if its slot is in the queue twice
+    set_local_translation(a, glm::vec3(8.0f, 0.0f, 0.0f), db);
+    auto c = insert_node(db.m_root_node, glm::vec3(0.0f, 0.0f, 1.0f), db);
+    erase_node_tree(c, db);
+    auto reused = insert_node(a, glm::vec3(0.0f, 0.0f, 2.0f), db);
+    ASSERT_EQ(reused, c);
+    ASSERT_EQ(update_accum_transforms(db), 2U);
+    check_accum_transforms(db);
+}
+
+TEST_F(rte_domain_test, accum_transforms_queue_after_compaction) {
+    view_database db;
+    init_database(db);
+    auto a = insert_node(db.m_root_node, glm::vec3(1.0f, 0.0f, 0.0f), db);
+    auto b = insert_node(a, glm::vec3(0.0f, 2.0f, 0.0f), db);
+    auto c = insert_node(db.m_root_node, glm::vec3(0.0f, 0.0f, 3.0f), db);
+    auto d = insert_node(c, glm::vec3(0.0f, 4.0f, 0.0f), db);
+    update_accum_transforms(db);
+
+    // The queue is remapped along with the nodes, and the erased ones are dropped
+    set_local_translation(b, glm::vec3(0.0f, 5.0f, 0.0f), db);
+    erase_node_tree(a, db);
+    set_local_translation(d, glm::vec3(0.0f, 6.0f, 0.0f), db);
+    set_local_translation(c, glm::vec3(0.0f, 0.0f, 7.0f), db);
+    ASSERT_EQ(db.m_dirty_transforms, std::vector<index_type>({b, d, c}));
+    compact_database(db);
+    ASSERT_EQ(db.m_nodes.size(), 3U);
+    ASSERT_EQ(db.m_dirty_transforms, std::vector<index_type>({2U, 1U}));
+    ASSERT_EQ(update_accum_transforms(db), 2U);
+    check_accum_transforms(db);
+    ASSERT_EQ(glm::vec3(db.m_nodes.at(2U).m_accum_transform[3]), glm::vec3(0.0f, 6.0f, 7.0f));
+}
+
+// Inserts a node with a mesh and a material, which goes to the render list if its ancestors are enabled
+index_type insert_rendered_node(index_type parent_index, view_database& db)
+{
+    index_type node_index = insert_node(parent_index, glm::vec3(0.0f), db);
+    set_node_mesh(node_index, index(list_begin(db.m_meshes, 0)), db);
+    set_node_material(node_index, index(list_begin(db.m_materials, 0)), db);
+    return node_index;
+}
+
+// Checks that the render list holds what a walk of the tree finds, that m_render_slot of every node
+// points to its entry (or is npos), and that the spatial index holds the nodes of the list
+void check_render_list(const view_database& db)
+{
+    std::vector<index_type> expected;
+    if (db.m_root_node != npos) {
+        get_descendant_nodes(db.m_root_node, expected, db);
+    }
+    std::vector<index_type> render_list = db.m_render_list;
+    std::sort(expected.begin(), expected.end());
+    std::sort(render_list.begin(), render_list.end());
+    ASSERT_EQ(render_list, expected);
+
+    db.m_nodes.for_each_used([&db](index_type i) {
+        index_type slot = db.m_nodes.at(i).m_render_slot;
+        if (slot != npos) {
+            ASSERT_LT(slot, db.m_render_list.size()) << "node " << i;
+            ASSERT_EQ(db.m_render_list[slot], i) << "node " << i;
+        } else {
+            ASSERT_EQ(std::count(db.m_render_list.begin(), db.m_render_list.end(), i), 0) << "node " << i;
+        }
+    });
+
+    ASSERT_EQ(db.m_spatial_index.m_item_count + db.m_spatial_index.m_pending.size(), db.m_render_list.size());
+    for (auto i : db.m_render_list) {
+        ASSERT_TRUE(bvh_contains(db.m_spatial_index, i)) << "node " << i;
+    }
+}
+
+TEST_F(rte_domain_test, accum_transforms_after_copy) {
+    view_database db;
+    init_database(db);
+    std::vector<index_type> children;
+    for (int i = 0; i < 600; i++) {
+        children.push_back(insert_node(db.m_root_node, glm::vec3(float(i), 0.0f, 0.0f), db));
+    }
+    update_accum_transforms(db);
+    auto& storage = db.m_nodes.get_storage();
+    ASSERT_EQ(storage.chunk_count(), 3U);
+
+    // A copy shares the chunks of the nodes. Recomputing a subtree only clones its chunks, and the
+    // chunk of its parent is only read
+    const view_database snapshot = db;
+    index_type moved = children[400];
+    ASSERT_EQ(moved / cow_chunk_size, 1U);
+    ASSERT_EQ(db.m_root_node / cow_chunk_size, 0U);
+    set_local_translation(moved, glm::vec3(0.0f, 9.0f, 0.0f), db);
+    ASSERT_EQ(update_accum_transforms(db), 1U);
+    ASSERT_TRUE(storage.shares_chunk(snapshot.m_nodes.get_storage(), 0));
+    ASSERT_FALSE(storage.shares_chunk(snapshot.m_nodes.get_storage(), 1));
+    ASSERT_TRUE(storage.shares_chunk(snapshot.m_nodes.get_storage(), 2));
+    for (index_type c = 0; c < 3U; c++) {
+        ASSERT_TRUE(db.m_nodes.get_cold_storage().shares_chunk(snapshot.m_nodes.get_cold_storage(), c));
+    }
+    check_accum_transforms(db);
+    ASSERT_EQ(glm::vec3(db.m_nodes.at(moved).m_accum_transform[3]), glm::vec3(0.0f, 9.0f, 0.0f));
+    ASSERT_EQ(glm::vec3(snapshot.m_nodes.at(moved).m_accum_transform[3]), glm::vec3(400.0f, 0.0f, 0.0f));
+}
+
+TEST_F(rte_domain_test, render_list_swap_remove) {
+    view_database db;
+    init_database(db);
+    list_insert(db.m_meshes, 0, mesh());
+    list_insert(db.m_materials, 0, material());
+    std::vector<index_type> nodes;
+    for (int i = 0; i < 5; i++) {
+        nodes.push_back(insert_rendered_node(db.m_root_node, db));
+    }
+    update_accum_transforms(db);
+    ASSERT_EQ(db.m_render_list, nodes);
+    check_render_list(db);
+
+    // The last entry takes the place of the removed one
+    set_node_material(nodes[1], npos, db);
+    ASSERT_EQ(db.m_render_list, std::vector<index_type>({nodes[0], nodes[4], nodes[2], nodes[3]}));
+    check_render_list(db);
+    set_node_mesh(nodes[3], npos, db);
+    check_render_list(db);
+    set_node_mesh(nodes[0], npos, db);
+    check_render_list(db);
+
+    // Adding them back appends them
+    set_node_material(nodes[1], index(list_begin(db.m_materials, 0)), db);
+    set_node_mesh(nodes[3], index(list_begin(db.m_meshes, 0)), db);
+    ASSERT_EQ(db.m_render_list.back(), nodes[3]);
+    check_render_list(db);
+    update_accum_transforms(db);
+    check_render_list(db);
+}
+
+TEST_F(rte_domain_test, render_list_mesh_and_material) {
+    view_database db;
+    init_database(db);
+    auto m = list_insert(db.m_meshes, 0, mesh());
+    auto mat = list_insert(db.m_materials, 0, material());
+    auto n = insert_node(db.m_root_node, glm::vec3(0.0f), db);
+    check_render_list(db);
+
+    // A node needs both a mesh and a material
+    set_node_mesh(n, m, db);
+    ASSERT_TRUE(db.m_render_list.empty());
+    check_render_list(db);
+    set_node_material(n, mat, db);
+    ASSERT_EQ(db.m_render_list, std::vector<index_type>({n}));
+    check_render_list(db);
+    set_node_material(n, mat, db);
+    ASSERT_EQ(db.m_render_list.size(), 1U);
+    set_node_mesh(n, npos, db);
+    ASSERT_TRUE(db.m_render_list.empty());
+    check_render_list(db);
+
+    // Under a disabled ancestor, neither of them adds the node
+    set_node_enabled(db.m_root_node, false, db);
+    set_node_mesh(n, m, db);
+    set_node_material(n, mat, db);
+    ASSERT_TRUE(db.m_render_list.empty());
+    check_render_list(db);
+    set_node_enabled(db.m_root_node, true, db);
+    ASSERT_EQ(db.m_render_list, std::vector<index_type>({n}));
+    check_render_list(db);
+}
+
+TEST_F(rte_domain_test, render_list_enabled) {
+    view_database db;
+    init_database(db);
+    list_insert(db.m_meshes, 0, mesh());
+    list_insert(db.m_materials, 0, material());
+    auto parent = insert_rendered_node(db.m_root_node, db);
+    auto child = insert_rendered_node(parent, db);
+    auto grandchild = insert_rendered_node(child, db);
+    auto sibling = insert_rendered_node(db.m_root_node, db);
+    ASSERT_EQ(db.m_render_list.size(), 4U);
+    check_render_list(db);
+
+    // Disabling a node removes its whole subtree
+    set_node_enabled(parent, false, db);
+    ASSERT_EQ(db.m_render_list, std::vector<index_type>({sibling}));
+    check_render_list(db);
+
+    // Nodes under a disabled ancestor stay out, whatever their own flag
+    set_node_enabled(child, false, db);
+    set_node_enabled(child, true, db);
+    ASSERT_EQ(db.m_render_list, std::vector<index_type>({sibling}));
+    check_render_list(db);
+    set_node_enabled(grandchild, false, db);
+    check_render_list(db);
+
+    // Enabling the ancestor brings back the nodes that are enabled themselves
+    set_node_enabled(parent, true, db);
+    ASSERT_EQ(db.m_render_list.size(), 3U);
+    ASSERT_EQ(db.m_nodes.at(grandchild).m_render_slot, npos);
+    check_render_list(db);
+    set_node_enabled(grandchild, true, db);
+    check_render_list(db);
+
+    // New nodes under a disabled ancestor are not added
+    set_node_enabled(child, false, db);
+    insert_rendered_node(child, db);
+    ASSERT_EQ(db.m_render_list.size(), 2U);
+    check_render_list(db);
+}
+
+TEST_F(rte_domain_test, render_list_nested_disabled) {
+    // Disabled subtrees at different depths, each followed by enabled siblings and cousins
+    view_database db;
+    init_database(db);
+    list_insert(db.m_meshes, 0, mesh());
+    list_insert(db.m_materials, 0, material());
+    auto a = insert_rendered_node(db.m_root_node, db);
+    auto a1 = insert_rendered_node(a, db);
+    insert_rendered_node(a1, db);
+    insert_rendered_node(a, db);
+    auto b = insert_rendered_node(db.m_root_node, db);
+    auto b1 = insert_rendered_node(b, db);
+    insert_rendered_node(b1, db);
+    auto b2 = insert_rendered_node(b, db);
+    insert_rendered_node(b2, db);
+    auto c = insert_rendered_node(db.m_root_node, db);
+    set_node_enabled(a1, false, db);
+    set_node_enabled(b, false, db);
+    set_node_enabled(b2, false, db);
+    check_render_list(db);
+    ASSERT_EQ(db.m_render_list.size(), 3U);
+
+    // Walking the whole tree again gives the same list
+    set_node_enabled(db.m_root_node, false, db);
+    ASSERT_TRUE(db.m_render_list.empty());
+    set_node_enabled(db.m_root_node, true, db);
+    check_render_list(db);
+    ASSERT_EQ(db.m_render_list.size(), 3U);
+    ASSERT_NE(db.m_nodes.at(c).m_render_slot, npos);
+
+    set_node_enabled(b, true, db);
+    check_render_list(db);
+    ASSERT_EQ(db.m_render_list.size(), 6U);
+}
+
+TEST_F(rte_domain_test, render_list_erase) {
+    view_database db;
+    init_database(db);
+    list_insert(db.m_meshes, 0, mesh());
+    list_insert(db.m_materials, 0, material());
+    auto first = insert_rendered_node(db.m_root_node, db);
+    auto parent = insert_rendered_node(db.m_root_node, db);
+    insert_rendered_node(parent, db);
+    insert_rendered_node(parent, db);
+    auto last = insert_rendered_node(db.m_root_node, db);
+    update_accum_transforms(db);
+    check_render_list(db);
+
+    // Erasing a subtree in the middle of the list moves the entries after it
+    erase_node_tree(parent, db);
+    ASSERT_EQ(db.m_render_list.size(), 2U);
+    check_render_list(db);
+
+    // Slots of erased nodes are reused by the new ones
+    auto reused = insert_rendered_node(first, db);
+    check_render_list(db);
+    erase_node_tree(last, db);
+    update_accum_transforms(db);
+    ASSERT_EQ(db.m_render_list.size(), 2U);
+    ASSERT_NE(db.m_nodes.at(reused).m_render_slot, npos);
+    check_render_list(db);
+
+    erase_node_tree(db.m_root_node, db);
+    ASSERT_EQ(db.m_root_node, npos);
+    ASSERT_TRUE(db.m_render_list.empty());
+    check_render_list(db);
+}
+
+TEST_F(rte_domain_test, render_list_after_compaction) {
+    view_database db;
+    init_database(db);
+    list_insert(db.m_meshes, 0, mesh());
+    auto erased_material = list_insert(db.m_materials, 0, material());
+    auto moved_material = list_insert(db.m_materials, 0, material());
+    std::vector<index_type> nodes;
+    for (int i = 0; i < 6; i++) {
+        nodes.push_back(insert_rendered_node(i < 3? db.m_root_node : nodes[i - 3], db));
+        set_node_material(nodes.back(), moved_material, db);
+    }
+    set_node_enabled(nodes[4], false, db);
+    update_accum_transforms(db);
+    erase_node_tree(nodes[0], db);
+    list_erase(db.m_materials, erased_material);
+    check_render_list(db);
+
+    // The list and the spatial index hold the new indexes, the slots stay valid, and the nodes
+    // follow their material into the slot left by the erased one
+    index_type list_size = db.m_render_list.size();
+    compact_database(db);
+    ASSERT_EQ(db.m_render_list.size(), list_size);
+    ASSERT_EQ(db.m_nodes.at(db.m_render_list[0]).m_material, erased_material);
+    check_render_list(db);
+    update_accum_transforms(db);
+    check_render_list(db);
+
+    // The compacted database keeps tracking changes
+    set_node_enabled(db.m_nodes.at(db.m_render_list[0]).m_parent, false, db);
+    check_render_list(db);
+    insert_rendered_node(db.m_root_node, db);
+    check_render_list(db);
+}
+
+TEST_F(rte_domain_test, set_local_transform_matrix) {
+    view_database db;
+    init_database(db);
+    update_accum_transforms(db);
+
+    // A matrix made of translation, rotation and scale is split and queued
+    glm::mat4 trs = glm::translate(glm::vec3(1.0f, 2.0f, 3.0f)) * glm::scale(glm::vec3(2.0f));
+    set_local_transform(db.m_root_node, trs, db);
+    ASSERT_EQ(db.m_dirty_transforms.size(), 1U);
+    ASSERT_EQ(update_accum_transforms(db), 1U);
+    ASSERT_EQ(db.m_nodes.at(db.m_root_node).m_accum_transform, trs);
+
+    // A shear can't be split, and the node is left untouched
+    glm::mat4 shear(1.0f);
+    shear[1][0] = 0.5f;
+    ASSERT_THROW(set_local_transform(db.m_root_node, trs * shear, db), std::invalid_argument);
+    ASSERT_THROW(set_local_transform(db.m_root_node, glm::perspective(1.0f, 1.0f, 0.1f, 10.0f), db), std::invalid_argument);
+    ASSERT_TRUE(db.m_dirty_transforms.empty());
+    ASSERT_EQ(trs_to_matrix(db.m_nodes.at(db.m_root_node).m_local_transform), trs);
+}
+
+int main(int argc, char** argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -1,7 +1,13 @@
+#include "concurrent_append.hpp"
+#include "parallel_tree.hpp"
 #include "sparse_tree.hpp"
+#include "cow_storage.hpp"
 #include "gtest/gtest.h"
 
+#include <stdexcept>
 #include <iostream>
+#include <atomic>
+#include <thread>
 #include <vector>
 
 using namespace rte;
@@ -228,7 +234,7 @@ index_type get_number_of_nodes_with_begin(my_vector& st, index_type root)
     std::vector<index_type> pending_nodes;
     pending_nodes.push_back(root);
     while (!pending_nodes.empty()) {
-        auto& node_index = pending_nodes.back();
+        auto node_index = pending_nodes.back();
         pending_nodes.pop_back();
         ret++;
         // This tests the non-const version of begin() and end()
@@ -419,6 +425,435 @@ TEST_F(sparse_tree_test, assignment) {
     ASSERT_EQ(get_number_of_nodes_with_begin(st2, 0), 9U);
 }
 
+void collect_values(const my_vector& st, index_type root, std::vector<int>& values_out)
+{
+    struct context { index_type node_index; int depth; };
+    std::vector<context> pending_nodes;
+    pending_nodes.push_back({root, 0});
+    while (!pending_nodes.empty()) {
+        auto current = pending_nodes.back();
+        pending_nodes.pop_back();
+        // Store depth and value so that two trees only compare equal if they have the same shape
+        values_out.push_back(current.depth);
+        values_out.push_back(st.at(current.node_index).m_val);
+        for (auto it = tree_rbegin(st, current.node_index); it != tree_rend(st, current.node_index); ++it) {
+            pending_nodes.push_back({index(it), current.depth + 1});
+        }
+    }
+}
+
+TEST_F(sparse_tree_test, insert_large_tree) {
+    // Build a tree mixing deep chains and wide fans
+    my_vector it;
+    tree_init(it);
+    tree_insert(it, my_struct(0));
+    for (int i = 1; i < 100000; i++) {
+        index_type parent = (i % 10 == 0)? i - 1 : (i / 10) * 10;
+        tree_insert(it, my_struct(i), parent);
+    }
+
+    // Leave some holes in the output tree so that the bulk allocation reuses them
+    my_vector ot;
+    tree_init(ot);
+    tree_insert(ot, my_struct(-1));
+    for (int i = 0; i < 100; i++) {
+        tree_insert(ot, my_struct(-2), 0);
+    }
+    for (index_type i = 1; i <= 100; i += 2) {
+        tree_erase(ot, i);
+    }
+
+    auto new_root = tree_insert(it, 0, ot, 0);
+    ASSERT_EQ(ot.size(), 100051U);
+
+    std::vector<int> input_values;
+    std::vector<int> output_values;
+    collect_values(it, 0, input_values);
+    collect_values(ot, new_root, output_values);
+    ASSERT_EQ(input_values, output_values);
+    ASSERT_EQ(ot.at(new_root).m_parent, 0U);
+}
+
+TEST_F(sparse_tree_test, insert_subtree_with_siblings) {
+    my_vector it;
+    tree_init(it);
+    tree_insert(it, my_struct(0));
+    tree_insert(it, my_struct(1), 0);
+    tree_insert(it, my_struct(2), 0);
+    tree_insert(it, my_struct(3), 2);
+    tree_insert(it, my_struct(4), 0);
+
+    my_vector ot;
+    tree_init(ot);
+    tree_insert(ot, my_struct(10));
+    auto new_root = tree_insert(it, 2, ot, 0);
+
+    std::vector<int> values;
+    collect_values(ot, 0, values);
+    ASSERT_EQ(values, std::vector<int>({0, 10, 1, 2, 2, 3}));
+    ASSERT_EQ(ot.at(new_root).m_next_sibling, npos);
+    ASSERT_EQ(ot.at(new_root).m_previous_sibling, npos);
+}
+
+TEST_F(sparse_tree_test, compact) {
+    my_vector st;
+    tree_init(st);
+    tree_insert(st, my_struct(0));
+    auto erased_root = tree_insert(st, my_struct(1), 0);
+    tree_insert(st, my_struct(2), erased_root);
+    auto branch = tree_insert(st, my_struct(3), 0);
+    tree_insert(st, my_struct(4), 0);
+    tree_insert(st, my_struct(5), branch);
+    auto second_root = tree_insert(st, my_struct(6));
+    tree_insert(st, my_struct(7), second_root);
+    tree_erase(st, erased_root);
+    ASSERT_EQ(st.size(), 8U);
+
+    std::vector<int> values_before;
+    collect_values(st, 0, values_before);
+    auto remap = tree_compact(st);
+
+    // Dead slots are dropped and nodes are stored in depth-first order, one tree after another
+    ASSERT_EQ(st.size(), 6U);
+    ASSERT_EQ(st.capacity(), 6U);
+    std::vector<int> values_in_memory;
+    for (index_type i = 0; i < st.size(); i++) {
+        values_in_memory.push_back(st.at(i).m_val);
+    }
+    ASSERT_EQ(values_in_memory, std::vector<int>({0, 3, 5, 4, 6, 7}));
+    std::vector<int> values_after;
+    collect_values(st, 0, values_after);
+    ASSERT_EQ(values_before, values_after);
+
+    ASSERT_EQ(remap.size(), 8U);
+    ASSERT_EQ(remap[0], 0U);
+    ASSERT_EQ(remap[erased_root], npos);
+    ASSERT_EQ(remap[branch], 1U);
+    ASSERT_EQ(tree_remap_index(remap, second_root), 4U);
+    ASSERT_EQ(tree_remap_index(remap, npos), npos);
+    ASSERT_EQ(st.at(4).m_parent, npos);
+    ASSERT_EQ(st.at(5).m_parent, 4U);
+
+    // The compacted tree can grow again
+    auto new_index = tree_insert(st, my_struct(8), 1);
+    ASSERT_EQ(new_index, 6U);
+    ASSERT_EQ(st.at(2).m_next_sibling, new_index);
+}
+
+TEST_F(sparse_tree_test, erase_large_subtree) {
+    my_vector st;
+    tree_init(st);
+    tree_insert(st, my_struct(0));
+    tree_insert(st, my_struct(1), 0);
+    auto subtree_root = tree_insert(st, my_struct(2), 0);
+    tree_insert(st, my_struct(3), 0);
+    // Mix deep chains and wide fans under the subtree root
+    for (int i = 4; i < 10000; i++) {
+        index_type parent = (i % 3 == 0? i - 1 : (i - 4) / 4 + 2);
+        tree_insert(st, my_struct(i), (parent < 4U? subtree_root : parent));
+    }
+    ASSERT_EQ(st.count_used(), 10000U);
+
+    tree_erase(st, subtree_root);
+    ASSERT_EQ(st.count_used(), 3U);
+    std::vector<int> values;
+    collect_values(st, 0, values);
+    ASSERT_EQ(values, std::vector<int>({0, 0, 1, 1, 1, 3}));
+
+    // Every erased slot went back to the free list
+    for (int i = 0; i < 9997; i++) {
+        tree_insert(st, my_struct(i), 0);
+    }
+    ASSERT_EQ(st.size(), 10000U);
+}
+
+// Builds this tree. Values and indexes are the same:
+//           0
+//      1    2    4
+//     3 5   6
+//     7
+void build_iteration_tree(my_vector& st)
+{
+    tree_init(st);
+    tree_insert(st, my_struct(0));
+    tree_insert(st, my_struct(1), 0);
+    tree_insert(st, my_struct(2), 0);
+    tree_insert(st, my_struct(3), 1);
+    tree_insert(st, my_struct(4), 0);
+    tree_insert(st, my_struct(5), 1);
+    tree_insert(st, my_struct(6), 2);
+    tree_insert(st, my_struct(7), 3);
+}
+
+TEST_F(sparse_tree_test, preorder_iteration) {
+    my_vector st;
+    build_iteration_tree(st);
+
+    std::vector<int> values;
+    std::vector<index_type> depths;
+    for (auto it = tree_preorder_begin(st, 0); it != tree_preorder_end(st, 0); ++it) {
+        values.push_back(it->m_val);
+        depths.push_back(it.get_depth());
+    }
+    ASSERT_EQ(values, std::vector<int>({0, 1, 3, 7, 5, 2, 6, 4}));
+    ASSERT_EQ(depths, std::vector<index_type>({0, 1, 2, 3, 2, 1, 2, 1}));
+
+    // Iterating a subtree doesn't visit the siblings of its root
+    const my_vector& cst = st;
+    values.clear();
+    for (auto it = tree_preorder_begin(cst, 1); it != tree_preorder_end(cst, 1); ++it) {
+        values.push_back((*it).m_val);
+    }
+    ASSERT_EQ(values, std::vector<int>({1, 3, 7, 5}));
+
+    auto leaf_it = tree_preorder_begin(st, 7);
+    ASSERT_EQ(index(leaf_it), 7U);
+    ASSERT_EQ(++leaf_it, tree_preorder_end(st, 7));
+}
+
+TEST_F(sparse_tree_test, preorder_iteration_pruning) {
+    my_vector st;
+    build_iteration_tree(st);
+
+    std::vector<int> values;
+    for (auto it = tree_preorder_begin(st, 0); it != tree_preorder_end(st, 0); ++it) {
+        values.push_back(it->m_val);
+        if (it->m_val == 1 || it->m_val == 6) {
+            it.skip_children();
+        }
+    }
+    ASSERT_EQ(values, std::vector<int>({0, 1, 2, 6, 4}));
+
+    // Pruning the root ends the iteration
+    auto it = tree_preorder_begin(st, 0);
+    it.skip_children();
+    ASSERT_EQ(++it, tree_preorder_end(st, 0));
+}
+
+TEST_F(sparse_tree_test, level_order_iteration) {
+    my_vector st;
+    build_iteration_tree(st);
+
+    std::vector<index_type> queue;
+    std::vector<int> values;
+    for (auto it = tree_level_order_begin(st, 0, queue); it != tree_level_order_end(st, 0, queue); ++it) {
+        values.push_back(it->m_val);
+    }
+    ASSERT_EQ(values, std::vector<int>({0, 1, 2, 4, 3, 5, 6, 7}));
+
+    // The queue can be reused, and pruned subtrees are not visited
+    values.clear();
+    for (auto it = tree_level_order_begin(st, 0, queue); it != tree_level_order_end(st, 0, queue); ++it) {
+        values.push_back(it->m_val);
+        if (it->m_val == 1) {
+            it.skip_children();
+        }
+    }
+    ASSERT_EQ(values, std::vector<int>({0, 1, 2, 4, 6}));
+
+    const my_vector& cst = st;
+    values.clear();
+    for (auto it = tree_level_order_begin(cst, 1, queue); it != tree_level_order_end(cst, 1, queue); ++it) {
+        values.push_back(it->m_val);
+    }
+    ASSERT_EQ(values, std::vector<int>({1, 3, 5, 7}));
+}
+
+TEST_F(sparse_tree_test, parallel_for_each) {
+    // Mix deep chains, wide fans and a few erased subtrees
+    my_vector st;
+    tree_init(st);
+    tree_insert(st, my_struct(0));
+    for (int i = 1; i < 50000; i++) {
+        index_type parent = (i % 5 == 0? i - 1 : (i - 1) / 3);
+        tree_insert(st, my_struct(i), parent);
+    }
+    tree_erase(st, 7);
+    tree_erase(st, 1000);
+
+    tree_worker_pool pool(3U);
+    tree_parallel_context context;
+    for (index_type grain : {1U, 64U, 5000U, 100000U}) {
+        // Each node records the order in which it was visited, and it must be visited after its parent
+        std::vector<index_type> visit_order(st.size(), npos);
+        std::atomic<index_type> next_visit(0U);
+        index_type processed = tree_parallel_for_each(st, 0, [&](index_type i) { visit_order[i] = next_visit++; }, grain, pool, context);
+
+        index_type visited = 0U;
+        for (auto it = tree_preorder_begin(st, 0); it != tree_preorder_end(st, 0); ++it) {
+            ASSERT_NE(visit_order[index(it)], npos);
+            if (it->m_parent != npos) {
+                ASSERT_LT(visit_order[it->m_parent], visit_order[index(it)]);
+            }
+            visited++;
+        }
+        ASSERT_EQ(next_visit.load(), visited);
+        ASSERT_EQ(processed, visited);
+    }
+
+    // A subtree smaller than grain is processed by the calling thread only, however big the tree
+    std::atomic<index_type> other_thread_calls(0U);
+    auto caller = std::this_thread::get_id();
+    index_type small_subtree = tree_parallel_for_each(st, 10000, [&](index_type) { other_thread_calls += (std::this_thread::get_id() != caller); }, 64U, pool, context);
+    ASSERT_EQ(small_subtree, 4U);
+    ASSERT_EQ(other_thread_calls.load(), 0U);
+
+    // A chain has a single node waiting at every step of the walk, it is still processed in order
+    my_vector chain;
+    tree_insert(chain, my_struct(0));
+    for (int i = 1; i < 1000; i++) {
+        tree_insert(chain, my_struct(i), i - 1);
+    }
+    int next_val = 0;
+    bool in_order = true;
+    auto check_order = [&](index_type i) { in_order = in_order && (chain.at(i).m_val == next_val++); };
+    ASSERT_EQ(tree_parallel_for_each(chain, 0, check_order, 1U, pool, context), 1000U);
+    ASSERT_TRUE(in_order);
+
+    // Exceptions thrown by fn in any thread reach the caller, and the pool can be used again
+    ASSERT_THROW(tree_parallel_for_each(st, 0, [](index_type i) { if (i >= 40000U) throw std::runtime_error("fn failed"); }, 64U, pool, context), std::runtime_error);
+    std::atomic<index_type> visited(0U);
+    tree_parallel_for_each(st, 0, [&](index_type) { visited++; }, 64U);
+    ASSERT_EQ(visited.load(), st.count_used());
+}
+
+TEST_F(sparse_tree_test, parallel_for_each_cow) {
+    // The walks don't clone the chunks shared with a snapshot, whichever thread does them
+    cow_sparse_vector<my_struct> st;
+    tree_insert(st, my_struct(0));
+    for (int i = 1; i < 5000; i++) {
+        tree_insert(st, my_struct(i), (i - 1) / 3);
+    }
+    const cow_sparse_vector<my_struct> snapshot = st;
+    tree_worker_pool pool(3U);
+    tree_parallel_context context;
+    for (index_type grain : {1U, 64U, 100000U}) {
+        std::atomic<index_type> visited(0U);
+        tree_parallel_for_each(st, 0, [&](index_type) { visited++; }, grain, pool, context);
+        ASSERT_EQ(visited.load(), 5000U);
+        for (index_type c = 0; c < st.get_storage().chunk_count(); c++) {
+            ASSERT_TRUE(st.get_storage().shares_chunk(snapshot.get_storage(), c));
+        }
+    }
+}
+
+TEST_F(sparse_tree_test, concurrent_append) {
+    my_vector st;
+    tree_insert(st, my_struct(0));
+    tree_insert(st, my_struct(1), 0);
+    tree_insert(st, my_struct(2), 0);
+    tree_erase(st, 1);
+
+    // Every thread inserts chains of 10 nodes under the root, each node a child of the previous one
+    const unsigned int thread_count = 4U;
+    const int chains = 50;
+    sparse_concurrent_append<my_vector> batch(st, thread_count * chains * 10U, thread_count);
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < thread_count; t++) {
+        threads.emplace_back([&batch, t]() {
+            auto& local = batch.get_local(t);
+            for (int c = 0; c < chains; c++) {
+                index_type parent = 0;
+                for (int i = 0; i < 10; i++) {
+                    parent = local.insert(my_struct(i + 1), parent);
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    // Nothing is visible before the link-up
+    ASSERT_EQ(st.count_used(), 2U);
+    batch.finish();
+    ASSERT_EQ(st.count_used(), 2U + thread_count * chains * 10U);
+    // The slot freed by the erase was reused
+    ASSERT_TRUE(st.used(1));
+
+    index_type chain_count = 0U;
+    for (auto it = tree_begin(st, 0); it != tree_end(st, 0); ++it) {
+        if (it->m_val == 2) {
+            continue;
+        }
+        chain_count++;
+        int depth = 0;
+        for (auto pit = tree_preorder_begin(st, index(it)); pit != tree_preorder_end(st, index(it)); ++pit) {
+            ASSERT_EQ(pit->m_val, int(pit.get_depth()) + 1);
+            depth++;
+        }
+        ASSERT_EQ(depth, 10);
+    }
+    ASSERT_EQ(chain_count, thread_count * chains);
+}
+
+TEST_F(sparse_tree_test, concurrent_append_input_order) {
+    my_vector st;
+    tree_insert(st, my_struct(0));
+
+    // Threads take the inputs from a shared counter, so the slots they get depend on the timing,
+    // but the children are linked in input order
+    const unsigned int thread_count = 4U;
+    const int input_count = 2000;
+    sparse_concurrent_append<my_vector> batch(st, input_count, thread_count);
+    std::atomic<int> next_input(0);
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < thread_count; t++) {
+        threads.emplace_back([&batch, &next_input, t]() {
+            auto& local = batch.get_local(t);
+            for (int i = next_input++; i < input_count; i = next_input++) {
+                local.insert(my_struct(i), 0, i);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    batch.finish();
+
+    int expected = 0;
+    for (auto it = tree_begin(st, 0); it != tree_end(st, 0); ++it) {
+        ASSERT_EQ(it->m_val, expected++);
+    }
+    ASSERT_EQ(expected, input_count);
+}
+
+TEST_F(sparse_tree_test, concurrent_append_rollback) {
+    my_vector st;
+    tree_insert(st, my_struct(0));
+    auto size_before = st.size();
+
+    // A batch that is not finished leaves no trace, and its slots are reused
+    {
+        sparse_concurrent_append<my_vector> batch(st, 100U, 2U);
+        batch.get_local(0).insert(my_struct(1), 0);
+        batch.get_local(1).emplace(0, 2);
+    }
+    ASSERT_EQ(st.count_used(), 1U);
+    ASSERT_EQ(tree_insert(st, my_struct(3), 0), 1U);
+    ASSERT_GE(st.size(), size_before + 100U);
+
+    // Exceeding the reservation throws
+    {
+        sparse_concurrent_append<my_vector> batch(st, 2U, 1U);
+        batch.get_local(0).insert(my_struct(4), 0);
+        batch.get_local(0).insert(my_struct(5), 0);
+        ASSERT_THROW(batch.get_local(0).insert(my_struct(6), 0), std::length_error);
+        batch.finish();
+    }
+    ASSERT_EQ(st.count_used(), 4U);
+
+    // An invalid parent makes finish() throw without changing anything
+    {
+        sparse_concurrent_append<my_vector> batch(st, 2U, 1U);
+        batch.get_local(0).insert(my_struct(7), 0);
+        batch.get_local(0).insert(my_struct(8), 90U);
+        ASSERT_THROW(batch.finish(), std::domain_error);
+    }
+    ASSERT_EQ(st.count_used(), 4U);
+    ASSERT_EQ(st.at(0).m_val, 0);
+}
+
 int main(int argc, char** argv)
 {
     ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,756 @@
+#include "split_sparse_vector.hpp"
+#include "rte_domain.hpp"
+#include "sparse_list.hpp"
+#include "cow_storage.hpp"
+#include "arena.hpp"
+#include "gtest/gtest.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace rte;
+
+struct my_struct : public sparse_node
+{
+    my_struct() : m_val(0) {}
+    my_struct(int val) : m_val(val) {}
+
+    int m_val;
+};
+
+typedef sparse_vector<my_struct> my_vector;
+
+// Element type whose copy assignment throws on demand, used to test exception safety
+struct throwing_struct : public sparse_node
+{
+    throwing_struct() : m_val(0) {}
+    throwing_struct(int val) : m_val(val) {}
+    throwing_struct(const throwing_struct&) = default;
+
+    throwing_struct& operator=(const throwing_struct& ts)
+    {
+        if (ts.m_val == throw_value && throw_enabled) {
+            throw std::runtime_error("throwing_struct: copy failed");
+        }
+        sparse_node::operator=(ts);
+        m_val = ts.m_val;
+        return *this;
+    }
+
+    static constexpr int throw_value = -1;
+    static bool throw_enabled;
+    int m_val;
+};
+
+bool throwing_struct::throw_enabled = false;
+
+typedef sparse_vector<throwing_struct> throwing_vector;
+
+struct my_cold_struct
+{
+    my_cold_struct() : m_name("default") {}
+
+    std::string m_name;
+};
+
+typedef split_sparse_vector<my_struct, my_cold_struct> my_split_vector;
+
+// Element type with a heavy payload. Its move assignment leaves the links of the target untouched
+struct buffer_struct : public sparse_node
+{
+    buffer_struct() : m_data() {}
+    buffer_struct(std::size_t size, int value) : m_data(size, value) {}
+    buffer_struct(const buffer_struct&) = default;
+    buffer_struct(buffer_struct&& b) : sparse_node(b), m_data(std::move(b.m_data)) {}
+    buffer_struct& operator=(const buffer_struct&) = default;
+
+    buffer_struct& operator=(buffer_struct&& b)
+    {
+        m_data = std::move(b.m_data);
+        return *this;
+    }
+
+    std::vector<int> m_data;
+};
+
+typedef sparse_vector<buffer_struct> buffer_vector;
+
+// Allocator that throws std::bad_alloc while allocation_fails is set
+struct failing_allocator_state
+{
+    static bool allocation_fails;
+};
+
+bool failing_allocator_state::allocation_fails = false;
+
+template<typename T>
+struct failing_allocator
+{
+    typedef T value_type;
+
+    failing_allocator() {}
+    template<typename U> failing_allocator(const failing_allocator<U>&) {}
+
+    T* allocate(std::size_t n)
+    {
+        if (failing_allocator_state::allocation_fails) {
+            throw std::bad_alloc();
+        }
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, std::size_t n) { std::allocator<T>().deallocate(p, n); }
+
+    template<typename U> bool operator==(const failing_allocator<U>&) const { return true; }
+    template<typename U> bool operator!=(const failing_allocator<U>&) const { return false; }
+};
+
+typedef sparse_vector<my_struct, arena_allocator<my_struct>> my_arena_vector;
+typedef split_sparse_vector<my_struct, my_cold_struct, arena_allocator<my_struct>> my_arena_split_vector;
+typedef cow_sparse_vector<my_struct> my_cow_vector;
+typedef cow_sparse_vector<my_struct, arena_allocator<my_struct>> my_arena_cow_vector;
+typedef cow_sparse_vector<my_struct, failing_allocator<my_struct>> my_failing_cow_vector;
+typedef split_sparse_vector<my_struct, my_cold_struct, std::allocator<my_struct>, cow_chunked_storage> my_cow_split_vector;
+
+// Sum of the values of the subtree of i, read through a const reference so that no chunk is cloned
+template<typename V>
+long subtree_sum(const V& tree, index_type i)
+{
+    long sum = 0;
+    for (auto it = tree_preorder_begin(tree, i); it != tree_preorder_end(tree, i); ++it) {
+        sum += it->m_val;
+    }
+
+    return sum;
+}
+
+class sparse_vector_test : public ::testing::Test
+{
+protected:
+    sparse_vector_test() {}
+    virtual ~sparse_vector_test() {}
+};
+
+TEST_F(sparse_vector_test, erased_slots_are_reused) {
+    my_vector sv;
+    tree_insert(sv, my_struct(0));
+    tree_insert(sv, my_struct(1), 0);
+    tree_insert(sv, my_struct(2), 0);
+    tree_insert(sv, my_struct(3), 0);
+    ASSERT_EQ(sv.size(), 4U);
+
+    tree_erase(sv, 2);
+    auto new_index = tree_insert(sv, my_struct(4), 0);
+    ASSERT_EQ(new_index, 2U);
+    ASSERT_EQ(sv.size(), 4U);
+    ASSERT_EQ(sv.at(new_index).m_val, 4);
+}
+
+TEST_F(sparse_vector_test, erased_subtree_is_reused_before_growing) {
+    my_vector sv;
+    tree_insert(sv, my_struct(0));
+    auto subtree_root = tree_insert(sv, my_struct(1), 0);
+    tree_insert(sv, my_struct(2), subtree_root);
+    tree_insert(sv, my_struct(3), subtree_root);
+    tree_insert(sv, my_struct(4), 0);
+    ASSERT_EQ(sv.size(), 5U);
+
+    tree_erase(sv, subtree_root);
+    std::vector<index_type> new_indices;
+    for (int i = 0; i < 3; i++) {
+        new_indices.push_back(tree_insert(sv, my_struct(10 + i), 0));
+    }
+    ASSERT_EQ(sv.size(), 5U);
+    for (auto i : new_indices) {
+        ASSERT_TRUE(i == 1U || i == 2U || i == 3U);
+    }
+
+    tree_insert(sv, my_struct(20), 0);
+    ASSERT_EQ(sv.size(), 6U);
+}
+
+TEST_F(sparse_vector_test, reserve) {
+    my_vector sv;
+    sv.reserve(100U);
+    ASSERT_GE(sv.capacity(), 100U);
+    ASSERT_EQ(sv.size(), 0U);
+
+    tree_insert(sv, my_struct(0));
+    auto& root = sv.at(0);
+    for (int i = 1; i < 100; i++) {
+        tree_insert(sv, my_struct(i), 0);
+    }
+    // No reallocation happened, so references are still valid
+    ASSERT_EQ(&root, &sv.at(0));
+    ASSERT_EQ(sv.size(), 100U);
+}
+
+TEST_F(sparse_vector_test, insert_exception_safety) {
+    throwing_vector sv;
+    tree_insert(sv, throwing_struct(0));
+    tree_insert(sv, throwing_struct(1), 0);
+    tree_erase(sv, 1);
+
+    throwing_struct::throw_enabled = true;
+    ASSERT_THROW(tree_insert(sv, throwing_struct(throwing_struct::throw_value), 0), std::runtime_error);
+    throwing_struct::throw_enabled = false;
+    ASSERT_EQ(tree_begin(sv, 0), tree_end(sv, 0));
+
+    // The slot reserved by the failed insertion has been given back
+    auto new_index = tree_insert(sv, throwing_struct(2), 0);
+    ASSERT_EQ(new_index, 1U);
+    ASSERT_EQ(sv.size(), 2U);
+}
+
+TEST_F(sparse_vector_test, insert_tree_exception_safety) {
+    throwing_vector input;
+    tree_insert(input, throwing_struct(0));
+    tree_insert(input, throwing_struct(1), 0);
+    tree_insert(input, throwing_struct(throwing_struct::throw_value), 1);
+    tree_insert(input, throwing_struct(3), 0);
+
+    throwing_vector output;
+    tree_insert(output, throwing_struct(10));
+    throwing_struct::throw_enabled = true;
+    ASSERT_THROW(tree_insert(input, 0, output, 0), std::runtime_error);
+    throwing_struct::throw_enabled = false;
+    ASSERT_EQ(tree_begin(output, 0), tree_end(output, 0));
+
+    // All the slots reserved by the failed insertion can be reused
+    index_type physical_size = output.size();
+    for (index_type i = 1; i < physical_size; i++) {
+        tree_insert(output, throwing_struct(10 + i), 0);
+    }
+    ASSERT_EQ(output.size(), physical_size);
+}
+
+TEST_F(sparse_vector_test, handles) {
+    my_vector sv;
+    tree_insert(sv, my_struct(0));
+    auto index1 = tree_insert(sv, my_struct(1), 0);
+    auto index2 = tree_insert(sv, my_struct(2), 0);
+    auto handle1 = sv.get_handle(index1);
+    auto handle2 = sv.get_handle(index2);
+    ASSERT_NE(handle1, handle2);
+    ASSERT_EQ(handle1.get_index(), index1);
+    ASSERT_EQ(sv.try_get(handle1), &sv.at(index1));
+    ASSERT_EQ(sv.try_get(handle2)->m_val, 2);
+    ASSERT_EQ(sv.try_get(nhandle), nullptr);
+    ASSERT_EQ(sparse_handle(), nhandle);
+    ASSERT_EQ(nhandle.get_index(), npos);
+    ASSERT_EQ(sparse_handle(0xfffffffeU, 1U).get_index(), 0xfffffffeU);
+    ASSERT_THROW(sparse_handle(0xffffffffU, 0xffffffffU), std::out_of_range);
+    ASSERT_THROW(sparse_handle(index_type(0xffffffffU) + 1U, 1U), std::out_of_range);
+
+    // Handles survive reallocation and copies of the vector
+    for (int i = 3; i < 1000; i++) {
+        tree_insert(sv, my_struct(i), 0);
+    }
+    const my_vector copy = sv;
+    ASSERT_EQ(copy.try_get(handle2)->m_val, 2);
+
+    tree_erase(sv, index1);
+    ASSERT_EQ(sv.try_get(handle1), nullptr);
+    ASSERT_EQ(copy.try_get(handle1)->m_val, 1);
+}
+
+TEST_F(sparse_vector_test, handles_detect_reused_slots) {
+    my_vector sv;
+    tree_insert(sv, my_struct(0));
+    auto old_index = tree_insert(sv, my_struct(1), 0);
+    auto old_handle = sv.get_handle(old_index);
+    tree_erase(sv, old_index);
+
+    auto new_index = tree_insert(sv, my_struct(2), 0);
+    ASSERT_EQ(new_index, old_index);
+    ASSERT_EQ(sv.try_get(old_handle), nullptr);
+    ASSERT_EQ(sv.try_get(sv.get_handle(new_index))->m_val, 2);
+}
+
+TEST_F(sparse_vector_test, handles_detect_compaction) {
+    my_vector sv;
+    tree_insert(sv, my_struct(0));
+    auto erased_index = tree_insert(sv, my_struct(1), 0);
+    auto moved_index = tree_insert(sv, my_struct(2), 0);
+    auto erased_handle = sv.get_handle(erased_index);
+    auto moved_handle = sv.get_handle(moved_index);
+    auto root_handle = sv.get_handle(0);
+    tree_erase(sv, erased_index);
+
+    // The entry that moves into the slot of the erased one doesn't validate the old handle, and
+    // handles taken before the compaction are stale even for entries that kept their slot
+    auto remap = tree_compact(sv);
+    ASSERT_EQ(remap[moved_index], erased_index);
+    ASSERT_EQ(sv.try_get(erased_handle), nullptr);
+    ASSERT_EQ(sv.try_get(moved_handle), nullptr);
+    ASSERT_EQ(sv.try_get(root_handle), nullptr);
+    ASSERT_EQ(sv.try_get(sv.get_handle(erased_index))->m_val, 2);
+}
+
+TEST_F(sparse_vector_test, handles_detect_regrowth_after_compaction) {
+    my_vector sv;
+    tree_insert(sv, my_struct(0));
+    auto erased_index = tree_insert(sv, my_struct(1), 0);
+    auto moved_index = tree_insert(sv, my_struct(2), 0);
+    auto moved_handle = sv.get_handle(moved_index);
+    tree_erase(sv, erased_index);
+    tree_compact(sv);
+    ASSERT_EQ(sv.size(), 2U);
+
+    // Slots past the compacted size are created again, and must not validate handles to the
+    // entries that were there before the compaction
+    auto new_index = tree_insert(sv, my_struct(3), 0);
+    tree_insert(sv, my_struct(4), 0);
+    ASSERT_EQ(sv.size(), 4U);
+    ASSERT_EQ(new_index, moved_index);
+    ASSERT_EQ(sv.try_get(moved_handle), nullptr);
+    ASSERT_EQ(sv.try_get(sv.get_handle(new_index))->m_val, 3);
+}
+
+TEST_F(sparse_vector_test, handles_detect_tree_init) {
+    my_vector sv;
+    tree_insert(sv, my_struct(0));
+    auto old_index = tree_insert(sv, my_struct(1), 0);
+    auto old_handle = sv.get_handle(old_index);
+    auto root_handle = sv.get_handle(0);
+
+    // The slots are created again from scratch, and don't validate the old handles
+    tree_init(sv);
+    ASSERT_EQ(sv.size(), 0U);
+    tree_insert(sv, my_struct(2));
+    auto new_index = tree_insert(sv, my_struct(3), 0);
+    ASSERT_EQ(new_index, old_index);
+    ASSERT_EQ(sv.try_get(old_handle), nullptr);
+    ASSERT_EQ(sv.try_get(root_handle), nullptr);
+    ASSERT_EQ(sv.try_get(sv.get_handle(new_index))->m_val, 3);
+
+    // Same after clearing a vector that has been compacted
+    tree_compact(sv);
+    auto compacted_handle = sv.get_handle(new_index);
+    sv.clear();
+    tree_insert(sv, my_struct(4));
+    tree_insert(sv, my_struct(5), 0);
+    ASSERT_EQ(sv.try_get(compacted_handle), nullptr);
+}
+
+TEST_F(sparse_vector_test, split_insert_erase) {
+    my_split_vector sv;
+    tree_insert(sv, my_struct(0));
+    auto index1 = tree_insert(sv, my_struct(1), 0);
+    auto index2 = tree_insert(sv, my_struct(2), index1);
+    sv.cold_at(index1).m_name = "one";
+    sv.cold_at(index2).m_name = "two";
+    ASSERT_EQ(sv.at(index2).m_val, 2);
+    ASSERT_EQ(sv.cold_at(index1).m_name, "one");
+    ASSERT_EQ(sv.cold_at(0).m_name, "default");
+
+    // The cold part of a reused slot is reset
+    tree_erase(sv, index1);
+    auto index3 = tree_insert(sv, my_struct(3), 0);
+    auto index4 = tree_insert(sv, my_struct(4), 0);
+    ASSERT_EQ(sv.size(), 3U);
+    ASSERT_EQ(sv.cold_at(index3).m_name, "default");
+    ASSERT_EQ(sv.cold_at(index4).m_name, "default");
+}
+
+TEST_F(sparse_vector_test, split_insert_tree) {
+    my_split_vector input;
+    tree_insert(input, my_struct(0));
+    for (int i = 1; i < 10; i++) {
+        auto new_index = tree_insert(input, my_struct(i), i - 1);
+        input.cold_at(new_index).m_name = std::to_string(i);
+    }
+
+    my_split_vector output;
+    tree_insert(output, my_struct(100));
+    auto new_root = tree_insert(input, 0, output, 0);
+    index_type current = new_root;
+    for (int i = 0; i < 10; i++) {
+        ASSERT_EQ(output.at(current).m_val, i);
+        ASSERT_EQ(output.cold_at(current).m_name, i == 0? std::string("default") : std::to_string(i));
+        current = output.at(current).m_first_child;
+    }
+    ASSERT_EQ(current, npos);
+
+    // Copies and swaps keep both parts in sync
+    my_split_vector copy = output;
+    my_split_vector().swap(output);
+    ASSERT_EQ(output.size(), 0U);
+    ASSERT_EQ(copy.cold_at(copy.at(new_root).m_first_child).m_name, "1");
+}
+
+TEST_F(sparse_vector_test, split_compact) {
+    my_split_vector sv;
+    tree_insert(sv, my_struct(0));
+    auto erased_index = tree_insert(sv, my_struct(1), 0);
+    auto kept_index = tree_insert(sv, my_struct(2), 0);
+    sv.cold_at(kept_index).m_name = "two";
+    tree_erase(sv, erased_index);
+
+    // The cold part follows the hot part to its new slot
+    auto remap = tree_compact(sv);
+    ASSERT_EQ(sv.size(), 2U);
+    ASSERT_EQ(remap[kept_index], 1U);
+    ASSERT_EQ(sv.at(1).m_val, 2);
+    ASSERT_EQ(sv.cold_at(1).m_name, "two");
+}
+
+TEST_F(sparse_vector_test, occupancy) {
+    my_vector sv;
+    ASSERT_EQ(sv.count_used(), 0U);
+    ASSERT_EQ(sv.first_free(), npos);
+    ASSERT_FALSE(sv.used(0));
+
+    // Use enough slots to span several words of the bitset
+    tree_insert(sv, my_struct(0));
+    for (int i = 1; i < 200; i++) {
+        tree_insert(sv, my_struct(i), 0);
+    }
+    ASSERT_EQ(sv.count_used(), 200U);
+    ASSERT_EQ(sv.first_free(), npos);
+
+    std::vector<index_type> erased_indices = {63U, 64U, 130U, 199U};
+    for (auto i : erased_indices) {
+        tree_erase(sv, i);
+    }
+    ASSERT_EQ(sv.count_used(), 196U);
+    ASSERT_EQ(sv.first_free(), 63U);
+    ASSERT_FALSE(sv.used(64U));
+    ASSERT_TRUE(sv.used(65U));
+    ASSERT_FALSE(sv.used(sv.size()));
+
+    std::vector<index_type> visited;
+    sv.for_each_used([&](index_type i) { visited.push_back(i); });
+    ASSERT_EQ(visited.size(), 196U);
+    ASSERT_TRUE(std::is_sorted(visited.begin(), visited.end()));
+    for (auto i : erased_indices) {
+        ASSERT_EQ(std::find(visited.begin(), visited.end(), i), visited.end());
+    }
+
+    // Copies carry the bitset with them
+    my_vector copy = sv;
+    ASSERT_EQ(copy.count_used(), 196U);
+    ASSERT_FALSE(copy.used(130U));
+    sv.clear();
+    ASSERT_EQ(sv.count_used(), 0U);
+}
+
+TEST_F(sparse_vector_test, move_insert) {
+    buffer_vector sv;
+    list_empty_list(sv);
+    buffer_struct b(1000U, 7);
+    const int* data = b.m_data.data();
+
+    // The payload is moved, not copied
+    auto new_index = list_insert(sv, 0, std::move(b));
+    ASSERT_EQ(sv.at(new_index).m_data.data(), data);
+    ASSERT_TRUE(b.m_data.empty());
+
+    auto emplaced_index = list_emplace(sv, 0, 10U, 3);
+    ASSERT_EQ(sv.at(emplaced_index).m_data, std::vector<int>(10U, 3));
+    ASSERT_EQ(std::distance(list_begin(sv, 0), list_end(sv, 0)), 2);
+}
+
+TEST_F(sparse_vector_test, move_insert_into_reused_slot) {
+    buffer_vector sv;
+    list_empty_list(sv);
+    list_emplace(sv, 0, 1U, 1);
+    auto erased_index = list_emplace(sv, 0, 1U, 2);
+    list_emplace(sv, 0, 1U, 3);
+    list_erase(sv, erased_index);
+
+    // The reused slot still holds free list links, which must not leak into the list
+    auto new_index = list_insert(sv, 0, buffer_struct(1U, 4));
+    ASSERT_EQ(new_index, erased_index);
+    std::vector<int> values;
+    for (auto it = list_begin(sv, 0); it != list_end(sv, 0); ++it) {
+        values.push_back(it->m_data[0]);
+    }
+    ASSERT_EQ(values, std::vector<int>({1, 3, 4}));
+    ASSERT_EQ(sv.at(new_index).m_next_sibling, npos);
+}
+
+TEST_F(sparse_vector_test, insert_own_element) {
+    // Copying an entry of the same vector works even when the insertion grows the storage
+    buffer_vector sv;
+    list_empty_list(sv);
+    auto first = list_insert(sv, 0, buffer_struct(100U, 5));
+    for (int i = 0; i < 100; i++) {
+        list_insert(sv, 0, sv.at(first));
+    }
+    for (auto it = list_begin(sv, 0); it != list_end(sv, 0); ++it) {
+        ASSERT_EQ(it->m_data, std::vector<int>(100U, 5));
+    }
+}
+
+TEST_F(sparse_vector_test, split_emplace) {
+    my_split_vector sv;
+    tree_emplace(sv, npos, 0);
+    auto index1 = tree_emplace(sv, 0, 1);
+    sv.cold_at(index1).m_name = "one";
+    tree_erase(sv, index1);
+
+    auto index2 = tree_insert(sv, my_struct(2), 0);
+    ASSERT_EQ(index2, index1);
+    ASSERT_EQ(sv.at(index2).m_val, 2);
+    ASSERT_EQ(sv.cold_at(index2).m_name, "default");
+}
+
+TEST_F(sparse_vector_test, arena) {
+    monotonic_arena arena(256U);
+    ASSERT_EQ(arena.bytes_allocated(), 0U);
+    auto p1 = arena.allocate(3U, 1U);
+    auto p2 = arena.allocate(16U, 16U);
+    ASSERT_NE(p1, p2);
+    ASSERT_EQ(reinterpret_cast<std::uintptr_t>(p2) % 16U, 0U);
+    // Requests bigger than a block get their own block
+    auto p3 = arena.allocate(1000U, 8U);
+    ASSERT_NE(p3, nullptr);
+    ASSERT_EQ(arena.bytes_allocated(), 1019U);
+    arena.release();
+    ASSERT_EQ(arena.bytes_allocated(), 0U);
+}
+
+TEST_F(sparse_vector_test, arena_vector) {
+    monotonic_arena arena;
+    my_arena_vector sv{my_arena_vector::allocator_type(&arena)};
+    ASSERT_EQ(sv.get_allocator().get_arena(), &arena);
+    tree_insert(sv, my_struct(0));
+    for (int i = 1; i < 100; i++) {
+        tree_insert(sv, my_struct(i), (i - 1) / 2);
+    }
+    tree_erase(sv, 1);
+    ASSERT_GT(arena.bytes_allocated(), 100U * sizeof(my_struct));
+
+    // Compaction keeps the arena
+    tree_compact(sv);
+    ASSERT_EQ(sv.get_allocator().get_arena(), &arena);
+    auto values_in_arena = sv.count_used();
+
+    // Copies and move assignments into heap vectors leave the arena behind
+    my_arena_vector copy = sv;
+    ASSERT_EQ(copy.get_allocator().get_arena(), nullptr);
+    my_arena_vector moved;
+    moved = std::move(sv);
+    ASSERT_EQ(moved.get_allocator().get_arena(), nullptr);
+    arena.release();
+    ASSERT_EQ(copy.count_used(), values_in_arena);
+    ASSERT_EQ(moved.count_used(), values_in_arena);
+    ASSERT_EQ(moved.at(0).m_val, 0);
+    ASSERT_EQ(copy.at(moved.at(0).m_first_child).m_val, 2);
+}
+
+TEST_F(sparse_vector_test, arena_split_vector) {
+    monotonic_arena arena;
+    my_arena_split_vector input{my_arena_split_vector::allocator_type(&arena)};
+    tree_insert(input, my_struct(0));
+    auto child = tree_insert(input, my_struct(1), 0);
+    input.cold_at(child).m_name = "one";
+
+    my_arena_split_vector output;
+    tree_insert(output, my_struct(10));
+    auto new_root = tree_insert(input, 0, output, 0);
+    arena.release();
+    ASSERT_EQ(output.cold_at(output.at(new_root).m_first_child).m_name, "one");
+}
+
+TEST_F(sparse_vector_test, cow_snapshot) {
+    my_cow_vector sv;
+    tree_insert(sv, my_struct(0));
+    for (int i = 1; i < 1000; i++) {
+        tree_insert(sv, my_struct(i), (i - 1) / 4);
+    }
+    ASSERT_EQ(sv.get_storage().chunk_count(), 4U);
+
+    // A snapshot shares every chunk, a write clones only the chunk it touches
+    const my_cow_vector snapshot = sv;
+    for (index_type c = 0; c < 4U; c++) {
+        ASSERT_TRUE(sv.get_storage().shares_chunk(snapshot.get_storage(), c));
+    }
+    sv.at(600).m_val = -1;
+    ASSERT_TRUE(sv.get_storage().shares_chunk(snapshot.get_storage(), 0));
+    ASSERT_TRUE(sv.get_storage().shares_chunk(snapshot.get_storage(), 1));
+    ASSERT_FALSE(sv.get_storage().shares_chunk(snapshot.get_storage(), 2));
+    ASSERT_TRUE(sv.get_storage().shares_chunk(snapshot.get_storage(), 3));
+    ASSERT_EQ(snapshot.at(600).m_val, 600);
+
+    // Reading through const iterators doesn't clone anything
+    const my_cow_vector& live = sv;
+    ASSERT_EQ(subtree_sum(live, 0), 999L * 1000L / 2L - 601L);
+    ASSERT_TRUE(sv.get_storage().shares_chunk(snapshot.get_storage(), 0));
+
+    // Structural changes don't reach the snapshot either
+    tree_erase(sv, 1);
+    tree_insert(sv, my_struct(5000), 0);
+    tree_compact(sv);
+    ASSERT_EQ(snapshot.count_used(), 1000U);
+    ASSERT_EQ(subtree_sum(snapshot, 0), 999L * 1000L / 2L);
+    ASSERT_EQ(subtree_sum(sv, 0), subtree_sum(live, 0));
+    ASSERT_LT(sv.count_used(), 1000U);
+}
+
+TEST_F(sparse_vector_test, cow_batch_allocate_rollback) {
+    my_failing_cow_vector sv;
+    tree_insert(sv, my_struct(0));
+    for (int i = 1; i < 100; i++) {
+        tree_insert(sv, my_struct(i), 0);
+    }
+    tree_erase(sv, 10);
+    tree_erase(sv, 20);
+    tree_erase(sv, 30);
+
+    // The free slots are in a chunk shared with the snapshot, and the storage can't grow
+    const my_failing_cow_vector snapshot = sv;
+    std::vector<index_type> indexes{42U};
+    failing_allocator_state::allocation_fails = true;
+    ASSERT_THROW(sv.allocate(3U + cow_chunk_size, indexes), std::bad_alloc);
+    failing_allocator_state::allocation_fails = false;
+
+    // Nothing has been reserved: the free list is intact and indexes is unchanged
+    ASSERT_EQ(indexes, std::vector<index_type>({42U}));
+    ASSERT_EQ(sv.size(), 100U);
+    ASSERT_TRUE(sv.get_storage().shares_chunk(snapshot.get_storage(), 0));
+    sv.allocate(3U, indexes);
+    std::sort(indexes.begin() + 1, indexes.end());
+    ASSERT_EQ(indexes, std::vector<index_type>({42U, 10U, 20U, 30U}));
+    ASSERT_EQ(sv.size(), 100U);
+}
+
+TEST_F(sparse_vector_test, cow_snapshot_read_by_another_thread) {
+    my_cow_vector sv;
+    tree_insert(sv, my_struct(0));
+    for (int i = 1; i < 5000; i++) {
+        tree_insert(sv, my_struct(1), (i - 1) / 8);
+    }
+
+    for (int round = 0; round < 10; round++) {
+        my_cow_vector snapshot = sv;
+        long expected_sum = subtree_sum(snapshot, 0);
+        int wrong_sums = 0;
+        std::thread reader([&]() {
+            for (int i = 0; i < 20; i++) {
+                wrong_sums += (subtree_sum(snapshot, 0) != expected_sum);
+            }
+        });
+        for (index_type i = 1; i < sv.size(); i += 7) {
+            if (sv.used(i)) {
+                sv.at(i).m_val++;
+            }
+        }
+        tree_insert(sv, my_struct(1), 0);
+        reader.join();
+        ASSERT_EQ(wrong_sums, 0);
+    }
+}
+
+TEST_F(sparse_vector_test, cow_split_vector) {
+    my_cow_split_vector sv;
+    tree_insert(sv, my_struct(0));
+    auto child = tree_insert(sv, my_struct(1), 0);
+    sv.cold_at(child).m_name = "one";
+
+    my_cow_split_vector snapshot = sv;
+    sv.cold_at(child).m_name = "uno";
+    tree_insert(sv, my_struct(2), child);
+    ASSERT_EQ(static_cast<const my_cow_split_vector&>(snapshot).cold_at(child).m_name, "one");
+    ASSERT_EQ(snapshot.count_used(), 2U);
+    ASSERT_EQ(sv.cold_at(child).m_name, "uno");
+    ASSERT_EQ(sv.count_used(), 3U);
+}
+
+TEST_F(sparse_vector_test, cow_arena_vector) {
+    monotonic_arena arena;
+    my_arena_cow_vector sv{my_arena_cow_vector::allocator_type(&arena)};
+    tree_insert(sv, my_struct(0));
+    for (int i = 1; i < 300; i++) {
+        tree_insert(sv, my_struct(i), i - 1);
+    }
+
+    // Copies and moves out of the arena can't share its chunks
+    my_arena_cow_vector copy = sv;
+    ASSERT_EQ(copy.get_allocator().get_arena(), nullptr);
+    ASSERT_FALSE(copy.get_storage().shares_chunk(sv.get_storage(), 0));
+    my_arena_cow_vector moved;
+    moved = std::move(sv);
+    arena.release();
+    ASSERT_EQ(subtree_sum(copy, 0), 299L * 300L / 2L);
+    ASSERT_EQ(subtree_sum(moved, 0), 299L * 300L / 2L);
+}
+
+TEST_F(sparse_vector_test, cow_list_iteration) {
+    // Stepping past the last entry must not read any slot: a chunked storage has nothing at npos
+    my_cow_vector sv;
+    list_empty_list(sv);
+    for (int i = 1; i <= 3; i++) {
+        list_insert(sv, 0, my_struct(i));
+    }
+
+    std::vector<int> values;
+    for (auto it = list_begin(sv, 0); it != list_end(sv, 0); ++it) {
+        values.push_back(it->m_val);
+    }
+    ASSERT_EQ(values, std::vector<int>({1, 2, 3}));
+
+    const my_cow_vector& csv = sv;
+    values.clear();
+    for (auto it = list_rbegin(csv, 0); it != list_rend(csv, 0); ++it) {
+        values.push_back(it->m_val);
+    }
+    ASSERT_EQ(values, std::vector<int>({3, 2, 1}));
+
+    // The end iterator reached by stepping can step back
+    auto it = list_begin(sv, 0);
+    std::advance(it, 3);
+    ASSERT_TRUE(it == list_end(sv, 0));
+    --it;
+    ASSERT_EQ(it->m_val, 3);
+}
+
+TEST_F(sparse_vector_test, cow_view_database_tables) {
+    view_database db;
+    list_empty_list(db.m_meshes);
+    list_empty_list(db.m_materials);
+    list_empty_list(db.m_cubemaps);
+    for (int i = 1; i < 300; i++) {
+        mesh m;
+        m.m_num_vertices = i;
+        list_insert(db.m_meshes, 0, m);
+        material mat;
+        mat.m_name = std::to_string(i);
+        list_insert(db.m_materials, 0, mat);
+    }
+    list_insert(db.m_cubemaps, 0, cubemap());
+    list_empty_list(db.m_point_lights);
+    list_insert(db.m_point_lights, 0, point_light());
+    tree_insert(db.m_resources, resource());
+
+    // Copying the database shares the chunks of the tables until they are written
+    const view_database snapshot = db;
+    ASSERT_EQ(db.m_meshes.get_storage().chunk_count(), 2U);
+    for (index_type c = 0; c < 2U; c++) {
+        ASSERT_TRUE(db.m_meshes.get_storage().shares_chunk(snapshot.m_meshes.get_storage(), c));
+        ASSERT_TRUE(db.m_materials.get_storage().shares_chunk(snapshot.m_materials.get_storage(), c));
+    }
+    ASSERT_TRUE(db.m_cubemaps.get_storage().shares_chunk(snapshot.m_cubemaps.get_storage(), 0));
+    ASSERT_TRUE(db.m_point_lights.get_storage().shares_chunk(snapshot.m_point_lights.get_storage(), 0));
+    ASSERT_TRUE(db.m_resources.get_storage().shares_chunk(snapshot.m_resources.get_storage(), 0));
+
+    db.m_meshes.at(280).m_num_vertices = 0U;
+    db.m_materials.at(10).m_name = "changed";
+    ASSERT_TRUE(db.m_meshes.get_storage().shares_chunk(snapshot.m_meshes.get_storage(), 0));
+    ASSERT_FALSE(db.m_meshes.get_storage().shares_chunk(snapshot.m_meshes.get_storage(), 1));
+    ASSERT_FALSE(db.m_materials.get_storage().shares_chunk(snapshot.m_materials.get_storage(), 0));
+    ASSERT_TRUE(db.m_materials.get_storage().shares_chunk(snapshot.m_materials.get_storage(), 1));
+    ASSERT_TRUE(db.m_cubemaps.get_storage().shares_chunk(snapshot.m_cubemaps.get_storage(), 0));
+    ASSERT_EQ(snapshot.m_meshes.at(280).m_num_vertices, 280U);
+    ASSERT_EQ(snapshot.m_materials.at(10).m_name, "10");
+}
+
+int main(int argc, char** argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,273 @@
+#include "glm/gtx/transform.hpp"
+#include "transform_batch.hpp"
+#include "sparse_tree.hpp"
+#include "gtest/gtest.h"
+
+#include <random>
+#include <vector>
+
+using namespace rte;
+
+struct transform_node : public sparse_node
+{
+    transform_node() :
+        m_local_transform(1.0f),
+        m_accum_transform(1.0f),
+        m_transform_dirty(true) {}
+
+    glm::mat4 m_local_transform;
+    glm::mat4 m_accum_transform;
+    bool m_transform_dirty;
+};
+
+// Same as transform_node, storing the local transform as translation, rotation and scale
+struct trs_node : public sparse_node
+{
+    trs_node() :
+        m_local_transform(),
+        m_accum_transform(1.0f),
+        m_transform_dirty(true) {}
+
+    trs_transform m_local_transform;
+    glm::mat4 m_accum_transform;
+    bool m_transform_dirty;
+};
+
+typedef sparse_vector<transform_node> transform_vector;
+typedef sparse_vector<trs_node> trs_vector;
+
+class transform_batch_test : public ::testing::Test
+{
+protected:
+    transform_batch_test() {}
+    virtual ~transform_batch_test() {}
+};
+
+glm::mat4 random_transform(std::mt19937& rng)
+{
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    glm::vec3 axis(dist(rng), dist(rng), dist(rng) + 2.0f);
+    return glm::translate(glm::vec3(dist(rng), dist(rng), dist(rng))) *
+           glm::rotate(dist(rng) * 3.0f, glm::normalize(axis)) *
+           glm::scale(glm::vec3(1.0f + 0.1f * dist(rng)));
+}
+
+void set_transform(glm::mat4& local, const glm::mat4& m) { local = m; }
+void set_transform(trs_transform& local, const glm::mat4& m) { local = trs_from_matrix(m); }
+
+// Tree with several levels of different widths, and a hole left by an erased subtree
+template<typename V>
+void build_tree(V& tree, index_type size)
+{
+    std::mt19937 rng(7U);
+    tree_init(tree);
+    typename V::value_type root;
+    set_transform(root.m_local_transform, random_transform(rng));
+    tree_insert(tree, root);
+    for (index_type i = 1; i < size; i++) {
+        typename V::value_type n;
+        set_transform(n.m_local_transform, random_transform(rng));
+        tree_insert(tree, n, (i % 7 == 0? i - 1 : (i - 1) / 4));
+    }
+    tree_erase(tree, 5);
+}
+
+// Reference: the per-node pre-order pass
+void expected_transforms(const transform_vector& tree, index_type root, std::vector<glm::mat4>& accums_out)
+{
+    accums_out.assign(tree.size(), glm::mat4(1.0f));
+    for (auto it = tree_preorder_begin(tree, root); it != tree_preorder_end(tree, root); ++it) {
+        glm::mat4 parent_transform = (it->m_parent != npos? (index(it) == root? tree.at(it->m_parent).m_accum_transform : accums_out[it->m_parent]) : glm::mat4(1.0f));
+        accums_out[index(it)] = it->m_local_transform * parent_transform;
+    }
+}
+
+void assert_near(const glm::mat4& a, const glm::mat4& b)
+{
+    for (int c = 0; c < 4; c++) {
+        for (int r = 0; r < 4; r++) {
+            ASSERT_NEAR(a[c][r], b[c][r], 1e-3f);
+        }
+    }
+}
+
+TEST_F(transform_batch_test, kernels_match_glm) {
+    std::mt19937 rng(3U);
+    const index_type count = 100U;
+    std::vector<index_type> parents(count);
+    std::vector<glm::mat4> locals(count);
+    for (index_type k = 0; k < count; k++) {
+        parents[k] = (k == 0U? npos : k / 2U);
+        locals[k] = random_transform(rng);
+    }
+
+    std::vector<glm::mat4> expected(count);
+    transform_multiply_scalar(parents.data(), locals.data(), expected.data(), 0U, count);
+    for (index_type k = 1; k < count; k++) {
+        assert_near(expected[k], locals[k] * expected[k / 2U]);
+    }
+    for (auto kernel : {transform_kernel::scalar, transform_kernel::sse, transform_kernel::avx2}) {
+        if (!transform_kernel_supported(kernel)) {
+            continue;
+        }
+        std::vector<glm::mat4> accums(count);
+        transform_multiply(kernel, parents.data(), locals.data(), accums.data(), 0U, count);
+        for (index_type k = 0; k < count; k++) {
+            assert_near(accums[k], expected[k]);
+        }
+    }
+    ASSERT_TRUE(transform_kernel_supported(transform_best_kernel()));
+}
+
+TEST_F(transform_batch_test, level_order_layout) {
+    transform_vector tree;
+    build_tree(tree, 200U);
+    transform_batch batch;
+    transform_batch_gather(tree, 0, batch);
+
+    ASSERT_EQ(batch.m_nodes.size(), tree.count_used());
+    ASSERT_EQ(batch.m_level_starts.front(), 0U);
+    ASSERT_EQ(batch.m_level_starts.back(), batch.m_nodes.size());
+    for (index_type l = 0; l + 1U < batch.m_level_starts.size(); l++) {
+        for (index_type k = batch.m_level_starts[l]; k < batch.m_level_starts[l + 1U]; k++) {
+            // The parent of every entry is in the previous level
+            if (l == 0U) {
+                ASSERT_EQ(batch.m_parents[k], npos);
+            } else {
+                ASSERT_GE(batch.m_parents[k], batch.m_level_starts[l - 1U]);
+                ASSERT_LT(batch.m_parents[k], batch.m_level_starts[l]);
+                ASSERT_EQ(batch.m_nodes[batch.m_parents[k]], tree.at(batch.m_nodes[k]).m_parent);
+            }
+        }
+    }
+}
+
+TEST_F(transform_batch_test, accum_transforms) {
+    transform_vector tree;
+    build_tree(tree, 20000U);
+    std::vector<glm::mat4> expected;
+    expected_transforms(tree, 0, expected);
+
+    tree_worker_pool pool(3U);
+    transform_batch batch;
+    for (auto kernel : {transform_kernel::scalar, transform_kernel::sse, transform_kernel::avx2}) {
+        if (!transform_kernel_supported(kernel)) {
+            continue;
+        }
+        // With a small grain the wide levels are split across threads
+        for (index_type grain : {16U, 100000U}) {
+            tree.for_each_used([&](index_type i) { tree.at(i).m_accum_transform = glm::mat4(0.0f); tree.at(i).m_transform_dirty = true; });
+            ASSERT_EQ(tree_batch_accum_transforms(tree, 0, batch, kernel, grain, pool), tree.count_used());
+            tree.for_each_used([&](index_type i) {
+                assert_near(tree.at(i).m_accum_transform, expected[i]);
+                ASSERT_FALSE(tree.at(i).m_transform_dirty);
+            });
+        }
+    }
+}
+
+TEST_F(transform_batch_test, in_place_accum_transforms) {
+    transform_vector tree;
+    build_tree(tree, 20000U);
+    std::vector<glm::mat4> expected;
+    expected_transforms(tree, 0, expected);
+
+    tree_worker_pool pool(3U);
+    tree_parallel_context context;
+    for (auto kernel : {transform_kernel::scalar, transform_kernel::sse, transform_kernel::avx2}) {
+        if (!transform_kernel_supported(kernel)) {
+            continue;
+        }
+        tree.for_each_used([&](index_type i) { tree.at(i).m_accum_transform = glm::mat4(0.0f); tree.at(i).m_transform_dirty = true; });
+        ASSERT_EQ(tree_accum_transforms(tree, 0, kernel, 64U, pool, context), tree.count_used());
+        tree.for_each_used([&](index_type i) {
+            assert_near(tree.at(i).m_accum_transform, expected[i]);
+            ASSERT_FALSE(tree.at(i).m_transform_dirty);
+        });
+    }
+}
+
+TEST_F(transform_batch_test, trs_to_matrix) {
+    std::mt19937 rng(5U);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    for (int i = 0; i < 100; i++) {
+        glm::vec3 translation(dist(rng), dist(rng), dist(rng));
+        glm::vec3 axis = glm::normalize(glm::vec3(dist(rng), dist(rng), dist(rng) + 2.0f));
+        float angle = dist(rng) * 3.0f;
+        glm::vec3 scale(1.5f + dist(rng), 1.5f + dist(rng), 1.5f + dist(rng));
+        if (i % 4 == 0) {
+            scale.x = -scale.x;
+        }
+        glm::mat4 expected = glm::translate(translation) * glm::rotate(angle, axis) * glm::scale(scale);
+
+        trs_transform trs(translation, glm::angleAxis(angle, axis), scale);
+        assert_near(trs_to_matrix(trs), expected);
+        // The decomposition gives back the same transform, up to the sign of the quaternion
+        trs_transform decomposed = trs_from_matrix(expected);
+        assert_near(trs_to_matrix(decomposed), expected);
+        ASSERT_NEAR(decomposed.m_scale.y, scale.y, 1e-4f);
+        ASSERT_NEAR(decomposed.m_translation.z, translation.z, 1e-4f);
+    }
+    assert_near(trs_to_matrix(trs_transform()), glm::mat4(1.0f));
+}
+
+TEST_F(transform_batch_test, trs_splits_exactly) {
+    glm::mat4 trs = glm::translate(glm::vec3(10.0f, 0.0f, -3.0f)) * glm::rotate(0.7f, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::scale(glm::vec3(-2.0f, 300.0f, 0.5f));
+    ASSERT_TRUE(trs_splits_exactly(trs));
+    ASSERT_TRUE(trs_splits_exactly(glm::mat4(1.0f)));
+
+    // A shear, or a projection, can't be split into translation, rotation and scale
+    glm::mat4 shear(1.0f);
+    shear[1][0] = 0.5f;
+    ASSERT_FALSE(trs_splits_exactly(trs * shear));
+    ASSERT_FALSE(trs_splits_exactly(glm::perspective(1.0f, 1.0f, 0.1f, 10.0f)));
+}
+
+TEST_F(transform_batch_test, trs_accum_transforms) {
+    // Nodes that store trs_transform give the same result as nodes that store matrices
+    transform_vector tree;
+    trs_vector trs_tree;
+    build_tree(tree, 3000U);
+    build_tree(trs_tree, 3000U);
+
+    tree_worker_pool pool(1U);
+    tree_parallel_context context;
+    transform_batch batch;
+    tree_accum_transforms(tree, 0, transform_kernel::scalar, 64U, pool, context);
+    tree_accum_transforms(trs_tree, 0, transform_best_kernel(), 64U, pool, context);
+    tree.for_each_used([&](index_type i) { assert_near(trs_tree.at(i).m_accum_transform, tree.at(i).m_accum_transform); });
+    tree_batch_accum_transforms(trs_tree, 0, batch, transform_best_kernel(), 64U, pool);
+    tree.for_each_used([&](index_type i) { assert_near(trs_tree.at(i).m_accum_transform, tree.at(i).m_accum_transform); });
+}
+
+TEST_F(transform_batch_test, subtree_accum_transforms) {
+    // Only the subtree is recomputed, starting from the accumulated transform of its parent
+    transform_vector tree;
+    build_tree(tree, 1000U);
+    tree_worker_pool pool(1U);
+    transform_batch batch;
+    tree_batch_accum_transforms(tree, 0, batch, transform_kernel::scalar, 64U, pool);
+
+    std::mt19937 rng(11U);
+    tree.at(9).m_local_transform = random_transform(rng);
+    tree.at(2).m_local_transform = random_transform(rng);
+    std::vector<glm::mat4> expected;
+    expected_transforms(tree, 9, expected);
+    glm::mat4 outside = tree.at(2).m_accum_transform;
+
+    index_type subtree_size = 0U;
+    for (auto it = tree_preorder_begin(tree, 9); it != tree_preorder_end(tree, 9); ++it) {
+        subtree_size++;
+    }
+    ASSERT_EQ(tree_batch_accum_transforms(tree, 9, batch, transform_best_kernel(), 64U, pool), subtree_size);
+    for (auto it = tree_preorder_begin(tree, 9); it != tree_preorder_end(tree, 9); ++it) {
+        assert_near(it->m_accum_transform, expected[index(it)]);
+    }
+    assert_near(tree.at(2).m_accum_transform, outside);
+}
+
+int main(int argc, char** argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
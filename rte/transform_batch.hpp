@@ -0,0 +1,309 @@
+#ifndef TRANSFORM_BATCH_HPP
+#define TRANSFORM_BATCH_HPP
+
+#include "parallel_tree.hpp"
+#include "trs_transform.hpp"
+#include "sparse_tree.hpp"
+#include "glm/glm.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RTE_X86_TRANSFORM_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace rte
+{
+    // Implementations of the matrix products of transform_multiply() and tree_accum_transforms(). The SIMD ones are compiled
+    // for their instruction set whatever the build flags, and used only if the CPU supports it
+    enum class transform_kernel
+    {
+        scalar,     //!< glm, always available
+        sse,        //!< 4 floats per operation
+        avx2        //!< 8 floats per operation with fused multiply-add, two columns at once
+    };
+
+    inline const char* transform_kernel_name(transform_kernel kernel)
+    {
+        switch (kernel) {
+        case transform_kernel::sse: return "sse";
+        case transform_kernel::avx2: return "avx2";
+        default: return "scalar";
+        }
+    }
+
+    inline bool transform_kernel_supported(transform_kernel kernel)
+    {
+#ifdef RTE_X86_TRANSFORM_KERNELS
+        switch (kernel) {
+        case transform_kernel::sse: return __builtin_cpu_supports("sse");
+        case transform_kernel::avx2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        default: return true;
+        }
+#else
+        return kernel == transform_kernel::scalar;
+#endif
+    }
+
+    // Returns the fastest kernel supported by the CPU. The check is made once
+    inline transform_kernel transform_best_kernel()
+    {
+        static const transform_kernel best = (transform_kernel_supported(transform_kernel::avx2)? transform_kernel::avx2 :
+                                              transform_kernel_supported(transform_kernel::sse)? transform_kernel::sse :
+                                              transform_kernel::scalar);
+        return best;
+    }
+
+    // The products compute out = local * parent, as glm does. out may alias neither input
+    inline void transform_product_scalar(const glm::mat4& local, const glm::mat4& parent, glm::mat4& out)
+    {
+        out = local * parent;
+    }
+
+#ifdef RTE_X86_TRANSFORM_KERNELS
+    // Column j of the product is the sum of the columns of the local transform weighted by the
+    // elements of column j of the parent transform
+    __attribute__((target("sse")))
+    inline void transform_product_sse(const glm::mat4& local, const glm::mat4& parent, glm::mat4& out)
+    {
+        const float* a = &local[0][0];
+        const float* b = &parent[0][0];
+        float* c = &out[0][0];
+        __m128 a0 = _mm_loadu_ps(a);
+        __m128 a1 = _mm_loadu_ps(a + 4);
+        __m128 a2 = _mm_loadu_ps(a + 8);
+        __m128 a3 = _mm_loadu_ps(a + 12);
+        for (int j = 0; j < 4; j++) {
+            __m128 column = _mm_mul_ps(a0, _mm_set1_ps(b[4 * j]));
+            column = _mm_add_ps(column, _mm_mul_ps(a1, _mm_set1_ps(b[4 * j + 1])));
+            column = _mm_add_ps(column, _mm_mul_ps(a2, _mm_set1_ps(b[4 * j + 2])));
+            column = _mm_add_ps(column, _mm_mul_ps(a3, _mm_set1_ps(b[4 * j + 3])));
+            _mm_storeu_ps(c + 4 * j, column);
+        }
+    }
+
+    // Each register holds two columns of the result: the columns of the local transform are
+    // duplicated in both halves, and an in-lane shuffle of two parent columns gives the weights
+    __attribute__((target("avx2,fma")))
+    inline void transform_product_avx2(const glm::mat4& local, const glm::mat4& parent, glm::mat4& out)
+    {
+        const float* a = &local[0][0];
+        const float* b = &parent[0][0];
+        float* c = &out[0][0];
+        __m256 a0 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(a));
+        __m256 a1 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(a + 4));
+        __m256 a2 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(a + 8));
+        __m256 a3 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(a + 12));
+        __m256 b01 = _mm256_loadu_ps(b);
+        __m256 b23 = _mm256_loadu_ps(b + 8);
+        __m256 c01 = _mm256_mul_ps(a0, _mm256_shuffle_ps(b01, b01, 0x00));
+        __m256 c23 = _mm256_mul_ps(a0, _mm256_shuffle_ps(b23, b23, 0x00));
+        c01 = _mm256_fmadd_ps(a1, _mm256_shuffle_ps(b01, b01, 0x55), c01);
+        c23 = _mm256_fmadd_ps(a1, _mm256_shuffle_ps(b23, b23, 0x55), c23);
+        c01 = _mm256_fmadd_ps(a2, _mm256_shuffle_ps(b01, b01, 0xAA), c01);
+        c23 = _mm256_fmadd_ps(a2, _mm256_shuffle_ps(b23, b23, 0xAA), c23);
+        c01 = _mm256_fmadd_ps(a3, _mm256_shuffle_ps(b01, b01, 0xFF), c01);
+        c23 = _mm256_fmadd_ps(a3, _mm256_shuffle_ps(b23, b23, 0xFF), c23);
+        _mm256_storeu_ps(c, c01);
+        _mm256_storeu_ps(c + 8, c23);
+    }
+#endif
+
+    // The batched kernels compute accums[k] = locals[k] * accums[parents[k]] for k in [first, last),
+    // or accums[k] = locals[k] if parents[k] is npos. A parent must come before its children, either
+    // before first or inside the range
+    inline void transform_multiply_scalar(const index_type* parents, const glm::mat4* locals, glm::mat4* accums, index_type first, index_type last)
+    {
+        for (index_type k = first; k < last; k++) {
+            accums[k] = (parents[k] != npos? locals[k] * accums[parents[k]] : locals[k]);
+        }
+    }
+
+#ifdef RTE_X86_TRANSFORM_KERNELS
+    __attribute__((target("sse")))
+    inline void transform_multiply_sse(const index_type* parents, const glm::mat4* locals, glm::mat4* accums, index_type first, index_type last)
+    {
+        for (index_type k = first; k < last; k++) {
+            if (parents[k] != npos) {
+                transform_product_sse(locals[k], accums[parents[k]], accums[k]);
+            } else {
+                accums[k] = locals[k];
+            }
+        }
+    }
+
+    __attribute__((target("avx2,fma")))
+    inline void transform_multiply_avx2(const index_type* parents, const glm::mat4* locals, glm::mat4* accums, index_type first, index_type last)
+    {
+        for (index_type k = first; k < last; k++) {
+            if (parents[k] != npos) {
+                transform_product_avx2(locals[k], accums[parents[k]], accums[k]);
+            } else {
+                accums[k] = locals[k];
+            }
+        }
+    }
+#endif
+
+    // Runs the given kernel, which must be supported (see transform_kernel_supported())
+    inline void transform_multiply(transform_kernel kernel, const index_type* parents, const glm::mat4* locals, glm::mat4* accums, index_type first, index_type last)
+    {
+#ifdef RTE_X86_TRANSFORM_KERNELS
+        if (kernel == transform_kernel::avx2) {
+            transform_multiply_avx2(parents, locals, accums, first, last);
+            return;
+        } else if (kernel == transform_kernel::sse) {
+            transform_multiply_sse(parents, locals, accums, first, last);
+            return;
+        }
+#endif
+        transform_multiply_scalar(parents, locals, accums, first, last);
+    }
+
+    // Recomputes in place the accumulated transforms of the subtree rooted at root, with the product
+    // of the given kernel and the threads of pool (see tree_parallel_for_each()), and clears their
+    // m_transform_dirty flags. Local transforms stored as trs_transform are turned into matrices on
+    // the fly. Returns the number of nodes recomputed.
+    // This is the pass used by the engine: the traversal reads each node once, while a
+    // transform_batch costs two more passes over the nodes to gather and scatter the transforms,
+    // which outweighs the faster products once the tree no longer fits in the cache
+    // (see transform_batch_bench).
+    // on_update(i) is called once the transform of node i is computed, to derive data from it (like
+    // world bounds). It runs in the threads of pool, so it must only write data of node i
+    template<typename V, typename F>
+    index_type tree_accum_transforms(V& nodes, index_type root, transform_kernel kernel, index_type grain, tree_worker_pool& pool, tree_parallel_context& context, F on_update)
+    {
+        // The parent of root may be out of the subtree, so it is only read through a const reference
+        const V& const_nodes = nodes;
+        auto update = [&nodes, &const_nodes, &on_update](index_type i, void (*product)(const glm::mat4&, const glm::mat4&, glm::mat4&)) {
+            auto& current_node = nodes.at(i);
+            if (current_node.m_parent != npos) {
+                product(transform_matrix(current_node.m_local_transform), const_nodes.at(current_node.m_parent).m_accum_transform, current_node.m_accum_transform);
+            } else {
+                current_node.m_accum_transform = transform_matrix(current_node.m_local_transform);
+            }
+            current_node.m_transform_dirty = false;
+            on_update(i);
+        };
+
+#ifdef RTE_X86_TRANSFORM_KERNELS
+        if (kernel == transform_kernel::avx2) {
+            return tree_parallel_for_each(nodes, root, [&update](index_type i) { update(i, transform_product_avx2); }, grain, pool, context);
+        } else if (kernel == transform_kernel::sse) {
+            return tree_parallel_for_each(nodes, root, [&update](index_type i) { update(i, transform_product_sse); }, grain, pool, context);
+        }
+#endif
+        return tree_parallel_for_each(nodes, root, [&update](index_type i) { update(i, transform_product_scalar); }, grain, pool, context);
+    }
+
+    template<typename V>
+    index_type tree_accum_transforms(V& nodes, index_type root, transform_kernel kernel, index_type grain, tree_worker_pool& pool, tree_parallel_context& context)
+    {
+        return tree_accum_transforms(nodes, root, kernel, grain, pool, context, [](index_type) {});
+    }
+
+    // Transforms of a subtree laid out in level order, so that they can be multiplied by a batched
+    // kernel in a single pass over contiguous arrays, and each level can be split across threads.
+    // Reusing a batch between calls avoids allocating
+    struct transform_batch
+    {
+        std::vector<index_type>    m_nodes;          //!< node of each entry, in level order
+        std::vector<index_type>    m_parents;        //!< entry of the parent of each entry, npos for the root
+        std::vector<glm::mat4>     m_locals;         //!< local transform of each entry (the root's includes its parent's accumulated transform)
+        std::vector<glm::mat4>     m_accums;         //!< accumulated transform of each entry
+        std::vector<index_type>    m_level_starts;   //!< first entry of each level, plus the number of entries
+        std::vector<index_type>    m_entries;        //!< entry of each node of the subtree, by node index
+    };
+
+    // Copies the local transforms of the subtree rooted at root into the batch. They can be stored in
+    // the nodes as matrices or as trs_transform
+    template<typename V>
+    void transform_batch_gather(const V& nodes, index_type root, transform_batch& batch)
+    {
+        auto& level_nodes = batch.m_nodes;
+        for (auto it = tree_level_order_begin(nodes, root, level_nodes); it != tree_level_order_end(nodes, root, level_nodes); ++it) {}
+
+        index_type count = level_nodes.size();
+        batch.m_parents.resize(count);
+        batch.m_locals.resize(count);
+        batch.m_accums.resize(count);
+        batch.m_entries.resize(std::max(batch.m_entries.size(), nodes.size()));
+        batch.m_level_starts.clear();
+        batch.m_level_starts.push_back(0U);
+        for (index_type k = 0; k < count; k++) {
+            auto& n = nodes.at(level_nodes[k]);
+            batch.m_entries[level_nodes[k]] = k;
+            batch.m_locals[k] = transform_matrix(n.m_local_transform);
+            if (k == 0U) {
+                batch.m_parents[k] = npos;
+                if (n.m_parent != npos) {
+                    batch.m_locals[k] = batch.m_locals[k] * nodes.at(n.m_parent).m_accum_transform;
+                }
+                continue;
+            }
+
+            // A level ends at the first entry whose parent is in that level
+            index_type parent_entry = batch.m_entries[n.m_parent];
+            batch.m_parents[k] = parent_entry;
+            if (parent_entry >= batch.m_level_starts.back()) {
+                batch.m_level_starts.push_back(k);
+            }
+        }
+        batch.m_level_starts.push_back(count);
+    }
+
+    // Computes the accumulated transforms of the batch. Levels of at least grain entries are split
+    // across the threads of pool
+    inline void transform_batch_compute(transform_batch& batch, transform_kernel kernel, index_type grain, tree_worker_pool& pool)
+    {
+        const index_type* parents = batch.m_parents.data();
+        const glm::mat4* locals = batch.m_locals.data();
+        glm::mat4* accums = batch.m_accums.data();
+        grain = std::max(grain, index_type(1U));
+        auto& level_starts = batch.m_level_starts;
+        for (index_type l = 0; l + 1U < level_starts.size(); l++) {
+            index_type first = level_starts[l];
+            index_type last = level_starts[l + 1U];
+            if (last - first < 2U * grain || pool.get_concurrency() == 1U) {
+                transform_multiply(kernel, parents, locals, accums, first, last);
+                continue;
+            }
+
+            std::atomic<index_type> next(first);
+            pool.run([&]() {
+                for (index_type begin = next.fetch_add(grain); begin < last; begin = next.fetch_add(grain)) {
+                    transform_multiply(kernel, parents, locals, accums, begin, std::min(begin + grain, last));
+                }
+            });
+        }
+    }
+
+    // Copies the accumulated transforms of the batch back into the nodes, and clears their
+    // m_transform_dirty flags
+    template<typename V>
+    void transform_batch_scatter(V& nodes, const transform_batch& batch)
+    {
+        for (index_type k = 0; k < batch.m_nodes.size(); k++) {
+            auto& n = nodes.at(batch.m_nodes[k]);
+            n.m_accum_transform = batch.m_accums[k];
+            n.m_transform_dirty = false;
+        }
+    }
+
+    // Recomputes the accumulated transforms of the subtree rooted at root from the local ones and
+    // the accumulated transform of the root's parent. Returns the number of nodes recomputed
+    template<typename V>
+    index_type tree_batch_accum_transforms(V& nodes, index_type root, transform_batch& batch, transform_kernel kernel, index_type grain, tree_worker_pool& pool)
+    {
+        transform_batch_gather(nodes, root, batch);
+        transform_batch_compute(batch, kernel, grain, pool);
+        transform_batch_scatter(nodes, batch);
+
+        return batch.m_nodes.size();
+    }
+} // namespace rte
+
+#endif // TRANSFORM_BATCH_HPP
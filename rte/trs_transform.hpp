@@ -0,0 +1,89 @@
+#ifndef TRS_TRANSFORM_HPP
+#define TRS_TRANSFORM_HPP
+
+#include "glm/gtc/quaternion.hpp"
+#include "glm/glm.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace rte
+{
+    // Transform stored as translation, rotation and scale, applied in the opposite order (the matrix
+    // is translation * rotation * scale). 40 bytes instead of the 64 of a glm::mat4, and each part
+    // can be changed without touching the others
+    struct trs_transform
+    {
+        trs_transform() :
+            m_translation(0.0f),
+            m_rotation(1.0f, 0.0f, 0.0f, 0.0f),
+            m_scale(1.0f) {}
+
+        trs_transform(const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale) :
+            m_translation(translation),
+            m_rotation(rotation),
+            m_scale(scale) {}
+
+        glm::vec3        m_translation;
+        glm::quat        m_rotation;      //!< must be a unit quaternion
+        glm::vec3        m_scale;
+    };
+
+    // Builds the matrix of the transform directly, without multiplying the three matrices: the
+    // columns of the rotation matrix are scaled and the translation is the last column
+    inline glm::mat4 trs_to_matrix(const trs_transform& trs)
+    {
+        const glm::quat& q = trs.m_rotation;
+        float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+        float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+        float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+        const glm::vec3& s = trs.m_scale;
+
+        return glm::mat4(glm::vec4((1.0f - 2.0f * (yy + zz)) * s.x, 2.0f * (xy + wz) * s.x, 2.0f * (xz - wy) * s.x, 0.0f),
+                         glm::vec4(2.0f * (xy - wz) * s.y, (1.0f - 2.0f * (xx + zz)) * s.y, 2.0f * (yz + wx) * s.y, 0.0f),
+                         glm::vec4(2.0f * (xz + wy) * s.z, 2.0f * (yz - wx) * s.z, (1.0f - 2.0f * (xx + yy)) * s.z, 0.0f),
+                         glm::vec4(trs.m_translation, 1.0f));
+    }
+
+    // Splits an affine matrix into translation, rotation and scale. Matrices with shear or a
+    // projective part can't be represented, and lose it. A mirroring is kept as a negative x scale
+    inline trs_transform trs_from_matrix(const glm::mat4& m)
+    {
+        glm::vec3 scale(glm::length(glm::vec3(m[0])), glm::length(glm::vec3(m[1])), glm::length(glm::vec3(m[2])));
+        if (glm::determinant(glm::mat3(m)) < 0.0f) {
+            scale.x = -scale.x;
+        }
+
+        glm::mat3 rotation(1.0f);
+        for (int c = 0; c < 3; c++) {
+            if (scale[c] != 0.0f) {
+                rotation[c] = glm::vec3(m[c]) / scale[c];
+            }
+        }
+
+        return trs_transform(glm::vec3(m[3]), glm::normalize(glm::quat_cast(rotation)), scale);
+    }
+
+    // Returns true if trs_from_matrix() gives m back, up to tolerance relative to the largest element
+    // of its 3x3 part. False for matrices with shear or a projective part, which lose it when split
+    inline bool trs_splits_exactly(const glm::mat4& m, float tolerance = 1e-4f)
+    {
+        glm::mat4 split = trs_to_matrix(trs_from_matrix(m));
+        float size = 0.0f;
+        float error = 0.0f;
+        for (int c = 0; c < 4; c++) {
+            for (int r = 0; r < 4; r++) {
+                size = (c < 3 && r < 3? std::max(size, std::abs(m[c][r])) : size);
+                error = std::max(error, std::abs(split[c][r] - m[c][r]));
+            }
+        }
+
+        return error <= tolerance * std::max(size, 1.0f);
+    }
+
+    // Matrix of a transform stored either way, for code that works with both
+    inline const glm::mat4& transform_matrix(const glm::mat4& m) { return m; }
+    inline glm::mat4 transform_matrix(const trs_transform& trs) { return trs_to_matrix(trs); }
+} // namespace rte
+
+#endif // TRS_TRANSFORM_HPP